@@ -0,0 +1,164 @@
+/*
+| spawn-latency.c   Benchmark of child process spawning
+| ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+|
+| Measures how long the parent is blocked when spawning a child
+| process with fork( ) + execvp( ) compared to posix_spawnp( ),
+| depending on the size of the parent's heap.
+|
+| Lsyncd's heap grows with the number of watches and queued delays,
+| fork( ) has to copy its page tables, posix_spawnp( ) does not.
+|
+| Usage: spawn-latency [max heap MB] [spawns per measurement]
+|
+| License: GPLv2 (see COPYING) or any later version
+|
+*/
+
+#define _DEFAULT_SOURCE 1
+#define _XOPEN_SOURCE 700
+
+#include <sys/wait.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char ** environ;
+
+static char * const child_argv[ ] = { "true", NULL };
+
+
+/*
+| Returns a monotonic timestamp in microseconds.
+*/
+static double
+now_us( )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/*
+| Spawns the child with fork( ) + execvp( ).
+*/
+static pid_t
+spawn_fork( )
+{
+	pid_t pid = fork( );
+
+	if( pid == 0 )
+	{
+		execvp( child_argv[ 0 ], child_argv );
+		_exit( 127 );
+	}
+
+	return pid;
+}
+
+
+/*
+| Spawns the child with posix_spawnp( ).
+*/
+static pid_t
+spawn_posix( )
+{
+	pid_t pid;
+
+	if( posix_spawnp( &pid, child_argv[ 0 ], NULL, NULL, child_argv, environ ) )
+	{
+		return -1;
+	}
+
+	return pid;
+}
+
+
+/*
+| Returns the average time in microseconds
+| the parent is blocked by one spawn.
+*/
+static double
+measure(
+	pid_t ( * spawn )( ),
+	int spawns
+)
+{
+	double total = 0;
+	int i;
+
+	for( i = 0; i < spawns; i++ )
+	{
+		double start = now_us( );
+		pid_t pid = spawn( );
+
+		total += now_us( ) - start;
+
+		if( pid < 0 )
+		{
+			fprintf( stderr, "spawn failed\n" );
+			exit( -1 );
+		}
+
+		waitpid( pid, NULL, 0 );
+	}
+
+	return total / spawns;
+}
+
+
+int
+main( int argc, char * argv[ ] )
+{
+	size_t max_mb = argc > 1 ? strtoul( argv[ 1 ], NULL, 10 ) : 1024;
+	int spawns    = argc > 2 ? atoi( argv[ 2 ] ) : 50;
+	size_t heap_mb = 0;
+	char * heap    = NULL;
+
+	printf( "%10s %14s %14s\n", "heap MB", "fork us", "posix_spawn us" );
+
+	while( true )
+	{
+		printf(
+			"%10zu %14.1f %14.1f\n",
+			heap_mb,
+			measure( spawn_fork, spawns ),
+			measure( spawn_posix, spawns )
+		);
+
+		if( heap_mb >= max_mb )
+		{
+			break;
+		}
+
+		heap_mb = heap_mb ? heap_mb * 2 : 64;
+
+		if( heap_mb > max_mb )
+		{
+			heap_mb = max_mb;
+		}
+
+		// grows the heap and touches every page,
+		// so it is actually mapped like Lsyncd's Lua heap
+		heap = realloc( heap, heap_mb << 20 );
+
+		if( !heap )
+		{
+			fprintf( stderr, "out of memory\n" );
+			return -1;
+		}
+
+		memset( heap, 1, heap_mb << 20 );
+	}
+
+	free( heap );
+
+	return 0;
+}
@@ -224,14 +224,18 @@ end
 
 
 --
--- Returns true for non Init and Blanket events.
+-- Returns true for non Init, Blanket and Full events.
 --
-local eventNotInitBlank =
+-- Full events are handled by rsync.full.
+--
+local eventNotInitBlankFull =
        function
 (
        event
 )
-       return event.etype ~= 'Init' and event.etype ~= 'Blanket'
+       return event.etype ~= 'Init'
+       and event.etype ~= 'Blanket'
+       and event.etype ~= 'Full'
 end
 
 --
@@ -253,7 +257,8 @@ local getBatchSize =
 	if event.etype == 'Move' or event.etype == 'Delete' then
 		return true
 	end
-	return lsyncd.get_file_size(event.sourcePath)
+	-- files found by reading a new directory come with their size
+	return event.size or lsyncd.get_file_size(event.sourcePath)
 end
 
 --
@@ -270,7 +275,7 @@ rsync.action = function
 
 	if sizeLimit == nil then
 		-- gets all events ready for syncing
-		return run_action(inlet, inlet.getEvents(eventNotInitBlank))
+		return run_action(inlet, inlet.getEvents(eventNotInitBlankFull))
 	else
 		-- spawn all files under the size limit/deletes/moves in batch mode
 		local eventInBatch = function(event)
@@ -355,7 +360,7 @@ end
 --	local config = inlet.getConfig( )
 --
 --	-- gets all events ready for syncing
---	local elist = inlet.getEvents( eventNotInitBlank )
+--	local elist = inlet.getEvents( eventNotInitBlankFull )
 --
 --	-- gets the list of paths for the event list
 --	-- deletes create multi match patterns
@@ -399,6 +404,95 @@ end
 --end
 
 
+--
+-- Syncs the entries of one directory, without the
+-- contents of its subdirectories unless 'subtree' is true.
+--
+-- Used by the overflow recovery to rescan changed directories
+-- and for the delays collapsed into the subtree of a new directory.
+--
+local rsyncDirectory = function
+	(
+		event,
+		excludes,
+		filters,
+		target,
+		subtree
+	)
+	local config = event.config
+
+	local path = event.path:
+		gsub( '%?', '\\?' ):
+		gsub( '%*', '\\*' ):
+		gsub( '%[', '\\[' ):
+		gsub( '%]', '\\]' )
+
+	local rules = { }
+
+	for _, exclude in ipairs( excludes )
+	do
+		table.insert( rules, '- ' .. exclude )
+	end
+
+	if filters
+	then
+		for _, filter in ipairs( filters )
+		do
+			table.insert( rules, filter )
+		end
+	end
+
+	-- rsync needs to have entries for all steps in the path
+	local pp = ''
+
+	for step in string.gmatch( path, '[^/]+/' )
+	do
+		pp = pp .. step
+
+		table.insert( rules, '+ /' .. pp )
+	end
+
+	if subtree
+	then
+		table.insert( rules, '+ /' .. path .. '***' )
+	else
+		table.insert( rules, '+ /' .. path .. '*' )
+	end
+
+	table.insert( rules, '- *' )
+
+	local delete = nil
+
+	if config.delete == true or config.delete == 'running'
+	then
+		delete = { '--delete', '--ignore-errors' }
+	end
+
+	local rS = table.concat( rules, '\n' )
+
+	log(
+		'Normal',
+		subtree and 'subtree rsync: ' or 'rescanning rsync: ',
+		config.source, path,
+		' -> ',
+		target,
+		' filtering\n',
+		rS
+	)
+
+	spawn(
+		event,
+		config.rsync.binary,
+		'<', rS,
+		'--filter=. -',
+		delete,
+		config.rsync._computed,
+		'-r',
+		config.source,
+		target
+	)
+end
+
 --
 -- Spawns the recursive startup sync.
 --
@@ -441,6 +535,11 @@ rsync.full = function
 	local substitudes = inlet.getSubstitutionData(event, {})
 	target = substitudeCommands(target, substitudes)
 
+	if event.flat or event.subtree
+	then
+		return rsyncDirectory( event, excludes, filters, target, event.subtree )
+	end
+
 	if config.delete == true
 	or config.delete == 'startup'
 	then
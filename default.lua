@@ -29,7 +29,10 @@ default._merge = {
 	init            = true,
 	maxDelays       = true,
 	maxProcesses    = true,
+	pollInterval    = true,
 	prepare         = true,
+	spillAfter      = true,
+	subtreeThreshold = true,
 }
 
 --
@@ -46,6 +49,7 @@ default.checkgauge = {
 	full          =  true,
 	maxDelays     =  true,
 	maxProcesses  =  true,
+	monitor       =  true,
 	onAttrib      =  true,
 	onCreate      =  true,
 	onModify      =  true,
@@ -53,8 +57,12 @@ default.checkgauge = {
 	onStartup     =  true,
 	onMove        =  true,
 	onFull        =  true,
+	pollInterval  =  true,
+	pollRate      =  true,
 	prepare       =  true,
 	source        =  true,
+	spillAfter    =  true,
+	subtreeThreshold = true,
 	target        =  true,
 	tunnel        =  true,
 }
@@ -311,6 +319,23 @@ end
 default.maxDelays = 1000
 
 
+--
+-- When this many delays are queued, new events are spilled
+-- to a file and read back as the queue drains, so Lsyncd's
+-- memory stays bounded during long outages of the target.
+-- 0 disables this.
+--
+default.spillAfter = 100000
+
+
+--
+-- When more delays than this are pending within a newly
+-- created directory, they are collapsed into one recursive
+-- transfer of the directory. 0 disables this.
+--
+default.subtreeThreshold = 256
+
+
 --
 -- The maximum number of processes Lsyncd will
 -- simultanously spawn for this sync.
@@ -388,6 +413,35 @@ default.sshExitCodes =
 default.statusInterval = 10
 
 
+--
+-- Files per second stat'ed to poll directories
+-- when out of inotify watches.
+--
+default.pollRate = 1000
+
+
+--
+-- Minimum seconds between two passes of the poll monitor.
+--
+default.pollInterval = 10
+
+
+--
+-- Most directories walked for inotify watches per turn
+-- of the masterloop and the most seconds spent on it.
+--
+default.watchBatch = 4096
+
+default.watchBatchTime = 0.1
+
+
+--
+-- Seconds events are collected before the journals
+-- are written and synced to disk together.
+--
+default.journalInterval = 1
+
+
 --
 -- Checks all keys to be in the checkgauge.
 --
@@ -0,0 +1,882 @@
+/*
+| fanotify.c from Lsyncd - Live (Mirror) Syncing Demon
+|
+| License: GPLv2 (see COPYING) or any later version
+|
+| Authors: Axel Kittenberger <axkibe@gmail.com>
+|
+| -----------------------------------------------------------------------
+|
+| Event interface for Lsyncd to Linux´ fanotify.
+|
+| Other than inotify, fanotify marks whole filesystems, so there
+| is no watch per directory and startup does not depend on the size
+| of the tree. It needs CAP_SYS_ADMIN though.
+|
+| The events report the handle of the directory and the name of
+| the entry within. The handles are resolved to paths through the
+| root directory of a sync on the same filesystem. Events outside all
+| sync roots are dropped before the runner sees them.
+|
+| The events are handed to the runner like inotify events, with no
+| watch descriptor and the absolute paths as file names.
+*/
+
+// open_by_handle_at( )
+#define _GNU_SOURCE 1
+
+#include "lsyncd.h"
+
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+
+/*
+| Event types.
+*/
+static const char * ATTRIB = "Attrib";
+static const char * MODIFY = "Modify";
+static const char * CREATE = "Create";
+static const char * DELETE = "Delete";
+static const char * MOVE   = "Move";
+
+
+/*
+| The fanotify file descriptor,
+| opened with the first mark.
+*/
+static int fanotify_fd = -1;
+
+
+/*
+| True if the kernel reports renames as one event ( Linux 5.17 ).
+| Otherwise moves become a Delete and a Create.
+*/
+static bool have_rename = false;
+
+
+/*
+| A marked filesystem.
+*/
+struct fanotify_fs
+{
+	// the filesystem id reported with the events
+	fsid_t fsid;
+
+	// a directory on the filesystem to resolve handles through
+	int mount_fd;
+};
+
+static struct fanotify_fs *filesystems = NULL;
+
+static int filesystems_n = 0;
+
+
+/*
+| The sync roots, events outside of them are dropped.
+| All end with a '/'.
+*/
+static char **roots = NULL;
+
+static int roots_n = 0;
+
+
+/*
+| Cache of directory handles resolved to paths.
+|
+| Directly mapped by a hash of the handle. Flushed whenever
+| a directory is moved or deleted, since this changes the paths
+| of the directories below.
+*/
+#define PATH_CACHE_SIZE 1024
+
+struct path_cache_entry
+{
+	uint64_t hash;
+
+	// the handle, compared in full on a hit
+	unsigned char handle[ sizeof( struct file_handle ) + MAX_HANDLE_SZ ];
+
+	size_t handle_len;
+
+	// the path, ending with a '/'
+	char *path;
+};
+
+static struct path_cache_entry *path_cache = NULL;
+
+
+/*
+| Buffer to read events into.
+*/
+#define FANOTIFY_BUFSIZ 65536
+
+static char *readbuf = NULL;
+
+
+/*
+| Dummy variable of which it's address is used as
+| the index in the lua registry to the event batch table.
+|
+| Like with inotify the events of one read are handed to the runner
+| in one call, each takes BATCH_FIELDS consecutive slots:
+|   etype, wd, isdir, filename, wd2, filename2
+| batch.n is the number of events.
+|
+| The watch descriptors are always 0, as there are no watches,
+| and the file names are absolute paths. For moves in from or out
+| of all sync roots the path outside is nil.
+*/
+static int batch;
+
+#define BATCH_FIELDS 6
+
+static int batch_n = 0;
+
+static int batch_index = 0;
+
+
+/*
+| Pushes the event batch table on the stack,
+| creates it on first use.
+*/
+static void
+batch_begin( lua_State *L )
+{
+	lua_pushlightuserdata( L, (void *) &batch );
+	lua_gettable( L, LUA_REGISTRYINDEX );
+
+	if( lua_isnil( L, -1 ) )
+	{
+		lua_pop( L, 1 );
+
+		lua_createtable( L, 256 * BATCH_FIELDS, 1 );
+
+		lua_pushlightuserdata( L, (void *) &batch );
+		lua_pushvalue( L, -2 );
+		lua_settable( L, LUA_REGISTRYINDEX );
+	}
+
+	batch_index = lua_gettop( L );
+	batch_n = 0;
+}
+
+
+/*
+| Hands the batched events over to the runner.
+*/
+static void
+batch_flush( lua_State *L )
+{
+	if( !batch_n )
+	{
+		return;
+	}
+
+	lua_pushinteger( L, batch_n );
+	lua_setfield( L, batch_index, "n" );
+
+	load_runner_func( L, "inotifyEvents" );
+
+	lua_pushvalue( L, batch_index );
+
+	l_now( L );
+
+	if( lua_pcall( L, 2, 0, -4 ) ) exit( -1 );
+
+	lua_pop( L, 1 );
+
+	batch_n = 0;
+}
+
+
+/*
+| Adds an event to the batch.
+*/
+static void
+batch_add(
+	lua_State *L,
+	const char *event_type,
+	bool isdir,
+	const char *path,
+	const char *path2  // only used for moves
+)
+{
+	int b = batch_n * BATCH_FIELDS;
+
+	lua_pushstring( L, event_type );
+	lua_rawseti( L, batch_index, b + 1 );
+
+	lua_pushinteger( L, 0 );
+	lua_rawseti( L, batch_index, b + 2 );
+
+	lua_pushboolean( L, isdir );
+	lua_rawseti( L, batch_index, b + 3 );
+
+	if( path ) lua_pushstring( L, path ); else lua_pushnil( L );
+	lua_rawseti( L, batch_index, b + 4 );
+
+	if( path2 ) lua_pushinteger( L, 0 ); else lua_pushnil( L );
+	lua_rawseti( L, batch_index, b + 5 );
+
+	if( path2 ) lua_pushstring( L, path2 ); else lua_pushnil( L );
+	lua_rawseti( L, batch_index, b + 6 );
+
+	batch_n++;
+}
+
+
+/*
+| Returns the marked filesystem of a fsid or NULL.
+*/
+static struct fanotify_fs *
+get_filesystem( const void *fsid )
+{
+	int i;
+
+	for( i = 0; i < filesystems_n; i++ )
+	{
+		if( !memcmp( &filesystems[ i ].fsid, fsid, sizeof( fsid_t ) ) )
+		{
+			return filesystems + i;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+| Returns true if the path lies within a sync root.
+*/
+static bool
+within_roots( const char *path )
+{
+	size_t len = strlen( path );
+	int i;
+
+	for( i = 0; i < roots_n; i++ )
+	{
+		size_t rlen = strlen( roots[ i ] );
+
+		// the root itself is reported without its '/'
+		if( !strncmp( path, roots[ i ], rlen )
+		|| ( len == rlen - 1 && !strncmp( path, roots[ i ], len ) ) )
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*
+| Flushes the path cache.
+*/
+static void
+flush_path_cache( )
+{
+	int i;
+
+	if( !path_cache ) return;
+
+	for( i = 0; i < PATH_CACHE_SIZE; i++ )
+	{
+		free( path_cache[ i ].path );
+
+		path_cache[ i ].path = NULL;
+	}
+}
+
+
+/*
+| Resolves the directory handle of an event to a path
+| ending with '/'.
+|
+| Returns NULL if the directory is gone or on an unmarked filesystem.
+| The result is valid until the next call.
+*/
+static const char *
+resolve_dir( struct fanotify_event_info_fid *fid )
+{
+	struct file_handle *fh = (struct file_handle *) fid->handle;
+	size_t hlen = sizeof( struct file_handle ) + fh->handle_bytes;
+	uint64_t hash = 14695981039346656037ULL;
+	struct path_cache_entry *e;
+	struct fanotify_fs *fs;
+	char proc[ 64 ];
+	char buf[ PATH_MAX + 1 ];
+	ssize_t len;
+	size_t i;
+	int fd;
+
+	// FNV-1a over the fsid and the handle
+	for( i = 0; i < sizeof( fid->fsid ); i++ )
+	{
+		hash = ( hash ^ ( (unsigned char *) &fid->fsid )[ i ] ) * 1099511628211ULL;
+	}
+
+	for( i = 0; i < hlen; i++ )
+	{
+		hash = ( hash ^ fid->handle[ i ] ) * 1099511628211ULL;
+	}
+
+	e = path_cache + ( hash % PATH_CACHE_SIZE );
+
+	if( e->path
+	&& e->hash == hash
+	&& e->handle_len == hlen
+	&& !memcmp( e->handle, fid->handle, hlen ) )
+	{
+		return e->path;
+	}
+
+	fs = get_filesystem( &fid->fsid );
+
+	if( !fs || hlen > sizeof( e->handle ) ) return NULL;
+
+	fd = open_by_handle_at( fs->mount_fd, fh, O_PATH );
+
+	if( fd < 0 )
+	{
+		// ESTALE if the directory is gone meanwhile
+		return NULL;
+	}
+
+	snprintf( proc, sizeof( proc ), "/proc/self/fd/%d", fd );
+
+	len = readlink( proc, buf, PATH_MAX - 1 );
+
+	close( fd );
+
+	if( len <= 0 || buf[ 0 ] != '/' ) return NULL;
+
+	if( buf[ len - 1 ] != '/' ) buf[ len++ ] = '/';
+
+	buf[ len ] = 0;
+
+	free( e->path );
+
+	e->path = s_strdup( buf );
+	e->hash = hash;
+	e->handle_len = hlen;
+
+	memcpy( e->handle, fid->handle, hlen );
+
+	return e->path;
+}
+
+
+/*
+| Builds the path of an event entry from its directory handle and name.
+|
+| Returns false if it cannot be resolved.
+*/
+static bool
+entry_path(
+	struct fanotify_event_info_fid *fid,
+	char *buf,
+	size_t size
+)
+{
+	struct file_handle *fh = (struct file_handle *) fid->handle;
+	const char *name = (const char *) fh->f_handle + fh->handle_bytes;
+	const char *dir = resolve_dir( fid );
+	size_t len;
+
+	if( !dir ) return false;
+
+	// events on the directory itself
+	if( !strcmp( name, "." ) ) name = "";
+
+	if( (size_t) snprintf( buf, size, "%s%s", dir, name ) >= size ) return false;
+
+	// directories are reported without their '/'
+	len = strlen( buf );
+
+	if( len > 1 && buf[ len - 1 ] == '/' ) buf[ len - 1 ] = 0;
+
+	return true;
+}
+
+
+/*
+| Handles one fanotify event.
+*/
+static void
+handle_event(
+	lua_State *L,
+	struct fanotify_event_metadata *md
+)
+{
+	static char path[ PATH_MAX + 1 ];
+	static char path2[ PATH_MAX + 1 ];
+
+	struct fanotify_event_info_fid *fid = NULL;
+	struct fanotify_event_info_fid *fid2 = NULL;
+
+	const char *event_type;
+	bool isdir = ( md->mask & FAN_ONDIR ) != 0;
+	char *p;
+
+	if( md->mask & FAN_Q_OVERFLOW )
+	{
+		batch_flush( L );
+
+		load_runner_func( L, "overflow" );
+
+		if( lua_pcall( L, 0, 1, -2 ) ) exit( -1 );
+
+		if( lua_toboolean( L, -1 ) )
+		{
+			hup = 1;
+		}
+
+		lua_pop( L, 2 );
+
+		return;
+	}
+
+	// walks the info records
+	for(
+		p = (char *) ( md + 1 );
+		p + sizeof( struct fanotify_event_info_header ) <= (char *) md + md->event_len;
+	)
+	{
+		struct fanotify_event_info_header *hdr =
+			(struct fanotify_event_info_header *) p;
+
+		if( hdr->len == 0 ) break;
+
+		switch( hdr->info_type )
+		{
+			case FAN_EVENT_INFO_TYPE_DFID_NAME :
+#ifdef FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
+			case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME :
+#endif
+				fid = (struct fanotify_event_info_fid *) p;
+				break;
+
+#ifdef FAN_EVENT_INFO_TYPE_NEW_DFID_NAME
+			case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME :
+				fid2 = (struct fanotify_event_info_fid *) p;
+				break;
+#endif
+		}
+
+		p += hdr->len;
+	}
+
+	if( !fid )
+	{
+		logstring( "Fanotify", "skipped event without directory and name." );
+
+		return;
+	}
+
+	// moving or deleting directories changes the paths below
+	if( isdir
+	&& ( md->mask & ( FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO
+#ifdef FAN_RENAME
+		| FAN_RENAME
+#endif
+		) ) )
+	{
+		// first resolves the paths of this event
+		bool has1 = entry_path( fid, path, sizeof( path ) );
+		bool has2 = fid2 && entry_path( fid2, path2, sizeof( path2 ) );
+
+		flush_path_cache( );
+
+		if( !has1 ) fid = NULL;
+		if( !has2 ) fid2 = NULL;
+	}
+	else
+	{
+		if( !entry_path( fid, path, sizeof( path ) ) ) fid = NULL;
+		if( fid2 && !entry_path( fid2, path2, sizeof( path2 ) ) ) fid2 = NULL;
+	}
+
+	if( fid && !within_roots( path ) ) fid = NULL;
+	if( fid2 && !within_roots( path2 ) ) fid2 = NULL;
+
+	if( !fid && !fid2 )
+	{
+		return;
+	}
+
+#ifdef FAN_RENAME
+	if( md->mask & FAN_RENAME )
+	{
+		// the runner turns moves in or out of a root
+		// into a Create or Delete
+		batch_add( L, MOVE, isdir, fid ? path : NULL, fid2 ? path2 : NULL );
+
+		return;
+	}
+#endif
+
+	if( !fid ) return;
+
+	// events of one entry are merged by the kernel
+	if( ( md->mask & ( FAN_CREATE | FAN_MOVED_TO ) )
+	&& ( md->mask & ( FAN_DELETE | FAN_MOVED_FROM ) ) )
+	{
+		// created and deleted, the order is lost
+		struct stat st;
+
+		event_type = lstat( path, &st ) ? DELETE : CREATE;
+	}
+	else if( md->mask & ( FAN_DELETE | FAN_MOVED_FROM ) )
+	{
+		event_type = DELETE;
+	}
+	else if( md->mask & ( FAN_CREATE | FAN_MOVED_TO ) )
+	{
+		event_type = CREATE;
+	}
+	else if( md->mask & ( FAN_CLOSE_WRITE | FAN_MODIFY ) )
+	{
+		event_type = MODIFY;
+	}
+	else if( md->mask & FAN_ATTRIB )
+	{
+		event_type = ATTRIB;
+	}
+	else
+	{
+		logstring( "Fanotify", "skipped some fanotify event." );
+
+		return;
+	}
+
+	batch_add( L, event_type, isdir, path, NULL );
+}
+
+
+/*
+| Called when the fanotify file descriptor became ready.
+| Reads it contents and forwards all received events
+| to the runner in one batch.
+*/
+static void
+fanotify_ready(
+	lua_State *L,
+	struct observance *obs
+)
+{
+	if( obs->fd != fanotify_fd )
+	{
+		logstring( "Error", "internal failure, fanotify_fd != obs->fd" );
+		exit( -1 );
+	}
+
+	batch_begin( L );
+
+	while( true )
+	{
+		struct fanotify_event_metadata *md;
+		ssize_t len = read( fanotify_fd, readbuf, FANOTIFY_BUFSIZ );
+
+		if( len < 0 )
+		{
+			if( errno == EAGAIN || errno == EINTR ) break;
+
+			printlogf(
+				L, "Error",
+				"Read fail on fanotify ( %d : %s )",
+				errno, strerror( errno )
+			);
+
+			exit( -1 );
+		}
+
+		if( len == 0 ) break;
+
+		md = (struct fanotify_event_metadata *) readbuf;
+
+		for( ; FAN_EVENT_OK( md, len ); md = FAN_EVENT_NEXT( md, len ) )
+		{
+			if( md->vers != FANOTIFY_METADATA_VERSION )
+			{
+				logstring( "Error", "fanotify metadata version mismatch." );
+				exit( -1 );
+			}
+
+			handle_event( L, md );
+		}
+	}
+
+	batch_flush( L );
+
+	lua_pop( L, 1 );
+}
+
+
+/*
+| Cleans up the fanotify handling.
+*/
+static void
+fanotify_tidy( struct observance *obs )
+{
+	int i;
+
+	if( obs->fd != fanotify_fd )
+	{
+		logstring( "Error", "internal failure: fanotify_fd != ob->fd" );
+		exit( -1 );
+	}
+
+	close( fanotify_fd );
+
+	fanotify_fd = -1;
+
+	for( i = 0; i < filesystems_n; i++ )
+	{
+		close( filesystems[ i ].mount_fd );
+	}
+
+	free( filesystems );
+
+	filesystems = NULL;
+
+	filesystems_n = 0;
+
+	for( i = 0; i < roots_n; i++ )
+	{
+		free( roots[ i ] );
+	}
+
+	free( roots );
+
+	roots = NULL;
+
+	roots_n = 0;
+
+	flush_path_cache( );
+
+	free( path_cache );
+
+	path_cache = NULL;
+
+	free( readbuf );
+
+	readbuf = NULL;
+}
+
+
+/*
+| Opens the fanotify group.
+*/
+static void
+open_fanotify( lua_State *L )
+{
+	fanotify_fd = fanotify_init(
+		FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK,
+		O_RDONLY | O_LARGEFILE
+	);
+
+	if( fanotify_fd < 0 )
+	{
+		printlogf(
+			L, "Error",
+			"Cannot access fanotify monitor! ( %d : %s )%s",
+			errno, strerror( errno ),
+			errno == EPERM ? ", needs CAP_SYS_ADMIN" : ""
+		);
+
+		exit( -1 );
+	}
+
+	printlogf( L, "Fanotify", "fanotify fd = %d", fanotify_fd );
+
+	readbuf = s_malloc( FANOTIFY_BUFSIZ );
+
+	path_cache = s_calloc( PATH_CACHE_SIZE, sizeof( struct path_cache_entry ) );
+
+	observe_fd( fanotify_fd, fanotify_ready, NULL, fanotify_tidy, NULL );
+}
+
+
+/*
+| Marks the filesystem of a sync root.
+|
+| param root        (Lua stack) absolute path of the root, ending with '/'
+| param inotifyMode (Lua stack) which event to react upon
+|                               "CloseWrite", "Modify", "CloseWrite or Modify"
+|
+| returns           (Lua stack) true
+*/
+static int
+l_mark( lua_State *L )
+{
+	const char *root  = luaL_checkstring( L, 1 );
+	const char *imode = luaL_checkstring( L, 2 );
+	struct statfs sfs;
+	int fd;
+
+	uint64_t mask =
+		FAN_ATTRIB      |
+		FAN_CLOSE_WRITE |
+		FAN_CREATE      |
+		FAN_DELETE      |
+		FAN_MOVED_FROM  |
+		FAN_MOVED_TO    |
+		FAN_ONDIR;
+
+	if( !strcmp( imode, "Modify" ) )
+	{
+		mask |=  FAN_MODIFY;
+		mask &= ~FAN_CLOSE_WRITE;
+	}
+	else if( !strcmp( imode, "CloseWrite or Modify" ) )
+	{
+		mask |= FAN_MODIFY;
+	}
+	else if( *imode && strcmp( imode, "CloseWrite" ) )
+	{
+		printlogf( L, "Error", "'%s' not a valid inotfiyMode.", imode );
+		exit( -1 );
+	}
+
+	if( fanotify_fd < 0 )
+	{
+		open_fanotify( L );
+	}
+
+	fd = open( root, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+
+	if( fd < 0 )
+	{
+		printlogf(
+			L, "Error",
+			"Cannot open sync root %s ( %d : %s )",
+			root, errno, strerror( errno )
+		);
+
+		exit( -1 );
+	}
+
+	if( fstatfs( fd, &sfs ) )
+	{
+		printlogf(
+			L, "Error",
+			"Cannot statfs sync root %s ( %d : %s )",
+			root, errno, strerror( errno )
+		);
+
+		exit( -1 );
+	}
+
+	if( get_filesystem( &sfs.f_fsid ) )
+	{
+		// another sync on the same filesystem
+		close( fd );
+	}
+	else
+	{
+		int r = -1;
+
+#ifdef FAN_RENAME
+		// tries one event per move first
+		r = fanotify_mark(
+			fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			( mask & ~( FAN_MOVED_FROM | FAN_MOVED_TO ) ) | FAN_RENAME,
+			fd, NULL
+		);
+
+		have_rename = r == 0;
+#endif
+
+		if( r )
+		{
+			r = fanotify_mark(
+				fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				mask, fd, NULL
+			);
+		}
+
+		if( r )
+		{
+			printlogf(
+				L, "Error",
+				"Cannot mark filesystem of %s ( %d : %s )",
+				root, errno, strerror( errno )
+			);
+
+			exit( -1 );
+		}
+
+		filesystems = s_realloc(
+			filesystems,
+			( filesystems_n + 1 ) * sizeof( struct fanotify_fs )
+		);
+
+		memcpy( &filesystems[ filesystems_n ].fsid, &sfs.f_fsid, sizeof( fsid_t ) );
+
+		filesystems[ filesystems_n++ ].mount_fd = fd;
+
+		printlogf(
+			L, "Fanotify",
+			"marked filesystem of %s%s",
+			root, have_rename ? "" : " ( moves are split )"
+		);
+	}
+
+	roots = s_realloc( roots, ( roots_n + 1 ) * sizeof( char * ) );
+
+	roots[ roots_n++ ] = s_strdup( root );
+
+	lua_pushboolean( L, 1 );
+
+	return 1;
+}
+
+
+/*
+| Returns the number of marked filesystems.
+*/
+static int
+l_marks( lua_State *L )
+{
+	lua_pushinteger( L, filesystems_n );
+
+	return 1;
+}
+
+
+/*
+| Lsyncd's core's fanotify functions.
+*/
+static const luaL_Reg lfanotifylib[ ] =
+{
+	{ "mark",  l_mark  },
+	{ "marks", l_marks },
+	{ NULL, NULL }
+};
+
+
+/*
+| Registers the fanotify functions.
+*/
+extern void
+register_fanotify( lua_State *L )
+{
+	lua_compat_register( L, LSYNCD_FANOTIFYLIBNAME, lfanotifylib );
+}
@@ -161,11 +161,13 @@ handle_event(lua_State *L, struct kfs_event *event, ssize_t mlen)
 	if (event->type == FSE_EVENTS_DROPPED) {
 		logstring("Fsevents", "Events dropped!");
 		load_runner_func(L, "overflow");
-		if (lua_pcall(L, 0, 0, -2)) {
+		if (lua_pcall(L, 0, 1, -2)) {
 			exit(-1); // ERRNO
 		}
-		lua_pop(L, 1);
-		hup = 1;
+		if (lua_toboolean(L, -1)) {
+			hup = 1;
+		}
+		lua_pop(L, 2);
 		return;
 	}
 
@@ -31,10 +31,25 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined( HAVE_EVENTFD ) && defined( HAVE_PTHREAD )
+#	define INOTIFY_DRAIN 1
+#	include <sys/eventfd.h>
+#	include <poll.h>
+#	include <pthread.h>
+#	include <stdatomic.h>
+#	include <stdint.h>
+#endif
+
+#include <stdint.h>
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 504
+#define lua_objlen lua_rawlen
+#endif
+
 
 /*
 | Event types.
@@ -68,19 +83,14 @@ static const uint32_t standard_event_mask =
 
 
 /*
-| Adds an inotify watch
-|
-| param dir         (Lua stack) path to directory
-| param inotifyMode (Lua stack) which inotify event to react upon
-|                               "CloseWrite", "CloseWrite or Modify"
-|
-| returns           (Lua stack) numeric watch descriptor
+| Returns the inotify event mask for an inotifyMode.
 */
-static int
-l_addwatch( lua_State *L )
+static uint32_t
+event_mask(
+	lua_State *L,
+	const char *imode
+)
 {
-	const char *path  = luaL_checkstring( L, 1 );
-	const char *imode = luaL_checkstring( L, 2 );
 	uint32_t mask = standard_event_mask;
 
 	// checks the desired inotify reaction mode
@@ -121,27 +131,48 @@ l_addwatch( lua_State *L )
 		}
 	}
 
+	return mask;
+}
+
+
+/*
+| Adds an inotify watch
+|
+| param dir         (Lua stack) path to directory
+| param inotifyMode (Lua stack) which inotify event to react upon
+|                               "CloseWrite", "CloseWrite or Modify"
+|
+| returns           (Lua stack) numeric watch descriptor
+|                   (Lua stack) true if the watch failed since the
+|                               user is out of inotify watches
+*/
+static int
+l_addwatch( lua_State *L )
+{
+	const char *path  = luaL_checkstring( L, 1 );
+	const char *imode = luaL_checkstring( L, 2 );
+	uint32_t mask = event_mask( L, imode );
+
 	// kernel call to create the inotify watch
 	int wd = inotify_add_watch( inotify_fd, path, mask );
 
 	if( wd < 0 )
 	{
-		if( errno == ENOSPC )
-		{
-			printlogf(
-				L, "Error",
-				"%s\n%s",
-				"Terminating since out of inotify watches.",
-				"Consider increasing /proc/sys/fs/inotify/max_user_watches"
-			);
-			exit(-1); // ERRNO.
-		}
+		int err = errno;
 
 		printlogf(
 			L, "Inotify",
 			"addwatch( %s )-> %d; err= %d : %s",
-			path, wd, errno, strerror( errno )
+			path, wd, err, strerror( err )
 		);
+
+		if( err == ENOSPC )
+		{
+			// out of watches, the runner falls back to polling
+			lua_pushinteger( L, wd );
+			lua_pushboolean( L, 1 );
+			return 2;
+		}
 	}
 	else
 	{
@@ -171,319 +202,1314 @@ l_rmwatch( lua_State *L )
 
 
 /*
-| Lsyncd's core's inotify functions.
+| Watching directory trees.
+|
+| The trees are walked by the tree walker, every directory
+| the syncs are concerned about gets a watch.
+|
+| A walk can be limited in directories and time, it then returns
+| the directories not walked yet, so the runner can go on with
+| them in a later turn of the masterloop.
+|
+| The directories are tested against the excludes and filters
+| of the syncs the same way Sync.concerns( ) and Sync.dirVerdict( )
+| in the runner do.
 */
-static const luaL_Reg linotfylib[ ] =
-{
-	{ "addwatch",   l_addwatch   },
-	{ "rmwatch",    l_rmwatch    },
-	{ NULL, NULL}
-};
 
 
 /*
-| Buffer for MOVE_FROM events.
-| Lsyncd buffers MOVE_FROM events to check if
-| they are followed by MOVE_TO events with identical cookie
-| then they are condensed into one move event to be sent to the
-| runner
+| Verdicts of a sync for all paths within a directory.
 */
-static struct inotify_event * move_event_buf = NULL;
+#define TREE_MIXED    0
+#define TREE_EXCLUDED 1
+#define TREE_INCLUDED 2
 
 
 /*
-| Memory allocated for move_event_buf
+| A sync as far as watching a tree is concerned.
 */
-static size_t move_event_buf_size = 0;
+struct tree_sync
+{
+	// the absolute source path ending with '/'
+	const char *source;
+	size_t srclen;
+
+	// the matchers, filters is NULL if there are none
+	const struct matcher *excludes;
+	const struct matcher *filters;
+
+	// false if the sync is not concerned about subdirectories
+	bool subdirs;
+
+	// the verdict of the directory holding the root of the walk
+	unsigned char verdict;
+};
 
 
 /*
-| True if the buffer is used.
+| A directory to walk.
+|
+| 'data' holds the verdicts per sync of the directory holding it,
+| followed by its path ending with '/'.
 */
-static bool move_event = false;
+struct tree_task
+{
+	size_t len;
+	int wd;
+	unsigned char data[ ];
+};
+
+#define TASK_PATH( walk, t ) ( ( char * ) ( t )->data + ( walk )->nsyncs )
 
 
 /*
-| Handles an inotify event.
+| What a worker of the tree walker keeps.
 */
-static void
-handle_event(
-	lua_State *L,
-	struct inotify_event *event
-)
+struct tree_worker
 {
-	const char *event_type = NULL;
+	// the walked directories, watched or not
+	struct tree_task **done;
+	size_t ndone;
+	size_t sdone;
 
-	// used to execute two events in case of unmatched MOVE_FROM buffer
-	struct inotify_event *after_buf = NULL;
+	// scratch space for the matchers
+	void *scratch;
 
-	if( event && ( IN_Q_OVERFLOW & event->mask ) )
-	{
-		// and overflow happened, tells the runner
-		load_runner_func( L, "overflow" );
+	// verdicts of the directory being walked
+	unsigned char *verdicts;
+};
 
-		if( lua_pcall( L, 0, 0, -2 ) ) exit( -1 );
 
-		lua_pop( L, 1 );
+/*
+| A walk.
+*/
+struct tree_walk
+{
+	struct tree_sync *syncs;
+	int nsyncs;
 
-		hup = 1;
+	uint32_t mask;
 
-		return;
-	}
+	struct tree_worker *workers;
+};
 
-	// cancel on ignored or resetting
-	if( event && ( IN_IGNORED & event->mask ) )
-	{
-		return;
-	}
 
-	if( event && event->len == 0 )
+/*
+| Queues a directory to walk.
+|
+| Returns false if out of memory, the walk failed then.
+*/
+static bool
+tree_queue(
+	struct treewalk *walker,
+	int worker,
+	const unsigned char *verdicts,
+	const char *path,
+	size_t len
+)
+{
+	struct tree_walk *walk = treewalk_arg( walker );
+	// called by workers, so no s_malloc( )
+	struct tree_task *t = malloc( sizeof( struct tree_task ) + walk->nsyncs + len + 1 );
+
+	if( !t )
 	{
-		// sometimes inotify sends such strange events,
-		// (e.g. when touching a dir
-		return;
+		treewalk_fail( walker, ENOMEM );
+		return false;
 	}
 
-	if( event == NULL )
+	t->len = len;
+	t->wd = -1;
+
+	memcpy( t->data, verdicts, walk->nsyncs );
+	memcpy( TASK_PATH( walk, t ), path, len + 1 );
+
+	if( !treewalk_queue( walker, worker, t ) )
 	{
-		// a buffered MOVE_FROM is not followed by anything,
-		// thus it is unary
-		event = move_event_buf;
-		event_type = "Delete";
-		move_event = false;
+		free( t );
+		return false;
 	}
-	else if(
-		move_event
-		&& (
-			!( IN_MOVED_TO & event->mask )
-			|| event->cookie != move_event_buf->cookie
-		)
-	)
-	{
-		// there is a MOVE_FROM event in the buffer and this is not the match
-		// continue in this function iteration to handle the buffer instead */
-		logstring(
-			"Inotify",
-			"icore, changing unary MOVE_FROM into DELETE"
-		);
 
-		after_buf = event;
+	return true;
+}
 
-		event = move_event_buf;
 
-		event_type = "Delete";
+/*
+| Tests if a sync concerns about a directory and sets
+| the sync's verdict for all paths within it.
+*/
+static bool
+tree_concerns(
+	struct tree_worker *w,
+	const struct tree_sync *s,
+	const char *path,
+	size_t len,
+	unsigned char parent,
+	unsigned char *verdict
+)
+{
+	// the path relative to the source, starting with '/'
+	const char *rel;
+	size_t rlen;
+	int v;
 
-		move_event = false;
+	*verdict = TREE_MIXED;
+
+	if( len < s->srclen || memcmp( path, s->source, s->srclen ) )
+	{
+		return false;
 	}
-	else if(
-		move_event
-		&& ( IN_MOVED_TO & event->mask )
-		&& event->cookie == move_event_buf->cookie
-	)
+
+	rel = path + s->srclen - 1;
+	rlen = len - s->srclen + 1;
+
+	// Sync.dirVerdict( )
+	if( parent != TREE_MIXED )
 	{
-		// this is indeed a matched move */
-		event_type = "Move";
-		move_event = false;
+		*verdict = parent;
 	}
-	else if( IN_MOVED_FROM & event->mask )
+	else
 	{
-		// just the MOVE_FROM, buffers this event, and wait if next event is
-		// a matching MOVED_TO of this was an unary move out of the watched
-		// tree.
-		size_t el = sizeof( struct inotify_event ) + event->len;
+		v = s->filters
+			? matcher_verdict( s->filters, rel, rlen, true, w->scratch )
+			: MATCH_NONE;
 
-		if( move_event_buf_size < el )
+		if( v == MATCH_NONE )
 		{
-			move_event_buf_size = el;
+			v = matcher_verdict( s->excludes, rel, rlen, true, w->scratch );
+		}
 
-			move_event_buf = s_realloc( move_event_buf, el );
+		if( v != MATCH_MIXED )
+		{
+			*verdict = v > 0 ? TREE_EXCLUDED : TREE_INCLUDED;
 		}
+	}
 
-		memcpy( move_event_buf, event, el );
+	// the root itself is never filtered
+	if( rlen == 1 ) return true;
 
-		move_event = true;
+	if( !s->subdirs ) return false;
 
-		return;
+	// Sync.testFilter( )
+	if( parent != TREE_MIXED ) return parent == TREE_INCLUDED;
 
-	}
-	else if( IN_MOVED_TO & event->mask )
-	{
-		// must be an unary move-to
-		event_type = CREATE;
-	}
-	else if( IN_ATTRIB & event->mask )
-	{
-		// just attrib change
-		event_type = ATTRIB;
-	}
-	else if( ( IN_CLOSE_WRITE | IN_MODIFY) & event->mask )
-	{
-		// modify, or closed after written something
-		// the event type received depends settings.inotifyMode
-		event_type = MODIFY;
-	}
-	else if( IN_CREATE & event->mask )
+	v = s->filters
+		? matcher_verdict( s->filters, rel, rlen, false, w->scratch )
+		: MATCH_NONE;
+
+	if( v == MATCH_NONE )
 	{
-		// a new file
-		event_type = CREATE;
+		v = matcher_verdict( s->excludes, rel, rlen, false, w->scratch );
 	}
-	else if( IN_DELETE & event->mask )
+
+	return v <= 0;
+}
+
+
+/*
+| Walks a directory, watches it and queues its subdirectories.
+*/
+static void
+tree_visit(
+	struct treewalk *walker,
+	int worker,
+	void *task
+)
+{
+	struct tree_walk *walk = treewalk_arg( walker );
+	struct tree_worker *w = &walk->workers[ worker ];
+	struct tree_task *t = task;
+	char *path = TASK_PATH( walk, t );
+	bool concerned = false;
+	struct dirscan ds;
+	const char *name;
+	unsigned char type;
+	ino_t ino;
+	char sub[ PATH_MAX ];
+	int i;
+
+	for( i = 0; i < walk->nsyncs; i++ )
 	{
-		// rm'ed
-		event_type = DELETE;
+		if(
+			tree_concerns(
+				w, &walk->syncs[ i ], path, t->len,
+				t->data[ i ], &w->verdicts[ i ]
+			)
+		)
+		{
+			concerned = true;
+		}
 	}
-	else
+
+	if( !concerned )
 	{
-		logstring(
-			"Inotify",
-			"skipped some inotify event."
-		);
+		free( t );
 		return;
 	}
 
-	// hands the event over to the runner
-	load_runner_func( L, "inotifyEvent" );
+	t->wd = inotify_add_watch( inotify_fd, path, walk->mask );
 
-	if( !event_type )
+	if( t->wd < 0 )
 	{
-		logstring(
-			"Error",
-			"internal failure: unknown event in handle_event()"
-		);
+		if( errno != ENOSPC )
+		{
+			// gone or not accessible
+			free( t );
+			return;
+		}
 
-		exit( -1 );
+		// out of watches, the runner polls it
+		t->wd = -ENOSPC;
 	}
 
-	lua_pushstring( L, event_type );
-
-	if( event_type != MOVE )
-	{
-		lua_pushnumber( L, event->wd );
-	}
-	else
+	if( w->ndone == w->sdone )
 	{
-		lua_pushnumber( L, move_event_buf->wd );
-	}
-	lua_pushboolean( L, ( event->mask & IN_ISDIR ) != 0 );
+		size_t sdone = w->sdone ? w->sdone * 2 : 256;
+		struct tree_task **done = realloc( w->done, sdone * sizeof( struct tree_task * ) );
 
-	l_now( L );
+		if( !done )
+		{
+			if( t->wd >= 0 ) inotify_rm_watch( inotify_fd, t->wd );
 
-	if( event_type == MOVE )
-	{
-		lua_pushstring( L, move_event_buf->name );
-		lua_pushnumber( L, event->wd            );
-		lua_pushstring( L, event->name          );
+			free( t );
+			treewalk_fail( walker, ENOMEM );
+			return;
+		}
+
+		w->done = done;
+		w->sdone = sdone;
 	}
-	else
+
+	w->done[ w->ndone++ ] = t;
+
+	if( !dirscan_open( &ds, path, false ) ) return;
+
+	memcpy( sub, path, t->len );
+
+	while( dirscan_next( &ds, &name, &type, &ino ) )
 	{
-		lua_pushstring( L, event->name );
-		lua_pushnil( L );
-		lua_pushnil( L );
-	}
+		bool isdir = type == DT_DIR;
+		size_t nlen;
 
-	if( lua_pcall( L, 7, 0, -9 ) ) exit( -1 );
+		if( type == DT_UNKNOWN )
+		{
+			struct stat st;
 
-	lua_pop( L, 1 );
+			isdir =
+				!fstatat( dirscan_fd( &ds ), name, &st, AT_SYMLINK_NOFOLLOW )
+				&& S_ISDIR( st.st_mode );
+		}
 
-	// if there is a buffered event, executes it
-	if (after_buf) {
-		logstring("Inotify", "icore, handling buffered event.");
-		handle_event(L, after_buf);
+		if( !isdir ) continue;
+
+		nlen = strlen( name );
+
+		if( t->len + nlen + 2 > sizeof( sub ) ) continue;
+
+		memcpy( sub + t->len, name, nlen );
+		sub[ t->len + nlen ] = '/';
+		sub[ t->len + nlen + 1 ] = 0;
+
+		if( !tree_queue( walker, worker, w->verdicts, sub, t->len + nlen + 1 ) ) break;
 	}
+
+	dirscan_close( &ds );
 }
 
 
 /*
-| buffer to read inotify events into
+| Watches a directory tree.
+|
+| Params on Lua stack:
+|     1: absolute path of the root directory, ending with '/'
+|     2: the inotifyMode
+|     3: a list of the syncs, each a table with
+|            source   -- absolute source path ending with '/'
+|            excludes -- the matcher of the excludes
+|            filters  -- the matcher of the filters or nil
+|            subdirs  -- false if not concerned about subdirectories
+|            verdict  -- the verdict of the directory holding the root
+|     4: stops after walking about this many directories ( optional )
+|     5: stops after about this many seconds ( optional )
+|
+| Returns on Lua stack:
+|     a list with two entries per directory walked, its path and
+|     its watch descriptor or false if out of inotify watches
+|     a list of the directories not walked yet
 */
-static size_t readbuf_size = 2048;
+static int
+l_addtree( lua_State *L )
+{
+	size_t len;
+	const char *root  = luaL_checklstring( L, 1, &len );
+	const char *imode = luaL_checkstring( L, 2 );
+	struct tree_walk walk;
+	struct treewalk *walker;
+	struct tree_task *t;
+	unsigned char *verdicts;
+	size_t limit;
+	double secs;
+	size_t scratch = 0;
+	size_t total = 0;
+	int nworkers;
+	int n;
+	int i;
 
-static char * readbuf = NULL;
+	luaL_checktype( L, 3, LUA_TTABLE );
 
+	memset( &walk, 0, sizeof( walk ) );
 
-/*
+	walk.mask = event_mask( L, imode );
+	walk.nsyncs = lua_objlen( L, 3 );
+
+	limit = luaL_optinteger( L, 4, 0 );
+	secs = luaL_optnumber( L, 5, 0 );
+
+	walk.syncs = s_calloc( walk.nsyncs + 1, sizeof( struct tree_sync ) );
+
+	verdicts = s_calloc( walk.nsyncs + 1, 1 );
+
+	for( i = 0; i < walk.nsyncs; i++ )
+	{
+		struct tree_sync *s = &walk.syncs[ i ];
+		size_t ss;
+
+		// the strings and matchers stay referenced
+		// by the table during the walk
+		lua_rawgeti( L, 3, i + 1 );
+
+		lua_getfield( L, -1, "source" );
+		s->source = luaL_checklstring( L, -1, &s->srclen );
+		lua_pop( L, 1 );
+
+		lua_getfield( L, -1, "excludes" );
+		s->excludes = check_matcher( L, -1 );
+		lua_pop( L, 1 );
+
+		lua_getfield( L, -1, "filters" );
+		s->filters = lua_isnil( L, -1 ) ? NULL : check_matcher( L, -1 );
+		lua_pop( L, 1 );
+
+		lua_getfield( L, -1, "subdirs" );
+		s->subdirs = lua_toboolean( L, -1 );
+		lua_pop( L, 1 );
+
+		lua_getfield( L, -1, "verdict" );
+		if( lua_isstring( L, -1 ) )
+		{
+			const char *v = lua_tostring( L, -1 );
+
+			if( !strcmp( v, "excluded" ) ) verdicts[ i ] = TREE_EXCLUDED;
+			else if( !strcmp( v, "included" ) ) verdicts[ i ] = TREE_INCLUDED;
+		}
+		lua_pop( L, 1 );
+
+		lua_pop( L, 1 );
+
+		ss = matcher_scratch_size( s->excludes );
+
+		if( ss > scratch ) scratch = ss;
+
+		if( s->filters && matcher_scratch_size( s->filters ) > scratch )
+		{
+			scratch = matcher_scratch_size( s->filters );
+		}
+	}
+
+	walker = treewalk_new( tree_visit, &walk );
+
+	nworkers = treewalk_workers( walker );
+
+	walk.workers = s_calloc( nworkers, sizeof( struct tree_worker ) );
+
+	for( i = 0; i < nworkers; i++ )
+	{
+		struct tree_worker *w = &walk.workers[ i ];
+
+		w->scratch = s_calloc( 1, scratch + sizeof( uint64_t ) );
+		w->verdicts = s_calloc( walk.nsyncs + 1, 1 );
+	}
+
+	if( len + 1 <= PATH_MAX && tree_queue( walker, 0, verdicts, root, len ) )
+	{
+		treewalk_run( walker, limit, secs );
+	}
+
+	// a worker ran out of memory, quits like s_malloc( ) does
+	if( treewalk_error( walker ) )
+	{
+		printlogf(
+			L, "Error",
+			"Cannot walk %s: %s",
+			root, strerror( treewalk_error( walker ) )
+		);
+
+		exit( -1 );
+	}
+
+	for( i = 0; i < nworkers; i++ )
+	{
+		total += walk.workers[ i ].ndone;
+	}
+
+	lua_createtable( L, total * 2, 0 );
+
+	n = 0;
+
+	for( i = 0; i < nworkers; i++ )
+	{
+		struct tree_worker *w = &walk.workers[ i ];
+		size_t k;
+
+		for( k = 0; k < w->ndone; k++ )
+		{
+			t = w->done[ k ];
+
+			lua_pushlstring( L, TASK_PATH( &walk, t ), t->len );
+			lua_rawseti( L, -2, ++n );
+
+			if( t->wd >= 0 ) lua_pushinteger( L, t->wd );
+			else lua_pushboolean( L, 0 );
+
+			lua_rawseti( L, -2, ++n );
+
+			free( t );
+		}
+
+		free( w->done );
+		free( w->scratch );
+		free( w->verdicts );
+	}
+
+	// the directories not walked
+	lua_createtable( L, treewalk_pending( walker ), 0 );
+
+	n = 0;
+
+	while( ( t = treewalk_take( walker ) ) )
+	{
+		lua_pushlstring( L, TASK_PATH( &walk, t ), t->len );
+		lua_rawseti( L, -2, ++n );
+
+		free( t );
+	}
+
+	printlogf(
+		L, "Inotify",
+		"addtree( %s )-> %d directories by %d workers, %d left",
+		root, ( int ) total, treewalk_ran( walker ), n
+	);
+
+	treewalk_free( walker );
+
+	free( walk.workers );
+	free( walk.syncs );
+	free( verdicts );
+
+	return 2;
+}
+
+
+static int l_queuestats( lua_State *L );
+
+
+/*
+| Lsyncd's core's inotify functions.
+*/
+static const luaL_Reg linotfylib[ ] =
+{
+	{ "addtree",    l_addtree    },
+	{ "addwatch",   l_addwatch   },
+	{ "queuestats", l_queuestats },
+	{ "rmwatch",    l_rmwatch    },
+	{ NULL, NULL}
+};
+
+
+/*
+| Buffer for MOVE_FROM events.
+| Lsyncd buffers MOVE_FROM events to check if
+| they are followed by MOVE_TO events with identical cookie
+| then they are condensed into one move event to be sent to the
+| runner
+*/
+static struct inotify_event * move_event_buf = NULL;
+
+
+/*
+| Memory allocated for move_event_buf
+*/
+static size_t move_event_buf_size = 0;
+
+
+/*
+| True if the buffer is used.
+*/
+static bool move_event = false;
+
+
+/*
+| Dummy variable of which it's address is used as
+| the index in the lua registry to the event batch table.
+|
+| The events of one read are handed to the runner in one call,
+| each event takes BATCH_FIELDS consecutive slots of the table:
+|   etype, wd, isdir, filename, wd2, filename2
+| batch.n is the number of events.
+|
+| The table is kept and reused for every read.
+*/
+static int batch;
+
+#define BATCH_FIELDS 6
+
+
+/*
+| Number of events in the batch.
+*/
+static int batch_n = 0;
+
+
+/*
+| Stack index of the batch table while reading.
+*/
+static int batch_index = 0;
+
+
+/*
+| Pushes the event batch table on the stack,
+| creates it on first use.
+*/
+static void
+batch_begin( lua_State *L )
+{
+	lua_pushlightuserdata( L, (void *) &batch );
+	lua_gettable( L, LUA_REGISTRYINDEX );
+
+	if( lua_isnil( L, -1 ) )
+	{
+		lua_pop( L, 1 );
+
+		lua_createtable( L, 256 * BATCH_FIELDS, 1 );
+
+		lua_pushlightuserdata( L, (void *) &batch );
+		lua_pushvalue( L, -2 );
+		lua_settable( L, LUA_REGISTRYINDEX );
+	}
+
+	batch_index = lua_gettop( L );
+	batch_n = 0;
+}
+
+
+/*
+| Hands the batched events over to the runner.
+*/
+static void
+batch_flush( lua_State *L )
+{
+	if( !batch_n )
+	{
+		return;
+	}
+
+	lua_pushinteger( L, batch_n );
+	lua_setfield( L, batch_index, "n" );
+
+	load_runner_func( L, "inotifyEvents" );
+
+	lua_pushvalue( L, batch_index );
+
+	// all events of the batch share one timestamp
+	l_now( L );
+
+	if( lua_pcall( L, 2, 0, -4 ) ) exit( -1 );
+
+	lua_pop( L, 1 );
+
+	batch_n = 0;
+}
+
+
+/*
+| Adds an event to the batch.
+*/
+static void
+batch_add(
+	lua_State *L,
+	const char *event_type,
+	int wd,
+	bool isdir,
+	const char *filename,
+	int wd2,               // only used for moves
+	const char *filename2  // only used for moves
+)
+{
+	int b = batch_n * BATCH_FIELDS;
+
+	lua_pushstring( L, event_type );
+	lua_rawseti( L, batch_index, b + 1 );
+
+	lua_pushinteger( L, wd );
+	lua_rawseti( L, batch_index, b + 2 );
+
+	lua_pushboolean( L, isdir );
+	lua_rawseti( L, batch_index, b + 3 );
+
+	lua_pushstring( L, filename );
+	lua_rawseti( L, batch_index, b + 4 );
+
+	if( filename2 )
+	{
+		lua_pushinteger( L, wd2 );
+		lua_rawseti( L, batch_index, b + 5 );
+
+		lua_pushstring( L, filename2 );
+		lua_rawseti( L, batch_index, b + 6 );
+	}
+	else
+	{
+		lua_pushnil( L );
+		lua_rawseti( L, batch_index, b + 5 );
+
+		lua_pushnil( L );
+		lua_rawseti( L, batch_index, b + 6 );
+	}
+
+	batch_n++;
+}
+
+
+/*
+| Handles an inotify event.
+|
+| Adds it to the batch, the batch is handed
+| to the runner by inotify_ready( ).
+*/
+static void
+handle_event(
+	lua_State *L,
+	struct inotify_event *event
+)
+{
+	const char *event_type = NULL;
+
+	// used to execute two events in case of unmatched MOVE_FROM buffer
+	struct inotify_event *after_buf = NULL;
+
+	if( event && ( IN_Q_OVERFLOW & event->mask ) )
+	{
+		// and overflow happened, tells the runner
+		// after the events before it
+		batch_flush( L );
+
+		load_runner_func( L, "overflow" );
+
+		if( lua_pcall( L, 0, 1, -2 ) ) exit( -1 );
+
+		// the runner either recovers by rescanning
+		// or Lsyncd resets
+		if( lua_toboolean( L, -1 ) )
+		{
+			hup = 1;
+		}
+
+		lua_pop( L, 2 );
+
+		return;
+	}
+
+	// cancel on ignored or resetting
+	if( event && ( IN_IGNORED & event->mask ) )
+	{
+		return;
+	}
+
+	if( event && event->len == 0 )
+	{
+		// sometimes inotify sends such strange events,
+		// (e.g. when touching a dir
+		return;
+	}
+
+	if( event == NULL )
+	{
+		// a buffered MOVE_FROM is not followed by anything,
+		// thus it is unary
+		event = move_event_buf;
+		event_type = "Delete";
+		move_event = false;
+	}
+	else if(
+		move_event
+		&& (
+			!( IN_MOVED_TO & event->mask )
+			|| event->cookie != move_event_buf->cookie
+		)
+	)
+	{
+		// there is a MOVE_FROM event in the buffer and this is not the match
+		// continue in this function iteration to handle the buffer instead */
+		logstring(
+			"Inotify",
+			"icore, changing unary MOVE_FROM into DELETE"
+		);
+
+		after_buf = event;
+
+		event = move_event_buf;
+
+		event_type = "Delete";
+
+		move_event = false;
+	}
+	else if(
+		move_event
+		&& ( IN_MOVED_TO & event->mask )
+		&& event->cookie == move_event_buf->cookie
+	)
+	{
+		// this is indeed a matched move */
+		event_type = "Move";
+		move_event = false;
+	}
+	else if( IN_MOVED_FROM & event->mask )
+	{
+		// just the MOVE_FROM, buffers this event, and wait if next event is
+		// a matching MOVED_TO of this was an unary move out of the watched
+		// tree.
+		size_t el = sizeof( struct inotify_event ) + event->len;
+
+		if( move_event_buf_size < el )
+		{
+			move_event_buf_size = el;
+
+			move_event_buf = s_realloc( move_event_buf, el );
+		}
+
+		memcpy( move_event_buf, event, el );
+
+		move_event = true;
+
+		return;
+
+	}
+	else if( IN_MOVED_TO & event->mask )
+	{
+		// must be an unary move-to
+		event_type = CREATE;
+	}
+	else if( IN_ATTRIB & event->mask )
+	{
+		// just attrib change
+		event_type = ATTRIB;
+	}
+	else if( ( IN_CLOSE_WRITE | IN_MODIFY) & event->mask )
+	{
+		// modify, or closed after written something
+		// the event type received depends settings.inotifyMode
+		event_type = MODIFY;
+	}
+	else if( IN_CREATE & event->mask )
+	{
+		// a new file
+		event_type = CREATE;
+	}
+	else if( IN_DELETE & event->mask )
+	{
+		// rm'ed
+		event_type = DELETE;
+	}
+	else
+	{
+		logstring(
+			"Inotify",
+			"skipped some inotify event."
+		);
+		return;
+	}
+
+	if( !event_type )
+	{
+		logstring(
+			"Error",
+			"internal failure: unknown event in handle_event()"
+		);
+
+		exit( -1 );
+	}
+
+	if( event_type == MOVE )
+	{
+		batch_add(
+			L, event_type, move_event_buf->wd,
+			( event->mask & IN_ISDIR ) != 0,
+			move_event_buf->name, event->wd, event->name
+		);
+	}
+	else
+	{
+		batch_add(
+			L, event_type, event->wd,
+			( event->mask & IN_ISDIR ) != 0,
+			event->name, 0, NULL
+		);
+	}
+
+	// if there is a buffered event, executes it
+	if (after_buf) {
+		logstring("Inotify", "icore, handling buffered event.");
+		handle_event(L, after_buf);
+	}
+}
+
+
+#ifndef INOTIFY_DRAIN
+
+/*
+| buffer to read inotify events into
+*/
+static size_t readbuf_size = 2048;
+
+static char * readbuf = NULL;
+
+
+/*
 | Called when the inotify file descriptor became ready.
 | Reads it contents and forwards all received events
-| to the runner.
+| to the runner in one batch.
+*/
+static void
+inotify_ready(
+	lua_State *L,
+	struct observance *obs
+)
+{
+	// sanity check
+	if( obs->fd != inotify_fd )
+	{
+		logstring( "Error", "internal failure, inotify_fd != obs->fd" );
+		exit( -1 );
+	}
+
+	batch_begin( L );
+
+	while( true )
+	{
+		ptrdiff_t len;
+		int err;
+		do {
+			len = read( inotify_fd, readbuf, readbuf_size );
+			err = errno;
+			if( len < 0 && err == EINVAL )
+			{
+				// kernel > 2.6.21 indicates that way that way that
+				// the buffer was too small to fit a filename.
+				// double its size and try again. When using a lower
+				// kernel and a filename > 2KB appears lsyncd
+				// will fail. (but does a 2KB filename really happen?)
+				//
+				readbuf_size *= 2;
+				readbuf = s_realloc(readbuf, readbuf_size);
+			}
+		} while( len < 0 && err == EINVAL );
+
+		if( len == 0 )
+		{
+			// no more inotify events
+			break;
+		}
+
+		if (len < 0)
+		{
+			if (err == EAGAIN) {
+				// nothing more inotify
+				break;
+			}
+			else
+			{
+				printlogf(
+					L, "Error",
+					"Read fail on inotify"
+				);
+				exit( -1 );
+			}
+		}
+
+		{
+			int i = 0;
+			while( i < len && !hup && !term )
+			{
+				struct inotify_event *event =
+					( struct inotify_event * )
+					(readbuf + i);
+
+				handle_event( L, event );
+
+				i += sizeof( struct inotify_event ) + event->len;
+			}
+		}
+
+		if( !move_event )
+		{
+			// give it a pause if not endangering splitting a move
+			break;
+		}
+	}
+
+	// checks if there is an unary MOVE_FROM left in the buffer
+	if( move_event )
+	{
+		logstring(
+			"Inotify",
+			"handling unary move from."
+		);
+		handle_event( L, NULL );
+	}
+
+	batch_flush( L );
+
+	// pops the batch table
+	lua_pop( L, 1 );
+}
+
+
+/*
+| Without the reader thread inotify is read
+| directly when it became ready.
+*/
+extern void
+start_inotify_drain( lua_State *L )
+{
+}
+
+#endif
+
+
+#ifdef INOTIFY_DRAIN
+
+/*
+| The inotify drain.
+|
+| A reader thread continuously drains the inotify file descriptor
+| into an in-memory queue, so the kernel's queue does not overflow
+| while the runner is busy. The main loop is woken through an eventfd
+| and takes the events from the queue.
+|
+| The queue is a single producer single consumer list of segments,
+| the reader thread appends segments as needed, the main thread frees
+| them when consumed. It grows up to DRAIN_MAX_BYTES, beyond that the
+| events are dropped and the main thread handles it like an overflow
+| of the kernel's queue.
+*/
+#define DRAIN_SEGMENT_SIZE ( 64 * 1024 )
+#define DRAIN_MAX_BYTES    ( 64 * 1024 * 1024 )
+
+// the bytes of events handed to the runner in one go, like a read of
+// inotify did before, so the masterloop keeps handling the delays
+#define DRAIN_BUDGET       2048
+
+
+/*
+| A segment of the drain queue.
+*/
+struct drain_segment
+{
+	// the next segment, set by the reader thread when this is full
+	_Atomic( struct drain_segment * ) next;
+
+	// bytes of data published by the reader thread
+	atomic_size_t used;
+
+	// the inotify event records
+	char data[ DRAIN_SEGMENT_SIZE ];
+};
+
+
+/*
+| The segment the main thread takes events from and its position.
+*/
+static struct drain_segment * drain_head = NULL;
+
+static size_t drain_pos = 0;
+
+
+/*
+| The segment the reader thread appends to.
+*/
+static struct drain_segment * drain_tail = NULL;
+
+
+/*
+| Bytes in the queue, its high-water mark and dropped events.
+*/
+static atomic_size_t drain_bytes;
+
+static atomic_size_t drain_hwm;
+
+static atomic_ulong drain_dropped;
+
+
+/*
+| Set by the reader thread if it dropped events.
+*/
+static atomic_bool drain_overflow;
+
+
+/*
+| Wakes the main thread when events were queued.
+*/
+static int drain_wake_fd = -1;
+
+
+/*
+| Tells the reader thread to end.
+*/
+static int drain_stop_fd = -1;
+
+
+/*
+| The reader thread.
+*/
+static pthread_t drain_thread;
+
+static bool drain_running = false;
+
+
+/*
+| Allocates an empty segment.
+*/
+static struct drain_segment *
+drain_segment_new( )
+{
+	struct drain_segment * seg = malloc( sizeof( struct drain_segment ) );
+
+	if( seg )
+	{
+		atomic_init( &seg->next, NULL );
+		atomic_init( &seg->used, 0 );
+	}
+
+	return seg;
+}
+
+
+/*
+| Appends an event record to the queue.
+|
+| Called by the reader thread only.
 */
 static void
-inotify_ready(
-	lua_State *L,
-	struct observance *obs
+drain_append(
+	const char * rec,
+	size_t len
 )
 {
-	// sanity check
-	if( obs->fd != inotify_fd )
+	struct drain_segment * seg = drain_tail;
+	size_t used = atomic_load_explicit( &seg->used, memory_order_relaxed );
+	size_t bytes;
+
+	if(
+		atomic_load( &drain_overflow )
+		|| atomic_load( &drain_bytes ) + len > DRAIN_MAX_BYTES
+	)
 	{
-		logstring( "Error", "internal failure, inotify_fd != obs->fd" );
-		exit( -1 );
+		// events are lost from here on,
+		// the main thread will reset Lsyncd
+		atomic_store( &drain_overflow, true );
+		atomic_fetch_add( &drain_dropped, 1 );
+		return;
+	}
+
+	if( used + len > DRAIN_SEGMENT_SIZE )
+	{
+		struct drain_segment * next = drain_segment_new( );
+
+		if( !next )
+		{
+			atomic_store( &drain_overflow, true );
+			atomic_fetch_add( &drain_dropped, 1 );
+			return;
+		}
+
+		// the main thread frees the full segment when done with it
+		atomic_store_explicit( &seg->next, next, memory_order_release );
+
+		drain_tail = seg = next;
+		used = 0;
+	}
+
+	memcpy( seg->data + used, rec, len );
+
+	atomic_store_explicit( &seg->used, used + len, memory_order_release );
+
+	bytes = atomic_fetch_add( &drain_bytes, len ) + len;
+
+	if( bytes > atomic_load_explicit( &drain_hwm, memory_order_relaxed ) )
+	{
+		atomic_store_explicit( &drain_hwm, bytes, memory_order_relaxed );
 	}
+}
+
+
+/*
+| The reader thread's loop.
+*/
+static void *
+drain_loop( void * arg )
+{
+	// large enough for any event, thus read( ) never fails with EINVAL
+	static char buf[ DRAIN_SEGMENT_SIZE ]
+		__attribute__ ( ( aligned( __alignof__( struct inotify_event ) ) ) );
+
+	const uint64_t one = 1;
+
+	struct pollfd pfds[ 2 ] =
+	{
+		{ .fd = inotify_fd,    .events = POLLIN },
+		{ .fd = drain_stop_fd, .events = POLLIN },
+	};
+
+	( void ) arg;
 
 	while( true )
 	{
-		ptrdiff_t len;
-		int err;
-		do {
-			len = read( inotify_fd, readbuf, readbuf_size );
-			err = errno;
-			if( len < 0 && err == EINVAL )
+		bool queued = false;
+
+		if( poll( pfds, 2, -1 ) < 0 )
+		{
+			if( errno == EINTR )
 			{
-				// kernel > 2.6.21 indicates that way that way that
-				// the buffer was too small to fit a filename.
-				// double its size and try again. When using a lower
-				// kernel and a filename > 2KB appears lsyncd
-				// will fail. (but does a 2KB filename really happen?)
-				//
-				readbuf_size *= 2;
-				readbuf = s_realloc(readbuf, readbuf_size);
+				continue;
 			}
-		} while( len < 0 && err == EINVAL );
 
-		if( len == 0 )
+			break;
+		}
+
+		if( pfds[ 1 ].revents )
 		{
-			// no more inotify events
 			break;
 		}
 
-		if (len < 0)
+		// reads until the kernel's queue is empty
+		while( true )
 		{
-			if (err == EAGAIN) {
-				// nothing more inotify
+			ssize_t len = read( inotify_fd, buf, sizeof( buf ) );
+			ssize_t i = 0;
+
+			if( len <= 0 )
+			{
 				break;
 			}
-			else
+
+			while( i < len )
 			{
-				printlogf(
-					L, "Error",
-					"Read fail on inotify"
-				);
-				exit( -1 );
+				struct inotify_event * event = ( struct inotify_event * ) ( buf + i );
+				size_t el = sizeof( struct inotify_event ) + event->len;
+
+				drain_append( buf + i, el );
+
+				i += el;
 			}
+
+			queued = true;
 		}
 
+		if( queued && write( drain_wake_fd, &one, sizeof( one ) ) < 0 )
 		{
-			int i = 0;
-			while( i < len && !hup && !term )
+			// the eventfd is readable already
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+| Called when the drain queue got events.
+|
+| Hands them over to the runner in batches.
+*/
+static void
+drain_ready(
+	lua_State *L,
+	struct observance *obs
+)
+{
+	size_t budget = DRAIN_BUDGET;
+	bool empty = false;
+	uint64_t count;
+
+	( void ) obs;
+
+	if( read( drain_wake_fd, &count, sizeof( count ) ) < 0 )
+	{
+		// nothing to reset
+	}
+
+	batch_begin( L );
+
+	while( !hup && !term )
+	{
+		struct drain_segment * seg = drain_head;
+		struct drain_segment * next;
+		size_t used = atomic_load_explicit( &seg->used, memory_order_acquire );
+
+		if( drain_pos < used )
+		{
+			struct inotify_event * event =
+				( struct inotify_event * ) ( seg->data + drain_pos );
+
+			size_t el = sizeof( struct inotify_event ) + event->len;
+
+			// a buffered MOVE_FROM is given its chance to be matched
+			if( budget == 0 && !move_event )
 			{
-				struct inotify_event *event =
-					( struct inotify_event * )
-					(readbuf + i);
+				const uint64_t one = 1;
 
-				handle_event( L, event );
+				// stays ready for the rest
+				if( write( drain_wake_fd, &one, sizeof( one ) ) < 0 )
+				{
+					// the eventfd is readable already
+				}
 
-				i += sizeof( struct inotify_event ) + event->len;
+				break;
 			}
+
+			handle_event( L, event );
+
+			drain_pos += el;
+			budget = budget > el ? budget - el : 0;
+
+			atomic_fetch_sub( &drain_bytes, el );
+
+			continue;
 		}
 
-		if( !move_event )
+		next = atomic_load_explicit( &seg->next, memory_order_acquire );
+
+		if( !next )
 		{
-			// give it a pause if not endangering splitting a move
+			// the queue is empty
+			empty = true;
 			break;
 		}
+
+		// the reader thread might have published more
+		// before moving on to the next segment
+		if( drain_pos < atomic_load_explicit( &seg->used, memory_order_acquire ) )
+		{
+			continue;
+		}
+
+		free( seg );
+
+		drain_head = next;
+		drain_pos = 0;
 	}
 
 	// checks if there is an unary MOVE_FROM left in the buffer
-	if( move_event )
+	if( move_event && !hup && !term )
 	{
 		logstring(
 			"Inotify",
@@ -491,6 +1517,160 @@ inotify_ready(
 		);
 		handle_event( L, NULL );
 	}
+
+	// the overflow is handled after the events queued before it,
+	// the reader thread queues again from here on, since a recovery
+	// by rescanning covers the changes up to the rescan
+	if(
+		empty && !hup && !term
+		&& atomic_exchange( &drain_overflow, false )
+	)
+	{
+		struct inotify_event overflow = { .mask = IN_Q_OVERFLOW };
+
+		printlogf(
+			L, "Error",
+			"Inotify queue full, dropped %d events.",
+			( int ) atomic_load( &drain_dropped )
+		);
+
+		handle_event( L, &overflow );
+	}
+
+	batch_flush( L );
+
+	// pops the batch table
+	lua_pop( L, 1 );
+}
+
+
+/*
+| Starts the reader thread.
+|
+| Called once Lsyncd is running, since threads do not
+| survive the forks of daemonizing and the spawn helper.
+*/
+extern void
+start_inotify_drain( lua_State *L )
+{
+	sigset_t all, old;
+	int err;
+
+	if( drain_running || inotify_fd < 0 )
+	{
+		return;
+	}
+
+	// signals are for the main thread
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+
+	err = pthread_create( &drain_thread, NULL, drain_loop, NULL );
+
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+	if( err )
+	{
+		printlogf(
+			L, "Error",
+			"Cannot start the inotify reader thread! ( %d : %s )",
+			err, strerror( err )
+		);
+		exit( -1 );
+	}
+
+	drain_running = true;
+}
+
+
+/*
+| Stops the reader thread and frees the queue.
+*/
+static void
+stop_inotify_drain( )
+{
+	if( drain_running )
+	{
+		const uint64_t one = 1;
+
+		if( write( drain_stop_fd, &one, sizeof( one ) ) < 0 )
+		{
+			logstring( "Error", "Cannot stop the inotify reader thread!" );
+			exit( -1 );
+		}
+
+		pthread_join( drain_thread, NULL );
+
+		drain_running = false;
+	}
+
+	while( drain_head )
+	{
+		struct drain_segment * next = atomic_load( &drain_head->next );
+
+		free( drain_head );
+
+		drain_head = next;
+	}
+
+	drain_tail = NULL;
+
+	close( drain_wake_fd );
+	close( drain_stop_fd );
+
+	drain_wake_fd = drain_stop_fd = -1;
+}
+
+
+/*
+| Sets up the queue and the eventfds of the drain.
+*/
+static void
+open_inotify_drain( lua_State *L )
+{
+	drain_head = drain_tail = drain_segment_new( );
+	drain_pos = 0;
+
+	atomic_store( &drain_bytes, 0 );
+	atomic_store( &drain_hwm, 0 );
+	atomic_store( &drain_dropped, 0 );
+	atomic_store( &drain_overflow, false );
+
+	drain_wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	drain_stop_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+
+	if( !drain_head || drain_wake_fd < 0 || drain_stop_fd < 0 )
+	{
+		printlogf(
+			L, "Error",
+			"Cannot set up the inotify reader! ( %d : %s )",
+			errno, strerror( errno )
+		);
+		exit( -1 );
+	}
+}
+
+#endif
+
+
+/*
+| Returns the bytes in the inotify queue, its high-water mark
+| and the number of dropped events.
+|
+| Returns nothing if the inotify queue is not used.
+*/
+static int
+l_queuestats( lua_State *L )
+{
+#ifdef INOTIFY_DRAIN
+	lua_pushinteger( L, atomic_load( &drain_bytes ) );
+	lua_pushinteger( L, atomic_load( &drain_hwm ) );
+	lua_pushinteger( L, atomic_load( &drain_dropped ) );
+
+	return 3;
+#else
+	return 0;
+#endif
 }
 
 
@@ -510,7 +1690,11 @@ register_inotify( lua_State *L )
 static void
 inotify_tidy( struct observance *obs )
 {
+#ifdef INOTIFY_DRAIN
+	if( obs->fd != drain_wake_fd )
+#else
 	if( obs->fd != inotify_fd )
+#endif
 	{
 		logstring(
 			"Error",
@@ -520,11 +1704,19 @@ inotify_tidy( struct observance *obs )
 		exit( -1 );
 	}
 
+#ifdef INOTIFY_DRAIN
+	stop_inotify_drain( );
+#endif
+
 	close( inotify_fd );
 
+	inotify_fd = -1;
+
+#ifndef INOTIFY_DRAIN
 	free( readbuf );
 
 	readbuf = NULL;
+#endif
 }
 
 /*
@@ -533,6 +1725,7 @@ inotify_tidy( struct observance *obs )
 extern void
 open_inotify( lua_State *L )
 {
+#ifndef INOTIFY_DRAIN
 	if( readbuf )
 	{
 		logstring(
@@ -543,6 +1736,7 @@ open_inotify( lua_State *L )
 	}
 
 	readbuf = s_malloc( readbuf_size );
+#endif
 
 	inotify_fd = inotify_init( );
 
@@ -565,6 +1759,14 @@ open_inotify( lua_State *L )
 
 	close_exec_fd( inotify_fd );
 	non_block_fd( inotify_fd );
+
+#ifdef INOTIFY_DRAIN
+	// the reader thread reads inotify,
+	// the core is woken through the eventfd
+	open_inotify_drain( L );
+	observe_fd( drain_wake_fd, drain_ready, NULL, inotify_tidy, NULL );
+#else
 	observe_fd( inotify_fd, inotify_ready, NULL, inotify_tidy, NULL );
+#endif
 }
 
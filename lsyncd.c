@@ -22,9 +22,22 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/select.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#endif
+#if defined( HAVE_PIDFD ) || defined( HAVE_GETDENTS64 )
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #include <sys/stat.h>
 #include <sys/times.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <errno.h>
@@ -33,6 +46,7 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -66,10 +80,12 @@ extern size_t defaults_size;
 | Makes sure there is one file system monitor.
 */
 #ifndef WITH_INOTIFY
+#ifndef WITH_FANOTIFY
 #ifndef WITH_FSEVENTS
 #	error "needing at least one notification system. please rerun cmake"
 #endif
 #endif
+#endif
 
 /*
 | All monitors supported by this Lsyncd.
@@ -80,10 +96,16 @@ static char *monitors[] = {
 	"inotify",
 #endif
 
+#ifdef WITH_FANOTIFY
+	"fanotify",
+#endif
+
 #ifdef WITH_FSEVENTS
 	"fsevents",
 #endif
 
+	"poll",
+
 	NULL,
 };
 
@@ -127,15 +149,28 @@ static bool first_time = true;
 
 
 /*
-| Set by TERM or HUP signal handler
+| Set by TERM signal handler or on an overflow
 | telling Lsyncd should end or reset ASAP.
 */
 volatile sig_atomic_t hup  = 0;
 volatile sig_atomic_t term = 0;
+
+/*
+| Set by HUP signal handler
+| telling Lsyncd to reload its configuration.
+*/
+volatile sig_atomic_t reload = 0;
 volatile sig_atomic_t sigcode = 0;
 int pidfile_fd = 0;
 
 
+/*
+| Set by the USR1 signal handler
+| telling Lsyncd to reopen the logfile (logrotate).
+*/
+volatile sig_atomic_t reopen_log = 0;
+
+
 /*
 | The kernel's clock ticks per second.
 */
@@ -158,6 +193,14 @@ static int runner;
 static int callError;
 
 
+/*
+| Dummy variable of which it's address is used as
+| the cores index in the lua registry to
+| the table mapping child pids to their owners.
+*/
+static int processOwners;
+
+
 /**
  * signal handler
  */
@@ -182,7 +225,11 @@ sig_handler( int sig )
 			return;
 
 		case SIGHUP:
-			hup = 1;
+			reload = 1;
+			return;
+
+		case SIGUSR1:
+			reopen_log = 1;
 			return;
 	}
 }
@@ -346,6 +393,269 @@ add_logcat( const char *name, int priority )
 }
 
 
+/*
+| The logfile is kept open and log lines are collected in a ring
+| buffer instead of opening and closing the logfile for every line.
+|
+| The ring is written out when the masterloop goes to sleep,
+| at least every LOG_FLUSH_SECS while it is busy and
+| right away for errors.
+|
+| If the ring is full, lines are dropped and counted
+| rather than blocking Lsyncd.
+*/
+#define LOG_RING_SIZE ( 256 * 1024 )
+#define LOG_FLUSH_SECS 1
+
+static char log_ring[ LOG_RING_SIZE ];
+
+// total bytes put into and written out of the ring,
+// their difference is the filling of the ring
+static size_t log_head = 0;
+static size_t log_tail = 0;
+
+// the number of lines in the ring
+static unsigned long log_lines = 0;
+
+// lines dropped since the last write and in total
+static unsigned long log_dropped = 0;
+static unsigned long log_dropped_total = 0;
+
+// the opened logfile
+static int log_fd = -1;
+
+// when the ring has been written out the last time
+static time_t log_written = 0;
+
+
+/*
+| Drops the lines of the parent from the log ring.
+|
+| Called by a forked child, so it does not write out
+| its parent's lines a second time.
+*/
+extern void
+log_forked( )
+{
+	log_head = log_tail = 0;
+	log_lines = 0;
+	log_dropped = 0;
+}
+
+
+/*
+| Puts the pieces of a log line into the ring.
+|
+| Drops the whole line if it does not fit.
+*/
+static void
+log_put(
+	const char * ct,     // the timestamp
+	const char * cat,    // the category
+	const char * message // the log message
+)
+{
+	const char * pieces[ ] = { ct, " ", cat, ": ", message, "\n" };
+	size_t len = 0;
+	unsigned int i;
+
+	for( i = 0; i < sizeof( pieces ) / sizeof( pieces[ 0 ] ); i++ )
+	{
+		len += strlen( pieces[ i ] );
+	}
+
+	if( len > LOG_RING_SIZE - ( log_head - log_tail ) )
+	{
+		log_dropped++;
+		log_dropped_total++;
+		return;
+	}
+
+	for( i = 0; i < sizeof( pieces ) / sizeof( pieces[ 0 ] ); i++ )
+	{
+		const char * p = pieces[ i ];
+		size_t plen = strlen( p );
+
+		while( plen > 0 )
+		{
+			size_t pos = log_head % LOG_RING_SIZE;
+			size_t chunk = LOG_RING_SIZE - pos;
+
+			if( chunk > plen )
+			{
+				chunk = plen;
+			}
+
+			memcpy( log_ring + pos, p, chunk );
+
+			log_head += chunk;
+			p += chunk;
+			plen -= chunk;
+		}
+	}
+
+	log_lines++;
+}
+
+
+/*
+| Writes the ring out to the logfile.
+|
+| If not forced, this only happens if the ring has not been
+| written for LOG_FLUSH_SECS or it is filled to more than half.
+*/
+static void
+log_flush( bool force )
+{
+	char note[ 128 ];
+	struct iovec iov[ 3 ];
+	int iovcnt = 0;
+	size_t pos, fill;
+
+	if( reopen_log )
+	{
+		// the logfile is reopened with the next write
+		reopen_log = 0;
+
+		if( log_fd >= 0 )
+		{
+			close( log_fd );
+			log_fd = -1;
+		}
+	}
+
+	fill = log_head - log_tail;
+
+	if( !fill && !log_dropped )
+	{
+		return;
+	}
+
+	if(
+		!force
+		&& fill < LOG_RING_SIZE / 2
+		&& time( NULL ) - log_written < LOG_FLUSH_SECS
+	)
+	{
+		return;
+	}
+
+	if( !settings.log_file )
+	{
+		log_head = log_tail = 0;
+		log_lines = 0;
+		return;
+	}
+
+	if( log_fd < 0 )
+	{
+		log_fd = open(
+			settings.log_file,
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+			0666
+		);
+
+		if( log_fd < 0 )
+		{
+			// empties the ring, so the exit does not try again
+			log_head = log_tail = 0;
+			log_lines = 0;
+			log_dropped = 0;
+
+			fprintf(
+				stderr,
+				"Cannot open logfile [%s]!\n",
+				settings.log_file
+			);
+
+			exit( -1 );
+		}
+	}
+
+	// the filling of the ring may wrap around its end
+	pos = log_tail % LOG_RING_SIZE;
+
+	if( fill > 0 )
+	{
+		iov[ iovcnt ].iov_base = log_ring + pos;
+		iov[ iovcnt ].iov_len  = fill < LOG_RING_SIZE - pos ? fill : LOG_RING_SIZE - pos;
+		iovcnt++;
+
+		if( fill > LOG_RING_SIZE - pos )
+		{
+			iov[ iovcnt ].iov_base = log_ring;
+			iov[ iovcnt ].iov_len  = fill - ( LOG_RING_SIZE - pos );
+			iovcnt++;
+		}
+	}
+
+	if( log_dropped )
+	{
+		iov[ iovcnt ].iov_base = note;
+		iov[ iovcnt ].iov_len  = snprintf(
+			note, sizeof( note ),
+			"Lsyncd: log buffer full, dropped %lu lines (%lu total).\n",
+			log_dropped, log_dropped_total
+		);
+		iovcnt++;
+	}
+
+	while( iovcnt > 0 )
+	{
+		ssize_t w = writev( log_fd, iov, iovcnt );
+
+		if( w < 0 )
+		{
+			if( errno == EINTR )
+			{
+				continue;
+			}
+
+			// the logfile is not writeable (like a full disk),
+			// the lines are lost, but Lsyncd carries on
+			log_dropped_total += log_lines;
+			break;
+		}
+
+		// skips what has been written
+		while( iovcnt > 0 && ( size_t ) w >= iov[ 0 ].iov_len )
+		{
+			w -= iov[ 0 ].iov_len;
+			memmove( iov, iov + 1, --iovcnt * sizeof( struct iovec ) );
+		}
+
+		if( iovcnt > 0 )
+		{
+			iov[ 0 ].iov_base = ( char * ) iov[ 0 ].iov_base + w;
+			iov[ 0 ].iov_len -= w;
+		}
+	}
+
+	log_head = log_tail = 0;
+	log_lines = 0;
+	log_dropped = 0;
+	log_written = time( NULL );
+}
+
+
+/*
+| Closes the logfile after writing out the ring.
+|
+| Used when exiting or when the logfile changes.
+*/
+static void
+log_close( )
+{
+	log_flush( true );
+
+	if( log_fd >= 0 )
+	{
+		close( log_fd );
+		log_fd = -1;
+	}
+}
+
+
 /*
 | Logs a string.
 |
@@ -394,41 +704,31 @@ logstring0(
 		);
 	}
 
-	// writes to file if configured so
+	// puts into the log ring if configured so
 	if( settings.log_file )
 	{
-		FILE * flog = fopen( settings.log_file, "a" );
-
-		char * ct;
+		// the timestamp day-time-year is formatted once per second
+		static char ct[ 64 ];
+		static time_t ct_time = 0;
 
 		time_t mtime;
 
-		// gets current timestamp day-time-year
 		time( &mtime );
 
-		ct = ctime( &mtime );
-
-	 	// cuts trailing linefeed
-		ct[ strlen( ct ) - 1] = 0;
-
-		if( flog == NULL )
+		if( mtime != ct_time || !ct[ 0 ] )
 		{
-			fprintf(
-				stderr,
-				"Cannot open logfile [%s]!\n",
-				settings.log_file
-			);
-
-			exit( -1 );
+			strftime( ct, sizeof( ct ), "%a %b %e %T %Y", localtime( &mtime ) );
+			ct_time = mtime;
 		}
 
-		fprintf(
-			flog,
-			"%s %s: %s\n",
-			ct, cat, message
-		);
+		log_put( ct, cat, message );
 
-		fclose( flog );
+		// errors are written right away, they are often
+		// the last thing Lsyncd says before exiting
+		if( priority <= LOG_ERR )
+		{
+			log_flush( true );
+		}
 	}
 
 	// sends to syslog if configured so
@@ -774,165 +1074,320 @@ write_pidfile
 
 
 /*
-| List of file descriptor watches.
+| Table of file descriptor watches, directly indexed by the fd.
+|
+| Every observance is allocated on its own, so growing the table
+| does not move the observance a running handler was called with.
+| A slot is in use when it is not NULL.
+*/
+static struct observance ** observances = NULL;
+static int observances_size             = 0;
+
+/*
+| Observances removed, but maybe still used by the handler
+| running. They are freed after the handlers of a beat.
+*/
+static struct observance ** observances_gone = NULL;
+static int observances_gone_count            = 0;
+static int observances_gone_size             = 0;
+
+/*
+| Number of slots in use and the highest fd in use.
+*/
+static int observances_count           = 0;
+static int observances_maxfd           = -1;
+
+/*
+| Generation counter, increased by every new observance.
+|
+| The masterloop remembers the generation before it goes to sleep
+| and skips observances that are younger than that, since their fd
+| number may be the one of an observance already gone in this beat.
 */
-static struct observance * observances = NULL;
-static int observances_len             = 0;
-static int observances_size            = 0;
+static unsigned int observances_gen    = 0;
 
+#ifdef HAVE_EPOLL
 
 /*
-| List of file descriptors to not observe.
+| The epoll instance every observance is registered with.
 |
-| While working for the oberver lists, it may
-| not be altered, thus nonobserve stores the
-| delayed removals.
+| Registrations are persistent, so the core does not have to
+| rebuild its interest set on every turn of the masterloop.
 */
-static int * nonobservances    = NULL;
-static int nonobservances_len  = 0;
-static int nonobservances_size = 0;
+static int epoll_fd = -1;
 
 /*
-| True while the observances list is being handled.
+| Receives the ready events of one epoll_pwait( ).
 */
-static bool observance_action = false;
+static struct epoll_event * epoll_events = NULL;
+static int epoll_events_size = 0;
 
 
 /*
-| Core watches a filedescriptor to become ready,
-| one of read_ready or write_ready may be zero
+| Adds (EPOLL_CTL_ADD) or updates (EPOLL_CTL_MOD) the
+| registration of an observance in the epoll instance.
+|
+| Updating also rearms edge triggered observances,
+| epoll reports them again if they are still ready.
 */
-extern void
-observe_fd(
-	int fd,
-	void ( * ready  ) (lua_State *, struct observance * ),
-	void ( * writey ) (lua_State *, struct observance * ),
-	void ( * tidy   ) (struct observance * ),
-	void *extra
+static void
+epoll_register(
+	int op,
+	struct observance * obs
 )
 {
-	int pos;
+	struct epoll_event ev;
 
-	// looks if the fd is already there as pos or
-	// stores the position to insert the new fd in pos
-	for( pos = 0; pos < observances_len; pos++)
+	if( epoll_fd < 0 )
 	{
-		if( fd <= observances[ pos ].fd )
-			{ break; }
-	}
+		epoll_fd = epoll_create1( EPOLL_CLOEXEC );
 
-	if( pos < observances_len && observances[ pos ].fd == fd )
-	{
-		// just updates an existing observance
-		logstring( "Masterloop", "updating fd observance" );
-		observances[ pos ].ready  = ready;
-		observances[ pos ].writey = writey;
-		observances[ pos ].tidy   = tidy;
-		observances[ pos ].extra  = extra;
-		return;
+		if( epoll_fd < 0 )
+		{
+			logstring( "Error", "Cannot create the epoll instance!" );
+			exit( -1 );
+		}
 	}
 
-	if( observance_action )
-	{
-		// FIXME
-		logstring(
-			"Error",
-			"New observances in ready/writey handlers not yet supported"
-		);
+	memset( &ev, 0, sizeof( ev ) );
 
-		exit( -1 );
-	}
+	if( obs->ready  ) ev.events |= EPOLLIN;
+	if( obs->writey ) ev.events |= EPOLLOUT;
+	if( obs->mode == OBSERVE_EDGE ) ev.events |= EPOLLET;
 
-	if( !tidy )
+	ev.data.fd = obs->fd;
+
+	if( epoll_ctl( epoll_fd, op, obs->fd, &ev ) < 0 )
 	{
-		logstring(
-			"Error",
-			"internal, tidy() in observe_fd() must not be NULL."
-		);
+		logstring( "Error", "internal fail, cannot register fd with epoll" );
 		exit( -1 );
 	}
+}
+
+#endif
 
-	if( observances_len + 1 > observances_size )
+
+/*
+| Returns the observance of a file descriptor
+| or NULL if not observed.
+*/
+static struct observance *
+get_observance( int fd )
+{
+	if( fd < 0 || fd >= observances_size )
 	{
-		observances_size = observances_len + 1;
-		observances = s_realloc(
-			observances,
-			observances_size * sizeof( struct observance )
-		);
+		return NULL;
 	}
 
-	memmove(
-		observances + pos + 1,
-		observances + pos,
-		(observances_len - pos) * sizeof(struct observance)
-	);
+	return observances[ fd ];
+}
 
-	observances_len++;
 
-	observances[ pos ].fd     = fd;
-	observances[ pos ].ready  = ready;
-	observances[ pos ].writey = writey;
-	observances[ pos ].tidy   = tidy;
-	observances[ pos ].extra  = extra;
+/*
+| Frees the observances removed since the last call.
+|
+| Called by the masterloop when no handler runs.
+*/
+static void
+free_gone_observances( )
+{
+	while( observances_gone_count > 0 )
+	{
+		free( observances_gone[ --observances_gone_count ] );
+	}
 }
 
 
 /*
-| Makes the core no longer watch a filedescriptor.
+| Returns the observance of a file descriptor, if it is
+| still observed and already was before the current beat.
 */
-extern void
-nonobserve_fd( int fd )
+static struct observance *
+get_beat_observance(
+	int fd,
+	unsigned int gen
+)
 {
-	int pos;
+	struct observance * obs = get_observance( fd );
 
-	if( observance_action )
+	if( !obs || (int) ( obs->gen - gen ) > 0 )
 	{
-		// this function is called through a ready/writey handler
-		// while the core works through the observance list, thus
-		// it does not alter the list, but stores this actions
-		// on a stack
-		nonobservances_len++;
-		if( nonobservances_len > nonobservances_size )
-		{
-			nonobservances_size = nonobservances_len;
-			nonobservances = s_realloc(
-				nonobservances,
-				nonobservances_size * sizeof( int )
-			);
-		}
-
-		nonobservances[ nonobservances_len - 1 ] = fd;
-		return;
+		return NULL;
 	}
 
-	// looks for the fd
-	for( pos = 0; pos < observances_len; pos++ )
-	{
-		if( observances[ pos ].fd == fd )
-			{ break; }
-	}
+	return obs;
+}
 
-	if( pos >= observances_len )
-	{
-		logstring(
-			"Error",
-			"internal fail, not observance file descriptor in nonobserve"
-		);
 
-		exit( -1 );
-	}
+/*
+| Core watches a filedescriptor to become ready,
+| one of read_ready or write_ready may be zero
+|
+| This may be called from within ready/writey handlers.
+*/
+extern void
+observe_fd_mode(
+	int fd,
+	void ( * ready  ) (lua_State *, struct observance * ),
+	void ( * writey ) (lua_State *, struct observance * ),
+	void ( * tidy   ) (struct observance * ),
+	void *extra,
+	int mode
+)
+{
+	struct observance * obs;
+
+	if( !tidy )
+	{
+		logstring(
+			"Error",
+			"internal, tidy() in observe_fd() must not be NULL."
+		);
+		exit( -1 );
+	}
 
-	// tidies up the observance
-	observances[ pos ].tidy( observances + pos );
+	if( fd < 0 )
+	{
+		logstring(
+			"Error",
+			"internal, invalid file descriptor in observe_fd()."
+		);
+		exit( -1 );
+	}
+
+	obs = get_observance( fd );
+
+	if( obs )
+	{
+		// just updates an existing observance
+		logstring( "Masterloop", "updating fd observance" );
+		obs->ready  = ready;
+		obs->writey = writey;
+		obs->tidy   = tidy;
+		obs->extra  = extra;
+		obs->mode   = mode;
+#ifdef HAVE_EPOLL
+		epoll_register( EPOLL_CTL_MOD, obs );
+#endif
+		return;
+	}
+
+	if( fd >= observances_size )
+	{
+		int size = observances_size ? observances_size : 16;
+
+		while( fd >= size )
+		{
+			size *= 2;
+		}
+
+		observances = s_realloc(
+			observances,
+			size * sizeof( struct observance * )
+		);
+
+		memset(
+			observances + observances_size,
+			0,
+			( size - observances_size ) * sizeof( struct observance * )
+		);
+
+		observances_size = size;
+	}
+
+	obs = s_calloc( 1, sizeof( struct observance ) );
+
+	observances[ fd ] = obs;
+
+	obs->fd     = fd;
+	obs->ready  = ready;
+	obs->writey = writey;
+	obs->tidy   = tidy;
+	obs->extra  = extra;
+	obs->mode   = mode;
+	obs->gen    = ++observances_gen;
+
+	observances_count++;
+
+	if( fd > observances_maxfd )
+	{
+		observances_maxfd = fd;
+	}
+
+#ifdef HAVE_EPOLL
+	epoll_register( EPOLL_CTL_ADD, obs );
+#endif
+}
 
-	// and moves the list down
-	memmove(
-		observances + pos,
-		observances + pos + 1,
-		(observances_len - pos) * sizeof( struct observance )
-	);
 
-	observances_len--;
+/*
+| Core watches a filedescriptor level triggered.
+*/
+extern void
+observe_fd(
+	int fd,
+	void ( * ready  ) (lua_State *, struct observance * ),
+	void ( * writey ) (lua_State *, struct observance * ),
+	void ( * tidy   ) (struct observance * ),
+	void *extra
+)
+{
+	observe_fd_mode( fd, ready, writey, tidy, extra, OBSERVE_LEVEL );
+}
+
+
+/*
+| Makes the core no longer watch a filedescriptor.
+|
+| This may be called from within ready/writey handlers,
+| also for the observance being handled.
+*/
+extern void
+nonobserve_fd( int fd )
+{
+	struct observance * obs = get_observance( fd );
+
+	if( !obs )
+	{
+		logstring(
+			"Error",
+			"internal fail, not observance file descriptor in nonobserve"
+		);
+
+		exit( -1 );
+	}
+
+#ifdef HAVE_EPOLL
+	// unregisters before tidy( ) closes the fd,
+	// fails harmlessly if the fd has been closed already
+	epoll_ctl( epoll_fd, EPOLL_CTL_DEL, fd, NULL );
+#endif
+
+	// frees the slot before tidying up,
+	// so tidy( ) may observe new fds
+	observances[ fd ] = NULL;
+
+	observances_count--;
+
+	while( observances_maxfd >= 0 && !observances[ observances_maxfd ] )
+	{
+		observances_maxfd--;
+	}
+
+	obs->tidy( obs );
+
+	// the handler being called may still look at it
+	if( observances_gone_count == observances_gone_size )
+	{
+		observances_gone_size = observances_gone_size ? observances_gone_size * 2 : 16;
+
+		observances_gone = s_realloc(
+			observances_gone,
+			observances_gone_size * sizeof( struct observance * )
+		);
+	}
+
+	observances_gone[ observances_gone_count++ ] = obs;
 }
 
 
@@ -1018,6 +1473,248 @@ user_obs_tidy( struct observance *obs )
 }
 
 
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*
+(             Child processes               )
+ *~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+/*
+| True if there may be children that are not observed
+| by a pidfd or the signalfd, in that case the masterloop
+| polls for zombies every turn.
+*/
+static bool reap_polling = false;
+
+
+#ifdef HAVE_PIDFD
+/*
+| Set if the kernel turned out to not support pidfds.
+*/
+static bool pidfd_unsupported = false;
+#endif
+
+
+#ifdef HAVE_SIGNALFD
+/*
+| Receives SIGCHLD if pidfds are not available.
+*/
+static int sigchld_fd = -1;
+#endif
+
+
+/*
+| Hands a collected child process to the runner.
+|
+| Also passes the Sync or Tunnel owning the child if known,
+| so the runner does not have to search for it.
+*/
+extern void
+collect_child(
+	lua_State * L,
+	pid_t pid,
+	int status
+)
+{
+	load_runner_func( L, "collectProcess" );
+	lua_pushinteger( L, pid );
+	lua_pushinteger( L, WEXITSTATUS( status ) );
+
+	// pushes the owner and removes it from the owners table
+	lua_pushlightuserdata( L, (void *) &processOwners );
+	lua_gettable( L, LUA_REGISTRYINDEX );
+
+	if( !lua_isnil( L, -1 ) )
+	{
+		lua_pushinteger ( L, pid );
+		lua_gettable    ( L, -2  );
+		lua_pushinteger ( L, pid );
+		lua_pushnil     ( L      );
+		lua_settable    ( L, -4  );
+		lua_remove      ( L, -2  );
+	}
+
+	if( lua_pcall( L, 3, 0, -5 ) )
+	{
+		safeexit( L, -1 );
+	}
+
+	lua_pop( L, 1 );
+}
+
+
+/*
+| Collects all zombified child processes.
+*/
+static void
+reap_children( lua_State * L )
+{
+	while( true )
+	{
+		int status;
+		pid_t pid = waitpid( 0, &status, WNOHANG );
+
+		if( pid <= 0 )
+		{
+			// no more zombies
+			break;
+		}
+
+		collect_child( L, pid, status );
+	}
+}
+
+
+#ifdef HAVE_PIDFD
+
+/*
+| The pidfd of a child became ready, thus it has exited.
+|
+| The observances extra is the pid of the child.
+*/
+static void
+pidfd_ready(
+	lua_State * L,
+	struct observance * obs
+)
+{
+	pid_t pid = ( pid_t ) ( intptr_t ) obs->extra;
+	int status;
+	pid_t rv = waitpid( pid, &status, WNOHANG );
+
+	if( rv == 0 )
+	{
+		// still running
+		return;
+	}
+
+	// marks it as reaped for pidfd_tidy( )
+	obs->extra = NULL;
+	nonobserve_fd( obs->fd );
+
+	// on ECHILD it has already been reaped by reap_children( )
+	if( rv == pid )
+	{
+		collect_child( L, pid, status );
+	}
+}
+
+
+/*
+| Tidies up a pidfd observance.
+*/
+static void
+pidfd_tidy( struct observance * obs )
+{
+	close( obs->fd );
+
+	// a child still running when the observances are torn down
+	// for a restart is left for polling
+	if( obs->extra )
+	{
+		reap_polling = true;
+	}
+}
+
+#endif
+
+
+#ifdef HAVE_SIGNALFD
+
+/*
+| The signalfd received a SIGCHLD.
+*/
+static void
+sigchld_ready(
+	lua_State * L,
+	struct observance * obs
+)
+{
+	struct signalfd_siginfo si;
+
+	// drains the signalfd, since SIGCHLDs coalesce
+	// this does not tell how many children have exited
+	while( read( obs->fd, &si, sizeof( si ) ) == sizeof( si ) ) { }
+
+	reap_children( L );
+}
+
+
+/*
+| Tidies up the signalfd.
+*/
+static void
+sigchld_tidy( struct observance * obs )
+{
+	close( obs->fd );
+	sigchld_fd = -1;
+}
+
+#endif
+
+
+/*
+| Makes the core observe a newly spawned child,
+| so it is collected as soon as it exits.
+|
+| Uses a pidfd per child, the signalfd for SIGCHLD if
+| pidfds are not available or as last resort polling.
+*/
+static void
+observe_child( pid_t pid )
+{
+#ifdef HAVE_PIDFD
+	if( !pidfd_unsupported )
+	{
+		int pidfd = syscall( SYS_pidfd_open, pid, 0 );
+
+		if( pidfd >= 0 )
+		{
+			close_exec_fd( pidfd );
+
+			observe_fd(
+				pidfd,
+				pidfd_ready,
+				NULL,
+				pidfd_tidy,
+				( void * ) ( intptr_t ) pid
+			);
+
+			return;
+		}
+
+		if( errno == ENOSYS )
+		{
+			logstring( "Normal", "Kernel has no pidfds, collecting children on SIGCHLD." );
+			pidfd_unsupported = true;
+		}
+	}
+#endif
+
+#ifdef HAVE_SIGNALFD
+	if( sigchld_fd < 0 )
+	{
+		sigset_t set;
+		sigemptyset( &set );
+		sigaddset( &set, SIGCHLD );
+
+		sigchld_fd = signalfd( -1, &set, SFD_NONBLOCK | SFD_CLOEXEC );
+
+		if( sigchld_fd >= 0 )
+		{
+			observe_fd( sigchld_fd, sigchld_ready, NULL, sigchld_tidy, NULL );
+		}
+	}
+
+	if( sigchld_fd >= 0 )
+	{
+		return;
+	}
+#endif
+
+	reap_polling = true;
+}
+
+
 /******************************.
 * Library calls for the runner *
 '******************************/
@@ -1128,6 +1825,8 @@ l_now(lua_State *L)
 /*
 | Sends a signal to proceess pid
 |
+| Children spawned by the spawn helper are known by their ticket.
+|
 | Params on Lua stack:
 |     1: pid
 |     2: signal
@@ -1141,7 +1840,7 @@ l_kill( lua_State *L )
 	pid_t pid = luaL_checkinteger( L, 1 );
 	int sig = luaL_checkinteger( L, 2 );
 
-	int rv = kill(pid, sig );
+	int rv = zygote_kill( pid, sig );
 
 	lua_pushinteger( L, rv );
 
@@ -1202,6 +1901,92 @@ error:
 
 
 
+#ifdef HAVE_POSIX_SPAWN
+
+extern char ** environ;
+
+/*
+| Spawns a child process with posix_spawnp( ).
+|
+| Other than fork( ) this does not copy the page tables of the
+| daemon (glibc uses a vfork like clone( ) for it), so spawning does
+| not get slower with a growing Lua heap.
+|
+| Returns the pid or -1 on failure.
+*/
+static pid_t
+spawn_child(
+	lua_State * L,
+	const char * binary,   // the binary to call
+	char const ** argv,    // the arguments
+	int stdin_fd           // if >= 0 becomes stdin of the child
+)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigset;
+	pid_t pid;
+	int err;
+
+	posix_spawn_file_actions_init( &actions );
+	posix_spawnattr_init( &attr );
+
+	// replaces stdin for pipes
+	if( stdin_fd >= 0 )
+	{
+		posix_spawn_file_actions_adddup2( &actions, stdin_fd, STDIN_FILENO );
+	}
+
+	// if lsyncd runs as a daemon and has a logfile it will redirect
+	// stdout/stderr of child processes to the logfile.
+	if( is_daemon && settings.log_file )
+	{
+		posix_spawn_file_actions_addopen(
+			&actions,
+			STDOUT_FILENO,
+			settings.log_file,
+			O_WRONLY | O_APPEND | O_CREAT,
+			0666
+		);
+
+		posix_spawn_file_actions_adddup2( &actions, STDOUT_FILENO, STDERR_FILENO );
+	}
+
+	// the child does not inherit the blocked SIGCHLD
+	sigemptyset( &sigset );
+	posix_spawnattr_setsigmask( &attr, &sigset );
+	posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETSIGMASK );
+
+	err = posix_spawnp(
+		&pid,
+		binary,
+		&actions,
+		&attr,
+		( char * const * ) argv,
+		environ
+	);
+
+	posix_spawnattr_destroy( &attr );
+	posix_spawn_file_actions_destroy( &actions );
+
+	if( err )
+	{
+		printlogf(
+			L, "Exec",
+			"posix_spawn of [ %s ] failed: %s",
+			binary,
+			strerror( err )
+		);
+
+		return -1;
+	}
+
+	return pid;
+}
+
+#endif
+
+
 /*
 | Executes a subprocess. Does not wait for it to return.
 |
@@ -1243,6 +2028,9 @@ l_exec( lua_State *L )
 	// pipe file descriptors
 	int pipefd[ 2 ];
 
+	// true if spawned by the spawn helper
+	bool by_zygote;
+
 	int i;
 
 	// expands tables
@@ -1367,11 +2155,47 @@ l_exec( lua_State *L )
 
 	argv[ i ] = NULL;
 
-	// the fork!
-	pid = fork( );
+	// the child writes into the logfile as well,
+	// the lines logged before come first
+	if( is_daemon && settings.log_file )
+	{
+		log_flush( true );
+	}
+
+	// spawns through the spawn helper if running
+	pid = zygote_spawn(
+		L, binary, argv,
+		pipe_text ? pipefd[ 0 ] : -1,
+		is_daemon ? settings.log_file : NULL
+	);
+
+	by_zygote = pid > 0;
+
+#ifdef HAVE_POSIX_SPAWN
+	if( pid < 0 )
+	{
+		pid = spawn_child( L, binary, argv, pipe_text ? pipefd[ 0 ] : -1 );
+	}
+#endif
+
+	// on failure falls back to fork( ), whose child reports
+	// an exec failure as exitcode like it always did
+	if( pid < 0 )
+	{
+		// the fork!
+		pid = fork( );
+	}
 
 	if( pid == 0 )
 	{
+		sigset_t sigset;
+
+		log_forked( );
+
+		// the child does not inherit the blocked SIGCHLD
+		sigemptyset( &sigset );
+		sigprocmask( SIG_SETMASK, &sigset, NULL );
+
 		// replaces stdin for pipes
 		if( pipe_text )
 		{
@@ -1454,6 +2278,12 @@ l_exec( lua_State *L )
 		}
 	}
 
+	// children of the spawn helper are reported by it
+	if( pid > 0 && !by_zygote )
+	{
+		observe_child( pid );
+	}
+
 	free( argv );
 	lua_pushnumber( L, pid );
 
@@ -1461,6 +2291,44 @@ l_exec( lua_State *L )
 }
 
 
+/*
+| Tells the core the owner of a child process.
+|
+| The owner is handed to runner.collectProcess( )
+| when the child process is collected.
+|
+| Params on Lua stack:
+|     1: pid of the child process
+|     2: the owning Sync or Tunnel
+*/
+static int
+l_own_process( lua_State *L )
+{
+	pid_t pid = luaL_checkinteger( L, 1 );
+
+	luaL_checkany( L, 2 );
+
+	lua_pushlightuserdata( L, (void *) &processOwners );
+	lua_gettable( L, LUA_REGISTRYINDEX );
+
+	if( lua_isnil( L, -1 ) )
+	{
+		lua_pop               ( L, 1                        );
+		lua_newtable          ( L                           );
+		lua_pushlightuserdata ( L, (void *) &processOwners  );
+		lua_pushvalue         ( L, -2                       );
+		lua_settable          ( L, LUA_REGISTRYINDEX        );
+	}
+
+	lua_pushinteger ( L, pid );
+	lua_pushvalue   ( L,  2  );
+	lua_settable    ( L, -3  );
+	lua_pop         ( L,  1  );
+
+	return 0;
+}
+
+
 /*
 | Converts a relative directory path to an absolute.
 |
@@ -1596,6 +2464,147 @@ l_stackdump( lua_State * L )
 	return 0;
 }
 
+/*
+| The layout of the records returned by getdents64( ).
+*/
+#ifdef HAVE_GETDENTS64
+struct dirscan_dirent
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[ ];
+};
+#endif
+
+
+/*
+| Opens a directory to scan, false on error.
+|
+| With getdents64( ) the entries are read in batches into
+| the buffer of the scan and nothing is allocated per entry.
+| Scans on their own stacks can run in parallel.
+*/
+bool
+dirscan_open(
+	struct dirscan *s,
+	const char *dirname,
+	bool follow  // false to not follow dirname if it is a symlink
+)
+{
+	s->fd = open(
+		dirname,
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC | ( follow ? 0 : O_NOFOLLOW )
+	);
+
+	if( s->fd < 0 )
+	{
+		return false;
+	}
+
+#ifdef HAVE_GETDENTS64
+	s->len = 0;
+	s->pos = 0;
+#else
+	s->d = fdopendir( s->fd );
+
+	if( !s->d )
+	{
+		close( s->fd );
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+
+/*
+| Returns the next entry of a directory, ignoring . and ..
+| false when finished.
+*/
+bool
+dirscan_next(
+	struct dirscan *s,
+	const char **name,
+	unsigned char *type,
+	ino_t *ino
+)
+{
+	while( true )
+	{
+#ifdef HAVE_GETDENTS64
+		struct dirscan_dirent *de;
+
+		if( s->pos >= s->len )
+		{
+			s->len = syscall( SYS_getdents64, s->fd, s->buf, sizeof( s->buf ) );
+			s->pos = 0;
+
+			if( s->len <= 0 )
+			{
+				return false;
+			}
+		}
+
+		de = ( struct dirscan_dirent * ) ( ( char * ) s->buf + s->pos );
+
+		s->pos += de->d_reclen;
+#else
+		struct dirent *de = readdir( s->d );
+
+		if( de == NULL )
+		{
+			return false;
+		}
+#endif
+
+		if(
+			!strcmp( de->d_name, "."  )
+			|| !strcmp( de->d_name, ".." )
+		)
+		{
+			continue;
+		}
+
+		*name = de->d_name;
+		*type = de->d_type;
+		*ino = ( ino_t ) de->d_ino;
+
+		return true;
+	}
+}
+
+
+/*
+| Closes a scanned directory.
+*/
+void
+dirscan_close( struct dirscan *s )
+{
+#ifdef HAVE_GETDENTS64
+	close( s->fd );
+#else
+	closedir( s->d );
+#endif
+}
+
+
+/*
+| Returns the fd to stat the entries of a scanned directory relative to.
+*/
+int
+dirscan_fd( struct dirscan *s )
+{
+#ifdef HAVE_GETDENTS64
+	return s->fd;
+#else
+	return dirfd( s->d );
+#endif
+}
+
+
 /*
 | Reads the directories entries.
 |
@@ -1611,12 +2620,12 @@ static int
 l_readdir( lua_State *L )
 {
 	const char * dirname = luaL_checkstring( L, 1 );
+	struct dirscan s;
+	const char *name;
+	unsigned char type;
+	ino_t ino;
 
-	DIR *d;
-
-	d = opendir( dirname );
-
-	if( d == NULL )
+	if( !dirscan_open( &s, dirname, true ) )
 	{
 		printlogf(
 			L, "Error", "cannot open dir [%s].",
@@ -1628,60 +2637,154 @@ l_readdir( lua_State *L )
 
 	lua_newtable( L );
 
-	while( !hup && !term )
-	{
-		struct dirent *de = readdir( d );
-		bool isdir;
+	while( !hup && !term && dirscan_next( &s, &name, &type, &ino ) )
+	{
+		bool isdir;
+
+		if( type == DT_UNKNOWN )
+		{
+			// must call stat on some systems :-/
+			// ( e.g. ReiserFS )
+			struct stat st;
+
+			if( fstatat( dirscan_fd( &s ), name, &st, AT_SYMLINK_NOFOLLOW ) == -1 )
+			{
+				// gone meanwhile
+				continue;
+			}
+
+			isdir = S_ISDIR( st.st_mode );
+		}
+		else
+		{
+			// otherwise readdir can be trusted
+			isdir = type == DT_DIR;
+		}
+
+		// adds this entry to the Lua table
+		lua_pushstring( L, name );
+		lua_pushboolean( L, isdir );
+		lua_settable( L, -3 );
+	}
+
+	dirscan_close( &s );
+
+	return 1;
+}
+
+
+/*
+| Returns a timespec as nanoseconds.
+*/
+static lua_Integer
+nanos( const struct timespec *ts )
+{
+	return ( lua_Integer ) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+
+/*
+| Reads the entries of a directory together with their status.
+|
+| Params on Lua stack:
+|     1: absolute path to directory
+|     2: if true all entries are stat'ed,
+|        otherwise only those the directory does not tell the type of.
+|
+| Returns on Lua stack:
+|     a list of records, nil if the directory cannot be read.
+|     Each record has:
+|        name  -- the name of the entry
+|        type  -- 'directory', 'file', 'symlink' or 'other'
+|        ino   -- the inode number
+|     and if stat'ed:
+|        size  -- the size in bytes
+|        mtime -- the modification time in nanoseconds
+|        ctime -- the status change time in nanoseconds
+*/
+static int
+l_scandir( lua_State *L )
+{
+	const char * dirname = luaL_checkstring( L, 1 );
+	bool full = lua_toboolean( L, 2 );
+	struct dirscan s;
+	const char *name;
+	unsigned char type;
+	ino_t ino;
+	int n = 0;
+
+	if( !dirscan_open( &s, dirname, true ) )
+	{
+		lua_pushnil( L );
+		return 1;
+	}
+
+	lua_newtable( L );
+
+	while( !hup && !term && dirscan_next( &s, &name, &type, &ino ) )
+	{
+		struct stat st;
+		bool stated = full || type == DT_UNKNOWN;
+		const char *tname;
+
+		if( stated )
+		{
+			if( fstatat( dirscan_fd( &s ), name, &st, AT_SYMLINK_NOFOLLOW ) == -1 )
+			{
+				// gone meanwhile
+				continue;
+			}
+
+			ino = st.st_ino;
 
-		if( de == NULL ) // finished
-		{
-			break;
+			if( S_ISDIR( st.st_mode ) ) tname = "directory";
+			else if( S_ISREG( st.st_mode ) ) tname = "file";
+			else if( S_ISLNK( st.st_mode ) ) tname = "symlink";
+			else tname = "other";
 		}
-
-		// ignores . and ..
-		if(
-			!strcmp( de->d_name, "."  )
-			|| !strcmp( de->d_name, ".." )
-		)
+		else
 		{
-			continue;
+			if( type == DT_DIR ) tname = "directory";
+			else if( type == DT_REG ) tname = "file";
+			else if( type == DT_LNK ) tname = "symlink";
+			else tname = "other";
 		}
 
-		if( de->d_type == DT_UNKNOWN )
-		{
-			// must call stat on some systems :-/
-			// ( e.g. ReiserFS )
-			char *entry = s_malloc(
-				strlen( dirname ) +
-				strlen( de->d_name ) +
-				2
-			);
-
-			struct stat st;
+		lua_createtable( L, 0, stated ? 6 : 3 );
 
-			strcpy( entry, dirname );
-			strcat( entry, "/" );
-			strcat( entry, de->d_name );
+		lua_pushstring( L, name );
+		lua_setfield( L, -2, "name" );
 
-			lstat( entry, &st );
+		lua_pushstring( L, tname );
+		lua_setfield( L, -2, "type" );
 
-			isdir = S_ISDIR( st.st_mode );
+		lua_pushinteger( L, ( lua_Integer ) ino );
+		lua_setfield( L, -2, "ino" );
 
-			free( entry );
-		}
-		else
+		if( stated )
 		{
-			// otherwise readdir can be trusted
-			isdir = de->d_type == DT_DIR;
+			lua_pushinteger( L, ( lua_Integer ) st.st_size );
+			lua_setfield( L, -2, "size" );
+
+#ifdef __APPLE__
+			lua_pushinteger( L, nanos( &st.st_mtimespec ) );
+			lua_setfield( L, -2, "mtime" );
+
+			lua_pushinteger( L, nanos( &st.st_ctimespec ) );
+			lua_setfield( L, -2, "ctime" );
+#else
+			lua_pushinteger( L, nanos( &st.st_mtim ) );
+			lua_setfield( L, -2, "mtime" );
+
+			lua_pushinteger( L, nanos( &st.st_ctim ) );
+			lua_setfield( L, -2, "ctime" );
+#endif
 		}
 
-		// adds this entry to the Lua table
-		lua_pushstring( L, de->d_name );
-		lua_pushboolean( L, isdir );
-		lua_settable( L, -3 );
+		lua_rawseti( L, -2, ++n );
 	}
 
-	closedir( d );
+	dirscan_close( &s );
 
 	return 1;
 }
@@ -1748,6 +2851,15 @@ l_configure( lua_State *L )
 			logstring( "Normal", "--- Startup ---" );
 		}
 
+		// the heap is still small, so this is the time to fork the spawn helper
+		open_zygote( L );
+
+#ifdef WITH_INOTIFY
+		// threads do not survive forks, so the inotify reader
+		// thread starts after daemonizing and the spawn helper
+		start_inotify_drain( L );
+#endif
+
 	}
 	else if( !strcmp( command, "nodaemon" ) )
 	{
@@ -1759,6 +2871,9 @@ l_configure( lua_State *L )
 
 		if( settings.log_file )
 		{
+			// lines logged so far go into the old logfile
+			log_close( );
+
 			free( settings.log_file );
 		}
 
@@ -1974,6 +3089,171 @@ l_file_size( lua_State *L )
 }
 
 
+/*
+| Returns the modification time in seconds of given path or nil on error
+|
+| Params on Lua stack:
+|     1:  path of file or directory
+*/
+extern int
+l_mtime( lua_State *L )
+{
+	struct stat sb;
+	const char *filename = luaL_checkstring( L, 1 );
+
+	if( lstat( filename, &sb ) == -1 )
+	{
+		lua_pushnil( L );
+		return 1;
+	}
+
+	lua_pushinteger( L, ( lua_Integer ) sb.st_mtime );
+
+	return 1;
+}
+
+
+/*
+| Returns the status of given path or nil on error
+|
+| Params on Lua stack:
+|     1:  path of file or directory
+|
+| Returns on Lua stack:
+|     true if a directory,
+|     inode number,
+|     size,
+|     modification time in nanoseconds,
+|     status change time in nanoseconds
+*/
+static int
+l_lstat( lua_State *L )
+{
+	struct stat sb;
+	const char *filename = luaL_checkstring( L, 1 );
+
+	if( lstat( filename, &sb ) == -1 )
+	{
+		lua_pushnil( L );
+		return 1;
+	}
+
+	lua_pushboolean( L, S_ISDIR( sb.st_mode ) );
+	lua_pushinteger( L, ( lua_Integer ) sb.st_ino );
+	lua_pushinteger( L, ( lua_Integer ) sb.st_size );
+
+#ifdef __APPLE__
+	lua_pushinteger( L, nanos( &sb.st_mtimespec ) );
+	lua_pushinteger( L, nanos( &sb.st_ctimespec ) );
+#else
+	lua_pushinteger( L, nanos( &sb.st_mtim ) );
+	lua_pushinteger( L, nanos( &sb.st_ctim ) );
+#endif
+
+	return 5;
+}
+
+
+/*
+| Flushes a Lua file handle and commits it to disk.
+|
+| Given the path of a directory commits its entries,
+| so a file renamed into it stays after a crash.
+|
+| Params on Lua stack:
+|     1:  the file handle or the path of a directory
+|
+| Returns on Lua stack:
+|     true on success, nil and the error otherwise
+*/
+static int
+l_fsync( lua_State *L )
+{
+	FILE *f;
+
+	if( lua_type( L, 1 ) == LUA_TSTRING )
+	{
+		int fd = open( lua_tostring( L, 1 ), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+		int err;
+
+		if( fd < 0 || fsync( fd ) )
+		{
+			err = errno;
+
+			if( fd >= 0 ) close( fd );
+
+			lua_pushnil( L );
+			lua_pushstring( L, strerror( err ) );
+			return 2;
+		}
+
+		close( fd );
+
+		lua_pushboolean( L, 1 );
+
+		return 1;
+	}
+
+	// Lua 5.1 uses a FILE**, later versions a luaL_Stream starting with it
+	f = *( FILE ** ) luaL_checkudata( L, 1, LUA_FILEHANDLE );
+
+	if( !f )
+	{
+		return luaL_error( L, "attempt to use a closed file" );
+	}
+
+	if( fflush( f ) || fsync( fileno( f ) ) )
+	{
+		lua_pushnil( L );
+		lua_pushstring( L, strerror( errno ) );
+		return 2;
+	}
+
+	lua_pushboolean( L, 1 );
+
+	return 1;
+}
+
+
+/*
+| Creates a file which did not exist before.
+|
+| Params on Lua stack:
+|     1:  the path of the file, ending with "XXXXXX"
+|
+| Returns on Lua stack:
+|     the path of the file created, nil and the error otherwise
+*/
+static int
+l_mkstemp( lua_State *L )
+{
+	size_t len;
+	const char *template = luaL_checklstring( L, 1, &len );
+	char *path = s_malloc( len + 1 );
+	int fd;
+
+	memcpy( path, template, len + 1 );
+
+	fd = mkstemp( path );
+
+	if( fd < 0 )
+	{
+		free( path );
+		lua_pushnil( L );
+		lua_pushstring( L, strerror( errno ) );
+		return 2;
+	}
+
+	close( fd );
+
+	lua_pushstring( L, path );
+
+	free( path );
+
+	return 1;
+}
+
+
 static int l_jiffies_fromseconds(lua_State *L);
 /*
 | The Lsnycd's core library
@@ -1982,18 +3262,26 @@ static const luaL_Reg lsyncdlib[] =
 {  
 	{ "configure",            l_configure     },
 	{ "exec",                 l_exec          },
+	{ "fsync",                l_fsync         },
 	{ "log",                  l_log           },
+	{ "matcher",              l_matcher       },
+	{ "mkstemp",              l_mkstemp       },
 	{ "now",                  l_now           },
 	{ "jiffies_from_seconds", l_jiffies_fromseconds},
 	{ "kill",                 l_kill          },
 	{ "get_free_port",        l_free_port     },
 	{ "nonobserve_fd",        l_nonobserve_fd },
 	{ "observe_fd",           l_observe_fd    },
+	{ "own_process",          l_own_process   },
 	{ "readdir",              l_readdir       },
 	{ "realdir",              l_realdir       },
+	{ "scandir",              l_scandir       },
 	{ "stackdump",            l_stackdump     },
 	{ "terminate",            l_terminate     },
+	{ "treeindex",            l_treeindex     },
 	{ "get_file_size",  	  l_file_size     },
+	{ "get_mtime",            l_mtime         },
+	{ "lstat",                l_lstat         },
 	{ NULL,                   NULL            }
 };
 
@@ -2219,6 +3507,10 @@ register_lsyncd( lua_State *L )
 
 	lua_pop( L, 1 ); // pop(mt)
 
+	register_matcher( L );
+
+	register_treeindex( L );
+
 #ifdef WITH_INOTIFY
 
 	lua_getglobal( L, LSYNCD_LIBNAME );
@@ -2226,6 +3518,15 @@ register_lsyncd( lua_State *L )
 	lua_setfield( L, -2, LSYNCD_INOTIFYLIBNAME );
 	lua_pop( L, 1 );
 
+#endif
+
+#ifdef WITH_FANOTIFY
+
+	lua_getglobal( L, LSYNCD_LIBNAME );
+	register_fanotify( L );
+	lua_setfield( L, -2, LSYNCD_FANOTIFYLIBNAME );
+	lua_pop( L, 1 );
+
 #endif
 
 	if( lua_gettop( L ) )
@@ -2306,6 +3607,8 @@ daemonize(
 	 	exit( 0 );
 	}
 
+	log_forked( );
+
 	if( pidfile )
 	{
 		write_pidfile( L, pidfile );
@@ -2339,7 +3642,12 @@ daemonize(
 
 	// does what clibs daemon( 0, 0 ) cannot do,
 	// checks if there were no stdstreams and it might close used fds
-	if( observances_len && observances->fd < 3 )
+	if(
+		get_observance( 0 ) || get_observance( 1 ) || get_observance( 2 )
+#ifdef HAVE_EPOLL
+		|| ( epoll_fd >= 0 && epoll_fd < 3 )
+#endif
+	)
 	{
 		printlogf(
 			L, "Normal",
@@ -2408,28 +3716,31 @@ masterloop(lua_State *L)
 
 		lua_pop( L, 2 );
 
-		if(
-			force_alarm ||
-			( have_alarm && time_before_eq( alarm_time, now ) )
-		)
-		{
-			// there is a delay that wants to be handled already thus instead
-			// of reading/writing from observances it jumps directly to
-			// handling
-
-			// TODO: Actually it might be smarter to handler observances
-			// eitherway. since event queues might overflow.
-			logstring( "Masterloop", "immediately handling delays." );
-		}
-		else
 		{
-			// uses select( ) to determine what happens next:
+			// uses epoll_pwait( ) or pselect( ) to determine what happens next:
 			//   a) a new event on an observance
 			//   b) an alarm on timeout
 			//   c) the return of a child process
 			struct timespec tv;
 
-			if( have_alarm )
+			if(
+				force_alarm ||
+				( have_alarm && time_before_eq( alarm_time, now ) )
+			)
+			{
+				// there is a delay that wants to be handled already thus
+				// the observances are only checked without waiting,
+				// they collect the child processes and keep the
+				// event queues from overflowing
+				logstring( "Masterloop", "immediately handling delays." );
+
+				have_alarm = true;
+				tv.tv_sec  = 0;
+				tv.tv_nsec = 0;
+
+				log_flush( false );
+			}
+			else if( have_alarm )
 			{
 				// TODO use trunc instead of long converstions
 				double d   = ( (double )( alarm_time - now ) ) / clocks_per_sec;
@@ -2440,6 +3751,9 @@ masterloop(lua_State *L)
 					"going into select ( timeout %f seconds )",
 					d
 				);
+
+				// writes out the log before going to rest
+				log_flush( true );
 			}
 			else
 			{
@@ -2447,27 +3761,157 @@ masterloop(lua_State *L)
 					"Masterloop",
 					"going into select ( no timeout )"
 				);
+
+				// writes out the log before going to rest
+				log_flush( true );
 			}
 
-			// time for Lsyncd to try to put itself to rest into the big select( )
+			// time for Lsyncd to try to put itself to rest into the big wait
 			// this configures:
 			//    timeouts,
 			//    filedescriptors and
 			//    signals
 			// that will wake Lsyncd
+#ifdef HAVE_EPOLL
+			{
+				sigset_t sigset;
+				int timeout = -1;
+				int ei, pr;
+				unsigned int gen = observances_gen;
+
+				sigemptyset( &sigset );
+
+				// SIGCHLD only needs to wake Lsyncd if it polls for children
+				if( !reap_polling )
+				{
+					sigaddset( &sigset, SIGCHLD );
+				}
+
+				if( !observances_count )
+				{
+					logstring(
+						"Error",
+						"Internal fail, no observances, no monitor!"
+					);
+
+					exit( -1 );
+				}
+
+				if( have_alarm )
+				{
+					// rounds up, so the alarm is not missed by a hair
+					// and Lsyncd spins here until it is due
+					timeout = tv.tv_sec * 1000 + ( tv.tv_nsec + 999999 ) / 1000000;
+				}
+
+				if( epoll_events_size < observances_count )
+				{
+					epoll_events_size = observances_count;
+					epoll_events = s_realloc(
+						epoll_events,
+						epoll_events_size * sizeof( struct epoll_event )
+					);
+				}
+
+				// the great wait, this is the very heart beat of Lsyncd
+				// that puts Lsyncd to sleep until anything worth noticing
+				// happens, only the ready file descriptors are returned.
+				pr = epoll_pwait(
+					epoll_fd,
+					epoll_events,
+					epoll_events_size,
+					timeout,
+					&sigset
+				);
+
+				// something happened!
+
+				for( ei = 0; ei < pr; ei++ )
+				{
+					uint32_t events = epoll_events[ ei ].events;
+					int fd = epoll_events[ ei ].data.fd;
+					struct observance *obs;
+
+					// Checks for signals not handled yet, while fading
+					// after TERM children are still collected
+					if( hup || reload || term == 1 )
+					{
+						break;
+					}
+
+					// handlers may add or remove observances, thus
+					// the observance is looked up again before each call
+					obs = get_beat_observance( fd, gen );
+
+					// a file descriptor became read-ready
+					if( obs && obs->ready && ( events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) )
+					{
+						obs->ready( L, obs );
+					}
+
+					// Checks for signals, again, better safe than sorry
+					if ( hup || reload || term == 1 )
+					{
+						// the write side has not been handled
+						obs = get_beat_observance( fd, gen );
+						if( obs && obs->writey && obs->mode == OBSERVE_EDGE )
+						{
+							epoll_register( EPOLL_CTL_MOD, obs );
+						}
+
+						ei++;
+						break;
+					}
+
+					obs = get_beat_observance( fd, gen );
+
+					// a file descriptor became write-ready
+					if( obs && obs->writey && ( events & ( EPOLLOUT | EPOLLERR ) ) )
+					{
+						obs->writey( L, obs );
+					}
+				}
+
+				// edge triggered observances not handled due to a signal
+				// are rearmed, otherwise their readiness would be lost
+				for( ; ei < pr; ei++ )
+				{
+					struct observance *obs =
+						get_beat_observance( epoll_events[ ei ].data.fd, gen );
+
+					if( obs && obs->mode == OBSERVE_EDGE )
+					{
+						epoll_register( EPOLL_CTL_MOD, obs );
+					}
+				}
+			}
+#else
 			{
 				fd_set rfds;
 				fd_set wfds;
 				sigset_t sigset;
-				int pi, pr;
+				int pi, pr, maxfd;
+				unsigned int gen = observances_gen;
 
 				sigemptyset( &sigset );
+
+				// SIGCHLD only needs to wake Lsyncd if it polls for children
+				if( !reap_polling )
+				{
+					sigaddset( &sigset, SIGCHLD );
+				}
 				FD_ZERO( &rfds );
 				FD_ZERO( &wfds );
 
-				for( pi = 0; pi < observances_len; pi++ )
+				for( pi = 0; pi <= observances_maxfd; pi++ )
 				{
-					struct observance *obs = observances + pi;
+					struct observance *obs = get_observance( pi );
+
+					if( !obs )
+					{
+						continue;
+					}
+
 					if ( obs->ready  )
 					{
 						FD_SET( obs->fd, &rfds );
@@ -2479,7 +3923,7 @@ masterloop(lua_State *L)
 					}
 				}
 
-				if( !observances_len )
+				if( !observances_count )
 				{
 					logstring(
 						"Error",
@@ -2493,8 +3937,10 @@ masterloop(lua_State *L)
 				// that puts Lsyncd to sleep until anything worth noticing
 				// happens
 
+				maxfd = observances_maxfd;
+
 				pr = pselect(
-					observances[ observances_len - 1 ].fd + 1,
+					maxfd + 1,
 					&rfds,
 					&wfds,
 					NULL,
@@ -2506,100 +3952,83 @@ masterloop(lua_State *L)
 
 				if (pr >= 0)
 				{
-					// walks through the observances calling ready/writey
-					observance_action = true;
-
-					for( pi = 0; pi < observances_len; pi++ )
+					// walks through the observances calling ready/writey,
+					// handlers may add or remove observances, thus
+					// the observance is looked up again before each call
+					for( pi = 0; pi <= maxfd; pi++ )
 					{
-						struct observance *obs = observances + pi;
+						struct observance *obs;
 
-						// Checks for signals
-						if( hup || term )
+						// Checks for signals not handled yet
+						if( hup || reload || term == 1 )
 						{
 							break;
 						}
 
+						obs = get_beat_observance( pi, gen );
+
 						// a file descriptor became read-ready
-						if( obs->ready && FD_ISSET( obs->fd, &rfds ) )
+						if( obs && obs->ready && FD_ISSET( pi, &rfds ) )
 						{
 							obs->ready(L, obs);
 						}
 
 						// Checks for signals, again, better safe than sorry
-						if ( hup || term )
+						if ( hup || reload || term == 1 )
 						{
 							break;
 						}
 
-						// FIXME breaks on multiple nonobservances in one beat
-						if(
-							nonobservances_len > 0 &&
-							nonobservances[ nonobservances_len - 1 ] == obs->fd
-						)
-						{
-							continue;
-						}
+						obs = get_beat_observance( pi, gen );
 
 						// a file descriptor became write-ready
-						if( obs->writey && FD_ISSET( obs->fd, &wfds ) )
+						if( obs && obs->writey && FD_ISSET( pi, &wfds ) )
 						{
 							obs->writey( L, obs );
 						}
 					}
-
-					observance_action = false;
-
-					// works through delayed nonobserve_fd() calls
-					for (pi = 0; pi < nonobservances_len; pi++)
-					{
-						nonobserve_fd( nonobservances[ pi ] );
-					}
-
-					nonobservances_len = 0;
 				}
 			}
+#endif
 		}
 
-		// collects zombified child processes
-		while( 1 )
-		{
-			int status;
-			pid_t pid = waitpid( 0, &status, WNOHANG );
-
-			if (pid <= 0)
-			{
-				// no more zombies
-				break;
-			}
-
-			// calls the runner to handle the collection
-			load_runner_func( L, "collectProcess" );
-			lua_pushinteger( L, pid );
-			lua_pushinteger( L, WEXITSTATUS( status ) );
+		// the observances removed by the handlers are no longer in use
+		free_gone_observances( );
 
-			if ( lua_pcall( L, 2, 0, -4 ) )
-			{
-				safeexit(L, -1);
-			}
-
-			lua_pop( L, 1 );
+		// collects zombified child processes not observed otherwise
+		if( reap_polling )
+		{
+			reap_children( L );
 		}
 
 		// reacts on HUP signals
-		if( hup )
+		if( reload )
 		{
 			load_runner_func( L, "hup" );
 
-			if( lua_pcall( L, 0, 0, -2 ) )
+			if( lsyncd_config_file )
+			{
+				lua_pushstring( L, lsyncd_config_file );
+			}
+			else
+			{
+				lua_pushnil( L );
+			}
+
+			if( lua_pcall( L, 1, 0, -3 ) )
 			{
 				safeexit( L, -1 );
 			}
 
 			lua_pop( L, 1 );
 
-			hup = 0;
+			reload = 0;
 		}
 
+		// after an overflow the runner is fading already,
+		// the events left in the batch have been skipped
+		hup = 0;
+
 		// reacts on TERM and INT signals
 		if( term == 1 )
 		{
@@ -3038,8 +4467,9 @@ main1( int argc, char *argv[] )
 #endif
 
 	// adds signal handlers
-	// listens to SIGCHLD, but blocks it until pselect( )
-	// opens the signal handler up
+	// listens to SIGCHLD, but blocks it, children are collected
+	// through their pidfds or the signalfd, only when polling for
+	// children the wait of the masterloop opens the signal handler up
 	{
 		sigset_t set;
 		sigemptyset( &set );
@@ -3050,6 +4480,7 @@ main1( int argc, char *argv[] )
 		signal( SIGHUP,  sig_handler );
 		signal( SIGTERM, sig_handler );
 		signal( SIGINT,  sig_handler );
+		signal( SIGUSR1, sig_handler );
 	}
 
 	// runs initializations from runner
@@ -3077,15 +4508,22 @@ main1( int argc, char *argv[] )
 
 	// tidies up all observances
 	{
-		int i;
-		for( i = 0; i < observances_len; i++ )
+		int fd;
+		for( fd = observances_maxfd; fd >= 0; fd-- )
 		{
-			struct observance *obs = observances + i;
-			obs->tidy( obs );
+			if( get_observance( fd ) )
+			{
+				nonobserve_fd( fd );
+			}
 		}
 
-		observances_len    = 0;
-		nonobservances_len = 0;
+#ifdef HAVE_EPOLL
+		if( epoll_fd >= 0 )
+		{
+			close( epoll_fd );
+			epoll_fd = -1;
+		}
+#endif
 	}
 
 	// frees logging categories
@@ -3125,6 +4563,9 @@ main( int argc, char * argv[ ] )
 	setlinebuf( stdout );
 	setlinebuf( stderr );
 
+	// writes out the log ring on any exit
+	atexit( log_close );
+
 	while( !term ) {
 		main1( argc, argv );
 	}
@@ -23,8 +23,11 @@
 // includes needed for headerfile
 #include "config.h"
 
+#include <sys/types.h>
+#include <dirent.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #define LUA_USE_APICHECK 1
@@ -32,6 +35,7 @@
 
 #define LSYNCD_LIBNAME "lsyncd"
 #define LSYNCD_INOTIFYLIBNAME "inotify"
+#define LSYNCD_FANOTIFYLIBNAME "fanotify"
 
 /*
 | Workaround to register a library for different lua versions.
@@ -76,7 +80,7 @@ extern int l_now(lua_State *L);
 // pushes a runner function and the runner error handler onto Lua stack
 extern void load_runner_func(lua_State *L, const char *name);
 
-// set to 1 on hup signal or term signal
+// set to 1 on term signal or when resetting after an overflow
 extern volatile sig_atomic_t hup;
 extern volatile sig_atomic_t term;
 
@@ -102,6 +106,9 @@ extern int check_logcat(const char *name);
 	{logstring0(p, cat, message);}}
 extern void logstring0(int priority, const char *cat, const char *message);
 
+// drops the parent's lines from the log buffer after a fork
+extern void log_forked(void);
+
 // logs a formated string 
 #define printlogf(L, cat, ...) \
 	{int p; if ((p = check_logcat(cat)) <= settings.log_level)  \
@@ -125,6 +132,40 @@ extern void non_block_fd(int fd);
 extern void close_exec_fd(int fd);
 
 
+/**
+ * Reading directories
+ */
+
+// the state of reading the entries of a directory
+struct dirscan {
+	int fd;
+#ifdef HAVE_GETDENTS64
+	uint64_t buf[4096];
+	long len;
+	long pos;
+#else
+	DIR *d;
+#endif
+};
+
+// opens a directory to read its entries, false on error
+extern bool dirscan_open(struct dirscan *s, const char *dirname, bool follow);
+
+// returns the next entry ignoring . and .., false when finished
+extern bool dirscan_next(
+	struct dirscan *s,
+	const char **name,
+	unsigned char *type,
+	ino_t *ino
+);
+
+// closes a directory read
+extern void dirscan_close(struct dirscan *s);
+
+// returns the fd to stat the entries relative to
+extern int dirscan_fd(struct dirscan *s);
+
+
 /**
  * An observance to be called when a file descritor becomes
  * read-ready or write-ready.
@@ -144,9 +185,25 @@ struct observance {
 
 	// Extra tokens to pass to the functions.
 	void *extra;
+
+	// OBSERVE_LEVEL or OBSERVE_EDGE
+	int mode;
+
+	// Generation of the core when the observance was added.
+	unsigned int gen;
 };
 
-// makes the core observe a file descriptor
+/*
+| Trigger modes of an observance.
+|
+| Level triggered observances are called as long as the fd is ready,
+| edge triggered ones only when it becomes ready again, so their
+| handlers must read or write until EAGAIN.
+*/
+#define OBSERVE_LEVEL 0
+#define OBSERVE_EDGE  1
+
+// makes the core observe a file descriptor (level triggered)
 extern void observe_fd(
 	int fd,
 	void (*ready) (lua_State *, struct observance *),
@@ -155,15 +212,139 @@ extern void observe_fd(
 	void *extra
 );
 
+// makes the core observe a file descriptor with a trigger mode
+extern void observe_fd_mode(
+	int fd,
+	void (*ready) (lua_State *, struct observance *),
+	void (*writey)(lua_State *, struct observance *),
+	void (*tidy)  (struct observance *),
+	void *extra,
+	int mode
+);
+
 // stops the core to observe a file descriptor
 extern void nonobserve_fd(int fd);
 
+/*
+ * child processes
+ */
+
+// hands a collected child process to the runner
+extern void collect_child(lua_State *L, pid_t pid, int status);
+
+// starts the spawn helper
+extern void open_zygote(lua_State *L);
+
+// spawns a child through the spawn helper, returns a ticket
+// standing for its pid or -1 if not available
+extern pid_t zygote_spawn(
+	lua_State *L,
+	const char *binary,
+	char const **argv,
+	int stdin_fd,
+	const char *log_file
+);
+
+// sends a signal to a child, by pid or by ticket of the spawn helper
+extern int zygote_kill(pid_t pid, int sig);
+
+/*
+ * exclude and filter matcher
+ */
+
+// compiles a list of rsync like patterns into a matcher
+extern int l_matcher(lua_State *L);
+
+// creates the metatable for matchers
+extern void register_matcher(lua_State *L);
+
+struct matcher;
+
+// verdicts besides true and false of matcher_verdict( )
+#define MATCH_NONE  -1
+#define MATCH_MIXED -2
+
+// returns the matcher at a Lua stack index
+extern const struct matcher *check_matcher(lua_State *L, int arg);
+
+// bytes of scratch space a thread needs to test with a matcher
+extern size_t matcher_scratch_size(const struct matcher *m);
+
+// tests a path, or a directory for all paths within it
+extern int matcher_verdict(
+	const struct matcher *m,
+	const char *path,
+	size_t len,
+	bool within,
+	void *scratch
+);
+
+/*
+ * tree walker
+ */
+
+struct treewalk;
+
+// makes a walker calling visit( ) for every directory walked
+extern struct treewalk *treewalk_new(
+	void (*visit)( struct treewalk *walk, int worker, void *task ),
+	void *arg
+);
+
+// returns the argument the walker was made with
+extern void *treewalk_arg(struct treewalk *walk);
+
+// returns the number of workers, these are numbered from 0
+extern int treewalk_workers(struct treewalk *walk);
+
+// returns the number of directories queued but not yet walked
+extern size_t treewalk_pending(struct treewalk *walk);
+
+// queues a directory for a worker, false if out of memory
+extern bool treewalk_queue(struct treewalk *walk, int worker, void *task);
+
+// stops a walk a worker failed in, with its errno
+extern void treewalk_fail(struct treewalk *walk, int error);
+
+// returns the errno a worker failed with, 0 if none
+extern int treewalk_error(struct treewalk *walk);
+
+// takes a directory not walked, NULL if none is left
+extern void *treewalk_take(struct treewalk *walk);
+
+// walks the queued directories for at most limit of them and secs
+extern size_t treewalk_run(struct treewalk *walk, size_t limit, double secs);
+
+// returns the number of workers of the last run
+extern int treewalk_ran(struct treewalk *walk);
+
+// frees a walker
+extern void treewalk_free(struct treewalk *walk);
+
+/*
+ * persistent index of a source tree
+ */
+
+// opens the index of a sync
+extern int l_treeindex(lua_State *L);
+
+// creates the metatable for indexes
+extern void register_treeindex(lua_State *L);
+
 /*
  * inotify
  */
 #ifdef WITH_INOTIFY
 extern void register_inotify(lua_State *L);
 extern void open_inotify(lua_State *L);
+extern void start_inotify_drain(lua_State *L);
+#endif
+
+/*
+ * fanotify
+ */
+#ifdef WITH_FANOTIFY
+extern void register_fanotify(lua_State *L);
 #endif
 
 /*
@@ -256,6 +256,62 @@ local settingsCheckgauge =
 	logident       = true,
 	insist         = true,
 	inotifyMode    = true,
+	onOverflow     = true,
+	pollRate       = true,
+	watchBatch     = true,
+	watchBatchTime = true,
+	spillDir       = true,
+	journalDir     = true,
+	indexDir       = true,
+	journalInterval = true,
+	maxProcesses   = true,
+	maxDelays      = true,
+}
+
+--
+-- The settings{} call changing the settings 'into'.
+--
+local function setSettings
+(
+	into,  -- the settings to change
+	a1,    -- a table of key/value pairs to set these settings
+	level  -- the level to report errors to
+)
+	for k, v in pairs( a1 )
+	do
+		if type( k ) ~= 'number'
+		then
+			if not settingsCheckgauge[ k ]
+			then
+				error( 'setting "'..k..'" unknown.', level )
+			end
+
+			into[ k ] = v
+		else
+			if not settingsCheckgauge[ v ]
+			then
+				error( 'setting "'..v..'" unknown.', level )
+			end
+
+			into[ v ] = true
+		end
+	end
+end
+
+--
+-- Settings a reload changes in place,
+-- any other setting changed resets Lsyncd.
+--
+local reloadableSettings =
+{
+	statusFile     = true,
+	statusInterval = true,
+	insist         = true,
+	onOverflow     = true,
+	pollRate       = true,
+	watchBatch     = true,
+	watchBatchTime = true,
+	journalInterval = true,
 	maxProcesses   = true,
 	maxDelays      = true,
 }
@@ -591,30 +647,20 @@ Queue = ( function
 			error( 'Removing nonexisting item in Queue', 2 )
 		end
 
-		-- if removing first or last element,
-		-- the queue limits are adjusted.
-		if pos == nt.first
-		then
-			nt[ pos ] = nil
-			nt.first = pos + 1
-		elseif pos == nt.last
-		then
-			nt[ pos ] = nil
-			nt.last = nt.last - 1
-		else
-			local first = nt.first
-			local last = nt.first
+		-- items in the middle leave a hole, since the positions
+		-- of the others are kept by their owners ( delay.dpos ).
+		nt[ pos ] = nil
 
-			local i = pos
+		-- if removing first or last element,
+		-- the queue limits are adjusted past any holes.
+		while nt.first <= nt.last and nt[ nt.first ] == nil
+		do
+			nt.first = nt.first + 1
+		end
 
-			while i < last do
-				if i == pos then
-					nt[ i ] = nt[ i + 1 ]
-					i = i + 1
-				end
-				i = i + 1
-			end
-			nt.last = last - 1
+		while nt.last >= nt.first and nt[ nt.last ] == nil
+		do
+			nt.last = nt.last - 1
 		end
 
 		-- reset the indizies if the queue is empty
@@ -782,6 +828,159 @@ Queue = ( function
 end )( )
 
 
+--
+-- A binary min-heap.
+--
+-- Ordered by the 'less' function given on creation.
+--
+local Heap = ( function
+( )
+	--
+	-- Pushes a value.
+	--
+	local function push
+	(
+		self,  -- the heap
+		value  -- value to push
+	)
+		local items = self.items
+
+		local less = self.less
+
+		local i = #items + 1
+
+		-- sifts up
+		while i > 1
+		do
+			local parent = math.floor( i / 2 )
+
+			if not less( value, items[ parent ] ) then break end
+
+			items[ i ] = items[ parent ]
+
+			i = parent
+		end
+
+		items[ i ] = value
+	end
+
+	--
+	-- Returns the smallest value without removing it.
+	--
+	local function peek
+	(
+		self
+	)
+		return self.items[ 1 ]
+	end
+
+	--
+	-- Removes and returns the smallest value.
+	--
+	local function pop
+	(
+		self
+	)
+		local items = self.items
+
+		local n = #items
+
+		local top = items[ 1 ]
+
+		if n <= 1
+		then
+			items[ 1 ] = nil
+
+			return top
+		end
+
+		local value = items[ n ]
+
+		items[ n ] = nil
+
+		n = n - 1
+
+		local less = self.less
+
+		local i = 1
+
+		-- sifts down
+		while true
+		do
+			local child = i * 2
+
+			if child > n then break end
+
+			if child < n and less( items[ child + 1 ], items[ child ] )
+			then
+				child = child + 1
+			end
+
+			if not less( items[ child ], value ) then break end
+
+			items[ i ] = items[ child ]
+
+			i = child
+		end
+
+		items[ i ] = value
+
+		return top
+	end
+
+	--
+	-- Returns the number of values.
+	--
+	local function size
+	(
+		self
+	)
+		return #self.items
+	end
+
+	--
+	-- Keeps only the values 'keep' returns true for.
+	--
+	local function filter
+	(
+		self,
+		keep
+	)
+		local old = self.items
+
+		self.items = { }
+
+		for _, v in ipairs( old )
+		do
+			if keep( v ) then push( self, v ) end
+		end
+	end
+
+	--
+	-- Creates a new heap.
+	--
+	local function new
+	(
+		less  -- returns true if a is to be before b
+	)
+		return {
+			items = { },
+			less = less,
+			filter = filter,
+			peek = peek,
+			pop = pop,
+			push = push,
+			size = size,
+		}
+	end
+
+	--
+	-- Public interface
+	--
+	return { new = new }
+end )( )
+
+
 --
 -- Locks globals.
 --
@@ -853,9 +1052,15 @@ local Delay = ( function
 	{
 		dpos   = true,
 		etype  = true,
+		flat   = true,
+		held   = true,
 		path   = true,
 		path2  = true,
+		seq    = true,
+		since  = true,
+		size   = true,
 		status = true,
+		subtree = true,
 	}
 
 	--
@@ -896,6 +1101,8 @@ local Delay = ( function
 	)
 		self[ k_nt ].status = 'block'
 
+		self[ k_nt ].blocker = delay
+
 		local blocks = delay[ k_nt ].blocks
 
 		if not blocks
@@ -1059,6 +1266,48 @@ local Combiner = ( function
 		},
 	}
 
+	--
+	-- Returns the way a new Delay combines with a Full delay
+	-- transferring the subtree of a directory recursively.
+	--
+	local function combineSubtree
+	(
+		d1, -- the subtree delay
+		d2  -- new delay
+	)
+		local dir = d1.path
+
+		local within = string.starts( d2.path, dir )
+
+		if d2.etype ~= 'Move' and within
+		then
+			-- the recursive transfer covers it unless running already
+			if d1.status ~= 'active'
+			then
+				return 'absorb'
+			end
+
+			return 'stack'
+		end
+
+		if within
+		or d2.path2 and string.starts( d2.path2, dir )
+		then
+			return 'stack'
+		end
+
+		-- on a parent directory
+		if d2.path:byte( -1 ) == 47 and string.starts( dir, d2.path )
+		or d2.path2
+			and d2.path2:byte( -1 ) == 47
+			and string.starts( dir, d2.path2 )
+		then
+			return 'stack'
+		end
+
+		return nil
+	end
+
 	--
 	-- Returns the way two Delay should be combined.
 	--
@@ -1083,7 +1332,13 @@ local Combiner = ( function
 		end
 
 		-- A full sync does not affect us
+		-- unless it transfers a subtree
 		if d1.etype == 'Full' or d2.etype == 'Full' then
+			if d1.subtree and d2.etype ~= 'Full'
+			then
+				return combineSubtree( d1, d2 )
+			end
+
 			return nil
 		end
 
@@ -1355,90 +1610,410 @@ end )( )
 
 
 --
--- Creates inlets for syncs: the user interface for events.
+-- Indexes the delays of a sync by their paths.
 --
-local InletFactory = ( function
+-- A new delay only needs to be combined with the delays
+-- the Combiner could return a result for. These are
+-- delays on the same paths, on parent directories or
+-- within the directory of the new delay, and the
+-- blanket delays Init and Blanket which block all.
+--
+local DelayIndex = ( function
 ( )
 	--
-	-- Table to receive the delay of an event
-	-- or the delay list of an event list.
-	--
-	-- Keys are events and values are delays.
+	-- Adds a delay to a set in a table of sets.
 	--
-	local e2d = { }
+	local function setAdd
+	(
+		sets,
+		key,
+		delay
+	)
+		local set = sets[ key ]
 
-	--
-	-- Table to ensure the uniqueness of every event
-	-- related to a delay.
-	--
-	-- Keys are delay and values are events.
-	--
-	local e2d2 = { }
+		if not set
+		then
+			set = { }
+
+			sets[ key ] = set
+		end
+
+		set[ delay ] = true
+	end
 
 	--
-	-- Allows the garbage collector to remove not refrenced
-	-- events.
+	-- Removes a delay from a set in a table of sets.
 	--
-	setmetatable( e2d,  { __mode = 'k' } )
-	setmetatable( e2d2, { __mode = 'v' } )
+	local function setRemove
+	(
+		sets,
+		key,
+		delay
+	)
+		local set = sets[ key ]
+
+		if not set then return end
+
+		set[ delay ] = nil
+
+		if next( set ) == nil
+		then
+			sets[ key ] = nil
+		end
+	end
 
 	--
-	-- Removes the trailing slash from a path.
+	-- Iterates the directories on the way to path,
+	-- including path itself if it is a directory.
 	--
-	local function cutSlash
+	local function dirSteps
 	(
-		path -- path to cut
+		path
 	)
-		if string.byte( path, -1 ) == 47
-		then
-			return string.sub( path, 1, -2 )
-		else
-			return path
+		local iter = string.gmatch( path, '()/' )
+
+		return function
+		( )
+			local pos = iter( )
+
+			return pos and string.sub( path, 1, pos )
 		end
 	end
 
 	--
-	-- Gets the path of an event.
+	-- Indexes one path of a delay.
 	--
-	local function getPath
+	local function addPath
 	(
-		event
+		self,
+		delay,
+		path
 	)
-		if event.move ~= 'To'
-		then
-			return e2d[ event ].path
-		else
-			return e2d[ event ].path2
+		setAdd( self.byPath, path, delay )
+
+		local counts = self.counts
+
+		for dir in dirSteps( path )
+		do
+			setAdd( self.within, dir, delay )
+
+			counts[ dir ] = ( counts[ dir ] or 0 ) + 1
 		end
 	end
 
 	--
-	-- Interface for user scripts to get event fields.
+	-- Unindexes one path of a delay.
 	--
-	local eventFields = {
+	local function removePath
+	(
+		self,
+		delay,
+		path
+	)
+		setRemove( self.byPath, path, delay )
 
-		--
-		-- Returns a copy of the configuration as called by sync.
-		-- But including all inherited data and default values.
-		--
-		-- TODO give user a readonly version.
-		--
-		config = function
-		(
-			event
-		)
-			return e2d[ event ].sync.config
-		end,
+		local counts = self.counts
 
-		--
-		-- Returns the inlet belonging to an event.
-		--
-		inlet = function
-		(
-			event
-		)
-			return e2d[ event ].sync.inlet
-		end,
+		for dir in dirSteps( path )
+		do
+			setRemove( self.within, dir, delay )
+
+			local c = counts[ dir ] - 1
+
+			counts[ dir ] = c > 0 and c or nil
+		end
+	end
+
+	--
+	-- Adds a delay to the index.
+	--
+	local function add
+	(
+		self,
+		delay
+	)
+		local etype = delay.etype
+
+		if etype == 'Init' or etype == 'Blanket'
+		then
+			self.blankets[ delay ] = true
+
+			return
+		end
+
+		-- a full sync does not combine with anything
+		-- unless it transfers a subtree
+		if etype == 'Full'
+		then
+			if delay.subtree
+			then
+				addPath( self, delay, delay.path )
+			end
+
+			return
+		end
+
+		if etype == 'Move'
+		then
+			self.moves[ delay ] = true
+		end
+
+		addPath( self, delay, delay.path )
+
+		if delay.path2
+		then
+			addPath( self, delay, delay.path2 )
+		end
+	end
+
+	--
+	-- Removes a delay from the index.
+	--
+	local function remove
+	(
+		self,
+		delay
+	)
+		local etype = delay.etype
+
+		if etype == 'Init' or etype == 'Blanket'
+		then
+			self.blankets[ delay ] = nil
+
+			return
+		end
+
+		if etype == 'Full'
+		then
+			if delay.subtree
+			then
+				removePath( self, delay, delay.path )
+			end
+
+			return
+		end
+
+		self.moves[ delay ] = nil
+
+		removePath( self, delay, delay.path )
+
+		if delay.path2
+		then
+			removePath( self, delay, delay.path2 )
+		end
+	end
+
+	--
+	-- Returns the delays a new delay might combine with,
+	-- latest first like the delay FIFO walked backwards.
+	--
+	local function candidates
+	(
+		self,
+		nd  -- the new delay
+	)
+		local found = { }
+
+		local list = { }
+
+		local function take
+		(
+			set
+		)
+			if not set then return end
+
+			for d, _ in pairs( set )
+			do
+				if not found[ d ]
+				then
+					found[ d ] = true
+
+					list[ #list + 1 ] = d
+				end
+			end
+		end
+
+		take( self.blankets )
+
+		-- the Combiner compares a move with its own destination
+		if nd.etype == 'Move' and nd.path == nd.path2
+		then
+			take( self.moves )
+		end
+
+		for _, path in ipairs{ nd.path, nd.path2 }
+		do
+			-- same path
+			take( self.byPath[ path ] )
+
+			-- on parent directories
+			for dir in dirSteps( path )
+			do
+				take( self.byPath[ dir ] )
+			end
+
+			-- within the directory
+			if path:byte( -1 ) == 47
+			then
+				take( self.within[ path ] )
+			end
+		end
+
+		table.sort(
+			list,
+			function( a, b ) return a.dpos > b.dpos end
+		)
+
+		return list
+	end
+
+	--
+	-- Returns the waiting Create delay of the topmost directory
+	-- on the way to path with more than 'threshold' delays
+	-- within, nil if there is none.
+	--
+	local function crowded
+	(
+		self,
+		path,
+		threshold
+	)
+		for dir in dirSteps( path )
+		do
+			if ( self.counts[ dir ] or 0 ) > threshold
+			then
+				for d, _ in pairs( self.byPath[ dir ] or { } )
+				do
+					if d.etype == 'Create' and d.status == 'wait'
+					then
+						return d
+					end
+				end
+			end
+		end
+	end
+
+	--
+	-- Creates a new index.
+	--
+	local function new
+	( )
+		return {
+			-- delays by their path and move destination
+			byPath = { },
+
+			-- delays by all directories their paths are in
+			within = { },
+
+			-- number of delays by all directories their paths are in
+			counts = { },
+
+			-- Init and Blanket delays
+			blankets = { },
+
+			-- Move delays
+			moves = { },
+
+			add = add,
+			candidates = candidates,
+			crowded = crowded,
+			remove = remove,
+		}
+	end
+
+	--
+	-- Public interface
+	--
+	return { new = new }
+
+end )( )
+
+
+--
+-- Creates inlets for syncs: the user interface for events.
+--
+local InletFactory = ( function
+( )
+	--
+	-- Table to receive the delay of an event
+	-- or the delay list of an event list.
+	--
+	-- Keys are events and values are delays.
+	--
+	local e2d = { }
+
+	--
+	-- Table to ensure the uniqueness of every event
+	-- related to a delay.
+	--
+	-- Keys are delay and values are events.
+	--
+	local e2d2 = { }
+
+	--
+	-- Allows the garbage collector to remove not refrenced
+	-- events.
+	--
+	setmetatable( e2d,  { __mode = 'k' } )
+	setmetatable( e2d2, { __mode = 'v' } )
+
+	--
+	-- Removes the trailing slash from a path.
+	--
+	local function cutSlash
+	(
+		path -- path to cut
+	)
+		if string.byte( path, -1 ) == 47
+		then
+			return string.sub( path, 1, -2 )
+		else
+			return path
+		end
+	end
+
+	--
+	-- Gets the path of an event.
+	--
+	local function getPath
+	(
+		event
+	)
+		if event.move ~= 'To'
+		then
+			return e2d[ event ].path
+		else
+			return e2d[ event ].path2
+		end
+	end
+
+	--
+	-- Interface for user scripts to get event fields.
+	--
+	local eventFields = {
+
+		--
+		-- Returns a copy of the configuration as called by sync.
+		-- But including all inherited data and default values.
+		--
+		-- TODO give user a readonly version.
+		--
+		config = function
+		(
+			event
+		)
+			return e2d[ event ].sync.config
+		end,
+
+		--
+		-- Returns the inlet belonging to an event.
+		--
+		inlet = function
+		(
+			event
+		)
+			return e2d[ event ].sync.inlet
+		end,
 
 		--
 		-- Returns the type of the event.
@@ -1452,6 +2027,29 @@ local InletFactory = ( function
 			return e2d[ event ].etype
 		end,
 
+		--
+		-- Returns true if a Full event covers only the entries of
+		-- its directory and not the subdirectories' contents.
+		-- ( used to recover from an overflow )
+		--
+		flat = function
+		(
+			event
+		)
+			return e2d[ event ].flat == true
+		end,
+
+		--
+		-- Returns true if a Full event covers only the subtree
+		-- of its directory, collapsed from the events within.
+		--
+		subtree = function
+		(
+			event
+		)
+			return e2d[ event ].subtree == true
+		end,
+
 		--
 		-- Events are not lists.
 		--
@@ -1610,6 +2208,17 @@ local InletFactory = ( function
 			return e2d[ event ].sync.source .. cutSlash( getPath( event ) )
 		end,
 
+		--
+		-- Returns the size of the file as read with its
+		-- directory when that was created, nil if unknown.
+		--
+		size = function
+		(
+			event
+		)
+			return e2d[ event ].size
+		end,
+
 		--
 		-- Returns the configured target.
 		--
@@ -2158,6 +2767,9 @@ local Excludes = ( function
 	-- Turns a rsync like file pattern to a lua pattern.
 	-- ( at best it can )
 	--
+	-- Only logged, the tests run on the compiled lsyncd.matcher( )
+	-- which gives the same verdicts as these lua patterns.
+	--
 	local function toLuaPattern
 	(
 		p  --  the rsync like pattern
@@ -2208,6 +2820,8 @@ local Excludes = ( function
 		local lp = toLuaPattern( pattern )
 
 		self.list[ pattern ] = lp
+
+		self.matcher = nil
 	end
 
 	--
@@ -2230,6 +2844,8 @@ local Excludes = ( function
 		end
 
 		self.list[ pattern ] = nil
+
+		self.matcher = nil
 	end
 
 	--
@@ -2283,6 +2899,30 @@ local Excludes = ( function
 		f:close( )
 	end
 
+	--
+	-- Returns the matcher of the excludes.
+	--
+	-- The patterns are compiled once until they change.
+	--
+	local function getMatcher
+	(
+		self
+	)
+		if not self.matcher
+		then
+			local patterns = { }
+
+			for pattern, _ in pairs( self.list )
+			do
+				table.insert( patterns, pattern )
+			end
+
+			self.matcher = lsyncd.matcher( patterns )
+		end
+
+		return self.matcher
+	end
+
 	--
 	-- Tests if 'path' is excluded.
 	--
@@ -2296,26 +2936,23 @@ local Excludes = ( function
 			error( 'Paths for exlusion tests must start with \'/\'' )
 		end
 
-		for _, p in pairs( self.list )
-		do
-			if p:byte( -1 ) == 36
-			then
-				-- ends with $
-				if path:match( p )
-				then
-					return true
-				end
-			else
-				-- ends either end with / or $
-				if path:match( p .. '/' )
-				or path:match( p .. '$' )
-				then
-					return true
-				end
-			end
-		end
+		return getMatcher( self ):test( path ) == true
+	end
 
-		return false
+	--
+	-- Tests if all paths within the directory 'path' are
+	-- excluded or none of them is.
+	--
+	-- Returns true and the verdict if so, false otherwise.
+	--
+	local function testDir
+	(
+		self,  -- self
+		path   -- the directory to test
+	)
+		local decided, verdict = getMatcher( self ):testdir( path )
+
+		return decided, verdict == true
 	end
 
 	--
@@ -2327,11 +2964,13 @@ local Excludes = ( function
 			list = { },
 
 			-- functions
-			add      = add,
-			addList  = addList,
-			loadFile = loadFile,
-			remove   = remove,
-			test     = test,
+			add        = add,
+			addList    = addList,
+			getMatcher = getMatcher,
+			loadFile   = loadFile,
+			remove     = remove,
+			test       = test,
+			testDir    = testDir,
 		}
 	end
 
@@ -2353,6 +2992,9 @@ local Filters = ( function
 	-- Turns a rsync like file pattern to a lua pattern.
 	-- ( at best it can )
 	--
+	-- Only logged, the tests run on the compiled lsyncd.matcher( )
+	-- which gives the same verdicts as these lua patterns.
+	--
 	local function toLuaPattern
 	(
 		p  --  the rsync like pattern
@@ -2406,6 +3048,8 @@ local Filters = ( function
 		local lp = toLuaPattern( pattern )
 
 		table.insert( self. list, { rule = rule, pattern = pattern, lp = lp } )
+
+		self.matcher = nil
 	end
 
 	--
@@ -2453,6 +3097,35 @@ local Filters = ( function
 		f:close( )
 	end
 
+	--
+	-- Returns the matcher of the filters.
+	--
+	-- The filters are compiled once until they change,
+	-- the first matching one decides.
+	--
+	local function getMatcher
+	(
+		self
+	)
+		if not self.matcher
+		then
+			local patterns = { }
+
+			local verdicts = { }
+
+			for i, entry in ipairs( self.list )
+			do
+				patterns[ i ] = entry.pattern
+
+				verdicts[ i ] = entry.rule == '-'
+			end
+
+			self.matcher = lsyncd.matcher( patterns, verdicts )
+		end
+
+		return self.matcher
+	end
+
 	--
 	-- Tests if 'path' is filtered.
 	--
@@ -2466,32 +3139,24 @@ local Filters = ( function
 			error( 'Paths for filter tests must start with \'/\'' )
 		end
 
-		for _, entry in ipairs( self.list )
-		do
-			local rule = entry.rule
-			local lp = entry.lp -- lua pattern
-
-			if lp:byte( -1 ) == 36
-			then
-				-- ends with $
-				if path:match( lp )
-				then
-					return rule == '-'
-				end
-			else
-				-- ends either end with / or $
-				if path:match( lp .. '/' )
-				or path:match( lp .. '$' )
-				then
-					return rule == '-'
-				end
-			end
-		end
-
 		-- nil means neither a positivie
 		-- or negative hit, thus excludes have to
 		-- be queried
-		return nil
+		return getMatcher( self ):test( path )
+	end
+
+	--
+	-- Tests if all paths within the directory 'path'
+	-- get the same verdict.
+	--
+	-- Returns true and the verdict if so, false otherwise.
+	--
+	local function testDir
+	(
+		self,  -- self
+		path   -- the directory to test
+	)
+		return getMatcher( self ):testdir( path )
 	end
 
 	--
@@ -2504,8 +3169,10 @@ local Filters = ( function
 			-- functions
 			append     = append,
 			appendList = appendList,
+			getMatcher = getMatcher,
 			loadFile   = loadFile,
 			test       = test,
+			testDir    = testDir,
 		}
 	end
 
@@ -2520,3778 +3187,8655 @@ end )( )
 
 
 --
--- Holds information about one observed directory including subdirs.
+-- A write-ahead journal of the events of a sync.
 --
-local Sync = ( function
+-- Events are appended as they are accepted, together with
+-- checkpoints telling up to which event everything is done.
+-- The records are written in groups and committed to disk
+-- at most every 'journalInterval' seconds.
+--
+-- When Lsyncd starts again after a crash, a HUP or a TERM,
+-- the events not done are replayed and only the directories
+-- which themselves or whose entries changed since the last
+-- commit are transferred instead of running the full init.
+--
+-- Records:
+--     S <len>\n<identity>     -- source and target of the sync
+--     I                       -- the init finished
+--     E <seq> <etype> <len> <len2>\n<path><path2>
+--     C <seq>                 -- all events before seq are done
+--     T <time>                -- all changes before are journaled
+--
+local Journal = ( function
 ( )
 	--
-	-- Syncs that have no name specified by the user script
-	-- get an incremental default name 'Sync[X]'
+	-- All open journals by sync.
 	--
-	local nextDefaultName = 1
+	local journals = { }
 
 	--
-	-- Adds an exclude.
+	-- Time of the next group commit, false if none.
 	--
-	local function addExclude
-	(
-		self,
-		pattern
-	)
-		return self.excludes:add( pattern )
-	end
+	local alarm = false
 
 	--
-	-- Appends a filter line to the Sync
+	-- A journal is started over when this large and nothing is pending.
 	--
-	local function appendFilter
-	(
-		self,
-		line
-	)
-		if not self.filters then self.filters = Filters.new( ) end
-
-		return self.filters:append( line )
-	end
+	local compactSize = 16 * 1024 * 1024
 
 	--
-	-- Removes an exclude.
+	-- Seconds before the last commit rescanned on a restart,
+	-- for events the kernel had not handed over yet.
 	--
-	local function rmExclude
-	(
-		self,
-		pattern
-	)
-		return self.excludes:remove( pattern )
-	end
+	local slack = 2
 
 	--
-	-- Removes a delay.
+	-- Returns what a sync transfers from and to.
 	--
-	local function removeDelay
+	local function identity
 	(
-		self,
-		delay
+		config
 	)
-		if self.delays[ delay.dpos ] ~= delay
-		then
-			error( 'Queue is broken, delay not at dpos' )
-		end
-
-		self.delays:remove( delay.dpos )
+		local target = config.target
 
-		-- frees all delays blocked by this one.
-		if delay.blocks
+		if not target and config.host
 		then
-			for _, vd in pairs( delay.blocks )
-			do
-				vd.status = 'wait'
-			end
+			target = config.host .. ':' .. ( config.targetdir or '' )
 		end
-	end
 
+		return config.source .. ' -> ' .. tostring( target )
+	end
 
 	--
-	-- Returns true if the relative path is excluded or filtered
+	-- Returns the record of an event.
 	--
-	local function testFilter
+	local function eventRecord
 	(
-		self,   -- the Sync
-		path    -- the relative path
+		seq,
+		etype,
+		path,
+		path2
 	)
-		-- never filter the relative root itself
-		-- ( that would make zero sense )
-		if path == '/' then return false end
-
-		local filter = self.filters and self.filters:test( path )
-
-		if filter ~= nil then return filter end
+		path2 = path2 or ''
 
-		-- otherwise check excludes if concerned
-		return self.excludes:test( path )
+		return table.concat{
+			'E ', seq, ' ', etype, ' ', #path, ' ', #path2, '\n', path, path2
+		}
 	end
 
 	--
-	-- Returns true if this Sync concerns about 'path'.
+	-- Reads a journal, nil if there is none.
 	--
-	local function concerns
+	-- A torn record at the end is ignored, as are all after it.
+	--
+	local function read
 	(
-		self,    -- the Sync
-		path     -- the absolute path
+		path
 	)
-		-- not concerned if watch rootdir doesn't match
-		if not path:starts( self.source )
-		then
-			return false
-		end
+		local f = io.open( path, 'rb' )
 
-		-- a sub dir and not concerned about subdirs
-		if self.config.subdirs == false
-		and path:sub( #self.source, -1 ):match( '[^/]+/?' )
+		if not f
 		then
-			return false
+			return nil
 		end
 
-		return not testFilter( self, path:sub( #self.source ) )
-	end
-
-	--
-	-- Collects a child process.
-	--
-	local function collect
-	(
-		self,     -- the sync
-		pid,      -- process id of collected child process
-		exitcode  -- exitcode of child process
-	)
-		local delay = self.processes[ pid ]
+		if f:read( '*l' ) ~= 'lsyncd journal 1'
+		then
+			f:close( )
 
-		-- not a child of this sync?
-		if not delay then
-			return false
+			return nil
 		end
 
-		if delay.status
-		then
-			log( 'Delay', 'collected an event' )
+		local st = { init = false, checkpoint = 1, events = { } }
 
-			if delay.status ~= 'active'
+		while true
+		do
+			local line = f:read( '*l' )
+
+			if not line
 			then
-				error( 'collecting a non-active process' )
+				break
 			end
 
-			local rc = self.config.collect(
-				InletFactory.d2e( delay ),
-				exitcode
-			)
+			local kind = line:sub( 1, 1 )
 
-			if rc == 'die'
+			if kind == 'S'
 			then
-				log( 'Error', 'Critical exitcode.' )
+				local len = line:match( '^S (%d+)$' )
 
-				terminate( -1 )
-			elseif rc ~= 'again'
-			then
-				-- if its active again the collecter restarted the event
-				removeDelay( self, delay )
+				len = len and tonumber( len )
 
-				log(
-					'Delay',
-					'Finish of ',
-					delay.etype,
-					' on ',
-					self.source,delay.path,
-					' = ',
-					exitcode
-				)
-				-- sets the initDone after the first success
-				self.initDone = true
+				local id = len and f:read( len )
 
-			else
-				-- sets the delay on wait again
-				local alarm = self.config.delay
+				if not id or #id ~= len
+				then
+					break
+				end
 
-				-- delays at least 1 second
-				if alarm < 1 then alarm = 1 end
+				st.identity = id
+			elseif kind == 'I'
+			then
+				st.init = true
+			elseif kind == 'E'
+			then
+				local seq, etype, len, len2 =
+					line:match( '^E (%d+) (%a+) (%d+) (%d+)$' )
 
-				delay:wait( now( ) + alarm )
-			end
-		else
-			log( 'Delay', 'collected a list' )
+				if not seq
+				then
+					break
+				end
 
-			local rc = self.config.collect(
-				InletFactory.dl2el( delay ),
-				exitcode
-			)
+				len = tonumber( len )
 
-			if rc == 'die'
-			then
-				log( 'Error', 'Critical exitcode.' );
+				len2 = tonumber( len2 )
 
-				terminate( -1 )
-			elseif rc == 'again'
+				local paths = f:read( len + len2 )
+
+				if not paths or #paths ~= len + len2
+				then
+					break
+				end
+
+				st.events[ #st.events + 1 ] =
+				{
+					seq = tonumber( seq ),
+					etype = etype,
+					path = paths:sub( 1, len ),
+					path2 = len2 > 0 and paths:sub( len + 1 ) or nil,
+				}
+			elseif kind == 'C'
 			then
-				-- sets the delay on wait again
-				local alarm = self.config.delay
+				local seq = line:match( '^C (%d+)$' )
 
-				-- delays are at least 1 second
-				if alarm < 1 then alarm = 1 end
+				if not seq
+				then
+					break
+				end
 
-				alarm = now() + alarm
+				st.checkpoint = tonumber( seq )
+			elseif kind == 'T'
+			then
+				local mark = line:match( '^T (%d+)$' )
 
-				for _, d in ipairs( delay )
-				do
-					d:wait( alarm )
+				if not mark
+				then
+					break
 				end
+
+				st.mark = tonumber( mark )
 			else
-				for _, d in ipairs( delay )
-				do
-					removeDelay( self, d )
-				end
+				break
 			end
-
-			log( 'Delay','Finished list = ',exitcode )
 		end
 
-		self.processes[ pid ] = nil
-		-- we handled this process
-		return true
+		f:close( )
+
+		return st
 	end
 
 	--
-	-- Stacks a newDelay on the oldDelay,
-	-- the oldDelay blocks the new Delay.
-	--
-	-- A delay can block 'n' other delays,
-	-- but is blocked at most by one, the latest delay.
+	-- Starts a journal over with the events given,
+	-- numbering them anew.
 	--
-	local function stack
+	local function rewrite
 	(
-		oldDelay,
-		newDelay
+		j,
+		events
 	)
-		newDelay:blockedBy( oldDelay )
-	end
+		local tmp = j.path .. '.new'
 
-	--
-	-- Puts an action on the delay stack.
-	--
-	local function delay
-	(
-		self,   -- the sync
-		etype,  -- the event type
-		time,   -- time of the event
-		path,   -- path of the event
-		path2   -- desitination path of move events
-	)
-		log(
-			'Function',
-			'delay( ',
-				self.config.name, ', ',
-				etype, ', ',
-				path, ', ',
-				path2,
-			' )'
-		)
-
-		--
-		-- In case new directories were created
-		-- looks through this directories and makes create events for
-		-- new stuff found in there.
-		--
-		local function recurse
-		( )
-			if etype == 'Create' and path:byte( -1 ) == 47
-			then
-				local entries = lsyncd.readdir( self.source .. path )
+		local f, err = io.open( tmp, 'wb' )
 
-				if entries
-				then
-					for dirname, isdir in pairs( entries )
-					do
-						local pd = path .. dirname
+		if not f
+		then
+			log( 'Error', 'Cannot write journal ', tmp, ': ', err )
 
-						if isdir then pd = pd..'/' end
+			return false
+		end
 
-						log( 'Delay', 'Create creates Create on ', pd )
+		local recs = { 'lsyncd journal 1\n', 'S ', #j.identity, '\n', j.identity }
 
-						delay( self, 'Create', time, pd, nil )
-					end
-				end
-			end
+		if j.init
+		then
+			recs[ #recs + 1 ] = 'I\n'
 		end
 
-		-- exclusion tests
-		if not path2
-		then
-			-- simple test for single path events
-			if testFilter( self, path )
-			then
-				log( 'Filter', 'filtered ', etype, ' on "', path, '"' )
+		j.nextSeq = 1
 
-				return
-			end
-		else
-			-- for double paths ( move ) it might result into a split
-			local ex1 = testFilter( self, path )
+		for _, e in ipairs( events )
+		do
+			e.seq = j.nextSeq
 
-			local ex2 = testFilter( self, path2 )
+			j.nextSeq = j.nextSeq + 1
 
-			if ex1 and ex2
-			then
-				log(
-					'Filter',
-					'filtered "', etype, ' on "', path,
-					'" -> "', path2, '"'
-				)
+			recs[ #recs + 1 ] = eventRecord( e.seq, e.etype, e.path, e.path2 )
+		end
 
-				return
-			elseif not ex1 and ex2
-			then
-				-- splits the move if only partly excluded
-				log(
-					'Filter',
-					'filtered destination transformed ',
-					etype,
-					' to Delete ',
-					path
-				)
+		recs[ #recs + 1 ] = 'C 1\n'
 
-				 delay( self, 'Delete', time, path, nil )
+		if j.mark
+		then
+			recs[ #recs + 1 ] = 'T ' .. j.mark .. '\n'
+		end
 
-				return
-			elseif ex1 and not ex2
-			then
-				-- splits the move if only partly excluded
-				log(
-					'Filter',
-					'filtered origin transformed ',
-					etype,
-					' to Create.',
-					path2
-				)
+		local data = table.concat( recs )
 
-				delay( self, 'Create', time, path2, nil )
+		f:write( data )
 
-				return
-			end
-		end
+		local ok, ferr = lsyncd.fsync( f )
 
-		if etype == 'Move'
-		and not self.config.onMove
+		if not ok
 		then
-			-- if there is no move action defined,
-			-- split a move as delete/create
-			-- layer 1 scripts which want moves events have to
-			-- set onMove simply to 'true'
-			log( 'Delay', 'splitting Move into Delete & Create' )
+			log( 'Error', 'Cannot write journal ', tmp, ': ', ferr )
 
-			delay( self, 'Delete', time, path,  nil )
+			f:close( )
 
-			delay( self, 'Create', time, path2, nil )
-
-			return
+			return false
 		end
 
-		-- creates the new action
-		local alarm
+		local rok, rerr = os.rename( tmp, j.path )
 
-		if time and self.config.delay
+		if not rok
 		then
-			alarm = time + self.config.delay
-		else
-			alarm = now( )
+			log( 'Error', 'Cannot write journal ', j.path, ': ', rerr )
+
+			f:close( )
+
+			return false
 		end
 
-		-- new delay
-		local nd = Delay.new( etype, self, alarm, path, path2 )
+		-- the rename only survives a crash with its directory
+		local dok, derr = lsyncd.fsync( j.dir )
 
-		if nd.etype == 'Init' or nd.etype == 'Blanket' or nd.etype == 'Full'
+		if not dok
 		then
-			-- always stack init or blanket events on the last event
-			log(
-				'Delay',
-				'Stacking ',
-				nd.etype,
-				' event.'
-			)
+			log( 'Error', 'Cannot commit journal directory ', j.dir, ': ', derr )
+		end
 
-			if self.delays:size( ) > 0
-			then
-				stack( self.delays:last( ), nd )
-			end
+		if j.file
+		then
+			j.file:close( )
+		end
 
-			nd.dpos = self.delays:push( nd )
+		j.file = f
 
-			recurse( )
+		j.bytes = #data
 
-			return
-		end
+		j.checkpoint = 1
 
-		-- detects blocks and combos by working from back until
-		-- front through the fifo
-		for il, od in self.delays:qpairsReverse( )
-		do
-			-- asks Combiner what to do
-			local ac = Combiner.combine( od, nd )
+		j.buffer = { }
 
-			if ac
-			then
-				Combiner.log( ac, od, nd )
+		return true
+	end
 
-				if ac == 'remove'
-				then
-					self.delays:remove( il )
-				elseif ac == 'stack'
-				then
-					stack( od, nd )
+	--
+	-- Opens the journal of a sync.
+	--
+	-- If 'resumable' and the journal tells the target was in sync,
+	-- returns the events to replay and the time since when
+	-- directories are to be rescanned.
+	--
+	local function open
+	(
+		sync,
+		resumable
+	)
+		local dir = uSettings.journalDir
 
-					nd.dpos = self.delays:push( nd )
-				elseif ac == 'toDelete,stack'
-				then
-					if od.status ~= 'active'
-					then
-						-- turns olddelay into a delete
-						local rd = Delay.new( 'Delete', self, od.alarm, od.path )
+		if not dir
+		then
+			return nil
+		end
 
-						self.delays:replace( il, rd )
+		local path = dir .. '/' .. sync.config.name:gsub( '[^%w_.-]', '_' ) .. '.journal'
 
-						rd.dpos = il
+		local j =
+		{
+			sync = sync,
+			dir = dir,
+			path = path,
+			identity = identity( sync.config ),
+			init = not sync.config.init,
+			mark = nil,
+			buffer = { },
+			dirty = false,
+		}
 
-						-- and stacks delay2
-						stack( rd, nd )
-					else
-						-- and stacks delay2
-						stack( od, nd )
-					end
+		local old = read( path )
 
-					nd.dpos = self.delays:push( nd )
-				elseif ac == 'absorb'
-				then
-					-- nada
-				elseif ac == 'replace'
-				then
-					if od.status ~= 'active'
-					then
-						self.delays:replace( il, nd )
+		local events = { }
 
-						nd.dpos = il
-					else
-						stack( od, nd )
+		local resume
 
-						nd.dpos = self.delays:push( nd )
-					end
-				elseif ac == 'split'
+		if resumable
+		and old
+		and old.identity == j.identity
+		and old.init
+		and old.mark
+		then
+			for _, e in ipairs( old.events )
+			do
+				if e.seq >= old.checkpoint
 				then
-					delay( self, 'Delete', time, path,  nil )
-
-					delay( self, 'Create', time, path2, nil )
-				else
-					error( 'unknown result of combine()' )
+					events[ #events + 1 ] = e
 				end
+			end
 
-				recurse( )
+			j.init = true
 
-				return
-			end
+			-- the rescan still has to be done
+			j.mark = old.mark
 
-			il = il - 1
+			resume = { events = events, since = old.mark - slack }
 		end
 
-		if nd.path2
+		if not rewrite( j, events )
 		then
-			log( 'Delay', 'New ', nd.etype, ': ', nd.path, ' -> ', nd.path2 )
-		else
-			log( 'Delay', 'New ', nd.etype, ': ', nd.path )
+			return nil
 		end
 
-		-- no block or combo
-		nd.dpos = self.delays:push( nd )
+		journals[ sync ] = j
 
-		recurse( )
+		sync.journal = j
+
+		return resume
 	end
 
-	local function updateNextCronAlarm(self, timestamp)
-		if timestamp == nil then
-			timestamp = now()
-		end
+	--
+	-- Schedules a group commit.
+	--
+	local function changed
+	(
+		j
+	)
+		j.dirty = true
 
-		local nalarm = nil
-		for i, c in ipairs(self.cron) do
-			local na = c:get_next_occurrence(timestamp.seconds)
-			if nalarm == nil or nalarm > na then
-				nalarm = na
-			end
-		end
-		if nalarm ~= nil then
-			self.nextCronAlarm = lsyncd.jiffies_from_seconds(nalarm)
+		if not alarm
+		then
+			alarm = now( ) + uSettings.journalInterval
 		end
 	end
 
 	--
-	-- Returns the soonest alarm for this Sync.
+	-- Journals an event, returns its sequence number.
 	--
-	local function getAlarm
+	local function event
 	(
-		self
+		j,
+		etype,
+		path,
+		path2
 	)
-		if self.processes:size( ) >= self.config.maxProcesses
-		then
-			return false
-		end
+		local seq = j.nextSeq
 
-		local rv = false
+		j.nextSeq = seq + 1
 
-		if self.cron ~= nil and self.nextCronAlarm == false then
-			updateNextCronAlarm(self)
-		end
+		j.buffer[ #j.buffer + 1 ] = eventRecord( seq, etype, path, path2 )
 
-		-- first checks if more processes could be spawned
-		if self.processes:size( ) > self.config.maxProcesses
+		changed( j )
+
+		return seq
+	end
+
+	--
+	-- Journals the init of a sync finished.
+	--
+	local function initDone
+	(
+		j
+	)
+		if not j.init
 		then
-			return false
-		end
+			j.init = true
 
-		-- finds the nearest delay waiting to be spawned
-		for _, d in self.delays:qpairs( )
-		do
-			if d.status == 'wait'
-			then
-				if type(d.alarm) == "boolean" and d.alarm == true then
-					return true
-				end
-				if type(d.alarm) == "userdata" then
-					if rv == false or
-						d.alarm < rv then
-						rv = d.alarm
-					end
-				end
-			end
-		end
+			j.buffer[ #j.buffer + 1 ] = 'I\n'
 
-		if rv == false and self.nextCronAlarm ~= false then
-			rv = self.nextCronAlarm
-		elseif self.nextCronAlarm ~= false and self.nextCronAlarm < rv then
-			rv = self.nextCronAlarm
+			changed( j )
 		end
-		-- nothing to spawn
-		return rv
 	end
 
 	--
-	-- Gets all delays that are not blocked by active delays.
+	-- Writes the records of a journal and commits them to disk.
 	--
-	local function getDelays
+	local function commitJournal
 	(
-		self,  -- the sync
-		test   -- function to test each delay
+		j
 	)
-		local dlist  = { sync = self }
+		local sync = j.sync
 
-		local dlistn = 1
+		-- the oldest event not done
+		local pending = j.nextSeq
 
-		local blocks = { }
+		-- false if something not journaled is pending,
+		-- like an init, blanket or full sync
+		local complete = not sync.settingUp
 
-		--
-		-- inheritly transfers all blocks from delay
-		--
-		local function getBlocks
-		(
-			delay
-		)
-			blocks[ delay ] = true
-
-			if delay.blocks
+		for _, d in sync.delays:qpairs( )
+		do
+			if d.seq
 			then
-				for _, d in ipairs( delay.blocks )
-				do
-					getBlocks( d )
-				end
+				if d.seq < pending then pending = d.seq end
+			else
+				complete = false
 			end
 		end
 
-		for _, d in self.delays:qpairs( )
-		do
-			local tr = true
+		if sync.spill
+		and sync.spill.headSeq
+		and sync.spill.headSeq < pending
+		then
+			pending = sync.spill.headSeq
+		end
 
-			if test
+		local mark = j.mark
+
+		if sync.recovery
+		then
+			-- an overflow recovery rescans since then
+			if not mark or sync.recovery.since < mark
 			then
-				tr = test( InletFactory.d2e( d ) )
+				mark = sync.recovery.since
 			end
+		elseif complete
+		then
+			mark = os.time( )
+		end
 
-			if tr == 'break' then break end
+		if pending == j.nextSeq
+		and mark == os.time( )
+		and j.bytes > compactSize
+		then
+			j.mark = mark
 
-			if d.status == 'active' or not tr
-			then
-				getBlocks( d )
-			elseif not blocks[ d ]
-			then
-				dlist[ dlistn ] = d
+			rewrite( j, { } )
 
-				dlistn = dlistn + 1
-			end
+			return
 		end
 
-		return dlist
-	end
+		local buffer = j.buffer
 
-	--
-	-- Creates new actions
-	--
-	local function invokeActions
-	(
-		self,
-		timestamp
-	)
-		log(
-			'Function',
-			'invokeActions( "',
-				self.config.name, '", ',
-				timestamp,
-			' )'
-		)
-		if self.disabled
+		if pending ~= j.checkpoint
 		then
-			return
-		end
+			buffer[ #buffer + 1 ] = 'C ' .. pending .. '\n'
 
-		-- tunnel configured but not up
-		if self.config.tunnel and
-		   self.config.tunnel:isReady() == false then
-			log('Tunnel', 'Tunnel for Sync ', self.config.name, ' not ready. Blocking events')
-			self.config.tunnel:blockSync(self)
-			return
+			j.checkpoint = pending
 		end
 
-		if self.processes:size( ) >= self.config.maxProcesses
+		if mark ~= j.mark
 		then
-			-- no new processes
-			return
+			buffer[ #buffer + 1 ] = 'T ' .. mark .. '\n'
+
+			j.mark = mark
 		end
 
-		if self.nextCronAlarm ~= false and self.nextCronAlarm < timestamp then
-			-- time fo a full sync
-			log('Info', 'Crontab triggered full sync')
-			self.inlet.createFullEvent("/")
-			updateNextCronAlarm(self, timestamp)
+		if #buffer == 0
+		then
+			return
 		end
 
-		for _, d in self.delays:qpairs( )
-		do
-			-- if reached the global limit return
-			if uSettings.maxProcesses
-			and processCount >= uSettings.maxProcesses
-			then
-				log('Alarm', 'at global process limit.')
+		local data = table.concat( buffer )
 
-				return
-			end
+		j.file:seek( 'end' )
 
-			if self.delays:size( ) < self.config.maxDelays
-			then
-				-- time constrains are only concerned if not maxed
-				-- the delay FIFO already.
-				if d.alarm ~= true and timestamp < d.alarm
-				then
-					-- reached point in stack where delays are in future
-					return
-				end
-			end
+		j.file:write( data )
 
-			if d.status == 'wait'
-			then
-				-- found a waiting delay
-				if d.etype == 'Init' then
-					self.config.init( InletFactory.d2e( d ) )
-				elseif d.etype == 'Full' and self.config.full then
-					self.config.full( InletFactory.d2e( d ) )
-				else
-					self.config.action( self.inlet )
-				end
+		local ok, err = lsyncd.fsync( j.file )
 
-				if self.processes:size( ) >= self.config.maxProcesses
-				then
-					-- no further processes
-					return
-				end
-			end
+		if not ok
+		then
+			log( 'Error', 'Cannot write journal ', j.path, ': ', err )
 		end
+
+		j.bytes = j.bytes + #data
+
+		j.buffer = { }
 	end
 
 	--
-	-- Gets the next event to be processed.
+	-- Commits the journals changed, when due or if 'force'd.
 	--
-	local function getNextDelay
+	local function commit
 	(
-		self,
-		timestamp
+		timestamp,
+		force
 	)
-		for i, d in self.delays:qpairs( )
+		if not force and ( not alarm or timestamp < alarm )
+		then
+			return
+		end
+
+		alarm = false
+
+		for _, j in pairs( journals )
 		do
-			if self.delays:size( ) < self.config.maxDelays
+			if j.dirty or force
 			then
-				-- time constrains are only concerned if not maxed
-				-- the delay FIFO already.
-				if d.alarm ~= true and timestamp < d.alarm
-				then
-					-- reached point in stack where delays are in future
-					return nil
-				end
-			end
+				j.dirty = false
 
-			if d.status == 'wait'
-			then
-				-- found a waiting delay
-				return d
+				commitJournal( j )
 			end
 		end
 	end
 
 	--
-	-- Adds and returns a blanket delay thats blocks all.
-	-- Used as custom marker.
+	-- Closes the journal of a sync removed by a reload.
 	--
-	local function addBlanketDelay
+	-- What it holds pending is replayed once a sync
+	-- transferring the same is started again.
+	--
+	local function close
 	(
-		self
+		sync
 	)
-		local newd = Delay.new( 'Blanket', self, true, '' )
+		local j = journals[ sync ]
+
+		if not j
+		then
+			return
+		end
 
-		newd.dpos = self.delays:push( newd )
+		commitJournal( j )
 
-		return newd
+		j.file:close( )
+
+		journals[ sync ] = nil
+
+		sync.journal = nil
 	end
 
 	--
-	-- Adds an full delay that will initiate a full transfer.
+	-- Removes all journals, so the next start runs the full init.
 	--
-	local function addFullDelay
-		(
-			self,
-			path
-		)
-		local newd = Delay.new( 'Full', self, true, path )
+	local function discard
+	( )
+		for sync, j in pairs( journals )
+		do
+			j.file:close( )
 
-		newd.dpos = self.delays:push( newd )
+			os.remove( j.path )
 
-		return newd
+			sync.journal = nil
+		end
+
+		journals = { }
+
+		alarm = false
 	end
 
 	--
-	-- Adds and returns a blanket delay thats blocks all.
-	-- Used as startup marker to call init asap.
+	-- Returns the time of the next group commit, false if none.
 	--
-	local function addInitDelay
-	(
-		self
-	)
-		local newd = Delay.new( 'Init', self, true, '' )
+	local function getAlarm
+	( )
+		return alarm
+	end
 
-		newd.dpos = self.delays:push( newd )
+	--
+	-- Public interface
+	--
+	return {
+		changed = changed,
+		close = close,
+		commit = commit,
+		discard = discard,
+		event = event,
+		getAlarm = getAlarm,
+		identity = identity,
+		initDone = initDone,
+		open = open,
+	}
+end )( )
 
-		return newd
-	end
 
+--
+-- A persistent index of the source tree of a sync.
+--
+-- It keeps the inode, size and times of every path as it was
+-- when its transfer started. On a restart the tree is scanned
+-- and compared against it, so only the paths changed meanwhile
+-- are transferred instead of running the init over all of it:
+--
+--     a new directory is transferred with all within,
+--     a changed directory flat, which covers its files and
+--     the paths gone from it, a changed file by itself.
+--
+-- The record of a changed path stays the old one until its
+-- transfer is done, so a crash in between finds it changed
+-- once more.
+--
+local TreeIndex = ( function
+( )
 	--
-	-- Writes a status report about delays in this sync.
+	-- The indexes by sync.
 	--
-	local function statusReport
-	(
-		self,
-		f
-	)
-		local spaces = '                    '
+	local indexes = { }
 
-		f:write( self.config.name, ' source=', self.source, '\n' )
+	--
+	-- The status of the paths of the delays
+	-- taken when they got active.
+	--
+	local taken = setmetatable( { }, { __mode = 'k' } )
 
-		f:write( 'There are ', self.delays:size( ), ' delays\n')
+	--
+	-- Records set are written when more are pending than
+	-- this or an eighth of the index.
+	--
+	local writeAfter = 65536
 
-		for i, vd in self.delays:qpairs( )
-		do
-			local st = vd.status
+	--
+	-- Opens the index of a sync.
+	--
+	-- Returns true if the index is valid, so the tree only
+	-- has to be compared against it instead of an init.
+	--
+	local function open
+	(
+		sync
+	)
+		local dir = uSettings.indexDir
 
-			f:write( st, string.sub( spaces, 1, 7 - #st ) )
-			f:write( vd.etype, ' ' )
-			f:write( vd.path )
+		-- the changes found are transferred by full actions
+		if not dir
+		or not sync.config.full
+		or sync.config.subdirs == false
+		then
+			return false
+		end
 
-			if vd.path2
-			then
-				f:write( ' -> ',vd.path2 )
-			end
+		local path = dir .. '/' .. sync.config.name:gsub( '[^%w_.-]', '_' ) .. '.index'
 
-			f:write('\n')
+		local x =
+		{
+			idx = lsyncd.treeindex( path, Journal.identity( sync.config ) ),
+			path = path,
+			-- true once the records may be written
+			ready = false,
+		}
 
-		end
+		-- the tree is compared against the index on disk
+		x.diff = x.idx:count( ) ~= nil
 
-		f:write( 'Filtering:\n' )
+		x.stored = x.diff
 
-		local nothing = true
+		indexes[ sync ] = x
 
-		if self.filters
-		then
-			for _, e in pairs( self.filters.list )
-			do
-				nothing = false
+		sync.treeIndex = x
 
-				f:write( e.rule, ' ', e.pattern,'\n' )
-			end
-		end
+		return x.diff
+	end
 
-		if #self.excludes.list > 0
-		then
-			f:write( 'From excludes:\n' )
+	--
+	-- Finishes the write of the index of a sync.
+	--
+	-- Returns false as long as it is written, unless waiting for it.
+	--
+	local function written
+	(
+		sync,
+		wait
+	)
+		local x = indexes[ sync ]
 
-			for t, p in pairs( self.excludes.list )
-			do
-				nothing = false
+		local ok, err = x.idx:written( wait )
 
-				f:write( '- ', t,'\n' )
-			end
+		if ok == false
+		then
+			return false
 		end
 
-		if nothing
+		x.writing = false
+
+		if ok
 		then
-			f:write('  nothing.\n')
+			x.stored = true
+		else
+			log( 'Error', 'Cannot write tree index of ', sync.config.name, ': ', err )
 		end
 
-		f:write( '\n' )
+		return true
 	end
 
 	--
-	-- Returns a debug string describing the Sync
+	-- Starts to write the index of a sync.
 	--
-	local function debug
+	-- The index is written besides the masterloop,
+	-- step( ) finishes it.
+	--
+	local function write
 	(
-		self
+		sync
 	)
-		local rv = "<Sync "..self.config.name.." delays:"..self.delays:size( ).."> "
-		return rv
-	end
-	--
-	-- Returns substitude data for event
-	--
-	local function getSubstitutionData(self, event, data)
-		if self.config.tunnel then
-			data = self.config.tunnel:getSubstitutionData(event, data)
+		local x = indexes[ sync ]
+
+		if x.writing
+		then
+			written( sync, true )
+		end
+
+		local ok, err = x.idx:write( )
+
+		if ok
+		then
+			x.writing = true
+		else
+			log( 'Error', 'Cannot write tree index of ', sync.config.name, ': ', err )
 		end
-		return data
 	end
 
 	--
-	-- Creates a new Sync.
+	-- Gives up the index of a sync which cannot be scanned.
 	--
-	local function new
+	local function fail
 	(
-		config
+		sync,
+		err
 	)
-		local s =
-		{
-			-- fields
-			config = config,
-			delays = Queue.new( ),
-			source = config.source,
-			processes = CountArray.new( ),
-			excludes = Excludes.new( ),
-			filters = nil,
-			initDone = false,
-			disabled = false,
-			tunnelBlock = nil,
-			cron = nil,
-			nextCronAlarm = false,
+		local x = indexes[ sync ]
 
-			-- functions
-			addBlanketDelay = addBlanketDelay,
-			addFullDelay    = addFullDelay,
-			addExclude      = addExclude,
-			addInitDelay    = addInitDelay,
-			appendFilter    = appendFilter,
-			collect         = collect,
-			concerns        = concerns,
-			delay           = delay,
-			debug           = debug,
-			getAlarm        = getAlarm,
-			getDelays       = getDelays,
-			getNextDelay    = getNextDelay,
-			invokeActions   = invokeActions,
-			removeDelay     = removeDelay,
-			rmExclude       = rmExclude,
-			statusReport    = statusReport,
-			getSubstitutionData = getSubstitutionData,
-		}
+		log( 'Error', 'Cannot scan tree of ', sync.config.name, ': ', err )
 
-		s.inlet = InletFactory.newInlet( s )
+		indexes[ sync ] = nil
 
-		-- provides a default name if needed
-		if not config.name
+		sync.treeIndex = nil
+
+		-- the init was skipped for the index
+		if x.diff and sync.config.init
 		then
-			config.name = 'Sync' .. nextDefaultName
+			sync:addInitDelay( )
 		end
+	end
 
-		-- increments defaults if a config name was given or not
-		-- so Sync{n} will be the n-th call to sync{}
-		nextDefaultName = nextDefaultName + 1
+	--
+	-- Queues delays for the paths changed found by a scan.
+	--
+	local function scanned
+	(
+		sync,
+		changes
+	)
+		local x = indexes[ sync ]
 
-		-- loads filters
-		if config.filter
+		if not x.diff
 		then
-			local te = type( config.filter )
+			-- without an init the tree as is counts as synced
+			x.ready = not sync.config.init
 
-			s.filters = Filters.new( )
+			return
+		end
 
-			if te == 'table'
+		for i = 1, #changes, 2
+		do
+			local path = changes[ i ]
+
+			local kind = changes[ i + 1 ]
+
+			if kind == 'file'
 			then
-				s.filters:appendList( config.filter )
-			elseif te == 'string'
+				sync:delay( 'Modify', nil, path )
+			elseif kind == 'dir'
 			then
-				s.filters:append( config.filter )
+				local d = sync:addFullDelay( path )
+
+				d.flat = true
 			else
-				error( 'type for filter must be table or string', 2 )
+				-- a new root is the whole tree anyway
+				sync:addFullDelay( path, path ~= '/' )
 			end
-
 		end
 
-		-- loads exclusions
-		if config.exclude
-		then
-			local te = type( config.exclude )
+		log(
+			'Normal',
+			'Tree index of ', sync.config.name, ' found ', math.floor( #changes / 2 ),
+			' changed paths in ', now( ) - x.scanning.started, ' seconds.'
+		)
 
-			if te == 'table'
-			then
-				s.excludes:addList( config.exclude )
-			elseif te == 'string'
-			then
-				s.excludes:add( config.exclude )
-			else
-				error( 'type for exclude must be table or string', 2 )
-			end
+		x.ready = true
+	end
 
-		end
+	--
+	-- Starts to scan the tree of a sync, so delays are queued
+	-- for the paths changed since the index was written.
+	--
+	-- Without a valid index the scan is recorded only, the index
+	-- is ready once the sync was in sync the first time.
+	--
+	-- The tree is walked in steps by step( ), 'ready' is called
+	-- once it is done.
+	--
+	local function scan
+	(
+		sync,
+		ready
+	)
+		local x = indexes[ sync ]
 
-		if config.delay ~= nil
-		and ( type( config.delay ) ~= 'number' or config.delay < 0 )
+		if not x
 		then
-			error( 'delay must be a number and >= 0', 2 )
+			if ready then ready( ) end
+
+			return
 		end
 
-		if config.filterFrom
+		local ok, err = x.idx:scan(
+			sync.source,
+			sync.excludes:getMatcher( ),
+			sync.filters and sync.filters:getMatcher( ),
+			not x.diff
+		)
+
+		if not ok
 		then
-			if not s.filters then s.filters = Filters.new( ) end
+			fail( sync, err )
 
-			s.filters:loadFile( config.filterFrom )
-		end
+			if ready then ready( ) end
 
-		if config.excludeFrom
-		then
-			s.excludes:loadFile( config.excludeFrom )
+			return
 		end
 
-		if config.crontab and loadCrontab() == false then
-			error("Sync ".. config.name.." uses a crontab, but lua-crontab dependency is not available", 0)
-		elseif config.crontab then
-			local cdata = {}
-			for i, v in ipairs( config.crontab ) do
-				local ok, cd = pcall(crontab.make_raw_cron_data_from_string, v)
-				if ok then
-					local props = crontab.make_cron_properties(cd)
-					local getter = crontab.make_next_occurrence_getter(props)
+		x.scanning = { ready = ready, started = now( ) }
+	end
 
-					table.insert( cdata, getter )
-				else
-					error("Sync: "..config.name.." - crontab rule ".. i .." is not valid: ".. cd.. " . Rule: ".. v, 0)
-				end
+	--
+	-- Walks the next batch of the scans going on, at most
+	-- 'watchBatch' directories and 'watchBatchTime' seconds,
+	-- and finishes the writes done.
+	--
+	local function step
+	( )
+		for sync, x in pairs( indexes )
+		do
+			if x.scanning
+			then
+				local changes, err =
+					x.idx:step( uSettings.watchBatch, uSettings.watchBatchTime )
+
+				if changes ~= false
+				then
+					local ready = x.scanning.ready
+
+					if changes
+					then
+						scanned( sync, changes )
+					else
+						fail( sync, err )
+					end
+
+					x.scanning = nil
 
+					if ready then ready( ) end
+				end
 			end
-			-- local ok, cron = pcall(crontab.make_crontab, cdata)
-			if #cdata then
-				s.cron = cdata
-			else
-				error("Can't parse crontab data: "..cdata, 0)
+
+			if x.writing
+			then
+				written( sync )
 			end
 		end
-
-		return s
 	end
 
 	--
-	-- Public interface
+	-- Returns the time of the next scan step, false if none.
 	--
-	return { new = new }
-end )( )
-
---
--- Writes functions for the user for layer 3 configurations.
---
-local functionWriter = ( function( )
+	local function getAlarm
+	( )
+		for _, x in pairs( indexes )
+		do
+			if x.scanning
+			then
+				return now( )
+			end
+		end
 
-	--
-	-- All variables known to layer 3 configs.
-	--
-	local transVars = {
-		{ '%^pathname',          'event.pathname',        1 },
-		{ '%^pathdir',           'event.pathdir',         1 },
-		{ '%^path',              'event.path',            1 },
-		{ '%^sourcePathname',    'event.sourcePathname',  1 },
-		{ '%^sourcePathdir',     'event.sourcePathdir',   1 },
-		{ '%^sourcePath',        'event.sourcePath',      1 },
-		{ '%^source',            'event.source',          1 },
-		{ '%^targetPathname',    'event.targetPathname',  1 },
-		{ '%^targetPathdir',     'event.targetPathdir',   1 },
-		{ '%^targetPath',        'event.targetPath',      1 },
-		{ '%^target',            'event.target',          1 },
-		{ '%^o%.pathname',       'event.pathname',        1 },
-		{ '%^o%.path',           'event.path',            1 },
-		{ '%^o%.sourcePathname', 'event.sourcePathname',  1 },
-		{ '%^o%.sourcePathdir',  'event.sourcePathdir',   1 },
-		{ '%^o%.sourcePath',     'event.sourcePath',      1 },
-		{ '%^o%.targetPathname', 'event.targetPathname',  1 },
-		{ '%^o%.targetPathdir',  'event.targetPathdir',   1 },
-		{ '%^o%.targetPath',     'event.targetPath',      1 },
-		{ '%^d%.pathname',       'event2.pathname',       2 },
-		{ '%^d%.path',           'event2.path',           2 },
-		{ '%^d%.sourcePathname', 'event2.sourcePathname', 2 },
-		{ '%^d%.sourcePathdir',  'event2.sourcePathdir',  2 },
-		{ '%^d%.sourcePath',     'event2.sourcePath',     2 },
-		{ '%^d%.targetPathname', 'event2.targetPathname', 2 },
-		{ '%^d%.targetPathdir',  'event2.targetPathdir',  2 },
-		{ '%^d%.targetPath',     'event2.targetPath',     2 },
-	}
+		return false
+	end
 
 	--
-	-- Splits a user string into its arguments.
-	-- Returns a table of arguments
+	-- Takes the status of the paths of a delay getting active.
 	--
-	local function splitStr(
-		str -- a string where parameters are seperated by spaces.
+	local function activate
+	(
+		sync,
+		delay
 	)
-		local args = { }
+		local x = indexes[ sync ]
 
-		while str ~= ''
-		do
-			-- break where argument stops
-			local bp = #str
+		local etype = delay.etype
 
-			-- in a quote
-			local inQuote = false
+		if etype == 'Init' or etype == 'Blanket'
+		then
+			return
+		end
 
-			-- tests characters to be space and not within quotes
-			for i = 1, #str
-			do
-				local c = string.sub( str, i, i )
+		local path = delay.path
 
-				if c == '"'
-				then
-					inQuote = not inQuote
-				elseif c == ' ' and not inQuote
-				then
-					bp = i - 1
+		if etype == 'Delete'
+		then
+			taken[ delay ] = { path, false }
 
-					break
-				end
-			end
+			return
+		end
 
-			local arg = string.sub( str, 1, bp )
-			arg = string.gsub( arg, '"', '\\"' )
-			table.insert( args, arg )
-			str = string.sub( str, bp + 1, -1 )
-			str = string.match( str, '^%s*(.-)%s*$' )
+		-- source ends and path starts with '/'
+		local source = sync.source:sub( 1, -2 )
+
+		if etype == 'Move'
+		then
+			taken[ delay ] =
+			{
+				path, false,
+				delay.path2, x.idx:stat( source .. delay.path2 )
+			}
 
+			return
 		end
 
-		return args
+		taken[ delay ] = { path, x.idx:stat( source .. path ) }
 	end
 
-
 	--
-	-- Translates a call to a binary to a lua function.
-	-- TODO this has a little too blocking.
+	-- Sets the records of the paths of a delay done.
 	--
-	local function translateBinary
+	local function done
 	(
-		str
+		sync,
+		delay
 	)
-		-- splits the string
-		local args = splitStr( str )
+		local x = indexes[ sync ]
 
-		-- true if there is a second event
-		local haveEvent2 = false
+		local t = taken[ delay ]
 
-		for ia, iv in ipairs( args )
-		do
-			-- a list of arguments this arg is being split into
-			local a = { { true, iv } }
-
-			-- goes through all translates
-			for _, v in ipairs( transVars )
-			do
-				local ai = 1
-				while ai <= #a
-				do
-					if a[ ai ][ 1 ]
-					then
-						local pre, post =
-							string.match( a[ ai ][ 2 ], '(.*)'..v[1]..'(.*)' )
-
-						if pre
-						then
-							if v[3] > 1
-							then
-								haveEvent2 = true
-							end
+		if not t
+		then
+			return
+		end
 
-							if pre ~= ''
-							then
-								table.insert( a, ai, { true, pre } )
-								ai = ai + 1
-							end
+		taken[ delay ] = nil
 
-							a[ ai ] = { false, v[ 2 ] }
+		for i = 1, #t, 2
+		do
+			x.idx:set( t[ i ], t[ i + 1 ] )
+		end
 
-							if post ~= ''
-							then
-								table.insert( a, ai + 1, { true, post } )
-							end
-						end
-					end
-					ai = ai + 1
-				end
-			end
+		if x.ready
+		and not x.writing
+		and x.idx:pending( ) > math.max( writeAfter, x.idx:count( ) / 8 )
+		then
+			write( sync )
+		end
+	end
 
-			-- concats the argument pieces into a string.
-			local as = ''
-			local first = true
+	--
+	-- Called when a sync is in sync, the scan without
+	-- a valid index is then the state of the target.
+	--
+	local function synced
+	(
+		sync
+	)
+		local x = indexes[ sync ]
 
-			for _, v in ipairs( a )
-			do
-				if not first then as = as..' .. ' end
+		if not x.ready and x.idx:count( )
+		then
+			x.ready = true
 
-				if v[ 1 ]
-				then
-					as = as .. '"' .. v[ 2 ] .. '"'
-				else
-					as = as .. v[ 2 ]
-				end
+			write( sync )
+		end
+	end
 
-				first = false
-			end
+	--
+	-- Closes the index of a sync removed by a reload.
+	--
+	-- The delays still running are not recorded, so the
+	-- next scan finds their paths changed.
+	--
+	local function close
+	(
+		sync
+	)
+		local x = indexes[ sync ]
 
-			args[ ia ] = as
+		if not x
+		then
+			return
 		end
 
-		local ft
+		if x.ready
+		and ( x.idx:pending( ) > 0 or not x.stored )
+		then
+			write( sync )
+		end
 
-		if not haveEvent2
+		if x.writing
 		then
-			ft = 'function( event )\n'
-		else
-			ft = 'function( event, event2 )\n'
+			written( sync, true )
 		end
 
-		ft = ft ..
-			"    log('Normal', 'Event ', event.etype, \n" ..
-			"        ' spawns action \"".. str.."\"')\n" ..
-			"    spawn( event"
+		indexes[ sync ] = nil
 
-		for _, v in ipairs( args )
+		sync.treeIndex = nil
+	end
+
+	--
+	-- Writes all indexes with records pending, on exit.
+	--
+	local function flush
+	( )
+		for sync, x in pairs( indexes )
 		do
-			ft = ft .. ',\n         ' .. v
-		end
+			-- a scan not done leaves the index as it was
+			if not x.scanning
+			then
+				if not x.ready
+				and x.idx:count( )
+				and sync.delays:size( ) == 0
+				and not sync.spill
+				then
+					x.ready = true
+				end
 
-		ft = ft .. ')\nend'
-		return ft
+				if x.ready
+				and ( x.idx:pending( ) > 0 or not x.stored )
+				then
+					write( sync )
+				end
 
+				if x.writing
+				then
+					written( sync, true )
+				end
+			end
+		end
 	end
 
+	--
+	-- Public interface
+	--
+	return {
+		activate = activate,
+		close = close,
+		done = done,
+		flush = flush,
+		getAlarm = getAlarm,
+		open = open,
+		scan = scan,
+		step = step,
+		synced = synced,
+	}
+end )( )
+
 
+--
+-- Holds information about one observed directory including subdirs.
+--
+local Sync = ( function
+( )
 	--
-	-- Translates a call using a shell to a lua function
+	-- Syncs that have no name specified by the user script
+	-- get an incremental default name 'Sync[X]'
 	--
-	local function translateShell
+	local nextDefaultName = 1
+
+	--
+	-- Adds an exclude.
+	--
+	local function addExclude
 	(
-		str
+		self,
+		pattern
 	)
-		local argn = 1
+		self.filterRound = self.filterRound + 1
 
-		local args = { }
+		return self.excludes:add( pattern )
+	end
 
-		local cmd = str
+	--
+	-- Appends a filter line to the Sync
+	--
+	local function appendFilter
+	(
+		self,
+		line
+	)
+		if not self.filters then self.filters = Filters.new( ) end
 
-		local lc = str
+		self.filterRound = self.filterRound + 1
 
-		-- true if there is a second event
-		local haveEvent2 = false
+		return self.filters:append( line )
+	end
 
-		for _, v in ipairs( transVars )
-		do
-			local occur = false
+	--
+	-- Removes an exclude.
+	--
+	local function rmExclude
+	(
+		self,
+		pattern
+	)
+		self.filterRound = self.filterRound + 1
 
-			cmd = string.gsub(
-				cmd,
-				v[ 1 ],
-				function
-				( )
-					occur = true
-					return '"$' .. argn .. '"'
-				end
-			)
+		return self.excludes:remove( pattern )
+	end
 
-			lc = string.gsub( lc, v[1], ']]..' .. v[2] .. '..[[' )
+	--
+	-- Replaces the filters of the Sync, nil for none.
+	--
+	local function setFilters
+	(
+		self,
+		filters
+	)
+		self.filterRound = self.filterRound + 1
 
-			if occur
-			then
-				argn = argn + 1
+		self.filters = filters
+	end
 
-				table.insert( args, v[ 2 ] )
+	--
+	-- The ready list holds the delays in FIFO order that are
+	-- not held back by an active delay, so getDelays( ) does
+	-- not have to walk the whole FIFO.
+	--
+	-- A delay is held if it is active or its blocker is held.
+	-- Entries of delays that got held, removed or replaced stay
+	-- in the list until it is compacted.
+	--
 
-				if v[ 3 ] > 1
-				then
-					haveEvent2 = true
-				end
-			end
+	--
+	-- Returns true if a ready list entry is valid.
+	--
+	local function isReady
+	(
+		self,
+		delay
+	)
+		return not delay.held and self.delays[ delay.dpos ] == delay
+	end
 
-		end
+	--
+	-- Inserts a delay into the ready list by its FIFO position.
+	--
+	local function readyInsert
+	(
+		self,
+		delay
+	)
+		local ready = self.ready
 
-		local ft
+		local dpos = delay.dpos
 
-		if not haveEvent2
-		then
-			ft = 'function( event )\n'
-		else
-			ft = 'function( event, event2 )\n'
-		end
+		-- a held delay keeps its entry until compacted
+		if self.listed[ delay ] then return end
 
-		-- TODO do array joining instead
-		ft = ft..
-			"    log('Normal', 'Event ',event.etype,\n"..
-			"        [[ spawns shell \""..lc.."\"]])\n"..
-			"    spawnShell(event, [["..cmd.."]]"
+		self.listed[ delay ] = true
 
-		for _, v in ipairs( args )
-		do
-			ft = ft..',\n         '..v
+		local lo = 1
+
+		local hi = #ready
+
+		-- usually the delay is the latest
+		if hi == 0 or ready[ hi ].dpos < dpos
+		then
+			ready[ hi + 1 ] = delay
+
+			return
 		end
 
-		ft = ft .. ')\nend'
+		while lo <= hi
+		do
+			local mid = math.floor( ( lo + hi ) / 2 )
 
-		return ft
+			if ready[ mid ].dpos < dpos
+			then
+				lo = mid + 1
+			else
+				hi = mid - 1
+			end
+		end
 
+		table.insert( ready, lo, delay )
 	end
 
 	--
-	-- Writes a lua function for a layer 3 user script.
+	-- Returns true if a delay is to be held.
 	--
-	local function translate
+	local function mustHold
 	(
-		str
+		self,
+		delay
 	)
-		-- trims spaces
-		str = string.match( str, '^%s*(.-)%s*$' )
-
-		local ft
-
-		if string.byte( str, 1, 1 ) == 47
-		then
-			-- starts with /
-			 ft = translateBinary( str )
-		elseif string.byte( str, 1, 1 ) == 94
+		if delay.status == 'active'
+		and self.delays[ delay.dpos ] == delay
 		then
-			-- starts with ^
-			 ft = translateShell( str:sub( 2, -1 ) )
-		else
-			 ft = translateShell( str )
+			return true
 		end
 
-		log( 'FWrite', 'translated "', str, '" to \n', ft )
+		local blocker = delay.blocker
 
-		return ft
+		return blocker ~= nil and blocker.held == true
 	end
 
-
 	--
-	-- Public interface.
+	-- Holds a delay that became active
+	-- and all delays it blocks.
 	--
-	return {
-		translate = translate,
-		splitStr = splitStr
-	}
+	local function hold
+	(
+		self,
+		delay
+	)
+		if delay.held then return end
 
-end )( )
+		if self.delays[ delay.dpos ] == delay
+		then
+			self.readyStale = self.readyStale + 1
+		end
 
+		delay.held = true
 
+		if delay.blocks
+		then
+			for _, vd in ipairs( delay.blocks )
+			do
+				hold( self, vd )
+			end
+		end
+	end
 
---
--- Basic Tunnel provider.
---
-Tunnel = (function()
+	--
+	-- Releases a held delay and all delays it blocks,
+	-- if nothing holds them anymore.
+	--
+	local function release
+	(
+		self,
+		delay
+	)
+		if not delay.held or mustHold( self, delay ) then return end
 
-	Tunnel = {}
+		delay.held = false
 
-	local TUNNEL_CMD_TYPES = {
-		CMD = 1,
-		CHK = 2
-	}
+		if self.delays[ delay.dpos ] == delay
+		then
+			readyInsert( self, delay )
+		end
 
-	local TUNNEL_STATUS = {
-		UNKNOWN = 0,
-		DOWN = 1,
-		DISABLED = 2,
-		CONNECTING = 3,
-		UP = 4,
-		RETRY_TIMEOUT = 5,
-		UP_RETRY_TIMEOUT = 6,
-	}
+		if delay.blocks
+		then
+			for _, vd in ipairs( delay.blocks )
+			do
+				release( self, vd )
+			end
+		end
+	end
 
-	local TUNNEL_MODES = {
-		COMMAND = "command",
-		POOL = "pool",
-	}
+	--
+	-- Drops the entries of no longer ready delays
+	-- from the ready list.
+	--
+	local function compactReady
+	(
+		self
+	)
+		local ready = { }
 
-	local TUNNEL_DISTRIBUTION = {
-		ROUNDROBIN = "rr",
-	}
+		local listed = { }
 
-	local TUNNEL_SUBSTITIONS = {
-		"localhost",
-		"localport"
-	}
+		for _, d in ipairs( self.ready )
+		do
+			if isReady( self, d )
+			then
+				ready[ #ready + 1 ] = d
 
-	local nextTunnelName = 1
+				listed[ d ] = true
+			end
+		end
 
-	Tunnel.defaults = {
-		mode = TUNNEL_MODES.COMMAND,
-		parallel = 1,
-		distribution = TUNNEL_DISTRIBUTION.ROUNDROBIN,
-		command = nil,
-		checkCommand = nil,
-		checkExitCodes = {0},
-		checkMaxFailed = 5,
-		retryDelay = 10,
-		readyDelay = 5,
-		localhost = 'localhost',
-	}
-	-- export constants
-	Tunnel.TUNNEL_CMD_TYPES = TUNNEL_CMD_TYPES
-	Tunnel.TUNNEL_STATUS = TUNNEL_STATUS
-	Tunnel.TUNNEL_MODES = TUNNEL_MODES
-	Tunnel.TUNNEL_DISTRIBUTION = TUNNEL_DISTRIBUTION
-	Tunnel.TUNNEL_SUBSTITIONS = TUNNEL_SUBSTITIONS
+		self.ready = ready
 
-	function Tunnel.new(
-		options
-	)
-		local rv = {
-			processes = CountArray.new( ),
-			blocks = {},
-			ready = false,
-			retryCount = 0,
-			status = TUNNEL_STATUS.DOWN,
-			alarm = true,
-			rrCounter = 0,
-		}
-		-- provides a default name if needed
-		if options.name == nil
-		then
-			options.name = 'Tunnel' .. nextTunnelName
-		end
+		self.listed = listed
 
-		nextTunnelName = nextTunnelName + 1
+		self.readyStale = 0
+	end
 
-		inherit(options, Tunnel.defaults)
+	--
+	-- The alarms of waiting delays are kept in a heap per sync.
+	--
+	-- Entries of delays that got removed, blocked, active or
+	-- another alarm are dropped when they come to the top.
+	--
 
-		rv.options = options
+	--
+	-- Returns true if alarm entry a is due before b.
+	--
+	local function alarmBefore
+	(
+		a,
+		b
+	)
+		if a.alarm == true then return b.alarm ~= true end
 
-		inherit(rv, Tunnel)
+		if b.alarm == true then return false end
 
-		--setmetatable(rv, Tunnel)
-		-- self.__index = self
+		return a.alarm < b.alarm
+	end
 
-		return rv
+	--
+	-- Returns true if an alarm entry is still valid.
+	--
+	local function alarmValid
+	(
+		self,
+		entry
+	)
+		local d = entry.delay
+
+		return self.delays[ d.dpos ] == d
+		and d.status == 'wait'
+		and d.alarm == entry.alarm
 	end
 
-	function Tunnel.statusToText(status)
-		for n, i in pairs(TUNNEL_STATUS) do
-			if status == i then
-				return n
-			end
+	--
+	-- Schedules the alarm of a waiting delay.
+	--
+	local function scheduleAlarm
+	(
+		self,
+		delay
+	)
+		if delay.status == 'wait'
+		then
+			self.alarms:push( { alarm = delay.alarm, delay = delay } )
 		end
-		return TUNNEL_STATUS.UNKNOWN
 	end
 
-	-- Returns the status of tunnel as text
-	function Tunnel:statusText()
-		return Tunnel.statusToText(self.status)
+	--
+	-- Returns the soonest alarm of the waiting delays,
+	-- true if one is due immediately or nil if none waits.
+	--
+	local function nextAlarm
+	(
+		self
+	)
+		local alarms = self.alarms
+
+		if alarms:size( ) > 2 * self.delays:size( ) + 64
+		then
+			alarms:filter(
+				function( entry ) return alarmValid( self, entry ) end
+			)
+		end
+
+		local top = alarms:peek( )
+
+		while top and not alarmValid( self, top )
+		do
+			alarms:pop( )
+
+			top = alarms:peek( )
+		end
+
+		return top and top.alarm
 	end
 
 	--
-	-- Returns next alarm
+	-- Sets a delay active.
 	--
-	function Tunnel:getAlarm()
-		return self.alarm
+	local function activateDelay
+	(
+		self,
+		delay
+	)
+		delay:setActive( )
+
+		if self.treeIndex
+		then
+			TreeIndex.activate( self, delay )
+		end
+
+		hold( self, delay )
 	end
 
 	--
-	-- User supplied function to check if tunnel is up
-	function Tunnel:check()
-		return true
-	end
+	-- Sets a delay waiting again.
+	--
+	local function waitDelay
+	(
+		self,
+		delay,
+		alarm
+	)
+		delay:wait( alarm )
 
-	function Tunnel:isReady()
-		return self.status == TUNNEL_STATUS.UP or
-			   self.status == TUNNEL_STATUS.UP_RETRY_TIMEOUT
-	end
+		release( self, delay )
 
-	function Tunnel:setStatus(status)
-		log('Tunnel',self.options.name,': status change: ',
-			self:statusText(), " -> ", Tunnel.statusToText(status))
-		self.status = status
+		scheduleAlarm( self, delay )
 	end
 
 	--
-	-- Returns the number of processes currently running
+	-- Appends a delay to the delay FIFO.
 	--
-	function Tunnel:countProcs(timestamp)
-		local run = 0
-		local starting = 0
-		local dead = 0
-		if timestamp == nil then
-			timestamp = now()
+	local function pushDelay
+	(
+		self,
+		delay
+	)
+		-- the wall clock time of the oldest event the delay covers
+		if not delay.since
+		then
+			delay.since = os.time( )
 		end
 
-		for pid, pd in self.processes:walk() do
-			if pd.type == TUNNEL_CMD_TYPES.CMD then
-				-- process needs to run for at least some time
-				if lsyncd.kill(pid, 0) ~= 0 then
-					dead = dead + 1
-				elseif (pd.started + self.options.readyDelay) > timestamp then
-					starting = starting + 1
-				else
-					pd.ready = true
-					run = run + 1
-				end
-			end
+		delay.dpos = self.delays:push( delay )
+
+		self.delayIndex:add( delay )
+
+		if mustHold( self, delay )
+		then
+			delay.held = true
+		else
+			delay.held = false
+
+			readyInsert( self, delay )
 		end
 
-		return run, starting, dead
+		scheduleAlarm( self, delay )
 	end
 
 	--
-	-- Check if the tunnel is up
-	function Tunnel:invoke(timestamp)
-		-- lsyncd.kill()
-		if self:check() == false then
-			-- check failed, consider tunnel broken
-			self:setStatus(TUNNEL_STATUS.DOWN)
+	-- Replaces the delay at pos in the delay FIFO.
+	--
+	local function replaceDelay
+	(
+		self,
+		pos,
+		delay
+	)
+		local old = self.delays[ pos ]
+
+		if not old.held
+		then
+			self.readyStale = self.readyStale + 1
 		end
 
-		if self.status == TUNNEL_STATUS.RETRY_TIMEOUT then
-			if self.alarm <= timestamp then
-				log(
-					'Tunnel',
-					'Retry setup ', self.options.name
-				)
-				self:start()
-				return
-			else
-				-- timeout not yet reached
-				self.alarm = now() + 1
-				return
-			end
-		elseif self.status == TUNNEL_STATUS.DOWN then
-			self:start()
-			return
-		elseif self.status == TUNNEL_STATUS.DISABLED then
-			self.alarm = false
-			return
+		self.delayIndex:remove( old )
+
+		-- the new delay covers the journaled events of the old one
+		if old.seq and ( not delay.seq or old.seq < delay.seq )
+		then
+			delay.seq = old.seq
 		end
 
-		local parallel = self.options.parallel
-		local run, starting, dead = self:countProcs(timestamp)
+		if old.since and ( not delay.since or old.since < delay.since )
+		then
+			delay.since = old.since
+		end
 
-		-- check if enough child processes are running
-		if self.status == TUNNEL_STATUS.CONNECTING then
-			if run > 0 then
-				log(
-					'Tunnel',
-					'Setup of tunnel ', self.options.name, ' sucessfull'
-				)
-				self:setStatus(TUNNEL_STATUS.UP)
-				self:unblockSyncs()
-			end
-		elseif self.status == TUNNEL_STATUS.UP and run == 0 then
-			-- no good process running, degrade
-			log(
-				'Tunnel',
-				'Tunnel ', self.options.name, ' changed to CONNECTING'
-			)
-			self:setStatus(TUNNEL_STATUS.CONNECTING)
-		end
+		self.delays:replace( pos, delay )
 
-		local spawned = 0
-		-- start more processes if necesarry
-		while run + starting + spawned  < self.options.parallel do
-			self:spawn()
-			spawned = spawned + 1
-		end
+		delay.dpos = pos
 
-		-- trigger next delay
-		if starting + spawned == 0 then
-			self.alarm = false
+		self.delayIndex:add( delay )
+
+		if mustHold( self, delay )
+		then
+			delay.held = true
 		else
-			self.alarm = now() + 1
+			delay.held = false
+
+			readyInsert( self, delay )
 		end
+
+		scheduleAlarm( self, delay )
 	end
 
 	--
-	-- Check if Sync is already blocked by Tunnel
-	function Tunnel:getBlockerForSync(
-		sync
+	-- Removes a delay.
+	--
+	local function removeDelay
+	(
+		self,
+		delay
 	)
-		for _, eblock in ipairs(self.blocks) do
-			if eblock.sync == sync then
-				return eblock
+		if self.delays[ delay.dpos ] ~= delay
+		then
+			error( 'Queue is broken, delay not at dpos' )
+		end
+
+		self.delays:remove( delay.dpos )
+
+		self.delayIndex:remove( delay )
+
+		if not delay.held
+		then
+			self.readyStale = self.readyStale + 1
+		end
+
+		if self.journal
+		then
+			Journal.changed( self.journal )
+		end
+
+		-- frees all delays blocked by this one.
+		if delay.blocks
+		then
+			for _, vd in pairs( delay.blocks )
+			do
+				vd.status = 'wait'
+
+				if self.delays[ vd.dpos ] == vd
+				then
+					scheduleAlarm( self, vd )
+				end
 			end
 		end
-		return nil
+
+		if self.delays:size( ) == 0
+		then
+			-- the FIFO starts over with its positions
+			self.ready = { }
+
+			self.listed = { }
+
+			self.readyStale = 0
+		else
+			release( self, delay )
+		end
 	end
 
+
 	--
-	-- Create a block on the sync until the tunnel reaches ready state
-	function Tunnel:blockSync(
-		sync
+	-- Returns the verdict of the filters and excludes for
+	-- all paths within the relative directory 'dir':
+	--
+	--   'excluded' if all of them are excluded or filtered
+	--   'included' if none of them is
+	--   'mixed'    if they have to be tested one by one
+	--
+	-- The verdict of a parent directory is inherited
+	-- unless it is 'mixed'.
+	--
+	local function dirVerdict
+	(
+		self,   -- the Sync
+		dir,    -- the relative directory
+		parent  -- the verdict of the parent directory if known
 	)
-		local block = self:getBlockerForSync(sync)
-
-		if block then
-			-- delay the block by another second
-			block:wait( now( ) + 1 )
-			return
+		if parent == 'excluded' or parent == 'included'
+		then
+			return parent
 		end
 
-		local block = sync:addBlanketDelay()
-		sync.tunnelBlock = block
+		local decided, verdict
 
-		table.insert (self.blocks, block)
-		-- set the new delay to be a block for existing delays
-		for _, eblock in sync.delays:qpairs() do
-			if eblock ~= block then
-				eblock:blockedBy(block)
+		if self.filters
+		then
+			decided, verdict = self.filters:testDir( dir )
+
+			if not decided then return 'mixed' end
+
+			if verdict ~= nil
+			then
+				return verdict and 'excluded' or 'included'
 			end
 		end
-		-- delay tunnel check by 1 second
-		block:wait( now( ) + 1 )
+
+		decided, verdict = self.excludes:testDir( dir )
+
+		if not decided then return 'mixed' end
+
+		return verdict and 'excluded' or 'included'
 	end
 
 	--
-	-- Create a block on the sync until the tunnel reaches ready state
-	function Tunnel:unblockSyncs()
-		for i,blk in ipairs(self.blocks) do
-			blk.sync:removeDelay(blk)
-			blk.sync.tunnelBlock = nil
-		end
-		self.blocks = {}
+	-- Returns true if the relative path is excluded or filtered
+	--
+	local function testFilter
+	(
+		self,    -- the Sync
+		path,    -- the relative path
+		verdict  -- the verdict of the directory holding path if known
+	)
+		-- never filter the relative root itself
+		-- ( that would make zero sense )
+		if path == '/' then return false end
+
+		if verdict == 'excluded' then return true end
+
+		if verdict == 'included' then return false end
+
+		local filter = self.filters and self.filters:test( path )
+
+		if filter ~= nil then return filter end
+
+		-- otherwise check excludes if concerned
+		return self.excludes:test( path )
 	end
 
 	--
-	-- Spawn a single tunnel program
+	-- Returns true if this Sync concerns about 'path'.
 	--
-	function Tunnel:spawn()
-		local opts = {
-			type = TUNNEL_CMD_TYPES.CMD,
-			started = now(),
-			localhost = self.options.localhost,
-			ready = false,
-		}
-		local cmd = self.options.command
-
-		if self.options.mode == TUNNEL_MODES.POOL then
-			opts.localport = lsyncd.get_free_port()
-		end
-		if type(cmd) == "string" then
-			cmd = functionWriter.splitStr(cmd)
+	local function concerns
+	(
+		self,    -- the Sync
+		path,    -- the absolute path
+		verdict  -- the verdict of the directory holding path if known
+	)
+		-- not concerned if watch rootdir doesn't match
+		if not path:starts( self.source )
+		then
+			return false
 		end
-		cmd = substitudeCommands(cmd, opts)
 
-		if #cmd < 1 then
-			log('Error',
-			'',
-			self.options
-			)
-			error( 'start tunnel of mode command with empty command', 2 )
-			-- FIXME: add line which tunnel was called
+		-- a sub dir and not concerned about subdirs
+		if self.config.subdirs == false
+		and path:sub( #self.source, -1 ):match( '[^/]+/?' )
+		then
 			return false
 		end
-		local bin = cmd[1]
-		-- for _,v in ipairs(cmd) do
-		-- 	if type( v ) ~= 'string' then
-		-- 		error( 'tunnel command must be a list of strings', 2 )
-		-- 	end
-		-- end
-		log(
-			'Info',
-			'Start tunnel command ',
-			cmd
-		)
-		--- @diagnostic disable-next-line: param-type-mismatch
-		local pid = lsyncd.exec(bin, table.unpack(cmd, 2))
-		--local pid = spawn(bin, table.unpack(self.options.command, 2))
-		if pid and pid > 0 then
-			self.processes[pid] = opts
-			self.retryCount = 0
-			self.alarm = now() + 1
-		else
-			self.alarm = now() + self.options.retryDelay
-			if self.status == TUNNEL_STATUS.UP then
-				self:setStatus(TUNNEL_STATUS.UP_RETRY_TIMEOUT)
-			else
-				self:setStatus(TUNNEL_STATUS.RETRY_TIMEOUT)
-			end
-		end
+
+		return not testFilter( self, path:sub( #self.source ), verdict )
 	end
 
-	function Tunnel:start()
-		if self.status == TUNNEL_STATUS.UP or
-		   self.status == TUNNEL_STATUS.CONNECTING then
-			return
+	--
+	-- Releases the Full delays of an overflow recovery,
+	-- not more than maxProcesses are queued at a time.
+	--
+	local function releaseRecovery
+	(
+		self
+	)
+		local r = self.recovery
+
+		while r.active < self.config.maxProcesses
+		and r.next <= #r.pending
+		do
+			local path = r.pending[ r.next ]
+
+			local d = self:addFullDelay( path )
+
+			d.flat = true
+
+			r.waiting[ path ] = nil
+
+			r.pending[ r.next ] = nil
+
+			r.next = r.next + 1
+
+			r.active = r.active + 1
 		end
 
-		if self.options.mode == TUNNEL_MODES.COMMAND or
-		   self.options.mode == TUNNEL_MODES.POOL then
+		if r.active == 0
+		then
+			r.took = now( ) - r.started
 
-			self:setStatus(TUNNEL_STATUS.CONNECTING)
-			self:invoke(now())
-		else
-			error('unknown tunnel mode:' .. self.options.mode)
-			self:setStatus(TUNNEL_STATUS.DISABLED)
+			log(
+				'Normal',
+				'Overflow recovery of ', self.config.name, ' finished, ',
+				r.dirs, ' directories rescanned in ', r.took, ' seconds.'
+			)
+
+			self.lastRecovery = r
+
+			self.recovery = nil
 		end
 	end
 
 	--
-	-- collect pids of exited child processes. Restart the tunnel if necessary
-	---
-	function Tunnel:collect (
-		pid,
-		exitcode
+	-- Collects a child process.
+	--
+	local function collect
+	(
+		self,     -- the sync
+		pid,      -- process id of collected child process
+		exitcode  -- exitcode of child process
 	)
-		local proc = self.processes[pid]
+		local delay = self.processes[ pid ]
 
-		if proc == nil then
+		-- not a child of this sync?
+		if not delay then
 			return false
 		end
-		log('Debug',
-			"collect tunnel event. pid: ", pid," exitcode: ", exitcode)
-		local run, starting, dead = self:countProcs()
-		-- cases in which the tunnel command is handled
-		if proc.type == TUNNEL_CMD_TYPES.CMD then
-			if self.status == TUNNEL_STATUS.CONNECTING then
-				log(
-					'Warning',
-					'Starting tunnel failed.',
-					self.options.name
-				)
-				self:setStatus(TUNNEL_STATUS.RETRY_TIMEOUT)
-				self.alarm = now() + self.options.retryDelay
-			else
-				log(
-						'Info',
-						'Tunnel died. Will Restarting',
-						self.options.name
+
+		if delay.status
+		then
+			log( 'Delay', 'collected an event' )
+
+			if delay.status ~= 'active'
+			then
+				error( 'collecting a non-active process' )
+			end
+
+			local rc = self.config.collect(
+				InletFactory.d2e( delay ),
+				exitcode
+			)
+
+			if rc == 'die'
+			then
+				log( 'Error', 'Critical exitcode.' )
+
+				terminate( -1 )
+			elseif rc ~= 'again'
+			then
+				-- if its active again the collecter restarted the event
+				removeDelay( self, delay )
+
+				log(
+					'Delay',
+					'Finish of ',
+					delay.etype,
+					' on ',
+					self.source,delay.path,
+					' = ',
+					exitcode
 				)
+				-- sets the initDone after the first success
+				self.initDone = true
 
-				if run == 0 then
-					self:setStatus(TUNNEL_STATUS.DOWN)
+				if delay.etype == 'Init' and self.journal
+				then
+					Journal.initDone( self.journal )
 				end
-				self.alarm = true
-			end
-		-- cases in which the check function has executed a program
-		elseif proc.type == TUNNEL_CMD_TYPES.CHK then
-			local good = false
-			if type(self.options.checkExitCodes) == 'table' then
 
-				for _,i in ipairs(self.options.checkExitCodes) do
-					if exitcode == i then
-						good = true
-					end
+				if self.treeIndex
+				then
+					TreeIndex.done( self, delay )
 				end
-			else
-				if self.options.checkExitCodes == exitcode then
-					good = true
+
+				if delay.flat and self.recovery
+				then
+					self.recovery.active = self.recovery.active - 1
+
+					releaseRecovery( self )
 				end
+			else
+				-- sets the delay on wait again
+				local alarm = self.config.delay
+
+				-- delays at least 1 second
+				if alarm < 1 then alarm = 1 end
+
+				waitDelay( self, delay, now( ) + alarm )
 			end
-			if good then
-				if self:isReady() == false then
-					log(
-					'Info',
-					self.options.name,
-					' Tunnel setup complete '
-					)
+		else
+			log( 'Delay', 'collected a list' )
+
+			local rc = self.config.collect(
+				InletFactory.dl2el( delay ),
+				exitcode
+			)
+
+			if rc == 'die'
+			then
+				log( 'Error', 'Critical exitcode.' );
+
+				terminate( -1 )
+			elseif rc == 'again'
+			then
+				-- sets the delay on wait again
+				local alarm = self.config.delay
+
+				-- delays are at least 1 second
+				if alarm < 1 then alarm = 1 end
+
+				alarm = now() + alarm
+
+				for _, d in ipairs( delay )
+				do
+					waitDelay( self, d, alarm )
 				end
-				self:setStatus(TUNNEL_STATUS.UP)
-				self.checksFailed = 0
 			else
-				if self.ready  then
-					log(
-					'Tunnel',
-					self.options.name
-					' Check failed.'
-					)
-					self.checksFailed = self.checksFailed + 1
-					if self.checksFailed > self.options.checkMaxFailed then
-						self:kill()
+				for _, d in ipairs( delay )
+				do
+					removeDelay( self, d )
+
+					if self.treeIndex
+					then
+						TreeIndex.done( self, d )
 					end
 				end
-				self:setStatus(TUNNEL_STATUS.DOWN)
 			end
+
+			log( 'Delay','Finished list = ',exitcode )
 		end
-		self.processes[pid] = nil
-	end
 
-	--
-	-- Stops all tunnel processes
-	--
-	function Tunnel:kill ()
-		log('Tunnel', 'Shutdown tunnel ', self.options.name)
-		for pid, pr in self.processes:walk() do
-			if pr.type == TUNNEL_CMD_TYPES.CMD then
-				log('Tunnel','Kill process ', pid)
-				lsyncd.kill(pid, 9)
-			end
+		self.processes[ pid ] = nil
+
+		if self.initDone
+		and self.delays:size( ) == 0
+		and not self.spill
+		and self.processes:size( ) == 0
+		and self.treeIndex
+		then
+			TreeIndex.synced( self )
 		end
-		self:setStatus(TUNNEL_STATUS.DISABLED)
-	end
 
-	function Tunnel:isReady ()
-		return self.status == TUNNEL_STATUS.UP
+		-- we handled this process
+		return true
 	end
 
 	--
-	-- Fills/changes the opts table with additional values
-	-- for the transfer to be started
+	-- Stacks a newDelay on the oldDelay,
+	-- the oldDelay blocks the new Delay.
 	--
-	function Tunnel:getSubstitutionData(event, opts)
-		local useProc, useProcLast = nil, nil
-		if self.options.mode == TUNNEL_MODES.POOL then
-			if self.options.distribution == TUNNEL_DISTRIBUTION.ROUNDROBIN then
-				local i = 0
-				for pid, proc in self.processes:walk() do
-					if proc.ready == true then
-						useProcLast = proc
-						if (i % self.processes:size()) == self.rrCounter then
-							useProc = proc
-							self.rrCounter = self.rrCounter + 1
-						end
-					end
-				end
-				if useProc == nil then
-					self.rrCounter = 0
-					useProc = useProcLast
-				end
-			else
-				log('Tunnel', 'Unknown distribution mode: ', self.options.distribution)
-				os.exit(1)
-			end
-		end
-		if useProc then
-			for k,v in pairs(self.TUNNEL_SUBSTITIONS) do
-				if useProc[v] ~= nil then
-					opts[v] = useProc[v]
-				end
-			end
-		end
-		return opts
+	-- A delay can block 'n' other delays,
+	-- but is blocked at most by one, the latest delay.
+	--
+	local function stack
+	(
+		oldDelay,
+		newDelay
+	)
+		newDelay:blockedBy( oldDelay )
 	end
 
 	--
-	-- Writes a status report about this tunnel
+	-- The event types that are spilled to disk.
 	--
-	function Tunnel:statusReport(f)
-		f:write( 'Tunnel: name=', self.options.name, ' status=', self:statusText(), '\n' )
+	local spillTypes =
+	{
+		Attrib = true,
+		Modify = true,
+		Create = true,
+		Delete = true,
+		Move = true,
+	}
 
-		f:write( 'Running processes: ', self.processes:size( ), '\n')
+	--
+	-- Returns the journal sequence number of the event being
+	-- handled, journaling it on first use, nil without a journal.
+	--
+	-- So events filtered away are never journaled.
+	--
+	local function takeSeq
+	(
+		self
+	)
+		local e = self.current
 
-		for pid, prc in self.processes:walk( )
-		do
-		    f:write("  pid=", pid, " type=", prc.type, " started="..prc.started, '\n')
+		if not e
+		then
+			return nil
 		end
 
-		f:write( '\n' )
+		if not e.seq
+		then
+			e.seq = Journal.event( self.journal, e.etype, e.path, e.path2 )
+		end
+
+		return e.seq
 	end
 
-	return Tunnel
+	--
+	-- Returns the wall clock time of an event's timestamp,
+	-- the current one for events without.
+	--
+	local function wallTime
+	(
+		time
+	)
+		if not time
+		then
+			return os.time( )
+		end
 
-end)() -- Tunnel scope
+		return os.time( ) - math.floor( now( ) - time )
+	end
 
---
--- Tunnels - a singleton
---
--- Tunnels maintains all configured tunnels.
---
-local Tunnels = ( function
-	( )
-		--
-		-- the list of all tunnels
-		--
-		local tunnelList = Array.new( )
+	--
+	-- Opens the file a sync spills its events to.
+	--
+	-- The file is removed right away, so it is gone
+	-- as soon as Lsyncd closes it or exits.
+	--
+	local function openSpill
+	(
+		self
+	)
+		local dir = uSettings.spillDir
 
-		--
-		-- Returns sync at listpos i
-		--
-		local function get
-		( i )
-			return tunnelList[ i ];
+		if not dir
+		then
+			return io.tmpfile( )
 		end
 
-		--
-		-- Adds a new tunnel.
-		--
-		local function add
-		(
-			tunnel
+		-- created exclusively, never truncating another file
+		local path, err = lsyncd.mkstemp(
+			string.format(
+				'%s/lsyncd-%s-XXXXXX',
+				dir,
+				( self.config.name:gsub( '[^%w_.-]', '_' ) )
+			)
 		)
-			table.insert( tunnelList, tunnel )
 
-			return tunnel
+		if not path
+		then
+			return nil, err
 		end
 
-		--
-		-- Allows a for-loop to walk through all syncs.
-		--
-		local function iwalk
-		( )
-			return ipairs( tunnelList )
-		end
+		local f
 
-		--
-		-- Returns the number of syncs.
-		--
-		local size = function
-		( )
-			return #tunnelList
-		end
-		--- @type any
-		local nextCycle = true
-		--
-		-- Cycle through all tunnels and call their invoke function
-		--
-		local function invoke(timestamp)
-			for _,tunnel in ipairs( tunnelList )
-			do
-				tunnel:invoke(timestamp)
-			end
-			if size() > 0 then
-				nextCycle = now() + 5
-			else
-				nextCycle = false
-			end
-		end
+		f, err = io.open( path, 'r+b' )
 
-		--
-		-- returns the next alarm
-		--
-		local function getAlarm()
-			local rv = nextCycle
-			for _, tunnel in ipairs( tunnelList ) do
-				local ta = tunnel:getAlarm()
-				if ta == true or (type(ta) == "userdata"
-				   and ta < rv) then
-					rv = ta
-				end
-			end
+		os.remove( path )
 
-			return rv
-		end
+		return f, err
+	end
 
-		--
-		-- closes all tunnels
-		--
-		local function killAll()
-			local rv = true
-			for _, tunnel in ipairs( tunnelList ) do
-				local ta = tunnel:kill()
-				if ta ~= true then
-					rv = false
-				end
-			end
+	--
+	-- Appends an event to the spill file.
+	--
+	-- Once more than 'spillAfter' delays are queued, new events
+	-- are not turned into delays but appended to a file as compact
+	-- records, so the memory used stays bounded. As the queue
+	-- drains, pageIn( ) reads them back in order.
+	--
+	-- Returns false if the event has to be queued in memory.
+	--
+	local function spill
+	(
+		self,
+		etype,
+		time,
+		path,
+		path2
+	)
+		local sp = self.spill
 
-			return rv
-		end
+		if not sp
+		then
+			local f, err = openSpill( self )
 
-		--
-		-- Public interface
-		--
-		return {
-			add = add,
-			get = get,
-			iwalk = iwalk,
-			size = size,
-			invoke = invoke,
-			getAlarm = getAlarm,
-			killAll = killAll
-		}
-	end )( )
+			if not f
+			then
+				log( 'Error', 'Cannot open a spill file: ', err )
 
+				return false
+			end
 
---
--- create a new tunnel from the passed options and registers the tunnel
---- @diagnostic disable-next-line: lowercase-global
-tunnel = function (options)
-	log(
-		'Debug',
-		'create tunnel:', options
-	)
-	local rv = Tunnel.new(options)
-	Tunnels.add(rv)
+			sp =
+			{
+				file = f,
+				start = now( ),
+				count = 0,
+				bytes = 0,
+				readPos = 0,
+				paging = false,
+				-- journal sequence number of the oldest spilled event
+				headSeq = takeSeq( self ),
+				-- wall clock time of the oldest spilled event
+				since = wallTime( time ),
+			}
 
-	return rv
+			self.spill = sp
 
-end
+			log(
+				'Normal',
+				'Spilling events of ', self.config.name, ' to disk, ',
+				self.delays:size( ), ' delays are queued.'
+			)
+		end
 
+		path2 = path2 or ''
 
---
--- Syncs - a singleton
---
--- Syncs maintains all configured syncs.
---
-local Syncs = ( function
-( )
-	--
-	-- the list of all syncs
-	--
-	local syncsList = Array.new( )
+		-- the time of the event relative to the spill's start
+		local rec = table.concat{
+			etype, ' ',
+			time and ( time - sp.start ) or '-', ' ',
+			takeSeq( self ) or '-', ' ',
+			#path, ' ',
+			#path2, '\n',
+			path,
+			path2
+		}
 
-	--
-	-- The round robin pointer. In case of global limited maxProcesses
-	-- gives every sync equal chances to spawn the next process.
-	--
-	local round = 1
+		sp.file:seek( 'end' )
 
-	--
-	-- The cycle( ) sheduler goes into the next round of roundrobin.
-	--
-	local function nextRound
-	( )
-		round = round + 1;
+		sp.file:write( rec )
 
-		if round > #syncsList
-		then
-			round = 1
-		end
+		sp.count = sp.count + 1
 
-		return round
-	end
+		sp.bytes = sp.bytes + #rec
 
-	--
-	-- Returns the round
-	--
-	local function getRound
-	( )
-		return round
+		return true
 	end
 
 	--
-	-- Returns sync at listpos i
+	-- Collapses the delays within a newly created directory
+	-- into one Full delay transferring its subtree recursively,
+	-- once more than 'subtreeThreshold' delays are within.
 	--
-	local function get
-	( i )
-		return syncsList[ i ];
-	end
-
-
+	-- Copying or unpacking a large tree so takes one delay
+	-- instead of one for every entry.
 	--
-	-- Adds a new sync.
+	-- Returns true if the new delay got collapsed.
 	--
-	local function add
+	local function collapse
 	(
-		config
+		self,
+		nd    -- the delay just added
 	)
-		-- Checks if user overwrote the settings function.
-		-- ( was Lsyncd <2.1 style )
-		if settings ~= settingsSafe
+		local threshold = self.config.subtreeThreshold
+
+		if nd.etype ~= 'Create'
+		or not threshold
+		or threshold <= 0
+		or not self.config.full
 		then
-			log(
-				'Error',
-				'Do not use settings = { ... }\n'..
-				'      please use settings{ ... } (without the equal sign)'
-			)
+			return false
+		end
 
-			os.exit( -1 )
+		local od = self.delayIndex:crowded( nd.path, threshold )
+
+		if not od or self.uncollapsed[ od ]
+		then
+			return false
 		end
 
-		-- Creates a new config table which inherits all keys/values
-		-- from integer keyed tables
-		local uconfig = config
+		local gone = { }
 
-		config = { }
+		for d, _ in pairs( self.delayIndex.within[ od.path ] )
+		do
+			-- running delays and moves stay as they are
+			if d.status == 'active' or d.etype == 'Move'
+			then
+				self.uncollapsed[ od ] = true
 
-		-- inherit the config but do not deep copy the tunnel object
-		-- the tunnel object is a reference to a object that might be shared
-		inherit( config, uconfig, nil, {"tunnel"} )
+				return false
+			end
 
-		--
-		-- last and least defaults are inherited
-		--
-		inherit( config, default )
+			gone[ d ] = true
+		end
 
-		-- copy references
-		config.tunnel = uconfig.tunnel
+		log(
+			'Delay',
+			'Collapsing ', self.delayIndex.counts[ od.path ],
+			' delays into a subtree Full: ', od.path
+		)
 
-		local inheritSettings = {
-			'delay',
-			'maxDelays',
-			'maxProcesses'
-		}
+		local sd = Delay.new( 'Full', self, od.alarm, od.path )
 
-		-- Lets settings override these values.
-		for _, v in ipairs( inheritSettings )
+		sd.subtree = true
+
+		-- covers the journaled events of all collapsed delays
+		for d, _ in pairs( gone )
 		do
-			if uSettings[ v ]
+			if d.seq and ( not sd.seq or d.seq < sd.seq )
 			then
-				config[ v ] = uSettings[ v ]
+				sd.seq = d.seq
+			end
+
+			if d.since and ( not sd.since or d.since < sd.since )
+			then
+				sd.since = d.since
 			end
 		end
 
-		-- Lets commandline override these values.
-		for _, v in ipairs( inheritSettings )
+		replaceDelay( self, od.dpos, sd )
+
+		for d, _ in pairs( gone )
 		do
-			if clSettings[ v ]
+			if d ~= od
 			then
-				config[ v ] = clSettings[ v ]
+				self.delays:remove( d.dpos )
+
+				self.delayIndex:remove( d )
+
+				if not d.held
+				then
+					self.readyStale = self.readyStale + 1
+				end
 			end
 		end
 
-		--
-		-- lets the userscript 'prepare' function
-		-- check and complete the config
-		--
-		if type( config.prepare ) == 'function'
-		then
-			-- prepare is given a writeable copy of config
-			config.prepare( config, 4 )
-		end
+		-- the delays outside blocked by the collapsed ones
+		-- are blocked by the subtree delay instead
+		for d, _ in pairs( gone )
+		do
+			if d.blocks
+			then
+				for _, vd in ipairs( d.blocks )
+				do
+					if not gone[ vd ]
+					then
+						stack( sd, vd )
 
-		if not config[ 'source' ]
-		then
-			local info = debug.getinfo( 3, 'Sl' )
+						release( self, vd )
+					end
+				end
+			end
+		end
 
-			log(
-				'Error',
-				info.short_src,':',
-				info.currentline,': source missing from sync.'
-			)
+		return true
+	end
 
-			terminate( -1 )
-		end
+	--
+	-- Puts an action on the delay stack.
+	--
+	local function delay
+	(
+		self,   -- the sync
+		etype,  -- the event type
+		time,   -- time of the event
+		path,   -- path of the event
+		path2,  -- desitination path of move events
+		verdict, -- the verdict of the directory holding path ( and path2 )
+		--          if known, see dirVerdict( )
+		size    -- the size of the file if read with its directory
+	)
+		log(
+			'Function',
+			'delay( ',
+				self.config.name, ', ',
+				etype, ', ',
+				path, ', ',
+				path2,
+			' )'
+		)
 
 		--
-		-- absolute path of source
+		-- In case new directories were created
+		-- looks through this directories and makes create events for
+		-- new stuff found in there.
 		--
-		local realsrc = lsyncd.realdir( config.source )
+		local function recurse
+		( )
+			if etype == 'Create' and path:byte( -1 ) == 47
+			then
+				-- the sizes are only needed to batch transfers
+				local entries =
+					lsyncd.scandir(
+						self.source .. path,
+						self.config.batchSizeLimit ~= nil
+					)
 
-		if not realsrc
-		then
-			log(
-				'Error',
-				'Cannot access source directory: ',
-				config.source
-			)
+				if entries
+				then
+					local dv = dirVerdict( self, path, verdict )
 
-			terminate( -1 )
-		end
+					for _, e in ipairs( entries )
+					do
+						local pd = path .. e.name
 
-		config._source = config.source
-		config.source = realsrc
+						if e.type == 'directory' then pd = pd..'/' end
 
-		if not config.action
-		and not config.onAttrib
-		and not config.onCreate
-		and not config.onModify
-		and not config.onDelete
-		and not config.onMove
-		and not config.onFull
+						log( 'Delay', 'Create creates Create on ', pd )
+
+						delay( self, 'Create', time, pd, nil, dv, e.size )
+					end
+				end
+			end
+		end
+
+		-- exclusion tests
+		if not path2
 		then
-			local info = debug.getinfo( 3, 'Sl' )
+			-- simple test for single path events
+			if testFilter( self, path, verdict )
+			then
+				log( 'Filter', 'filtered ', etype, ' on "', path, '"' )
+
+				return
+			end
+		else
+			-- for double paths ( move ) it might result into a split
+			local ex1 = testFilter( self, path, verdict )
+
+			local ex2 = testFilter( self, path2, verdict )
+
+			if ex1 and ex2
+			then
+				log(
+					'Filter',
+					'filtered "', etype, ' on "', path,
+					'" -> "', path2, '"'
+				)
+
+				return
+			elseif not ex1 and ex2
+			then
+				-- splits the move if only partly excluded
+				log(
+					'Filter',
+					'filtered destination transformed ',
+					etype,
+					' to Delete ',
+					path
+				)
+
+				 delay( self, 'Delete', time, path, nil, verdict )
+
+				return
+			elseif ex1 and not ex2
+			then
+				-- splits the move if only partly excluded
+				log(
+					'Filter',
+					'filtered origin transformed ',
+					etype,
+					' to Create.',
+					path2
+				)
+
+				delay( self, 'Create', time, path2, nil, verdict )
+
+				return
+			end
+		end
+
+		if etype == 'Move'
+		and not self.config.onMove
+		then
+			-- if there is no move action defined,
+			-- split a move as delete/create
+			-- layer 1 scripts which want moves events have to
+			-- set onMove simply to 'true'
+			log( 'Delay', 'splitting Move into Delete & Create' )
+
+			delay( self, 'Delete', time, path,  nil, verdict )
+
+			delay( self, 'Create', time, path2, nil, verdict )
+
+			return
+		end
+
+		-- spills new events to disk once too many delays are queued
+		local sp = self.spill
+
+		if spillTypes[ etype ]
+		and self.config.spillAfter
+		and self.config.spillAfter > 0
+		and not ( sp and sp.paging )
+		and ( sp or self.delays:size( ) >= self.config.spillAfter )
+		and spill( self, etype, time, path, path2 )
+		then
+			return
+		end
+
+		-- creates the new action
+		local alarm
+
+		if time and self.config.delay
+		then
+			alarm = time + self.config.delay
+		else
+			alarm = now( )
+		end
+
+		-- new delay
+		local nd = Delay.new( etype, self, alarm, path, path2 )
+
+		nd.seq = takeSeq( self )
+
+		nd.since = wallTime( time )
+
+		nd.size = size
 
+		if nd.etype == 'Init' or nd.etype == 'Blanket' or nd.etype == 'Full'
+		then
+			-- always stack init or blanket events on the last event
 			log(
-				'Error',
-				info.short_src, ':',
-				info.currentline,
-				': no actions specified.'
+				'Delay',
+				'Stacking ',
+				nd.etype,
+				' event.'
 			)
 
-			terminate( -1 )
+			if self.delays:size( ) > 0
+			then
+				stack( self.delays:last( ), nd )
+			end
+
+			pushDelay( self, nd )
+
+			recurse( )
+
+			return
 		end
 
-		-- the monitor to use
-		config.monitor =
-			uSettings.monitor or
-			config.monitor or
-			Monitors.default( )
+		-- detects blocks and combos by working from back until
+		-- front through the delays the new one might combine with
+		for _, od in ipairs( self.delayIndex:candidates( nd ) )
+		do
+			local il = od.dpos
 
-		if config.monitor ~= 'inotify'
-		and config.monitor ~= 'fsevents'
+			-- asks Combiner what to do
+			local ac = Combiner.combine( od, nd )
+
+			if ac
+			then
+				Combiner.log( ac, od, nd )
+
+				if ac == 'remove'
+				then
+					self.delays:remove( il )
+
+					self.delayIndex:remove( od )
+				elseif ac == 'stack'
+				then
+					stack( od, nd )
+
+					pushDelay( self, nd )
+
+					-- the subtree delay covers the new directory's entries
+					if collapse( self, nd )
+					then
+						return
+					end
+				elseif ac == 'toDelete,stack'
+				then
+					if od.status ~= 'active'
+					then
+						-- turns olddelay into a delete
+						local rd = Delay.new( 'Delete', self, od.alarm, od.path )
+
+						rd.since = od.since
+
+						replaceDelay( self, il, rd )
+
+						-- and stacks delay2
+						stack( rd, nd )
+					else
+						-- and stacks delay2
+						stack( od, nd )
+					end
+
+					pushDelay( self, nd )
+				elseif ac == 'absorb'
+				then
+					-- a subtree delay covers the new directory's entries too
+					if od.subtree
+					then
+						return
+					end
+				elseif ac == 'replace'
+				then
+					if od.status ~= 'active'
+					then
+						replaceDelay( self, il, nd )
+					else
+						stack( od, nd )
+
+						pushDelay( self, nd )
+					end
+				elseif ac == 'split'
+				then
+					delay( self, 'Delete', time, path,  nil )
+
+					delay( self, 'Create', time, path2, nil )
+				else
+					error( 'unknown result of combine()' )
+				end
+
+				recurse( )
+
+				return
+			end
+		end
+
+		if nd.path2
 		then
-			local info = debug.getinfo( 3, 'Sl' )
+			log( 'Delay', 'New ', nd.etype, ': ', nd.path, ' -> ', nd.path2 )
+		else
+			log( 'Delay', 'New ', nd.etype, ': ', nd.path )
+		end
+
+		-- no block or combo
+		pushDelay( self, nd )
+
+		if collapse( self, nd )
+		then
+			return
+		end
+
+		recurse( )
+	end
+
+	--
+	-- Reads spilled events back in order once the queue
+	-- drained below half of 'spillAfter' delays and hands
+	-- them to delay( ) again, so they combine with the
+	-- delays queued like events arriving just now.
+	--
+	local function pageIn
+	(
+		self
+	)
+		local sp = self.spill
+
+		local limit = self.config.spillAfter
+
+		if not sp or self.delays:size( ) >= limit / 2
+		then
+			return
+		end
+
+		local f = sp.file
+
+		sp.paging = true
+
+		while sp.count > 0 and self.delays:size( ) < limit
+		do
+			f:seek( 'set', sp.readPos )
+
+			local header = f:read( '*l' )
+
+			local etype, secs, seq, len, len2 =
+				header:match( '^(%a+) (%S+) (%S+) (%d+) (%d+)$' )
+
+			len = tonumber( len )
+
+			len2 = tonumber( len2 )
+
+			local paths = f:read( len + len2 )
+
+			sp.readPos = f:seek( )
+
+			sp.count = sp.count - 1
+
+			local time
+
+			if secs ~= '-'
+			then
+				time = sp.start + tonumber( secs )
+
+				-- the events after are not older
+				sp.since = wallTime( time )
+			end
+
+			if seq ~= '-'
+			then
+				-- the events after are not older
+				sp.headSeq = tonumber( seq )
+
+				self.current = { seq = sp.headSeq }
+			end
+
+			delay(
+				self, etype, time,
+				paths:sub( 1, len ),
+				len2 > 0 and paths:sub( len + 1 ) or nil
+			)
+
+			self.current = nil
+		end
+
+		sp.paging = false
+
+		if sp.count == 0
+		then
+			f:close( )
+
+			self.spill = nil
 
 			log(
-				'Error',
-				info.short_src, ':',
-				info.currentline,
-				': event monitor "',
-				config.monitor,
-				'" unknown.'
+				'Normal',
+				'Read back all spilled events of ', self.config.name, '.'
 			)
+		end
+	end
+
+	--
+	-- Puts an event from a monitor on the delay stack.
+	--
+	-- With a journal the event is journaled once it
+	-- is not filtered away.
+	--
+	local function event
+	(
+		self,
+		etype,
+		time,
+		path,
+		path2,
+		verdict
+	)
+		if self.journal and spillTypes[ etype ]
+		then
+			self.current = { etype = etype, path = path, path2 = path2 }
+
+			delay( self, etype, time, path, path2, verdict )
+
+			self.current = nil
+		else
+			delay( self, etype, time, path, path2, verdict )
+		end
+	end
+
+	--
+	-- Replays the events not done from the journal.
+	--
+	local function replay
+	(
+		self,
+		events  -- the events as returned by Journal.open( )
+	)
+		for _, e in ipairs( events )
+		do
+			self.current = { seq = e.seq }
+
+			delay( self, e.etype, nil, e.path, e.path2 )
+		end
+
+		self.current = nil
+	end
+
+	local function updateNextCronAlarm(self, timestamp)
+		if timestamp == nil then
+			timestamp = now()
+		end
+
+		local nalarm = nil
+		for i, c in ipairs(self.cron) do
+			local na = c:get_next_occurrence(timestamp.seconds)
+			if nalarm == nil or nalarm > na then
+				nalarm = na
+			end
+		end
+		if nalarm ~= nil then
+			self.nextCronAlarm = lsyncd.jiffies_from_seconds(nalarm)
+		end
+	end
+
+	--
+	-- Returns the soonest alarm for this Sync.
+	--
+	local function getAlarm
+	(
+		self
+	)
+		if self.processes:size( ) >= self.config.maxProcesses
+		then
+			return false
+		end
+
+		local rv = false
+
+		if self.cron ~= nil and self.nextCronAlarm == false then
+			updateNextCronAlarm(self)
+		end
+
+		-- first checks if more processes could be spawned
+		if self.processes:size( ) > self.config.maxProcesses
+		then
+			return false
+		end
+
+		-- spilled events are to be read back
+		if self.spill
+		and self.delays:size( ) < self.config.spillAfter / 2
+		then
+			return true
+		end
+
+		-- finds the nearest delay waiting to be spawned
+		rv = nextAlarm( self ) or false
+
+		if rv == true then return true end
+
+		if rv == false and self.nextCronAlarm ~= false then
+			rv = self.nextCronAlarm
+		elseif self.nextCronAlarm ~= false and self.nextCronAlarm < rv then
+			rv = self.nextCronAlarm
+		end
+		-- nothing to spawn
+		return rv
+	end
+
+	--
+	-- Gets all delays that are not blocked by active delays.
+	--
+	-- Held delays are not passed to the test function, so unlike
+	-- the full walk this replaced, a 'break' on an active delay
+	-- or one it blocks does not end the list.
+	--
+	local function getDelays
+	(
+		self,  -- the sync
+		test   -- function to test each delay
+	)
+		local dlist  = { sync = self }
+
+		local dlistn = 1
+
+		local blocks = { }
+
+		--
+		-- inheritly transfers all blocks from delay
+		--
+		local function getBlocks
+		(
+			delay
+		)
+			blocks[ delay ] = true
+
+			if delay.blocks
+			then
+				for _, d in ipairs( delay.blocks )
+				do
+					getBlocks( d )
+				end
+			end
+		end
+
+		if self.readyStale > #self.ready / 2
+		then
+			compactReady( self )
+		end
+
+		-- delays held back by active delays are not in the ready list
+		for _, d in ipairs( self.ready )
+		do
+			if isReady( self, d )
+			then
+				local tr = true
+
+				if test
+				then
+					tr = test( InletFactory.d2e( d ) )
+				end
+
+				if tr == 'break' then break end
+
+				if not tr
+				then
+					getBlocks( d )
+				elseif not blocks[ d ]
+				then
+					dlist[ dlistn ] = d
+
+					dlistn = dlistn + 1
+				end
+			end
+		end
+
+		return dlist
+	end
+
+	--
+	-- Creates new actions
+	--
+	local function invokeActions
+	(
+		self,
+		timestamp
+	)
+		log(
+			'Function',
+			'invokeActions( "',
+				self.config.name, '", ',
+				timestamp,
+			' )'
+		)
+		if self.disabled
+		then
+			return
+		end
+
+		-- tunnel configured but not up
+		if self.config.tunnel and
+		   self.config.tunnel:isReady() == false then
+			log('Tunnel', 'Tunnel for Sync ', self.config.name, ' not ready. Blocking events')
+			self.config.tunnel:blockSync(self)
+			return
+		end
+
+		if self.processes:size( ) >= self.config.maxProcesses
+		then
+			-- no new processes
+			return
+		end
+
+		if self.nextCronAlarm ~= false and self.nextCronAlarm < timestamp then
+			-- time fo a full sync
+			log('Info', 'Crontab triggered full sync')
+			self.inlet.createFullEvent("/")
+			updateNextCronAlarm(self, timestamp)
+		end
+
+		pageIn( self )
+
+		-- cycles without a waiting delay due are cheap
+		local due = nextAlarm( self )
+
+		if not due
+		or due ~= true
+		and timestamp < due
+		and self.delays:size( ) < self.config.maxDelays
+		then
+			return
+		end
+
+		for _, d in self.delays:qpairs( )
+		do
+			-- if reached the global limit return
+			if uSettings.maxProcesses
+			and processCount >= uSettings.maxProcesses
+			then
+				log('Alarm', 'at global process limit.')
+
+				return
+			end
+
+			if self.delays:size( ) < self.config.maxDelays
+			then
+				-- time constrains are only concerned if not maxed
+				-- the delay FIFO already.
+				if d.alarm ~= true and timestamp < d.alarm
+				then
+					-- reached point in stack where delays are in future
+					return
+				end
+			end
+
+			if d.status == 'wait'
+			then
+				-- found a waiting delay
+				if d.etype == 'Init' and self.settingUp
+				then
+					-- not yet watching the whole tree,
+					-- the init blocks all other delays anyway
+					return
+				elseif d.etype == 'Init' then
+					self.config.init( InletFactory.d2e( d ) )
+				elseif d.etype == 'Full' and self.config.full then
+					self.config.full( InletFactory.d2e( d ) )
+				else
+					self.config.action( self.inlet )
+				end
+
+				if self.processes:size( ) >= self.config.maxProcesses
+				then
+					-- no further processes
+					return
+				end
+			end
+		end
+	end
+
+	--
+	-- Gets the next event to be processed.
+	--
+	local function getNextDelay
+	(
+		self,
+		timestamp
+	)
+		for i, d in self.delays:qpairs( )
+		do
+			if self.delays:size( ) < self.config.maxDelays
+			then
+				-- time constrains are only concerned if not maxed
+				-- the delay FIFO already.
+				if d.alarm ~= true and timestamp < d.alarm
+				then
+					-- reached point in stack where delays are in future
+					return nil
+				end
+			end
+
+			if d.status == 'wait'
+			then
+				-- found a waiting delay
+				return d
+			end
+		end
+	end
+
+	--
+	-- Adds and returns a blanket delay thats blocks all.
+	-- Used as custom marker.
+	--
+	local function addBlanketDelay
+	(
+		self
+	)
+		local newd = Delay.new( 'Blanket', self, true, '' )
+
+		pushDelay( self, newd )
+
+		return newd
+	end
+
+	--
+	-- Adds an full delay that will initiate a full transfer.
+	--
+	local function addFullDelay
+		(
+			self,
+			path,
+			subtree  -- if true transfers all within the directory 'path'
+		)
+		local newd = Delay.new( 'Full', self, true, path )
+
+		-- indexed by whether it is a subtree transfer
+		newd.subtree = subtree
+
+		pushDelay( self, newd )
+
+		return newd
+	end
+
+	--
+	-- Recovers from an overflow of the event queue
+	-- without a reset.
+	--
+	-- Queues flat Full delays for the directories changed
+	-- since the oldest event still pending.
+	--
+	local function recover
+	(
+		self,
+		dirs,  -- absolute paths of the changed directories
+		since  -- the wall clock time they were searched from
+	)
+		local r = self.recovery
+
+		if not r
+		then
+			r =
+			{
+				started = now( ),
+				since = since,
+				dirs = 0,
+				bytes = 0,
+				pending = { },
+				waiting = { },
+				next = 1,
+				active = 0,
+			}
+
+			self.recovery = r
+		end
+
+		for _, dir in ipairs( dirs )
+		do
+			-- the path relative to the source, keeps the leading slash
+			local path = string.sub( dir, #self.source )
+
+			-- a directory still waiting to be rescanned is not queued twice
+			if not r.waiting[ path ]
+			then
+				local entries = lsyncd.scandir( dir, true )
+
+				if entries
+				then
+					for _, e in ipairs( entries )
+					do
+						if e.type ~= 'directory'
+						then
+							r.bytes = r.bytes + e.size
+						end
+					end
+				end
+
+				r.waiting[ path ] = true
+
+				r.pending[ #r.pending + 1 ] = path
+
+				r.dirs = r.dirs + 1
+			end
+		end
+
+		log(
+			'Normal',
+			'Overflow recovery of ', self.config.name, ' rescans ',
+			#dirs, ' directories changed since ', os.date( '%c', since )
+		)
+
+		releaseRecovery( self )
+	end
+
+	--
+	-- Returns the wall clock time changes have to be
+	-- searched from for an overflow recovery or nil
+	-- if the sync cannot recover without a reset.
+	--
+	local function recoverySince
+	(
+		self
+	)
+		if not self.initDone
+		or self.settingUp
+		or not self.config.full
+		or self.config.monitor ~= 'inotify'
+		then
+			return nil
+		end
+
+		-- everything before the oldest event still pending is synced,
+		-- so a sync always busy can recover as well
+		local since = os.time( )
+
+		for _, d in self.delays:qpairs( )
+		do
+			if d.since < since then since = d.since end
+		end
+
+		if self.spill and self.spill.since < since
+		then
+			since = self.spill.since
+		end
+
+		-- a second of slack for events still in the kernel
+		-- and the second granularity of modification times
+		since = since - 1
+
+		if self.recovery and self.recovery.since < since
+		then
+			since = self.recovery.since
+		end
+
+		return since
+	end
+
+	--
+	-- Adds and returns a blanket delay thats blocks all.
+	-- Used as startup marker to call init asap.
+	--
+	local function addInitDelay
+	(
+		self
+	)
+		local newd = Delay.new( 'Init', self, true, '' )
+
+		pushDelay( self, newd )
+
+		return newd
+	end
+
+	--
+	-- Writes a status report about delays in this sync.
+	--
+	local function statusReport
+	(
+		self,
+		f
+	)
+		local spaces = '                    '
+
+		f:write( self.config.name, ' source=', self.source, '\n' )
+
+		f:write( 'There are ', self.delays:size( ), ' delays\n')
+
+		if self.spill
+		then
+			f:write(
+				'Spilled to disk are ', self.spill.count, ' events, ',
+				self.spill.bytes - self.spill.readPos, ' bytes\n'
+			)
+		end
+
+		if self.recovery
+		then
+			local r = self.recovery
+
+			f:write(
+				'Overflow recovery running for ', now( ) - r.started,
+				' seconds, ', r.dirs, ' directories with ', r.bytes,
+				' bytes rescanned\n'
+			)
+		elseif self.lastRecovery
+		then
+			local r = self.lastRecovery
+
+			f:write(
+				'Last overflow recovery took ', r.took,
+				' seconds, ', r.dirs, ' directories with ', r.bytes,
+				' bytes rescanned\n'
+			)
+		end
+
+		for i, vd in self.delays:qpairs( )
+		do
+			local st = vd.status
+
+			f:write( st, string.sub( spaces, 1, 7 - #st ) )
+			f:write( vd.etype, ' ' )
+			f:write( vd.path )
+
+			if vd.path2
+			then
+				f:write( ' -> ',vd.path2 )
+			end
+
+			f:write('\n')
+
+		end
+
+		f:write( 'Filtering:\n' )
+
+		local nothing = true
+
+		if self.filters
+		then
+			for _, e in pairs( self.filters.list )
+			do
+				nothing = false
+
+				f:write( e.rule, ' ', e.pattern,'\n' )
+			end
+		end
+
+		if #self.excludes.list > 0
+		then
+			f:write( 'From excludes:\n' )
+
+			for t, p in pairs( self.excludes.list )
+			do
+				nothing = false
+
+				f:write( '- ', t,'\n' )
+			end
+		end
+
+		if nothing
+		then
+			f:write('  nothing.\n')
+		end
+
+		f:write( '\n' )
+	end
+
+	--
+	-- Returns a debug string describing the Sync
+	--
+	local function debug
+	(
+		self
+	)
+		local rv = "<Sync "..self.config.name.." delays:"..self.delays:size( ).."> "
+		return rv
+	end
+	--
+	-- Returns substitude data for event
+	--
+	local function getSubstitutionData(self, event, data)
+		if self.config.tunnel then
+			data = self.config.tunnel:getSubstitutionData(event, data)
+		end
+		return data
+	end
+
+	--
+	-- Creates a new Sync.
+	--
+	local function new
+	(
+		config
+	)
+		local s =
+		{
+			-- fields
+			config = config,
+			delays = Queue.new( ),
+			delayIndex = DelayIndex.new( ),
+			alarms = Heap.new( alarmBefore ),
+			ready = { },
+			listed = { },
+			readyStale = 0,
+			source = config.source,
+			processes = CountArray.new( ),
+			excludes = Excludes.new( ),
+			filters = nil,
+			filterRound = 0,
+			initDone = false,
+			recovery = nil,
+			lastRecovery = nil,
+			spill = nil,
+			journal = nil,
+			treeIndex = nil,
+			current = nil,
+			uncollapsed = setmetatable( { }, { __mode = 'k' } ),
+			disabled = false,
+			tunnelBlock = nil,
+			cron = nil,
+			nextCronAlarm = false,
+
+			-- functions
+			activateDelay   = activateDelay,
+			addBlanketDelay = addBlanketDelay,
+			addFullDelay    = addFullDelay,
+			addExclude      = addExclude,
+			addInitDelay    = addInitDelay,
+			appendFilter    = appendFilter,
+			collect         = collect,
+			concerns        = concerns,
+			delay           = event,
+			debug           = debug,
+			dirVerdict      = dirVerdict,
+			getAlarm        = getAlarm,
+			getDelays       = getDelays,
+			getNextDelay    = getNextDelay,
+			invokeActions   = invokeActions,
+			recover         = recover,
+			recoverySince   = recoverySince,
+			removeDelay     = removeDelay,
+			replay          = replay,
+			rmExclude       = rmExclude,
+			setFilters      = setFilters,
+			statusReport    = statusReport,
+			testFilter      = testFilter,
+			waitDelay       = waitDelay,
+			getSubstitutionData = getSubstitutionData,
+		}
+
+		s.inlet = InletFactory.newInlet( s )
+
+		-- provides a default name if needed
+		if not config.name
+		then
+			config.name = 'Sync' .. nextDefaultName
+		end
+
+		-- increments defaults if a config name was given or not
+		-- so Sync{n} will be the n-th call to sync{}
+		nextDefaultName = nextDefaultName + 1
+
+		-- loads filters
+		if config.filter
+		then
+			local te = type( config.filter )
+
+			s.filters = Filters.new( )
+
+			if te == 'table'
+			then
+				s.filters:appendList( config.filter )
+			elseif te == 'string'
+			then
+				s.filters:append( config.filter )
+			else
+				error( 'type for filter must be table or string', 2 )
+			end
+
+		end
+
+		-- loads exclusions
+		if config.exclude
+		then
+			local te = type( config.exclude )
+
+			if te == 'table'
+			then
+				s.excludes:addList( config.exclude )
+			elseif te == 'string'
+			then
+				s.excludes:add( config.exclude )
+			else
+				error( 'type for exclude must be table or string', 2 )
+			end
+
+		end
+
+		if config.delay ~= nil
+		and ( type( config.delay ) ~= 'number' or config.delay < 0 )
+		then
+			error( 'delay must be a number and >= 0', 2 )
+		end
+
+		if config.filterFrom
+		then
+			if not s.filters then s.filters = Filters.new( ) end
+
+			s.filters:loadFile( config.filterFrom )
+		end
+
+		if config.excludeFrom
+		then
+			s.excludes:loadFile( config.excludeFrom )
+		end
+
+		if config.crontab and loadCrontab() == false then
+			error("Sync ".. config.name.." uses a crontab, but lua-crontab dependency is not available", 0)
+		elseif config.crontab then
+			local cdata = {}
+			for i, v in ipairs( config.crontab ) do
+				local ok, cd = pcall(crontab.make_raw_cron_data_from_string, v)
+				if ok then
+					local props = crontab.make_cron_properties(cd)
+					local getter = crontab.make_next_occurrence_getter(props)
+
+					table.insert( cdata, getter )
+				else
+					error("Sync: "..config.name.." - crontab rule ".. i .." is not valid: ".. cd.. " . Rule: ".. v, 0)
+				end
+
+			end
+			-- local ok, cron = pcall(crontab.make_crontab, cdata)
+			if #cdata then
+				s.cron = cdata
+			else
+				error("Can't parse crontab data: "..cdata, 0)
+			end
+		end
+
+		return s
+	end
+
+	--
+	-- Public interface
+	--
+	return { new = new }
+end )( )
+
+--
+-- Writes functions for the user for layer 3 configurations.
+--
+local functionWriter = ( function( )
+
+	--
+	-- All variables known to layer 3 configs.
+	--
+	local transVars = {
+		{ '%^pathname',          'event.pathname',        1 },
+		{ '%^pathdir',           'event.pathdir',         1 },
+		{ '%^path',              'event.path',            1 },
+		{ '%^sourcePathname',    'event.sourcePathname',  1 },
+		{ '%^sourcePathdir',     'event.sourcePathdir',   1 },
+		{ '%^sourcePath',        'event.sourcePath',      1 },
+		{ '%^source',            'event.source',          1 },
+		{ '%^targetPathname',    'event.targetPathname',  1 },
+		{ '%^targetPathdir',     'event.targetPathdir',   1 },
+		{ '%^targetPath',        'event.targetPath',      1 },
+		{ '%^target',            'event.target',          1 },
+		{ '%^o%.pathname',       'event.pathname',        1 },
+		{ '%^o%.path',           'event.path',            1 },
+		{ '%^o%.sourcePathname', 'event.sourcePathname',  1 },
+		{ '%^o%.sourcePathdir',  'event.sourcePathdir',   1 },
+		{ '%^o%.sourcePath',     'event.sourcePath',      1 },
+		{ '%^o%.targetPathname', 'event.targetPathname',  1 },
+		{ '%^o%.targetPathdir',  'event.targetPathdir',   1 },
+		{ '%^o%.targetPath',     'event.targetPath',      1 },
+		{ '%^d%.pathname',       'event2.pathname',       2 },
+		{ '%^d%.path',           'event2.path',           2 },
+		{ '%^d%.sourcePathname', 'event2.sourcePathname', 2 },
+		{ '%^d%.sourcePathdir',  'event2.sourcePathdir',  2 },
+		{ '%^d%.sourcePath',     'event2.sourcePath',     2 },
+		{ '%^d%.targetPathname', 'event2.targetPathname', 2 },
+		{ '%^d%.targetPathdir',  'event2.targetPathdir',  2 },
+		{ '%^d%.targetPath',     'event2.targetPath',     2 },
+	}
+
+	--
+	-- Splits a user string into its arguments.
+	-- Returns a table of arguments
+	--
+	local function splitStr(
+		str -- a string where parameters are seperated by spaces.
+	)
+		local args = { }
+
+		while str ~= ''
+		do
+			-- break where argument stops
+			local bp = #str
+
+			-- in a quote
+			local inQuote = false
+
+			-- tests characters to be space and not within quotes
+			for i = 1, #str
+			do
+				local c = string.sub( str, i, i )
+
+				if c == '"'
+				then
+					inQuote = not inQuote
+				elseif c == ' ' and not inQuote
+				then
+					bp = i - 1
+
+					break
+				end
+			end
+
+			local arg = string.sub( str, 1, bp )
+			arg = string.gsub( arg, '"', '\\"' )
+			table.insert( args, arg )
+			str = string.sub( str, bp + 1, -1 )
+			str = string.match( str, '^%s*(.-)%s*$' )
+
+		end
+
+		return args
+	end
+
+
+	--
+	-- Translates a call to a binary to a lua function.
+	-- TODO this has a little too blocking.
+	--
+	local function translateBinary
+	(
+		str
+	)
+		-- splits the string
+		local args = splitStr( str )
+
+		-- true if there is a second event
+		local haveEvent2 = false
+
+		for ia, iv in ipairs( args )
+		do
+			-- a list of arguments this arg is being split into
+			local a = { { true, iv } }
+
+			-- goes through all translates
+			for _, v in ipairs( transVars )
+			do
+				local ai = 1
+				while ai <= #a
+				do
+					if a[ ai ][ 1 ]
+					then
+						local pre, post =
+							string.match( a[ ai ][ 2 ], '(.*)'..v[1]..'(.*)' )
+
+						if pre
+						then
+							if v[3] > 1
+							then
+								haveEvent2 = true
+							end
+
+							if pre ~= ''
+							then
+								table.insert( a, ai, { true, pre } )
+								ai = ai + 1
+							end
+
+							a[ ai ] = { false, v[ 2 ] }
+
+							if post ~= ''
+							then
+								table.insert( a, ai + 1, { true, post } )
+							end
+						end
+					end
+					ai = ai + 1
+				end
+			end
+
+			-- concats the argument pieces into a string.
+			local as = ''
+			local first = true
+
+			for _, v in ipairs( a )
+			do
+				if not first then as = as..' .. ' end
+
+				if v[ 1 ]
+				then
+					as = as .. '"' .. v[ 2 ] .. '"'
+				else
+					as = as .. v[ 2 ]
+				end
+
+				first = false
+			end
+
+			args[ ia ] = as
+		end
+
+		local ft
+
+		if not haveEvent2
+		then
+			ft = 'function( event )\n'
+		else
+			ft = 'function( event, event2 )\n'
+		end
+
+		ft = ft ..
+			"    log('Normal', 'Event ', event.etype, \n" ..
+			"        ' spawns action \"".. str.."\"')\n" ..
+			"    spawn( event"
+
+		for _, v in ipairs( args )
+		do
+			ft = ft .. ',\n         ' .. v
+		end
+
+		ft = ft .. ')\nend'
+		return ft
+
+	end
+
+
+	--
+	-- Translates a call using a shell to a lua function
+	--
+	local function translateShell
+	(
+		str
+	)
+		local argn = 1
+
+		local args = { }
+
+		local cmd = str
+
+		local lc = str
+
+		-- true if there is a second event
+		local haveEvent2 = false
+
+		for _, v in ipairs( transVars )
+		do
+			local occur = false
+
+			cmd = string.gsub(
+				cmd,
+				v[ 1 ],
+				function
+				( )
+					occur = true
+					return '"$' .. argn .. '"'
+				end
+			)
+
+			lc = string.gsub( lc, v[1], ']]..' .. v[2] .. '..[[' )
+
+			if occur
+			then
+				argn = argn + 1
+
+				table.insert( args, v[ 2 ] )
+
+				if v[ 3 ] > 1
+				then
+					haveEvent2 = true
+				end
+			end
+
+		end
+
+		local ft
+
+		if not haveEvent2
+		then
+			ft = 'function( event )\n'
+		else
+			ft = 'function( event, event2 )\n'
+		end
+
+		-- TODO do array joining instead
+		ft = ft..
+			"    log('Normal', 'Event ',event.etype,\n"..
+			"        [[ spawns shell \""..lc.."\"]])\n"..
+			"    spawnShell(event, [["..cmd.."]]"
+
+		for _, v in ipairs( args )
+		do
+			ft = ft..',\n         '..v
+		end
+
+		ft = ft .. ')\nend'
+
+		return ft
+
+	end
+
+	--
+	-- Writes a lua function for a layer 3 user script.
+	--
+	local function translate
+	(
+		str
+	)
+		-- trims spaces
+		str = string.match( str, '^%s*(.-)%s*$' )
+
+		local ft
+
+		if string.byte( str, 1, 1 ) == 47
+		then
+			-- starts with /
+			 ft = translateBinary( str )
+		elseif string.byte( str, 1, 1 ) == 94
+		then
+			-- starts with ^
+			 ft = translateShell( str:sub( 2, -1 ) )
+		else
+			 ft = translateShell( str )
+		end
+
+		log( 'FWrite', 'translated "', str, '" to \n', ft )
+
+		return ft
+	end
+
+
+	--
+	-- Public interface.
+	--
+	return {
+		translate = translate,
+		splitStr = splitStr
+	}
+
+end )( )
+
+
+
+--
+-- Basic Tunnel provider.
+--
+Tunnel = (function()
+
+	Tunnel = {}
+
+	local TUNNEL_CMD_TYPES = {
+		CMD = 1,
+		CHK = 2
+	}
+
+	local TUNNEL_STATUS = {
+		UNKNOWN = 0,
+		DOWN = 1,
+		DISABLED = 2,
+		CONNECTING = 3,
+		UP = 4,
+		RETRY_TIMEOUT = 5,
+		UP_RETRY_TIMEOUT = 6,
+	}
+
+	local TUNNEL_MODES = {
+		COMMAND = "command",
+		POOL = "pool",
+	}
+
+	local TUNNEL_DISTRIBUTION = {
+		ROUNDROBIN = "rr",
+	}
+
+	local TUNNEL_SUBSTITIONS = {
+		"localhost",
+		"localport"
+	}
+
+	local nextTunnelName = 1
+
+	Tunnel.defaults = {
+		mode = TUNNEL_MODES.COMMAND,
+		parallel = 1,
+		distribution = TUNNEL_DISTRIBUTION.ROUNDROBIN,
+		command = nil,
+		checkCommand = nil,
+		checkExitCodes = {0},
+		checkMaxFailed = 5,
+		retryDelay = 10,
+		readyDelay = 5,
+		localhost = 'localhost',
+	}
+	-- export constants
+	Tunnel.TUNNEL_CMD_TYPES = TUNNEL_CMD_TYPES
+	Tunnel.TUNNEL_STATUS = TUNNEL_STATUS
+	Tunnel.TUNNEL_MODES = TUNNEL_MODES
+	Tunnel.TUNNEL_DISTRIBUTION = TUNNEL_DISTRIBUTION
+	Tunnel.TUNNEL_SUBSTITIONS = TUNNEL_SUBSTITIONS
+
+	function Tunnel.new(
+		options
+	)
+		local rv = {
+			processes = CountArray.new( ),
+			blocks = {},
+			ready = false,
+			retryCount = 0,
+			status = TUNNEL_STATUS.DOWN,
+			alarm = true,
+			rrCounter = 0,
+		}
+		-- provides a default name if needed
+		if options.name == nil
+		then
+			options.name = 'Tunnel' .. nextTunnelName
+		end
+
+		nextTunnelName = nextTunnelName + 1
+
+		inherit(options, Tunnel.defaults)
+
+		rv.options = options
+
+		inherit(rv, Tunnel)
+
+		--setmetatable(rv, Tunnel)
+		-- self.__index = self
+
+		return rv
+	end
+
+	function Tunnel.statusToText(status)
+		for n, i in pairs(TUNNEL_STATUS) do
+			if status == i then
+				return n
+			end
+		end
+		return TUNNEL_STATUS.UNKNOWN
+	end
+
+	-- Returns the status of tunnel as text
+	function Tunnel:statusText()
+		return Tunnel.statusToText(self.status)
+	end
+
+	--
+	-- Returns next alarm
+	--
+	function Tunnel:getAlarm()
+		return self.alarm
+	end
+
+	--
+	-- User supplied function to check if tunnel is up
+	function Tunnel:check()
+		return true
+	end
+
+	function Tunnel:isReady()
+		return self.status == TUNNEL_STATUS.UP or
+			   self.status == TUNNEL_STATUS.UP_RETRY_TIMEOUT
+	end
+
+	function Tunnel:setStatus(status)
+		log('Tunnel',self.options.name,': status change: ',
+			self:statusText(), " -> ", Tunnel.statusToText(status))
+		self.status = status
+	end
+
+	--
+	-- Returns the number of processes currently running
+	--
+	function Tunnel:countProcs(timestamp)
+		local run = 0
+		local starting = 0
+		local dead = 0
+		if timestamp == nil then
+			timestamp = now()
+		end
+
+		for pid, pd in self.processes:walk() do
+			if pd.type == TUNNEL_CMD_TYPES.CMD then
+				-- process needs to run for at least some time
+				if lsyncd.kill(pid, 0) ~= 0 then
+					dead = dead + 1
+				elseif (pd.started + self.options.readyDelay) > timestamp then
+					starting = starting + 1
+				else
+					pd.ready = true
+					run = run + 1
+				end
+			end
+		end
+
+		return run, starting, dead
+	end
+
+	--
+	-- Check if the tunnel is up
+	function Tunnel:invoke(timestamp)
+		-- lsyncd.kill()
+		if self:check() == false then
+			-- check failed, consider tunnel broken
+			self:setStatus(TUNNEL_STATUS.DOWN)
+		end
+
+		if self.status == TUNNEL_STATUS.RETRY_TIMEOUT then
+			if self.alarm <= timestamp then
+				log(
+					'Tunnel',
+					'Retry setup ', self.options.name
+				)
+				self:start()
+				return
+			else
+				-- timeout not yet reached
+				self.alarm = now() + 1
+				return
+			end
+		elseif self.status == TUNNEL_STATUS.DOWN then
+			self:start()
+			return
+		elseif self.status == TUNNEL_STATUS.DISABLED then
+			self.alarm = false
+			return
+		end
+
+		local parallel = self.options.parallel
+		local run, starting, dead = self:countProcs(timestamp)
+
+		-- check if enough child processes are running
+		if self.status == TUNNEL_STATUS.CONNECTING then
+			if run > 0 then
+				log(
+					'Tunnel',
+					'Setup of tunnel ', self.options.name, ' sucessfull'
+				)
+				self:setStatus(TUNNEL_STATUS.UP)
+				self:unblockSyncs()
+			end
+		elseif self.status == TUNNEL_STATUS.UP and run == 0 then
+			-- no good process running, degrade
+			log(
+				'Tunnel',
+				'Tunnel ', self.options.name, ' changed to CONNECTING'
+			)
+			self:setStatus(TUNNEL_STATUS.CONNECTING)
+		end
+
+		local spawned = 0
+		-- start more processes if necesarry
+		while run + starting + spawned  < self.options.parallel do
+			self:spawn()
+			spawned = spawned + 1
+		end
+
+		-- trigger next delay
+		if starting + spawned == 0 then
+			self.alarm = false
+		else
+			self.alarm = now() + 1
+		end
+	end
+
+	--
+	-- Check if Sync is already blocked by Tunnel
+	function Tunnel:getBlockerForSync(
+		sync
+	)
+		for _, eblock in ipairs(self.blocks) do
+			if eblock.sync == sync then
+				return eblock
+			end
+		end
+		return nil
+	end
+
+	--
+	-- Create a block on the sync until the tunnel reaches ready state
+	function Tunnel:blockSync(
+		sync
+	)
+		local block = self:getBlockerForSync(sync)
+
+		if block then
+			-- delay the block by another second
+			sync:waitDelay( block, now( ) + 1 )
+			return
+		end
+
+		local block = sync:addBlanketDelay()
+		sync.tunnelBlock = block
+
+		table.insert (self.blocks, block)
+		-- set the new delay to be a block for existing delays
+		for _, eblock in sync.delays:qpairs() do
+			if eblock ~= block then
+				eblock:blockedBy(block)
+			end
+		end
+		-- delay tunnel check by 1 second
+		sync:waitDelay( block, now( ) + 1 )
+	end
+
+	--
+	-- Create a block on the sync until the tunnel reaches ready state
+	function Tunnel:unblockSyncs()
+		for i,blk in ipairs(self.blocks) do
+			blk.sync:removeDelay(blk)
+			blk.sync.tunnelBlock = nil
+		end
+		self.blocks = {}
+	end
+
+	--
+	-- Spawn a single tunnel program
+	--
+	function Tunnel:spawn()
+		local opts = {
+			type = TUNNEL_CMD_TYPES.CMD,
+			started = now(),
+			localhost = self.options.localhost,
+			ready = false,
+		}
+		local cmd = self.options.command
+
+		if self.options.mode == TUNNEL_MODES.POOL then
+			opts.localport = lsyncd.get_free_port()
+		end
+		if type(cmd) == "string" then
+			cmd = functionWriter.splitStr(cmd)
+		end
+		cmd = substitudeCommands(cmd, opts)
+
+		if #cmd < 1 then
+			log('Error',
+			'',
+			self.options
+			)
+			error( 'start tunnel of mode command with empty command', 2 )
+			-- FIXME: add line which tunnel was called
+			return false
+		end
+		local bin = cmd[1]
+		-- for _,v in ipairs(cmd) do
+		-- 	if type( v ) ~= 'string' then
+		-- 		error( 'tunnel command must be a list of strings', 2 )
+		-- 	end
+		-- end
+		log(
+			'Info',
+			'Start tunnel command ',
+			cmd
+		)
+		--- @diagnostic disable-next-line: param-type-mismatch
+		local pid = lsyncd.exec(bin, table.unpack(cmd, 2))
+		--local pid = spawn(bin, table.unpack(self.options.command, 2))
+		if pid and pid > 0 then
+			lsyncd.own_process(pid, self)
+			self.processes[pid] = opts
+			self.retryCount = 0
+			self.alarm = now() + 1
+		else
+			self.alarm = now() + self.options.retryDelay
+			if self.status == TUNNEL_STATUS.UP then
+				self:setStatus(TUNNEL_STATUS.UP_RETRY_TIMEOUT)
+			else
+				self:setStatus(TUNNEL_STATUS.RETRY_TIMEOUT)
+			end
+		end
+	end
+
+	function Tunnel:start()
+		if self.status == TUNNEL_STATUS.UP or
+		   self.status == TUNNEL_STATUS.CONNECTING then
+			return
+		end
+
+		if self.options.mode == TUNNEL_MODES.COMMAND or
+		   self.options.mode == TUNNEL_MODES.POOL then
+
+			self:setStatus(TUNNEL_STATUS.CONNECTING)
+			self:invoke(now())
+		else
+			error('unknown tunnel mode:' .. self.options.mode)
+			self:setStatus(TUNNEL_STATUS.DISABLED)
+		end
+	end
+
+	--
+	-- collect pids of exited child processes. Restart the tunnel if necessary
+	---
+	function Tunnel:collect (
+		pid,
+		exitcode
+	)
+		local proc = self.processes[pid]
+
+		if proc == nil then
+			return false
+		end
+		log('Debug',
+			"collect tunnel event. pid: ", pid," exitcode: ", exitcode)
+		local run, starting, dead = self:countProcs()
+		-- cases in which the tunnel command is handled
+		if proc.type == TUNNEL_CMD_TYPES.CMD then
+			if self.status == TUNNEL_STATUS.CONNECTING then
+				log(
+					'Warning',
+					'Starting tunnel failed.',
+					self.options.name
+				)
+				self:setStatus(TUNNEL_STATUS.RETRY_TIMEOUT)
+				self.alarm = now() + self.options.retryDelay
+			else
+				log(
+						'Info',
+						'Tunnel died. Will Restarting',
+						self.options.name
+				)
+
+				if run == 0 then
+					self:setStatus(TUNNEL_STATUS.DOWN)
+				end
+				self.alarm = true
+			end
+		-- cases in which the check function has executed a program
+		elseif proc.type == TUNNEL_CMD_TYPES.CHK then
+			local good = false
+			if type(self.options.checkExitCodes) == 'table' then
+
+				for _,i in ipairs(self.options.checkExitCodes) do
+					if exitcode == i then
+						good = true
+					end
+				end
+			else
+				if self.options.checkExitCodes == exitcode then
+					good = true
+				end
+			end
+			if good then
+				if self:isReady() == false then
+					log(
+					'Info',
+					self.options.name,
+					' Tunnel setup complete '
+					)
+				end
+				self:setStatus(TUNNEL_STATUS.UP)
+				self.checksFailed = 0
+			else
+				if self.ready  then
+					log(
+					'Tunnel',
+					self.options.name
+					' Check failed.'
+					)
+					self.checksFailed = self.checksFailed + 1
+					if self.checksFailed > self.options.checkMaxFailed then
+						self:kill()
+					end
+				end
+				self:setStatus(TUNNEL_STATUS.DOWN)
+			end
+		end
+		self.processes[pid] = nil
+	end
+
+	--
+	-- Stops all tunnel processes
+	--
+	function Tunnel:kill ()
+		log('Tunnel', 'Shutdown tunnel ', self.options.name)
+		for pid, pr in self.processes:walk() do
+			if pr.type == TUNNEL_CMD_TYPES.CMD then
+				log('Tunnel','Kill process ', pid)
+				lsyncd.kill(pid, 9)
+			end
+		end
+		self:setStatus(TUNNEL_STATUS.DISABLED)
+	end
+
+	function Tunnel:isReady ()
+		return self.status == TUNNEL_STATUS.UP
+	end
+
+	--
+	-- Fills/changes the opts table with additional values
+	-- for the transfer to be started
+	--
+	function Tunnel:getSubstitutionData(event, opts)
+		local useProc, useProcLast = nil, nil
+		if self.options.mode == TUNNEL_MODES.POOL then
+			if self.options.distribution == TUNNEL_DISTRIBUTION.ROUNDROBIN then
+				local i = 0
+				for pid, proc in self.processes:walk() do
+					if proc.ready == true then
+						useProcLast = proc
+						if (i % self.processes:size()) == self.rrCounter then
+							useProc = proc
+							self.rrCounter = self.rrCounter + 1
+						end
+					end
+				end
+				if useProc == nil then
+					self.rrCounter = 0
+					useProc = useProcLast
+				end
+			else
+				log('Tunnel', 'Unknown distribution mode: ', self.options.distribution)
+				os.exit(1)
+			end
+		end
+		if useProc then
+			for k,v in pairs(self.TUNNEL_SUBSTITIONS) do
+				if useProc[v] ~= nil then
+					opts[v] = useProc[v]
+				end
+			end
+		end
+		return opts
+	end
+
+	--
+	-- Writes a status report about this tunnel
+	--
+	function Tunnel:statusReport(f)
+		f:write( 'Tunnel: name=', self.options.name, ' status=', self:statusText(), '\n' )
+
+		f:write( 'Running processes: ', self.processes:size( ), '\n')
+
+		for pid, prc in self.processes:walk( )
+		do
+		    f:write("  pid=", pid, " type=", prc.type, " started="..prc.started, '\n')
+		end
+
+		f:write( '\n' )
+	end
+
+	return Tunnel
+
+end)() -- Tunnel scope
+
+--
+-- Tunnels - a singleton
+--
+-- Tunnels maintains all configured tunnels.
+--
+local Tunnels = ( function
+	( )
+		--
+		-- the list of all tunnels
+		--
+		local tunnelList = Array.new( )
+
+		--
+		-- Returns sync at listpos i
+		--
+		local function get
+		( i )
+			return tunnelList[ i ];
+		end
+
+		--
+		-- Adds a new tunnel.
+		--
+		local function add
+		(
+			tunnel
+		)
+			table.insert( tunnelList, tunnel )
+
+			return tunnel
+		end
+
+		--
+		-- Allows a for-loop to walk through all syncs.
+		--
+		local function iwalk
+		( )
+			return ipairs( tunnelList )
+		end
+
+		--
+		-- Returns the number of syncs.
+		--
+		local size = function
+		( )
+			return #tunnelList
+		end
+		--- @type any
+		local nextCycle = true
+		--
+		-- Cycle through all tunnels and call their invoke function
+		--
+		local function invoke(timestamp)
+			for _,tunnel in ipairs( tunnelList )
+			do
+				tunnel:invoke(timestamp)
+			end
+			if size() > 0 then
+				nextCycle = now() + 5
+			else
+				nextCycle = false
+			end
+		end
+
+		--
+		-- returns the next alarm
+		--
+		local function getAlarm()
+			local rv = nextCycle
+			for _, tunnel in ipairs( tunnelList ) do
+				local ta = tunnel:getAlarm()
+				if ta == true or (type(ta) == "userdata"
+				   and ta < rv) then
+					rv = ta
+				end
+			end
+
+			return rv
+		end
+
+		--
+		-- closes all tunnels
+		--
+		local function killAll()
+			local rv = true
+			for _, tunnel in ipairs( tunnelList ) do
+				local ta = tunnel:kill()
+				if ta ~= true then
+					rv = false
+				end
+			end
+
+			return rv
+		end
+
+		--
+		-- Public interface
+		--
+		return {
+			add = add,
+			get = get,
+			iwalk = iwalk,
+			size = size,
+			invoke = invoke,
+			getAlarm = getAlarm,
+			killAll = killAll
+		}
+	end )( )
+
+
+--
+-- create a new tunnel from the passed options and registers the tunnel
+--- @diagnostic disable-next-line: lowercase-global
+tunnel = function (options)
+	log(
+		'Debug',
+		'create tunnel:', options
+	)
+	local rv = Tunnel.new(options)
+	Tunnels.add(rv)
+
+	return rv
+
+end
+
+
+--
+-- Syncs - a singleton
+--
+-- Syncs maintains all configured syncs.
+--
+local Syncs = ( function
+( )
+	--
+	-- the list of all syncs
+	--
+	local syncsList = Array.new( )
+
+	--
+	-- The round robin pointer. In case of global limited maxProcesses
+	-- gives every sync equal chances to spawn the next process.
+	--
+	local round = 1
+
+	--
+	-- The cycle( ) sheduler goes into the next round of roundrobin.
+	--
+	local function nextRound
+	( )
+		round = round + 1;
+
+		if round > #syncsList
+		then
+			round = 1
+		end
+
+		return round
+	end
+
+	--
+	-- Returns the round
+	--
+	local function getRound
+	( )
+		return round
+	end
+
+	--
+	-- Returns sync at listpos i
+	--
+	local function get
+	( i )
+		return syncsList[ i ];
+	end
+
+
+	--
+	-- Completes the config of a sync by its defaults and settings.
+	--
+	-- Returns the config or nil and what is wrong with it.
+	--
+	local function prepare
+	(
+		uconfig,  -- the config as given by the user
+		level     -- the stack level of the user's sync{ } call
+	)
+		-- Creates a new config table which inherits all keys/values
+		-- from integer keyed tables
+		local config = { }
+
+		-- inherit the config but do not deep copy the tunnel object
+		-- the tunnel object is a reference to a object that might be shared
+		inherit( config, uconfig, nil, {"tunnel"} )
+
+		--
+		-- last and least defaults are inherited
+		--
+		inherit( config, default )
+
+		-- copy references
+		config.tunnel = uconfig.tunnel
+
+		local inheritSettings = {
+			'delay',
+			'maxDelays',
+			'maxProcesses'
+		}
+
+		-- Lets settings override these values.
+		for _, v in ipairs( inheritSettings )
+		do
+			if uSettings[ v ]
+			then
+				config[ v ] = uSettings[ v ]
+			end
+		end
+
+		-- Lets commandline override these values.
+		for _, v in ipairs( inheritSettings )
+		do
+			if clSettings[ v ]
+			then
+				config[ v ] = clSettings[ v ]
+			end
+		end
+
+		--
+		-- lets the userscript 'prepare' function
+		-- check and complete the config
+		--
+		if type( config.prepare ) == 'function'
+		then
+			-- prepare is given a writeable copy of config
+			config.prepare( config, level + 1 )
+		end
+
+		if not config[ 'source' ]
+		then
+			return nil, 'source missing from sync.'
+		end
+
+		--
+		-- absolute path of source
+		--
+		local realsrc = lsyncd.realdir( config.source )
+
+		if not realsrc
+		then
+			return nil, 'Cannot access source directory: ' .. config.source
+		end
+
+		config._source = config.source
+		config.source = realsrc
+
+		if not config.action
+		and not config.onAttrib
+		and not config.onCreate
+		and not config.onModify
+		and not config.onDelete
+		and not config.onMove
+		and not config.onFull
+		then
+			return nil, 'no actions specified.'
+		end
+
+		-- the monitor to use
+		config.monitor =
+			uSettings.monitor or
+			config.monitor or
+			Monitors.default( )
+
+		if config.monitor ~= 'inotify'
+		and config.monitor ~= 'fanotify'
+		and config.monitor ~= 'fsevents'
+		and config.monitor ~= 'poll'
+		then
+			return nil, 'event monitor "' .. config.monitor .. '" unknown.'
+		end
+
+		return config
+	end
+
+	--
+	-- Adds a sync created from a prepared config.
+	--
+	local function insert
+	(
+		s
+	)
+		table.insert( syncsList, s )
+	end
+
+	--
+	-- Adds a new sync.
+	--
+	local function add
+	(
+		config
+	)
+		-- Checks if user overwrote the settings function.
+		-- ( was Lsyncd <2.1 style )
+		if settings ~= settingsSafe
+		then
+			log(
+				'Error',
+				'Do not use settings = { ... }\n'..
+				'      please use settings{ ... } (without the equal sign)'
+			)
+
+			os.exit( -1 )
+		end
+
+		local uconfig = config
+
+		local err
+
+		config, err = prepare( uconfig, 4 )
+
+		if not config
+		then
+			local info = debug.getinfo( 3, 'Sl' )
+
+			log(
+				'Error',
+				info.short_src, ':',
+				info.currentline, ': ', err
+			)
+
+			terminate( -1 )
+		end
+
+		-- creates the new sync
+		local s = Sync.new( config )
+
+		insert( s )
+
+		return s
+	end
+
+	--
+	-- Removes a sync.
+	--
+	-- Its processes running are still collected by their owner.
+	--
+	local function remove
+	(
+		s
+	)
+		for i, v in ipairs( syncsList )
+		do
+			if v == s
+			then
+				table.remove( syncsList, i )
+
+				break
+			end
+		end
+
+		if round > #syncsList
+		then
+			round = 1
+		end
+	end
+
+	--
+	-- Allows a for-loop to walk through all syncs.
+	--
+	local function iwalk
+	( )
+		return ipairs( syncsList )
+	end
+
+	--
+	-- Returns the number of syncs.
+	--
+	local size = function
+	( )
+		return #syncsList
+	end
+
+	--
+	-- Tests if any sync is interested in a path.
+	--
+	local function concerns
+	(
+		path,     -- the absolute path
+		verdicts  -- if given, the verdicts per sync of the directory
+		--           holding path, see Sync.dirVerdict( )
+	)
+		for _, s in ipairs( syncsList )
+		do
+			if s:concerns( path, verdicts and verdicts[ s ] )
+			then
+				return true
+			end
+		end
+
+		return false
+	end
+
+	--
+	-- Public interface
+	--
+	return {
+		add = add,
+		get = get,
+		getRound = getRound,
+		concerns = concerns,
+		insert = insert,
+		iwalk = iwalk,
+		nextRound = nextRound,
+		prepare = prepare,
+		remove = remove,
+		size = size
+	}
+end )( )
+
+
+--
+-- Utility function,
+-- Returns the relative part of absolute path if it
+-- begins with root
+--
+local function splitPath
+(
+	path,
+	root
+)
+	local rlen = #root
+
+	local sp = string.sub( path, 1, rlen )
+
+	if sp == root
+	then
+		return string.sub( path, rlen, -1 )
+	else
+		return nil
+	end
+end
+
+local function splitQuotedString
+    (
+        text
+    )
+    local spat, epat, buf, quoted = [=[^(['"])]=], [=[(['"])$]=], nil, nil
+    local rv = {}
+    for str in text:gmatch("%S+") do
+        local squoted = str:match(spat)
+        local equoted = str:match(epat)
+        local escaped = str:match([=[(\*)['"]$]=])
+        if squoted and not quoted and not equoted then
+            buf, quoted = str, squoted
+        elseif buf and equoted == quoted and #escaped % 2 == 0 then
+            str, buf, quoted = buf .. ' ' .. str, nil, nil
+        elseif buf then
+            buf = buf .. ' ' .. str
+        end
+        if not buf
+        then
+            table.insert(rv, (str:gsub(spat,""):gsub(epat,"")))
+        end
+    end
+    if buf
+    then
+        print("Missing matching quote for "..buf)
+    end
+    return rv
+end
+
+lsyncd.splitQuotedString = splitQuotedString
+
+--- @diagnostic disable-next-line: lowercase-global
+function substitudeCommands(cmd, data)
+	assert(type(data) == "table")
+
+	if type(cmd) == "string" then
+		local rv = cmd
+		for key,value in pairs(data) do
+			local getData = function()
+				return tostring(value)
+			end
+			rv = string.gsub(rv, "%^("..key..")", getData)
+		end
+		return rv
+	elseif type(cmd) == "table" then
+		local rv = {}
+		for i, v in ipairs(cmd) do
+			rv[i] = v
+			for key, value in pairs(data) do
+				local getData = function()
+					return tostring(value)
+				end
+				rv[i] = string.gsub(rv[i], "%^("..key..")", getData)
+			end
+		end
+		return rv
+	else
+		log("Error", "Unsupported type in substitudeCommands")
+	end
+end
+
+--
+-- Interface to inotify.
+--
+-- watches recursively subdirs and sends events.
+--
+-- All inotify specific implementation is enclosed here.
+--
+local Inotify = ( function
+( )
+	--
+	-- A list indexed by inotify watch descriptors yielding
+	-- the directories absolute paths.
+	--
+	local wdpaths = CountArray.new( )
+
+	--
+	-- The same vice versa,
+	-- all watch descriptors by their absolute paths.
+	--
+	local pathwds = { }
+
+	--
+	-- A list indexed by syncs containing yielding
+	-- the root paths the syncs are interested in.
+	--
+	local syncRoots = { }
+
+	--
+	-- The same for the syncs of monitors marking whole
+	-- filesystems instead of watching directories, like fanotify.
+	--
+	-- Their events come without a watch descriptor
+	-- and with absolute paths as file names.
+	--
+	local markRoots = { }
+
+	--
+	-- The verdicts of the syncs for the paths within the
+	-- watched directories, see Sync.dirVerdict( ).
+	--
+	-- Indexed by absolute path yielding a table indexed by sync.
+	--
+	local pathverdicts = { }
+
+	--
+	-- The filter round of each sync its cached verdicts are from.
+	--
+	local verdictRounds = { }
+
+	--
+	-- Returns the verdicts per sync for the paths within
+	-- the watched directory 'path'.
+	--
+	local function dirVerdicts
+	(
+		path  -- absolute path of a watched directory
+	)
+		local verdicts = pathverdicts[ path ]
+
+		if not verdicts
+		then
+			verdicts = { }
+
+			pathverdicts[ path ] = verdicts
+		end
+
+		local dir = path:match( '^(.*/)[^/]+/$' )
+
+		for sync, root in pairs( syncRoots )
+		do
+			if verdictRounds[ sync ] ~= sync.filterRound
+			then
+				-- the excludes or filters of the sync changed
+				for _, v in pairs( pathverdicts )
+				do
+					v[ sync ] = nil
+				end
+
+				verdictRounds[ sync ] = sync.filterRound
+			end
+
+			if not verdicts[ sync ]
+			then
+				local relative = splitPath( path, root )
+
+				local parent = dir and pathverdicts[ dir ]
+
+				if relative
+				then
+					verdicts[ sync ] =
+						sync:dirVerdict( relative, parent and parent[ sync ] )
+				else
+					verdicts[ sync ] = 'mixed'
+				end
+			end
+		end
+
+		return verdicts
+	end
+
+	--
+	-- Directories not watched since the user ran out of inotify
+	-- watches. These are polled for changes instead.
+	--
+	-- Indexed by absolute path yielding the snapshot of the directory:
+	--     mtime   -- modification time of the directory
+	--     at      -- wall clock time the snapshot was taken
+	--     entries -- by name the mtime of files, true for directories
+	--
+	local polled = { }
+
+	--
+	-- Number of polled directories.
+	--
+	local polledCount = 0
+
+	--
+	-- The polled directories in order they are visited,
+	-- with 'pollPos' the next one to visit.
+	--
+	local pollOrder = { }
+
+	local pollPos = 1
+
+	--
+	-- Time of the next polling round, false if nothing is polled.
+	--
+	local pollAlarm = false
+
+	--
+	-- Set when the user ran out of watches. From then on the
+	-- watched directories are kept in order of their last activity
+	-- in a list linked by 'newer' and 'older' so the least recently
+	-- active one gives up its watch to a polled directory turning active.
+	--
+	local budgeted = false
+
+	local newer = { }
+
+	local older = { }
+
+	local newest = nil
+
+	local oldest = nil
+
+	--
+	-- Removes a watched directory from the activity list.
+	--
+	local function unlink
+	(
+		path
+	)
+		if newest ~= path and not newer[ path ]
+		then
+			return
+		end
+
+		local n = newer[ path ]
+
+		local o = older[ path ]
+
+		if n then older[ n ] = o else newest = o end
+
+		if o then newer[ o ] = n else oldest = n end
+
+		newer[ path ] = nil
+
+		older[ path ] = nil
+	end
+
+	--
+	-- Marks a watched directory as the most recently active one.
+	--
+	local function touch
+	(
+		path
+	)
+		if not budgeted or not pathwds[ path ] or newest == path
+		then
+			return
+		end
+
+		unlink( path )
+
+		older[ path ] = newest
+
+		if newest then newer[ newest ] = path else oldest = path end
+
+		newest = path
+	end
+
+	--
+	-- Takes a snapshot of a directory to poll, nil if it is gone.
+	--
+	local function snapshot
+	(
+		path  -- absolute path of the directory
+	)
+		local mtime = lsyncd.get_mtime( path )
+
+		local entries = mtime and lsyncd.scandir( path, true )
+
+		if not entries
+		then
+			return nil
+		end
+
+		-- the modification times of the files in nanoseconds
+		local snap = { }
+
+		for _, e in ipairs( entries )
+		do
+			if e.type == 'directory'
+			then
+				snap[ e.name ] = true
+			else
+				snap[ e.name ] = e.mtime
+			end
+		end
+
+		return { mtime = mtime, at = os.time( ), entries = snap }
+	end
+
+	--
+	-- Starts to poll a directory.
+	--
+	local function poll
+	(
+		path,
+		snap
+	)
+		if not polled[ path ]
+		then
+			polledCount = polledCount + 1
+
+			pollOrder[ #pollOrder + 1 ] = path
+		end
+
+		polled[ path ] = snap
+
+		if not pollAlarm
+		then
+			pollAlarm = now( ) + 1
+		end
+	end
+
+	--
+	-- Stops to poll a directory.
+	--
+	local function unpoll
+	(
+		path
+	)
+		if polled[ path ]
+		then
+			polled[ path ] = nil
+
+			polledCount = polledCount - 1
+		end
+	end
+
+	--
+	-- Registers a watch descriptor for a directory.
+	--
+	local function watched
+	(
+		path,
+		wd
+	)
+		-- If this watch descriptor is registered already
+		-- the kernel reuses it since the old dir is gone.
+		local op = wdpaths[ wd ]
+
+		if op and op ~= path
+		then
+			pathwds[ op ] = nil
+
+			pathverdicts[ op ] = nil
+
+			unlink( op )
+		end
+
+		unpoll( path )
+
+		pathwds[ path ] = wd
+
+		wdpaths[ wd   ] = path
+
+		touch( path )
+	end
+
+	--
+	-- Called the first time the user ran out of watches.
+	--
+	local function startBudget
+	( )
+		budgeted = true
+
+		log(
+			'Normal',
+			'Out of inotify watches, polling the remaining directories. ',
+			'Consider increasing /proc/sys/fs/inotify/max_user_watches'
+		)
+
+		for path, _ in pairs( pathwds )
+		do
+			touch( path )
+		end
+	end
+
+	--
+	-- Moves the least recently active watched directory
+	-- to polling. Returns false if there is none.
+	--
+	local function demote
+	( )
+		local path = oldest
+
+		if not path
+		then
+			return false
+		end
+
+		local wd = pathwds[ path ]
+
+		-- snapshots first, so changes until the watch
+		-- is gone are either reported or in the snapshot
+		local snap = snapshot( path )
+
+		lsyncd.inotify.rmwatch( wd )
+
+		unlink( path )
+
+		wdpaths[ wd   ] = nil
+		pathwds[ path ] = nil
+
+		if snap
+		then
+			log( 'Inotify', 'polling inactive "', path, '"' )
+
+			poll( path, snap )
+		else
+			pathverdicts[ path ] = nil
+		end
+
+		return true
+	end
+
+	--
+	-- Moves a polled directory which turned active to a watch,
+	-- taking the watch from the least recently active directory
+	-- if need be. Returns true on success.
+	--
+	local function promote
+	(
+		path
+	)
+		local inotifyMode = ( uSettings and uSettings.inotifyMode ) or ''
+
+		local wd, full = lsyncd.inotify.addwatch( path, inotifyMode )
+
+		if full and demote( )
+		then
+			wd, full = lsyncd.inotify.addwatch( path, inotifyMode )
+		end
+
+		if wd < 0
+		then
+			return false
+		end
+
+		log( 'Inotify', 'watching active "', path, '"' )
+
+		unpoll( path )
+
+		watched( path, wd )
+
+		return true
+	end
+
+	--
+	-- Stops watching or polling a directory
+	--
+	local function removeWatch
+	(
+		path,  -- absolute path to unwatch
+		core   -- if false not actually send the unwatch to the kernel
+		--        ( used in moves which reuse the watch )
+	)
+		if polled[ path ]
+		then
+			unpoll( path )
+
+			pathverdicts[ path ] = nil
+
+			return
+		end
+
+		local wd = pathwds[ path ]
+
+		if not wd
+		then
+			return
+		end
+
+		if core
+		then
+			lsyncd.inotify.rmwatch( wd )
+		end
+
+		unlink( path )
+
+		wdpaths[ wd   ] = nil
+		pathwds[ path ] = nil
+
+		pathverdicts[ path ] = nil
+	end
+
+
+	--
+	-- Directories still to be walked for watches.
+	--
+	-- Large trees are walked a batch per turn of the masterloop,
+	-- so events of the directories watched already are handled
+	-- meanwhile. Each entry holds:
+	--     path   -- the directory to walk
+	--     parent -- the directory holding it, nil for a root
+	--     job    -- the setup the directory belongs to
+	--
+	-- A job counts its 'pending' entries and calls 'ready'
+	-- once all are walked.
+	--
+	local setupQueue = { }
+
+	local setupHead = 1
+
+	--
+	-- Number of directories walked by the setup so far.
+	--
+	local setupWalked = 0
+
+	--
+	-- Queues a directory to walk.
+	--
+	local function queueSetup
+	(
+		path,
+		parent,
+		job
+	)
+		setupQueue[ #setupQueue + 1 ] = { path = path, parent = parent, job = job }
+
+		job.pending = job.pending + 1
+	end
+
+	--
+	-- Adds watches for a directory including all subdirectories.
+	--
+	-- The core walks the tree by a pool of threads and tests the
+	-- directories against the excludes and filters of the syncs
+	-- the same way Syncs.concerns( ) does.
+	--
+	-- If a job is given the walk is limited to 'limit' directories
+	-- and 'time' seconds, the directories left are queued to the job.
+	--
+	-- Returns the number of directories walked.
+	--
+	local function addWatch
+	(
+		path,   -- absolute path of directory to observe
+		added,  -- if given, a list the newly watched paths are appended to
+		parent, -- if given, the watched directory holding path
+		job,    -- if given, the setup job to queue what is left to
+		limit,  -- the most directories to walk with a job
+		time    -- the most seconds to walk with a job
+	)
+		log( 'Function', 'Inotify.addWatch( ', path, ' )' )
+
+		local verdicts = parent and dirVerdicts( parent )
+
+		local syncs = { }
+
+		for _, s in Syncs.iwalk( )
+		do
+			syncs[ #syncs + 1 ] =
+			{
+				source = s.source,
+				excludes = s.excludes:getMatcher( ),
+				filters = s.filters and s.filters:getMatcher( ),
+				subdirs = s.config.subdirs ~= false,
+				verdict = verdicts and verdicts[ s ],
+			}
+		end
+
+		local inotifyMode = ( uSettings and uSettings.inotifyMode ) or ''
+
+		-- two entries per directory, its path and watch descriptor
+		local found, left
+
+		if job
+		then
+			found, left =
+				lsyncd.inotify.addtree( path, inotifyMode, syncs, limit, time )
+		else
+			found = lsyncd.inotify.addtree( path, inotifyMode, syncs )
+		end
+
+		for i = 1, #found, 2
+		do
+			local dir = found[ i ]
+
+			local wd = found[ i + 1 ]
+
+			if wd
+			then
+				watched( dir, wd )
+			else
+				-- out of watches, polls the directory instead
+				if not budgeted
+				then
+					startBudget( )
+				end
+
+				local snap = snapshot( dir )
+
+				if snap
+				then
+					poll( dir, snap )
+				end
+			end
+
+			if added
+			then
+				added[ #added + 1 ] = dir
+			end
+		end
+
+		if left
+		then
+			for _, dir in ipairs( left )
+			do
+				queueSetup( dir, dir:match( '^(.*/)[^/]+/$' ), job )
+			end
+		end
+
+		return #found / 2
+	end
+
+	--
+	-- Walks the next batch of the queued directories,
+	-- at most 'watchBatch' directories and 'watchBatchTime' seconds.
+	--
+	local function setupRound
+	( )
+		if setupHead > #setupQueue
+		then
+			return
+		end
+
+		local started = now( )
+
+		local left = uSettings.watchBatch
+
+		while left > 0 and setupHead <= #setupQueue
+		do
+			local time = uSettings.watchBatchTime - ( now( ) - started )
+
+			if time <= 0
+			then
+				break
+			end
+
+			local entry = setupQueue[ setupHead ]
+
+			setupQueue[ setupHead ] = nil
+
+			setupHead = setupHead + 1
+
+			local walked =
+				addWatch( entry.path, nil, entry.parent, entry.job, left, time )
+
+			left = left - walked
+
+			setupWalked = setupWalked + walked
+
+			local job = entry.job
+
+			job.pending = job.pending - 1
+
+			if job.pending == 0 and job.ready
+			then
+				job.ready( )
+
+				job.ready = nil
+			end
+		end
+
+		if setupHead > #setupQueue
+		then
+			setupQueue = { }
+
+			setupHead = 1
+
+			log( 'Normal', 'Watching ', wdpaths:size( ), ' directories.' )
+		end
+	end
+
+	--
+	-- Returns the absolute paths of all watched directories
+	-- modified since 'since' (wall clock seconds) or holding
+	-- an entry whose status changed since.
+	--
+	-- Writing a file in place leaves the modification time of
+	-- its directory alone, but not the status change time
+	-- of the file.
+	--
+	-- Subdirectories created while events were lost are
+	-- watched and returned as well.
+	--
+	local function changedDirs
+	(
+		since
+	)
+		local changed = { }
+
+		-- the status times of the entries are in nanoseconds
+		local sinceNs = since * 1000000000
+
+		for path, _ in pairs( pathwds )
+		do
+			local mtime = lsyncd.get_mtime( path )
+
+			local modified = mtime and mtime >= since
+
+			if mtime and not modified
+			then
+				for _, e in ipairs( lsyncd.scandir( path, true ) or { } )
+				do
+					if e.ctime >= sinceNs
+					then
+						modified = true
+
+						break
+					end
+				end
+			end
+
+			if modified
+			then
+				changed[ #changed + 1 ] = path
+			end
+		end
+
+		local dirs = { }
+
+		for _, path in ipairs( changed )
+		do
+			dirs[ #dirs + 1 ] = path
+
+			local entries = lsyncd.readdir( path )
+
+			if entries
+			then
+				for dirname, isdir in pairs( entries )
+				do
+					if isdir and not pathwds[ path .. dirname .. '/' ]
+					then
+						addWatch( path .. dirname .. '/', dirs, path )
+					end
+				end
+			end
+		end
+
+		return dirs
+	end
+
+	--
+	-- Adds a Sync to receive events.
+	--
+	local function addSync
+	(
+		sync,     -- object to receive events.
+		rootdir,  -- root dir to watch
+		ready     -- called once the whole tree is watched
+	)
+		if syncRoots[ sync ]
+		then
+			error( 'duplicate sync in Inotify.addSync()' )
+		end
+
+		syncRoots[ sync ] = rootdir
+
+		queueSetup( rootdir, nil, { pending = 0, ready = ready } )
+	end
+
+	--
+	-- Adds a Sync of a monitor marking whole filesystems.
+	--
+	local function addMarked
+	(
+		sync,    -- object to receive events
+		rootdir  -- root dir of the sync
+	)
+		markRoots[ sync ] = rootdir
+	end
+
+	--
+	-- Removes a Sync of a monitor marking whole filesystems.
+	--
+	local function removeMarked
+	(
+		sync
+	)
+		markRoots[ sync ] = nil
+	end
+
+	--
+	-- Removes a Sync, see prune( ) for the watches.
+	--
+	local function removeSync
+	(
+		sync
+	)
+		syncRoots[ sync ] = nil
+
+		verdictRounds[ sync ] = nil
+
+		for _, v in pairs( pathverdicts )
+		do
+			v[ sync ] = nil
+		end
+	end
+
+	--
+	-- Stops watching and polling the directories
+	-- no sync is interested in anymore.
+	--
+	local function prune
+	( )
+		local gone = { }
+
+		for path, _ in pairs( pathwds )
+		do
+			if not Syncs.concerns( path )
+			then
+				gone[ #gone + 1 ] = path
+			end
+		end
+
+		for path, _ in pairs( polled )
+		do
+			if not Syncs.concerns( path )
+			then
+				gone[ #gone + 1 ] = path
+			end
+		end
+
+		for _, path in ipairs( gone )
+		do
+			removeWatch( path, true )
+		end
+
+		if #gone > 0
+		then
+			log( 'Normal', 'Stopped watching ', #gone, ' directories.' )
+		end
+	end
+
+	--
+	-- Watches the trees of directories a Sync
+	-- became interested in.
+	--
+	local function rewatch
+	(
+		sync,  -- the sync its excludes or filters changed
+		dirs,  -- the relative directories newly included
+		ready  -- called once all of them are watched
+	)
+		local root = syncRoots[ sync ]
+
+		local job = { pending = 0, ready = ready }
+
+		for _, dir in ipairs( dirs )
+		do
+			local path = root .. dir:sub( 2 )
+
+			queueSetup( path, path:match( '^(.*/)[^/]+/$' ), job )
+		end
+
+		if job.pending == 0
+		then
+			ready( )
+		end
+	end
+
+	--
+	-- Hands an event on the absolute path(s) to the syncs.
+	--
+	-- Without a watched directory the event is from a monitor
+	-- marking whole filesystems and goes to the syncs of those.
+	--
+	local function dispatch
+	(
+		etype,  -- 'Attrib', 'Modify', 'Create', 'Delete', 'Move'
+		isdir,  -- true if path is a directory
+		time,   -- time of event
+		path,   -- absolute path
+		path2,  -- absolute path of Move target
+		dir,    -- the watched or polled directory holding path
+		dir2    -- the watched or polled directory holding path2
+	)
+		local roots = markRoots
+
+		if dir
+		then
+			roots = syncRoots
+
+			touch( dir )
+		end
+
+		if dir2
+		then
+			touch( dir2 )
+		end
+
+		-- the setup of a directory created or moved in
+		local job
+
+		-- the absolute path of that directory
+		local created = path2 or path
+
+		for sync, root in pairs( roots )
+		do repeat
+			local relative  = splitPath( path, root )
+
+			local relative2 = nil
+
+			if path2
+			then
+				relative2 = splitPath( path2, root )
+			end
+
+			if not relative and not relative2
+			then
+				-- sync is not interested in this dir
+				break -- continue
+			end
+
+			-- makes a copy of etype to possibly change it
+			local etyped = etype
+
+			-- the watched directory holding the relative path(s)
+			local vdir = dir
+
+			if etyped == 'Move'
+			then
+				if not relative2
+				then
+					log(
+						'Normal',
+						'Transformed Move to Delete for ',
+						sync.config.name
+					)
+
+					etyped = 'Delete'
+				elseif not relative
+				then
+					relative = relative2
+
+					relative2 = nil
+
+					vdir = dir2
+
+					log(
+						'Normal',
+						'Transformed Move to Create for ',
+						sync.config.name
+					)
+
+					etyped = 'Create'
+				end
+			end
+
+			-- events on the root itself
+			if relative == '/'
+			then
+				break -- continue
+			end
+
+			-- without watches on subdirs only
+			-- the entries of the root are seen
+			if sync.config.subdirs == false
+			and (
+				relative:match( '^/[^/]+/.' )
+				or ( relative2 and relative2:match( '^/[^/]+/.' ) )
+			)
+			then
+				break -- continue
+			end
+
+			-- a move between directories has no common verdict
+			local verdict
+
+			if vdir and ( relative2 == nil or dir == dir2 )
+			then
+				verdict = dirVerdicts( vdir )[ sync ]
+			end
+
+			if isdir and dir
+			then
+				if etyped == 'Delete'
+				then
+					removeWatch( path, true )
+				else
+					if etyped == 'Move'
+					then
+						removeWatch( path, false )
+					end
+
+					-- the tree is walked once for all syncs
+					if not job
+					then
+						job = { pending = 0, rescans = { } }
+
+						addWatch(
+							created, nil, path2 and dir2 or dir, job,
+							uSettings.watchBatch, uSettings.watchBatchTime
+						)
+					end
+
+					job.rescans[ sync ] = relative2 or relative
+				end
+			end
+
+			sync:delay( etyped, time, relative, relative2, verdict )
+
+		until true end
+
+		-- The directories of the tree left to the setup queue are
+		-- watched later, what is written into them meanwhile
+		-- is caught by transferring the whole tree once it is watched.
+		if job and job.pending > 0
+		then
+			job.ready = function
+			( )
+				for sync, relative in pairs( job.rescans )
+				do
+					if syncRoots[ sync ] and sync:concerns( created )
+					then
+						log( 'Inotify', 'Transferring ', created, ' now watched.' )
+
+						sync:addFullDelay( relative, true )
+					end
+				end
+			end
+		end
+	end
+
+	--
+	-- Called when an event has occured.
+	--
+	-- Monitors marking whole filesystems report events with
+	-- the watch descriptors 0 and absolute paths as file names,
+	-- nil for the side of a Move outside of all sync roots.
+	--
+	local function event
+	(
+		etype,     -- 'Attrib', 'Modify', 'Create', 'Delete', 'Move'
+		wd,        --  watch descriptor, matches lsyncd.inotifyadd()
+		isdir,     --  true if filename is a directory
+		time,      --  time of event
+		filename,  --  string filename without path
+		wd2,       --  watch descriptor for target if it's a Move
+		filename2  --  string filename without path of Move target
+	)
+		if isdir
+		then
+			if filename
+			then
+				filename = filename .. '/'
+			end
+
+			if filename2
+			then
+				filename2 = filename2 .. '/'
+			end
+		end
+
+		if filename2
+		then
+			log(
+				'Inotify',
+				'got event ',
+				etype,
+				' ',
+				filename,
+				'(', wd, ') to ',
+				filename2,
+				'(', wd2 ,')'
+			)
+		else
+			log(
+				'Inotify',
+				'got event ',
+				etype,
+				' ',
+				filename,
+				'(', wd, ')'
+			)
+		end
+
+		local dir, path, dir2, path2
+
+		if wd == 0
+		then
+			-- from a monitor marking whole filesystems
+			path = filename
+
+			path2 = filename2
+		else
+			-- looks up the watch descriptor id
+			dir = wdpaths[ wd ]
+
+			path = dir
+
+			if path
+			then
+				path = path..filename
+			end
+
+			dir2 = wd2 and wdpaths[ wd2 ]
+
+			path2 = dir2
+
+			if path2 and filename2
+			then
+				path2 = path2..filename2
+			end
+		end
+
+		if not path and path2 and etype == 'Move'
+		then
+			log(
+				'Inotify',
+				'Move from deleted directory or outside ',
+				path2,
+				' becomes Create.'
+			)
+
+			path  = path2
+
+			path2 = nil
+
+			dir = dir2
+
+			etype = 'Create'
+		end
+
+		if not path
+		then
+			-- this is normal in case of deleted subdirs
+			log(
+				'Inotify',
+				'event belongs to unknown watch descriptor.'
+			)
+
+			return
+		end
+
+		dispatch( etype, isdir, time, path, path2, dir, dir2 )
+	end
+
+	--
+	-- Called with all events of one read from the core.
+	--
+	-- Each event takes six consecutive entries of the batch:
+	--     etype, wd, isdir, filename, wd2, filename2
+	--
+	local function events
+	(
+		batch, -- the events, batch.n is the number of events
+		time   -- time of the events
+	)
+		for i = 1, batch.n * 6, 6
+		do
+			event(
+				batch[ i ],
+				batch[ i + 1 ],
+				batch[ i + 2 ],
+				time,
+				batch[ i + 3 ],
+				batch[ i + 4 ],
+				batch[ i + 5 ]
+			)
+		end
+	end
+
+	--
+	-- Looks for changes in a polled directory and reports them.
+	--
+	-- Returns the number of files stat'ed.
+	--
+	local function visit
+	(
+		path,  -- absolute path of the polled directory
+		time   -- time of the events
+	)
+		local snap = polled[ path ]
+
+		local mtime = lsyncd.get_mtime( path )
+
+		if not mtime
+		then
+			-- gone, the directory holding it reports the Delete
+			removeWatch( path, true )
+
+			return 1
+		end
+
+		local cost = 1
+
+		-- true if something changed for sure
+		local active = mtime ~= snap.mtime
+
+		-- true if something might have changed within
+		-- the second the snapshot was taken
+		local racy = snap.mtime >= snap.at
+
+		local modified = { }
+
+		local stats = lsyncd.scandir( path, true ) or { }
+
+		cost = cost + #stats
+
+		for _, e in ipairs( stats )
+		do
+			local m = snap.entries[ e.name ]
+
+			if
+				m and m ~= true and e.type ~= 'directory'
+				and ( e.mtime ~= m or math.floor( m / 1000000000 ) >= snap.at )
+			then
+				modified[ #modified + 1 ] = e.name
+
+				active = active or e.mtime ~= m
+			end
+		end
+
+		if not active and not racy and #modified == 0
+		then
+			return cost
+		end
+
+		-- an active directory is watched before looking
+		-- what changed, so nothing falls in between
+		local watching = active and promote( path )
+
+		local entries = lsyncd.readdir( path )
+
+		if not entries
+		then
+			removeWatch( path, true )
+
+			return cost
+		end
+
+		for name, isdir in pairs( entries )
+		do
+			local old = snap.entries[ name ]
+
+			if old == nil or ( old == true ) ~= isdir
+			then
+				if old ~= nil
+				then
+					dispatch(
+						'Delete', old == true, time,
+						path .. name .. ( old == true and '/' or '' ),
+						nil, path, nil
+					)
+				end
+
+				dispatch(
+					'Create', isdir, time,
+					path .. name .. ( isdir and '/' or '' ),
+					nil, path, nil
+				)
+			end
+		end
+
+		for name, old in pairs( snap.entries )
+		do
+			if entries[ name ] == nil
+			then
+				dispatch(
+					'Delete', old == true, time,
+					path .. name .. ( old == true and '/' or '' ),
+					nil, path, nil
+				)
+			end
+		end
+
+		for _, name in ipairs( modified )
+		do
+			if entries[ name ] == false
+			then
+				dispatch( 'Modify', false, time, path .. name, nil, path, nil )
+			end
+		end
+
+		if not watching and polled[ path ]
+		then
+			polled[ path ] = snapshot( path ) or snap
+		end
+
+		return cost
+	end
+
+	--
+	-- Polls the next directories, stat'ing about
+	-- 'pollRate' files per second.
+	--
+	local function pollRound
+	(
+		timestamp
+	)
+		if not pollAlarm or timestamp < pollAlarm
+		then
+			return
+		end
+
+		local budget = uSettings.pollRate
+
+		local spent = 0
+
+		local round = #pollOrder
+
+		while spent < budget and round > 0
+		do
+			if pollPos > #pollOrder
+			then
+				-- starts over, dropping the directories
+				-- no longer polled from the order
+				pollOrder = { }
+
+				for path, _ in pairs( polled )
+				do
+					pollOrder[ #pollOrder + 1 ] = path
+				end
+
+				pollPos = 1
+
+				round = math.min( round, #pollOrder )
+			end
+
+			local path = pollOrder[ pollPos ]
+
+			pollPos = pollPos + 1
+
+			round = round - 1
+
+			if path and polled[ path ]
+			then
+				spent = spent + visit( path, timestamp )
+			end
+		end
+
+		if polledCount > 0
+		then
+			pollAlarm = timestamp + 1
+		else
+			pollAlarm = false
+
+			pollOrder = { }
+
+			pollPos = 1
+		end
+	end
+
+	--
+	-- Returns the time of the next setup batch or
+	-- polling round, false if none.
+	--
+	local function getAlarm
+	( )
+		if setupHead <= #setupQueue
+		then
+			return now( )
+		end
+
+		return pollAlarm
+	end
+
+	--
+	-- Writes a status report about inotify to a file descriptor
+	--
+	local function statusReport( f )
+
+		f:write( 'Inotify watching ', wdpaths:size(), ' directories\n' )
+
+		if setupHead <= #setupQueue
+		then
+			f:write(
+				'Inotify setting up watches, walked ', setupWalked,
+				' directories, ', #setupQueue - setupHead + 1,
+				' subtrees left to walk\n'
+			)
+		end
+
+		if polledCount > 0
+		then
+			f:write( 'Inotify polling ', polledCount, ' directories\n' )
+		end
+
+		local bytes, hwm, dropped = lsyncd.inotify.queuestats( )
+
+		if bytes
+		then
+			f:write(
+				'Inotify queue holds ', bytes, ' bytes, high-water mark ',
+				hwm, ' bytes, dropped ', dropped, ' events\n'
+			)
+		end
+
+		for wd, path in wdpaths:walk( )
+		do
+			f:write( '  ', wd, ': ', path, '\n' )
+		end
+	end
+
+
+	--
+	-- Public interface.
+	--
+	return {
+		addMarked = addMarked,
+		addSync = addSync,
+		changedDirs = changedDirs,
+		event = event,
+		events = events,
+		getAlarm = getAlarm,
+		pollRound = pollRound,
+		prune = prune,
+		removeMarked = removeMarked,
+		removeSync = removeSync,
+		rewatch = rewatch,
+		setupRound = setupRound,
+		statusReport = statusReport,
+	}
+
+end)( )
+
+
+--
+-- Interface to Linux fanotify
+--
+-- This marks whole filesystems, thus needs no watch per
+-- directory, but CAP_SYS_ADMIN.
+--
+-- The events come through runner.inotifyEvents( ) with absolute
+-- paths and are dispatched like inotify events, see Inotify.event( ).
+--
+local Fanotify = ( function
+( )
+	--
+	-- A list indexed by syncs yielding
+	-- the root path the sync is interested in.
+	--
+	local syncRoots = { }
+
+	--
+	-- Adds a Sync to receive events.
+	--
+	local function addSync
+	(
+		sync,     -- object to receive events
+		rootdir   -- root dir to watch
+	)
+		if syncRoots[ sync ]
+		then
+			error( 'duplicate sync in Fanotify.addSync()' )
+		end
+
+		if not lsyncd.fanotify
+		then
+			log( 'Error', 'This Lsyncd has been compiled without fanotify.' )
+
+			terminate( -1 )
+		end
+
+		syncRoots[ sync ] = rootdir
+
+		local inotifyMode = ( uSettings and uSettings.inotifyMode ) or ''
+
+		lsyncd.fanotify.mark( rootdir, inotifyMode )
+
+		-- the events come through the inotify interface
+		Inotify.addMarked( sync, rootdir )
+	end
+
+	--
+	-- Removes a Sync.
+	--
+	-- The filesystems stay marked, events of them
+	-- concerning no sync are ignored.
+	--
+	local function removeSync
+	(
+		sync
+	)
+		syncRoots[ sync ] = nil
+
+		Inotify.removeMarked( sync )
+	end
+
+	--
+	-- Writes a status report about fanotify to a file descriptor
+	--
+	local function statusReport
+	(
+		f
+	)
+		if not next( syncRoots )
+		then
+			return
+		end
+
+		f:write( 'Fanotify marking ', lsyncd.fanotify.marks( ), ' filesystems\n' )
+
+		for sync, root in pairs( syncRoots )
+		do
+			f:write( '  ', sync.config.name, ': ', root, '\n' )
+		end
+	end
+
+	--
+	-- Public interface
+	--
+	return {
+		addSync      = addSync,
+		removeSync   = removeSync,
+		statusReport = statusReport
+	}
+end )( )
+
+
+--
+-- Polls directory trees for changes, for filesystems
+-- the kernel does not report changes of, like NFS or FUSE.
+--
+-- Each sync keeps an index of its tree which is rescanned
+-- incrementally, stat'ing about 'pollRate' files per second
+-- and starting a pass at most every 'pollInterval' seconds.
+--
+local Poll = ( function
+( )
+	--
+	-- The polling state by sync:
+	--     root      -- the root dir
+	--     dirs      -- the index, by absolute path of the directories
+	--     count     -- number of indexed directories
+	--     order     -- the directories in order of the current pass
+	--     pos       -- the next directory of the pass to visit
+	--     vanished  -- by inode the entries gone in the current pass
+	--     appeared  -- by inode the entries new in the current pass
+	--     passStart -- the time the current pass started
+	--     alarm     -- the time of the next polling step
+	--
+	-- Each indexed directory holds:
+	--     inos   -- by name the inode numbers of its entries
+	--     stamps -- by name the status change times of the files
+	--               or true for directories. The status change time
+	--               changes with any change of size, content or mtime.
+	--     mtimes -- by name the modification times of its entries
+	--     sizes  -- by name the sizes of its entries
+	--
+	-- The entries gone or new hold their absolute path, modification
+	-- time and size. A move keeps the latter two, other than a write
+	-- or an inode number reused for another entry.
+	--
+	local states = { }
+
+	--
+	-- Adds a directory and all its subdirectories
+	-- to the index without reporting anything.
+	--
+	local function index
+	(
+		st,   -- the polling state
+		path  -- absolute path of the directory
+	)
+		if not st.sync:concerns( path )
+		then
+			return
+		end
+
+		local entries = lsyncd.scandir( path, true )
+
+		if not entries
+		then
+			return
+		end
+
+		local d = { inos = { }, stamps = { }, mtimes = { }, sizes = { } }
+
+		if not st.dirs[ path ]
+		then
+			st.count = st.count + 1
+		end
+
+		st.dirs[ path ] = d
+
+		st.order[ #st.order + 1 ] = path
+
+		for _, e in ipairs( entries )
+		do
+			d.inos[ e.name ] = e.ino
+
+			d.mtimes[ e.name ] = e.mtime
+
+			d.sizes[ e.name ] = e.size
+
+			if e.type == 'directory'
+			then
+				d.stamps[ e.name ] = true
+
+				index( st, path .. e.name .. '/' )
+			else
+				d.stamps[ e.name ] = e.ctime
+			end
+		end
+	end
+
+	--
+	-- Removes a directory and all its subdirectories from the index.
+	--
+	local function unindex
+	(
+		st,
+		path
+	)
+		local d = st.dirs[ path ]
+
+		if not d
+		then
+			return
+		end
+
+		st.dirs[ path ] = nil
+
+		st.count = st.count - 1
+
+		for name, stamp in pairs( d.stamps )
+		do
+			if stamp == true
+			then
+				unindex( st, path .. name .. '/' )
+			end
+		end
+	end
+
+	--
+	-- Hands an event to the sync.
+	--
+	local function delay
+	(
+		st,
+		etype,
+		time,
+		path,
+		path2
+	)
+		log( 'Poll', etype, ' ', path, path2 and ' -> ' or '', path2 or '' )
+
+		local relative2 = path2 and splitPath( path2, st.root )
+
+		st.sync:delay( etype, time, splitPath( path, st.root ), relative2 )
+	end
+
+	--
+	-- An entry of a directory is gone.
+	--
+	local function vanish
+	(
+		st,
+		d,     -- the index of the directory
+		path,  -- absolute path of the directory
+		name   -- name of the entry
+	)
+		local isdir = d.stamps[ name ] == true
+
+		st.vanished[ d.inos[ name ] ] =
+		{
+			path = path .. name .. ( isdir and '/' or '' ),
+			mtime = d.mtimes[ name ],
+			size = d.sizes[ name ],
+		}
+
+		d.inos[ name ] = nil
+
+		d.stamps[ name ] = nil
+
+		d.mtimes[ name ] = nil
+
+		d.sizes[ name ] = nil
+
+		if isdir
+		then
+			unindex( st, path .. name .. '/' )
+		end
+	end
+
+	--
+	-- An entry of a directory is new.
+	--
+	local function appear
+	(
+		st,
+		d,      -- the index of the directory
+		path,   -- absolute path of the directory
+		e       -- the entry as read by lsyncd.scandir( )
+	)
+		local name = e.name
+
+		local isdir = e.type == 'directory'
+
+		d.inos[ name ] = e.ino
+
+		d.stamps[ name ] = isdir or e.ctime
+
+		d.mtimes[ name ] = e.mtime
+
+		d.sizes[ name ] = e.size
+
+		if isdir
+		then
+			index( st, path .. name .. '/' )
+		end
+
+		st.appeared[ e.ino ] =
+		{
+			path = path .. name .. ( isdir and '/' or '' ),
+			mtime = e.mtime,
+			size = e.size,
+		}
+	end
+
+	--
+	-- Looks for changes in an indexed directory.
+	--
+	-- Modifications are reported right away, entries gone or new
+	-- are reported at the end of the pass, so these are paired
+	-- to moves, see endPass( ).
+	--
+	-- Returns the number of files stat'ed.
+	--
+	local function visit
+	(
+		st,
+		path,  -- absolute path of the directory
+		time   -- time of the events
+	)
+		local d = st.dirs[ path ]
+
+		-- the entries and their status are read in one pass.
+		-- Writing a file leaves the modification time of its
+		-- directory alone, so its entries are stat'ed anyway and
+		-- skipping the listing of unchanged directories saves nothing.
+		local entries = lsyncd.scandir( path, true )
+
+		if not entries
+		then
+			-- gone, the directory holding it reports this
+			unindex( st, path )
+
+			return 1
+		end
+
+		local names = { }
+
+		for _, e in ipairs( entries )
+		do
+			names[ e.name ] = e
+		end
+
+		for name, _ in pairs( d.inos )
+		do
+			if not names[ name ]
+			then
+				vanish( st, d, path, name )
+			end
+		end
+
+		for _, e in ipairs( entries )
+		do
+			local name = e.name
+
+			local sisdir = e.type == 'directory'
+
+			local old = d.inos[ name ]
+
+			if old ~= e.ino or ( d.stamps[ name ] == true ) ~= sisdir
+			then
+				if old
+				then
+					vanish( st, d, path, name )
+				end
+
+				appear( st, d, path, e )
+			elseif not sisdir and d.stamps[ name ] ~= e.ctime
+			then
+				d.stamps[ name ] = e.ctime
+
+				d.mtimes[ name ] = e.mtime
+
+				d.sizes[ name ] = e.size
+
+				delay( st, 'Modify', time, path .. name )
+			end
+		end
+
+		local cost = 1 + #entries
+
+		return cost
+	end
+
+	--
+	-- Reports the entries gone or new in this pass
+	-- and starts the next one.
+	--
+	local function endPass
+	(
+		st,
+		time
+	)
+		for ino, from in pairs( st.vanished )
+		do
+			local to = st.appeared[ ino ]
+
+			-- an entry written after its move or an inode number reused
+			-- would leave the old content at the destination of a move,
+			-- these are transferred anew
+			if to
+			and to.mtime == from.mtime
+			and to.size == from.size
+			then
+				st.appeared[ ino ] = nil
+
+				delay( st, 'Move', time, from.path, to.path )
+			else
+				delay( st, 'Delete', time, from.path )
+			end
+		end
+
+		for _, to in pairs( st.appeared )
+		do
+			delay( st, 'Create', time, to.path )
+		end
+
+		st.vanished = { }
+
+		st.appeared = { }
+
+		st.order = { }
+
+		for path, _ in pairs( st.dirs )
+		do
+			st.order[ #st.order + 1 ] = path
+		end
+
+		st.pos = 1
+	end
+
+	--
+	-- Polls the next directories of a sync.
+	--
+	local function step
+	(
+		st,
+		timestamp
+	)
+		local config = st.sync.config
+
+		local budget = config.pollRate or uSettings.pollRate
+
+		local spent = 0
+
+		while spent < budget
+		do
+			if st.pos > #st.order
+			then
+				endPass( st, timestamp )
+
+				st.passStart = st.passStart + config.pollInterval
+
+				if st.passStart < timestamp + 1
+				then
+					st.passStart = timestamp + 1
+				end
+
+				st.alarm = st.passStart
+
+				return
+			end
+
+			local path = st.order[ st.pos ]
+
+			st.pos = st.pos + 1
+
+			if st.dirs[ path ]
+			then
+				spent = spent + visit( st, path, timestamp )
+			end
+		end
+
+		st.alarm = timestamp + 1
+	end
+
+	--
+	-- Adds a Sync to poll.
+	--
+	local function addSync
+	(
+		sync,     -- object to receive events
+		rootdir   -- root dir to poll
+	)
+		if states[ sync ]
+		then
+			error( 'duplicate sync in Poll.addSync()' )
+		end
+
+		local st = {
+			sync = sync,
+			root = rootdir,
+			dirs = { },
+			count = 0,
+			order = { },
+			pos = 1,
+			vanished = { },
+			appeared = { },
+			passStart = now( ),
+		}
+
+		st.alarm = st.passStart + 1
+
+		states[ sync ] = st
+
+		index( st, rootdir )
+	end
+
+	--
+	-- Removes a Sync and its index.
+	--
+	local function removeSync
+	(
+		sync
+	)
+		states[ sync ] = nil
+	end
+
+	--
+	-- Returns the time of the next polling step, false if none.
+	--
+	local function getAlarm
+	( )
+		local alarm = false
+
+		for _, st in pairs( states )
+		do
+			if not alarm or st.alarm < alarm
+			then
+				alarm = st.alarm
+			end
+		end
+
+		return alarm
+	end
+
+	--
+	-- Polls the syncs which are due.
+	--
+	local function invoke
+	(
+		timestamp
+	)
+		for _, st in pairs( states )
+		do
+			if st.alarm <= timestamp
+			then
+				step( st, timestamp )
+			end
+		end
+	end
+
+	--
+	-- Writes a status report about polling to a file descriptor
+	--
+	local function statusReport
+	(
+		f
+	)
+		for sync, st in pairs( states )
+		do
+			f:write(
+				'Poll indexing ', st.count, ' directories for ',
+				sync.config.name, ', ', #st.order - st.pos + 1,
+				' left in this pass\n'
+			)
+		end
+	end
+
+	--
+	-- Public interface
+	--
+	return {
+		addSync      = addSync,
+		getAlarm     = getAlarm,
+		invoke       = invoke,
+		removeSync   = removeSync,
+		statusReport = statusReport
+	}
+end )( )
+
+
+--
+-- Interface to OSX /dev/fsevents
+--
+-- This watches all the filesystems at once,
+-- but needs root access.
+--
+-- All fsevents specific implementation are enclosed here.
+--
+local Fsevents = ( function
+( )
+	--
+	-- A list indexed by syncs yielding
+	-- the root path the sync is interested in.
+	--
+	local syncRoots = { }
+
+	--
+	-- Adds a Sync to receive events.
+	--
+	local function addSync
+	(
+		sync,  -- object to receive events
+		dir    -- dir to watch
+	)
+		if syncRoots[ sync ]
+		then
+			error( 'duplicate sync in Fanotify.addSync()' )
+		end
+
+		syncRoots[ sync ] = dir
+
+	end
+
+	--
+	-- Removes a Sync.
+	--
+	local function removeSync
+	(
+		sync
+	)
+		syncRoots[ sync ] = nil
+	end
+
+	--
+	-- Called when an event has occured.
+	--
+	local function event
+	(
+		etype,  --  'Attrib', 'Modify', 'Create', 'Delete', 'Move'
+		isdir,  --  true if filename is a directory
+		time,   --  time of event
+		path,   --  path of file
+		path2   --  path of target in case of 'Move'
+	)
+		if isdir
+		then
+			path = path .. '/'
+
+			if path2 then path2 = path2 .. '/' end
+		end
+
+		log( 'Fsevents', etype, ',', isdir, ',', time,  ',', path, ',', path2 )
+
+		for _, sync in Syncs.iwalk()
+		do repeat
+
+			local root = sync.source
+
+			-- TODO combine ifs
+			if not path:starts( root )
+			then
+				if not path2 or not path2:starts( root )
+				then
+					break  -- continue
+				end
+			end
+
+			local relative = splitPath( path, root )
+
+			local relative2
+
+			if path2
+			then
+				relative2 = splitPath( path2, root )
+			end
+
+			-- possibly change etype for this iteration only
+			local etyped = etype
+
+			if etyped == 'Move'
+			then
+				if not relative2
+				then
+					log( 'Normal', 'Transformed Move to Delete for ', sync.config.name )
+
+					etyped = 'Delete'
+
+				elseif not relative
+				then
+					relative = relative2
+
+					relative2 = nil
+
+					log( 'Normal', 'Transformed Move to Create for ', sync.config.name )
+
+					etyped = 'Create'
+				end
+			end
+
+			sync:delay( etyped, time, relative, relative2 )
+
+		until true end
+
+	end
+
+
+	--
+	-- Writes a status report about fsevents to a filedescriptor.
+	--
+	local function statusReport
+	(
+		f
+	)
+		-- TODO
+	end
+
+	--
+	-- Public interface
+	--
+	return {
+		addSync      = addSync,
+		event        = event,
+		removeSync   = removeSync,
+		statusReport = statusReport
+	}
+end )( )
+
+
+--
+-- Holds information about the event monitor capabilities
+-- of the core.
+--
+Monitors = ( function
+( )
+	--
+	-- The cores monitor list
+	--
+	local list = { }
+
+
+	--
+	-- The default event monitor.
+	--
+	local function default
+	( )
+		return list[ 1 ]
+	end
+
+
+	--
+	-- Initializes with info received from core
+	--
+	local function initialize( clist )
+		for k, v in ipairs( clist )
+		do
+			list[ k ] = v
+		end
+	end
+
+
+	--
+	-- Public interface
+	--
+	return {
+		default = default,
+		list = list,
+		initialize = initialize
+	}
+
+end)( )
+
+
+--
+-- Writes a status report file at most every 'statusintervall' seconds.
+--
+local StatusFile = ( function
+( )
+	--
+	-- Timestamp when the status file has been written.
+	--
+	local lastWritten = false
+
+
+	--
+	-- Timestamp when a status file should be written.
+	--
+	local alarm = false
+
+
+	--
+	-- Returns the alarm when the status file should be written-
+	--
+	local function getAlarm
+	( )
+		return alarm
+	end
+
+
+	--
+	-- Called to check if to write a status file.
+	--
+	local function write
+	(
+		timestamp
+	)
+		log( 'Function', 'write( ', timestamp, ' )' )
+
+		--
+		-- takes care not write too often
+		--
+		if uSettings.statusInterval > 0
+		then
+			-- already waiting?
+			if alarm and timestamp < alarm
+			then
+				log( 'Statusfile', 'waiting(', timestamp, ' < ', alarm, ')' )
+
+				return
+			end
+
+			-- determines when a next write will be possible
+			if not alarm
+			then
+				local nextWrite = lastWritten and timestamp + uSettings.statusInterval
+
+				if nextWrite and timestamp < nextWrite
+				then
+					log( 'Statusfile', 'setting alarm: ', nextWrite )
+					alarm = nextWrite
+
+					return
+				end
+			end
+
+			lastWritten = timestamp
+			alarm = false
+		end
+
+		log( 'Statusfile', 'writing now' )
+
+		local f, err = io.open( uSettings.statusFile, 'w' )
+
+		if not f
+		then
+			log(
+				'Error',
+				'Cannot open status file "' ..
+					uSettings.statusFile ..
+					'" :' ..
+					err
+			)
+			return
+		end
+
+		f:write( 'Lsyncd status report at ', os.date( ), '\n\n' )
+
+		for i, s in Syncs.iwalk( )
+		do
+			s:statusReport( f )
+
+			f:write( '\n' )
+		end
+
+		for i, t in Tunnels.iwalk( )
+		do
+			t:statusReport( f )
+
+			f:write( '\n' )
+		end
+
+		Inotify.statusReport( f )
+
+		Fanotify.statusReport( f )
+
+		Poll.statusReport( f )
+
+		f:close( )
+	end
+
+
+	--
+	-- Public interface
+	--
+	return {
+		write = write,
+		getAlarm = getAlarm
+	}
+
+end )( )
+
+
+--
+-- Lets userscripts make their own alarms.
+--
+local UserAlarms = ( function
+( )
+	--
+	-- Alarms with the same timestamp are called
+	-- in the order they were added.
+	--
+	local alarms = Heap.new(
+		function( a, b )
+			if a.timestamp == b.timestamp then return a.seq < b.seq end
+
+			return a.timestamp < b.timestamp
+		end
+	)
+
+	local seq = 0
+
+	--
+	-- Calls the user function at timestamp.
+	--
+	local function alarm
+	(
+		timestamp,
+		func,
+		extra
+	)
+		seq = seq + 1
+
+		alarms:push(
+			{
+				timestamp = timestamp,
+				func = func,
+				extra = extra,
+				seq = seq
+			}
+		)
+	end
+
+
+	--
+	-- Retrieves the soonest alarm.
+	--
+	local function getAlarm
+	( )
+		local a = alarms:peek( )
+
+		if not a
+		then
+			return false
+		else
+			return a.timestamp
+		end
+	end
+
+
+	--
+	-- Calls user alarms.
+	--
+	local function invoke
+	(
+		timestamp
+	)
+		while alarms:size( ) > 0
+		and alarms:peek( ).timestamp <= timestamp
+		do
+			local a = alarms:pop( )
+
+			a.func( a.timestamp, a.extra )
+		end
+	end
+
+
+	--
+	-- Public interface
+	--
+	return {
+		alarm    = alarm,
+		getAlarm = getAlarm,
+		invoke   = invoke
+	}
+
+end )( )
+
+--============================================================================
+-- Lsyncd runner's plugs. These functions are called from core.
+--============================================================================
+
+--
+-- Current status of Lsyncd.
+--
+-- 'init'  ... on (re)init
+-- 'run'   ... normal operation
+-- 'fade'  ... waits for remaining processes
+--
+local lsyncdStatus = 'init'
+
+--
+-- The cores interface to the runner.
+--
+local runner = { }
+
+--
+-- Last time said to be waiting for more child processes
+--
+local lastReportedWaiting = false
+
+--
+-- Called from core whenever Lua code failed.
+--
+-- Logs a backtrace
+--
+function runner.callError
+(
+	message
+)
+	log( 'Error', 'in Lua: ', message )
+
+	-- prints backtrace
+	local level = 2
+
+	while true
+	do
+		local info = debug.getinfo( level, 'Sl' )
+
+		if not info
+		then
+			terminate( -1 )
+		end
+
+		log(
+			'Error',
+			'Backtrace ',
+			level - 1, ' :',
+			info.short_src, ':',
+			info.currentline
+		)
+
+		level = level + 1
+	end
+end
+
+
+--
+-- Called from core whenever a child process has finished and
+-- the zombie process was collected by core.
+--
+function runner.collectProcess
+(
+	pid,       -- process id
+	exitcode,  -- exitcode
+	owner      -- the Sync or Tunnel that spawned the process (if known)
+)
+	if owner
+	then
+		-- only Syncs count their processes
+		-- Tunnel:collect( ) does not return true
+		if owner:collect( pid, exitcode )
+		then
+			processCount = processCount - 1
+		end
+	else
+		for _, s in Syncs.iwalk( )
+		do
+			if s:collect( pid, exitcode ) then
+				processCount = processCount - 1
+				break
+			end
+		end
+
+		for _, s in Tunnels.iwalk( )
+		do
+			if s:collect( pid, exitcode ) then
+				break
+			end
+		end
+	end
+
+	if processCount < 0
+	then
+		error( 'negative number of processes!' )
+	end
+
+
+end
+
+--
+-- Called from core everytime a masterloop cycle runs through.
+--
+-- This happens in case of
+--   * an expired alarm.
+--   * a returned child process.
+--   * received filesystem events.
+--   * received a HUP, TERM or INT signal.
+--
+function runner.cycle(
+	timestamp   -- the current kernel time (in jiffies)
+)
+	log( 'Function', 'cycle( ', timestamp, ' )' )
+
+	if lsyncdStatus == 'fade'
+	then
+		if processCount > 0
+		then
+			if
+				lastReportedWaiting == false or
+				timestamp >= lastReportedWaiting + 60
+			then
+				lastReportedWaiting = timestamp
 
-			terminate( -1 )
-		end
+				log(
+					'Normal',
+					'waiting for ',
+					processCount,
+					' more child processes.'
+				)
+			end
 
-		-- creates the new sync
-		local s = Sync.new( config )
+			return true
+		else
+			-- the delays still queued are replayed on restart
+			Journal.commit( timestamp, true )
 
-		table.insert( syncsList, s )
+			TreeIndex.flush( )
 
-		return s
+			Tunnels.killAll()
+			return false
+		end
 	end
 
-	--
-	-- Allows a for-loop to walk through all syncs.
-	--
-	local function iwalk
-	( )
-		return ipairs( syncsList )
+	if lsyncdStatus ~= 'run'
+	then
+		error( 'runner.cycle() called while not running!' )
 	end
 
-	--
-	-- Returns the number of syncs.
-	--
-	local size = function
-	( )
-		return #syncsList
+	-- check and start tunnels
+	if not uSettings.maxProcesses
+	or processCount < uSettings.maxProcesses
+	then
+		Tunnels.invoke( timestamp )
 	end
 
-	--
-	-- Tests if any sync is interested in a path.
-	--
-	local function concerns
-	(
-		path
-	)
-		for _, s in ipairs( syncsList )
+	if uSettings.onepass
+	then
+		local allDone = true
+		for i, s in Syncs.iwalk( )
 		do
-			if s:concerns( path )
+			if s.initDone == true
 			then
-				return true
+				s.disabled = true
+			else
+				allDone = false
 			end
 		end
-
-		return false
+		if allDone and processCount == 0 then
+			log( 'Info', 'onepass active and all syncs finished. Exiting successfully')
+			os.exit(0)
+		end
 	end
 
 	--
-	-- Public interface
+	-- goes through all syncs and spawns more actions
+	-- if possibly. But only let Syncs invoke actions if
+	-- not at global limit
 	--
-	return {
-		add = add,
-		get = get,
-		getRound = getRound,
-		concerns = concerns,
-		iwalk = iwalk,
-		nextRound = nextRound,
-		size = size
-	}
-end )( )
+	if not uSettings.maxProcesses
+	or processCount < uSettings.maxProcesses
+	then
+		local start = Syncs.getRound( )
 
+		local ir = start
 
---
--- Utility function,
--- Returns the relative part of absolute path if it
--- begins with root
---
-local function splitPath
-(
-	path,
-	root
-)
-	local rlen = #root
+		repeat
+			local s = Syncs.get( ir )
 
-	local sp = string.sub( path, 1, rlen )
+			s:invokeActions( timestamp )
 
-	if sp == root
-	then
-		return string.sub( path, rlen, -1 )
-	else
-		return nil
+			ir = ir + 1
+
+			if ir > Syncs.size( )
+			then
+				ir = 1
+			end
+		until ir == start
+
+		Syncs.nextRound( )
 	end
-end
 
-local function splitQuotedString
-    (
-        text
-    )
-    local spat, epat, buf, quoted = [=[^(['"])]=], [=[(['"])$]=], nil, nil
-    local rv = {}
-    for str in text:gmatch("%S+") do
-        local squoted = str:match(spat)
-        local equoted = str:match(epat)
-        local escaped = str:match([=[(\*)['"]$]=])
-        if squoted and not quoted and not equoted then
-            buf, quoted = str, squoted
-        elseif buf and equoted == quoted and #escaped % 2 == 0 then
-            str, buf, quoted = buf .. ' ' .. str, nil, nil
-        elseif buf then
-            buf = buf .. ' ' .. str
-        end
-        if not buf
-        then
-            table.insert(rv, (str:gsub(spat,""):gsub(epat,"")))
-        end
-    end
-    if buf
-    then
-        print("Missing matching quote for "..buf)
-    end
-    return rv
-end
+	UserAlarms.invoke( timestamp )
 
-lsyncd.splitQuotedString = splitQuotedString
+	Inotify.setupRound( )
 
---- @diagnostic disable-next-line: lowercase-global
-function substitudeCommands(cmd, data)
-	assert(type(data) == "table")
+	TreeIndex.step( )
 
-	if type(cmd) == "string" then
-		local rv = cmd
-		for key,value in pairs(data) do
-			local getData = function()
-				return tostring(value)
-			end
-			rv = string.gsub(rv, "%^("..key..")", getData)
-		end
-		return rv
-	elseif type(cmd) == "table" then
-		local rv = {}
-		for i, v in ipairs(cmd) do
-			rv[i] = v
-			for key, value in pairs(data) do
-				local getData = function()
-					return tostring(value)
-				end
-				rv[i] = string.gsub(rv[i], "%^("..key..")", getData)
-			end
-		end
-		return rv
-	else
-		log("Error", "Unsupported type in substitudeCommands")
+	Inotify.pollRound( timestamp )
+
+	Poll.invoke( timestamp )
+
+	Journal.commit( timestamp )
+
+	if uSettings.statusFile
+	then
+		StatusFile.write( timestamp )
 	end
+
+	return true
 end
 
 --
--- Interface to inotify.
---
--- watches recursively subdirs and sends events.
---
--- All inotify specific implementation is enclosed here.
+-- Called by core if '-help' or '--help' is in
+-- the arguments.
 --
-local Inotify = ( function
-( )
-	--
-	-- A list indexed by inotify watch descriptors yielding
-	-- the directories absolute paths.
-	--
-	local wdpaths = CountArray.new( )
-
-	--
-	-- The same vice versa,
-	-- all watch descriptors by their absolute paths.
-	--
-	local pathwds = { }
-
-	--
-	-- A list indexed by syncs containing yielding
-	-- the root paths the syncs are interested in.
-	--
-	local syncRoots = { }
+function runner.help(_arg0)
+	io.stdout:write(
+'lsyncd version: ' .. lsyncd_version ..
+[[
 
-	--
-	-- Stops watching a directory
-	--
-	local function removeWatch
-	(
-		path,  -- absolute path to unwatch
-		core   -- if false not actually send the unwatch to the kernel
-		--        ( used in moves which reuse the watch )
-	)
-		local wd = pathwds[ path ]
 
-		if not wd
-		then
-			return
-		end
+USAGE:
+  runs a config file:
+    lsyncd [OPTIONS] [CONFIG-FILE]
 
-		if core
-		then
-			lsyncd.inotify.rmwatch( wd )
-		end
+  default rsync behaviour:
+    lsyncd [OPTIONS] -rsync [SOURCE] [TARGET]
 
-		wdpaths[ wd   ] = nil
-		pathwds[ path ] = nil
-	end
+  default rsync with mv's through ssh:
+    lsyncd [OPTIONS] -rsyncssh [SOURCE] [HOST] [TARGETDIR]
 
+  default local copying mechanisms (cp|mv|rm):
+    lsyncd [OPTIONS] -direct [SOURCE] [TARGETDIR]
 
-	--
-	-- Adds watches for a directory (optionally) including all subdirectories.
-	--
-	--
-	local function addWatch
-	(
-		path  -- absolute path of directory to observe
-	)
-		log( 'Function', 'Inotify.addWatch( ', path, ' )' )
+OPTIONS:
+  -delay SECS         Overrides default delay times
+  -help               Shows this
+  -insist             Continues startup even if it cannot connect
+  -log    all         Logs everything (debug)
+  -log    scarce      Logs errors only
+  -log    [Category]  Turns on logging for a debug category
+  -logfile FILE       Writes log to FILE (DEFAULT: uses syslog)
+  -nodaemon           Does not detach and logs to stdout/stderr
+  -onepass            Sync once and exit
+  -pidfile FILE       Writes Lsyncds PID into FILE
+  -runner FILE        Loads Lsyncds lua part from FILE
+  -script FILE        Script to load before execting runner (ADVANCED)
+  -sshopts            Additional ssh command options when using rsyncssh
+  -version            Prints versions and exits
 
-		if not Syncs.concerns( path )
-		then
-			log('Inotify', 'not concerning "', path, '"')
+LICENSE:
+  GPLv2 or any later version.
 
-			return
-		end
+SEE:
+  `man lsyncd` for further information.
 
-		-- registers the watch
-		local inotifyMode = ( uSettings and uSettings.inotifyMode ) or '';
+]])
 
-		local wd = lsyncd.inotify.addwatch( path, inotifyMode ) ;
+--
+--  -monitor NAME       Uses operating systems event montior NAME
+--                      (inotify/fanotify/fsevents)
 
-		if wd < 0
-		then
-			log( 'Inotify','Unable to add watch "', path, '"' )
+	os.exit( -1 )
+end
 
-			return
-		end
 
-		do
-			-- If this watch descriptor is registered already
-			-- the kernel reuses it since the old dir is gone.
-			local op = wdpaths[ wd ]
+--
+-- Called from core to parse the command line arguments
+--
+-- returns a string as user script to load.
+--    or simply 'true' if running with rsync bevaiour
+--
+-- terminates on invalid arguments.
+--
+function runner.configure( args, monitors )
 
-			if op and op ~= path
-			then
-				pathwds[ op ] = nil
-			end
-		end
+	Monitors.initialize( monitors )
 
-		pathwds[ path ] = wd
+	--
+	-- a list of all valid options
+	--
+	-- first paramter is the number of parameters an option takes
+	-- if < 0 the called function has to check the presence of
+	-- optional arguments.
+	--
+	-- second paramter is the function to call
+	--
+	local options =
+	{
+		-- log is handled by core already.
 
-		wdpaths[ wd   ] = path
+		delay =
+		{
+			1,
+			function
+			(
+				secs
+			)
+				clSettings.delay = secs + 0
+			end
+		},
 
-		-- registers and adds watches for all subdirectories
-		local entries = lsyncd.readdir( path )
+		insist =
+		{
+			0,
+			function
+			( )
+				clSettings.insist = true
+			end
+		},
 
-		if not entries
-		then
-			return
-		end
+		log =
+		{
+			1,
+			nil
+		},
 
-		for dirname, isdir in pairs( entries )
-		do
-			if isdir
-			then
-				addWatch( path .. dirname .. '/' )
+		logfile =
+		{
+			1,
+			function
+			(
+				file
+			)
+				clSettings.logfile = file
 			end
-		end
-	end
+		},
 
-	--
-	-- Adds a Sync to receive events.
-	--
-	local function addSync
-	(
-		sync,     -- object to receive events.
-		rootdir   -- root dir to watch
-	)
-		if syncRoots[ sync ]
-		then
-			error( 'duplicate sync in Inotify.addSync()' )
-		end
+		monitor =
+		{
+			-1,
+			function
+			(
+				monitor
+			)
+				if not monitor
+				then
+					io.stdout:write( 'This Lsyncd supports these monitors:\n' )
+					for _, v in ipairs( Monitors.list )
+					do
+						io.stdout:write( '   ', v, '\n' )
+					end
 
-		syncRoots[ sync ] = rootdir
+					io.stdout:write('\n')
 
-		addWatch( rootdir )
-	end
+					lsyncd.terminate( -1 )
+				else
+					clSettings.monitor = monitor
+				end
+			end
+		},
 
-	--
-	-- Called when an event has occured.
-	--
-	local function event
-	(
-		etype,     -- 'Attrib', 'Modify', 'Create', 'Delete', 'Move'
-		wd,        --  watch descriptor, matches lsyncd.inotifyadd()
-		isdir,     --  true if filename is a directory
-		time,      --  time of event
-		filename,  --  string filename without path
-		wd2,       --  watch descriptor for target if it's a Move
-		filename2  --  string filename without path of Move target
-	)
-		if isdir
-		then
-			filename = filename .. '/'
+		nodaemon =
+		{
+			0,
+			function
+			( )
+				clSettings.nodaemon = true
+			end
+		},
 
-			if filename2
-			then
-				filename2 = filename2 .. '/'
+		onepass =
+		{
+			0,
+			function
+			( )
+				clSettings.onepass = true
 			end
-		end
+		},
 
-		if filename2
-		then
-			log(
-				'Inotify',
-				'got event ',
-				etype,
-				' ',
-				filename,
-				'(', wd, ') to ',
-				filename2,
-				'(', wd2 ,')'
+		pidfile =
+		{
+			1,
+			function
+			(
+				file
 			)
-		else
-			log(
-				'Inotify',
-				'got event ',
-				etype,
-				' ',
-				filename,
-				'(', wd, ')'
+				clSettings.pidfile=file
+			end
+		},
+
+		sshopts =
+		{
+			1,
+			function
+			(
+				options
 			)
-		end
+				clSettings.ssh_extras = splitQuotedString(options)
+			end
+		},
 
-		-- looks up the watch descriptor id
-		--- @type any
-		local path = wdpaths[ wd ]
+		script =
+		{
+			1,
+			function
+			(
+				file
+			)
+				clSettings.scripts = clSettings.scripts or {}
+				table.insert(clSettings.scripts, file)
+			end
+		},
 
-		if path
-		then
-			path = path..filename
-		end
+		rsync  =
+		{
+			2,
+			function
+			(
+				src,
+				trg
+			)
+				clSettings.syncs = clSettings.syncs or { }
+				table.insert( clSettings.syncs, { 'rsync', src, trg } )
+			end
+		},
 
-		--- @type any
-		local path2 = wd2 and wdpaths[ wd2 ]
+		rsyncssh =
+		{
+			3,
+			function
+			(
+				src,
+				host,
+				tdir
+			)
+				clSettings.syncs = clSettings.syncs or { }
 
-		if path2 and filename2
-		then
-			path2 = path2..filename2
-		end
+				table.insert( clSettings.syncs, { 'rsyncssh', src, host, tdir } )
+			end
+		},
 
-		if not path and path2 and etype == 'Move'
-		then
-			log(
-				'Inotify',
-				'Move from deleted directory ',
-				path2,
-				' becomes Create.'
+		direct =
+		{
+			2,
+			function
+			(
+				src,
+				trg
 			)
+				clSettings.syncs = clSettings.syncs or { }
 
-			path  = path2
-
-			path2 = nil
+				table.insert( clSettings.syncs, { 'direct', src, trg } )
+			end
+		},
 
-			etype = 'Create'
-		end
+		version =
+		{
+			0,
+			function
+			( )
+				io.stdout:write( 'Version: ', lsyncd_version, '\n' )
 
-		if not path
-		then
-			-- this is normal in case of deleted subdirs
-			log(
-				'Inotify',
-				'event belongs to unknown watch descriptor.'
-			)
+				os.exit( 0 )
+			end
+		}
+	}
 
-			return
-		end
+	-- non-opts is filled with all args that were no part dash options
 
-		for sync, root in pairs( syncRoots )
-		do repeat
-			local relative  = splitPath( path, root )
+	local nonopts = { }
 
-			local relative2 = nil
+	local i = 1
 
-			if path2
-			then
-				relative2 = splitPath( path2, root )
-			end
+	while i <= #args
+	do
+		local a = args[ i ]
 
-			if not relative and not relative2
+		if a:sub( 1, 1 ) ~= '-'
+		then
+			table.insert( nonopts, args[ i ] )
+		else
+			if a:sub( 1, 2 ) == '--'
 			then
-				-- sync is not interested in this dir
-				break -- continue
+				a = a:sub( 3 )
+			else
+				a = a:sub( 2 )
 			end
 
-			-- makes a copy of etype to possibly change it
-			local etyped = etype
+			local o = options[ a ]
 
-			if etyped == 'Move'
+			if not o
 			then
-				if not relative2
-				then
-					log(
-						'Normal',
-						'Transformed Move to Delete for ',
-						sync.config.name
-					)
-
-					etyped = 'Delete'
-				elseif not relative
-				then
-					relative = relative2
+				log( 'Error', 'unknown option command line option ', args[ i ] )
 
-					relative2 = nil
+				os.exit( -1 )
+			end
 
-					log(
-						'Normal',
-						'Transformed Move to Create for ',
-						sync.config.name
-					)
+			if o[ 1 ] >= 0 and i + o[ 1 ] > #args
+			then
+				log( 'Error', a ,' needs ', o[ 1 ],' arguments' )
 
-					etyped = 'Create'
-				end
+				os.exit( -1 )
+			elseif o[1] < 0
+			then
+				o[ 1 ] = -o[ 1 ]
 			end
 
-			if isdir
+			if o[ 2 ]
 			then
-				if etyped == 'Create'
+				if o[ 1 ] == 0
 				then
-					addWatch( path )
-				elseif etyped == 'Delete'
+					o[ 2 ]( )
+				elseif o[ 1 ] == 1
 				then
-					removeWatch( path, true )
-				elseif etyped == 'Move'
+					o[ 2 ]( args[ i + 1] )
+				elseif o[ 1 ] == 2
 				then
-					removeWatch( path, false )
-					addWatch( path2 )
+					o[ 2 ]( args[ i + 1], args[ i + 2] )
+				elseif o[ 1 ] == 3
+				then
+					o[ 2 ]( args[ i + 1], args[ i + 2], args[ i + 3] )
 				end
 			end
 
-			sync:delay( etyped, time, relative, relative2 )
+			i = i + o[1]
+		end
 
-		until true end
+		i = i + 1
 	end
 
-	--
-	-- Writes a status report about inotify to a file descriptor
-	--
-	local function statusReport( f )
-
-		f:write( 'Inotify watching ', wdpaths:size(), ' directories\n' )
+	log( 'Debug', 'lsyncd version: '.. lsyncd_version .. ' starting.' )
+	log( 'Debug', 'module search path: '.. package.path)
 
-		for wd, path in wdpaths:walk( )
-		do
-			f:write( '  ', wd, ': ', path, '\n' )
+	if clSettings.scripts then
+		for _, file in ipairs(clSettings.scripts) do
+			log( 'Info', 'Run addition script: ' .. file )
+			dofile(file)
 		end
 	end
 
+	if clSettings.syncs
+	then
+		if #nonopts ~= 0
+		then
+			log( 'Error', 'There cannot be command line syncs and a config file together.' )
 
-	--
-	-- Public interface.
-	--
-	return {
-		addSync = addSync,
-		event = event,
-		statusReport = statusReport,
-	}
+			os.exit( -1 )
+		end
+	else
+		if #nonopts == 0
+		then
+			runner.help( args[ 0 ] )
+		elseif #nonopts == 1
+		then
+			return nonopts[ 1 ]
+		else
+			-- TODO make this possible
+			log( 'Error', 'There can only be one config file in the command line.' )
 
-end)( )
+			os.exit( -1 )
+		end
+	end
+end
 
 
 --
--- Interface to OSX /dev/fsevents
+-- Settings taking the defaults if not set.
 --
--- This watches all the filesystems at once,
--- but needs root access.
+local defaultedSettings =
+{
+	'statusInterval',
+	'pollRate',
+	'watchBatch',
+	'watchBatchTime',
+	'journalInterval',
+}
+
 --
--- All fsevents specific implementation are enclosed here.
+-- Transfers the defaults of settings not set.
 --
-local Fsevents = ( function
-( )
-	--
-	-- A list indexed by syncs yielding
-	-- the root path the sync is interested in.
-	--
-	local syncRoots = { }
-
-	--
-	-- Adds a Sync to receive events.
-	--
-	local function addSync
-	(
-		sync,  -- object to receive events
-		dir    -- dir to watch
-	)
-		if syncRoots[ sync ]
+local function transferDefaults
+(
+	settings
+)
+	for _, k in ipairs( defaultedSettings )
+	do
+		if settings[ k ] == nil
 		then
-			error( 'duplicate sync in Fanotify.addSync()' )
+			settings[ k ] = default[ k ]
 		end
-
-		syncRoots[ sync ] = dir
-
 	end
+end
 
-	--
-	-- Called when an event has occured.
-	--
-	local function event
-	(
-		etype,  --  'Attrib', 'Modify', 'Create', 'Delete', 'Move'
-		isdir,  --  true if filename is a directory
-		time,   --  time of event
-		path,   --  path of file
-		path2   --  path of target in case of 'Move'
-	)
-		if isdir
-		then
-			path = path .. '/'
-
-			if path2 then path2 = path2 .. '/' end
-		end
-
-		log( 'Fsevents', etype, ',', isdir, ',', time,  ',', path, ',', path2 )
-
-		for _, sync in Syncs.iwalk()
-		do repeat
-
-			local root = sync.source
-
-			-- TODO combine ifs
-			if not path:starts( root )
-			then
-				if not path2 or not path2:starts( root )
-				then
-					break  -- continue
-				end
-			end
-
-			local relative = splitPath( path, root )
-
-			local relative2
+--
+-- The user functions of a config that may be layer 3 strings.
+--
+local ufuncs =
+{
+	'onAttrib',
+	'onCreate',
+	'onDelete',
+	'onModify',
+	'onMove',
+	'onStartup',
+}
 
-			if path2
-			then
-				relative2 = splitPath( path2, root )
+--
+-- Translates the layer 3 strings of a config to functions.
+--
+local function translateLayer3
+(
+	config
+)
+	for _, fn in ipairs( ufuncs )
+	do
+		if type(config[fn]) == 'string'
+		then
+			local ft = functionWriter.translate( config[ fn ] )
+			if _LUA_VERSION_MAJOR <= 5 and _LUA_VERSION_MINOR < 2 then
+				-- lua 5.1 and older
+				--- @diagnostic disable-next-line deprecated
+				config[ fn ] = assert( loadstring( 'return '..ft ) )( )
+			else
+				config[ fn ] = assert( load( 'return '..ft ) )( )
 			end
+		end
+	end
+end
 
-			-- possibly change etype for this iteration only
-			local etyped = etype
-
-			if etyped == 'Move'
-			then
-				if not relative2
-				then
-					log( 'Normal', 'Transformed Move to Delete for ', sync.config.name )
-
-					etyped = 'Delete'
-
-				elseif not relative
-				then
-					relative = relative2
-
-					relative2 = nil
-
-					log( 'Normal', 'Transformed Move to Create for ', sync.config.name )
-
-					etyped = 'Create'
-				end
-			end
+--
+-- Starts a Sync, its event monitor and its init.
+--
+local function startSync
+(
+	s
+)
+	-- resuming from a journal needs the watched directories
+	-- to find what changed meanwhile and a full action to
+	-- transfer them
+	local resume = Journal.open(
+		s,
+		s.config.monitor == 'inotify'
+		and s.config.full
+		and not uSettings.onepass
+	)
 
-			sync:delay( etyped, time, relative, relative2 )
+	if resume
+	then
+		log(
+			'Normal',
+			'Resuming ', s.config.name, ' from its journal, replaying ',
+			#resume.events, ' events and rescanning directories changed since ',
+			os.date( '%c', resume.since )
+		)
 
-		until true end
+		s.initDone = true
 
+		s:replay( resume.events )
 	end
 
+	-- with a valid tree index the tree is compared
+	-- against it instead of running the init
+	local indexed = not uSettings.onepass and TreeIndex.open( s )
 
-	--
-	-- Writes a status report about fsevents to a filedescriptor.
-	--
-	local function statusReport
-	(
-		f
-	)
-		-- TODO
+	if indexed
+	then
+		s.initDone = true
 	end
 
-	--
-	-- Public interface
-	--
-	return {
-		addSync      = addSync,
-		event        = event,
-		statusReport = statusReport
-	}
-end )( )
-
+	if s.config.monitor == 'inotify'
+	then
+		-- the init waits until the whole tree is watched
+		s.settingUp = true
+
+		Inotify.addSync(
+			s, s.source,
+			function( )
+				-- scans before the init may start
+				TreeIndex.scan(
+					s,
+					function( )
+						s.settingUp = false
+
+						-- the tree index finds all changes by itself
+						if resume and not indexed
+						then
+							local dirs = { }
+
+							for _, dir in ipairs( Inotify.changedDirs( resume.since ) )
+							do
+								if splitPath( dir, s.source )
+								then
+									dirs[ #dirs + 1 ] = dir
+								end
+							end
 
---
--- Holds information about the event monitor capabilities
--- of the core.
---
-Monitors = ( function
-( )
-	--
-	-- The cores monitor list
-	--
-	local list = { }
+							s:recover( dirs, resume.since )
+						end
+					end
+				)
+			end
+		)
+	else
+		if s.config.monitor == 'fanotify'
+		then
+			Fanotify.addSync( s, s.source )
+		elseif s.config.monitor == 'fsevents'
+		then
+			Fsevents.addSync( s, s.source )
+		elseif s.config.monitor == 'poll'
+		then
+			Poll.addSync( s, s.source )
+		else
+			error(
+				'sync ' ..
+				s.config.name ..
+				' has no known event monitor interface.'
+			)
+		end
 
+		-- the init waits until the tree is scanned
+		s.settingUp = true
 
-	--
-	-- The default event monitor.
-	--
-	local function default
-	( )
-		return list[ 1 ]
+		TreeIndex.scan(
+			s,
+			function( )
+				s.settingUp = false
+			end
+		)
 	end
 
-
-	--
-	-- Initializes with info received from core
-	--
-	local function initialize( clist )
-		for k, v in ipairs( clist )
-		do
-			list[ k ] = v
-		end
+	-- if the sync has an init function, the init delay
+	-- is stacked which causes the init function to be called.
+	if s.config.init and not resume and not indexed
+	then
+		s:addInitDelay( )
 	end
+end
 
+--
+-- Called from core on init or restart after user configuration.
+--
+-- firstTime:
+--    true when Lsyncd startups the first time,
+--    false on resets, due to a HUP signal not reloaded in place
+--    or monitor queue overflow.
+--
+function runner.initialize( firstTime )
 
-	--
-	-- Public interface
-	--
-	return {
-		default = default,
-		list = list,
-		initialize = initialize
-	}
+	-- Checks if user overwrote the settings function.
+	-- ( was Lsyncd <2.1 style )
+	if settings ~= settingsSafe
+	then
+		log(
+			'Error',
+			'Do not use settings = { ... }\n'..
+			'      please use settings{ ... } ( without the equal sign )'
+		)
 
-end)( )
+		os.exit( -1 )
+	end
 
+	lastReportedWaiting = false
 
---
--- Writes a status report file at most every 'statusintervall' seconds.
---
-local StatusFile = ( function
-( )
 	--
-	-- Timestamp when the status file has been written.
+	-- From this point on, no globals may be created anymore
 	--
-	local lastWritten = false
-
+	lockGlobals( )
 
 	--
-	-- Timestamp when a status file should be written.
+	-- all command line settings overwrite config file settings
 	--
-	local alarm = false
-
+	for k, v in pairs( clSettings )
+	do
+		if k ~= 'syncs'
+		then
+			uSettings[ k ] = v
+		end
+	end
 
 	--
-	-- Returns the alarm when the status file should be written-
+	-- implicitly forces 'insist' on Lsyncd resets.
 	--
-	local function getAlarm
-	( )
-		return alarm
+	if not firstTime
+	then
+		uSettings.insist = true
 	end
 
-
 	--
-	-- Called to check if to write a status file.
+	-- adds syncs specified by command line.
 	--
-	local function write
-	(
-		timestamp
-	)
-		log( 'Function', 'write( ', timestamp, ' )' )
-
-		--
-		-- takes care not write too often
-		--
-		if uSettings.statusInterval > 0
-		then
-			-- already waiting?
-			if alarm and timestamp < alarm
+	if clSettings.syncs
+	then
+		for _, s in ipairs( clSettings.syncs )
+		do
+			if s[ 1 ] == 'rsync'
 			then
-				log( 'Statusfile', 'waiting(', timestamp, ' < ', alarm, ')' )
-
-				return
-			end
-
-			-- determines when a next write will be possible
-			if not alarm
+				sync{
+					default.rsync,
+					source = s[ 2 ],
+					target = s[ 3 ]
+				}
+			elseif s[ 1 ] == 'rsyncssh'
 			then
-				local nextWrite = lastWritten and timestamp + uSettings.statusInterval
-
-				if nextWrite and timestamp < nextWrite
+				local opts = {
+					default.rsyncssh,
+					source = s[ 2 ],
+					host   = s[ 3 ],
+					targetdir=s[ 4 ]
+				}
+				if clSettings.ssh_extras ~= nil
 				then
-					log( 'Statusfile', 'setting alarm: ', nextWrite )
-					alarm = nextWrite
-
-					return
+					opts.ssh = {_extra = clSettings.ssh_extras}
 				end
+				sync(opts)
+			elseif s[ 1 ] == 'direct'
+			then
+				sync{
+					default.direct,
+					source=s[ 2 ],
+					target=s[ 3 ]
+				}
 			end
-
-			lastWritten = timestamp
-			alarm = false
 		end
+	end
 
-		log( 'Statusfile', 'writing now' )
-
-		local f, err = io.open( uSettings.statusFile, 'w' )
-
-		if not f
-		then
-			log(
-				'Error',
-				'Cannot open status file "' ..
-					uSettings.statusFile ..
-					'" :' ..
-					err
-			)
-			return
-		end
+	if uSettings.nodaemon
+	then
+		lsyncd.configure( 'nodaemon' )
+	end
 
-		f:write( 'Lsyncd status report at ', os.date( ), '\n\n' )
+	if uSettings.logfile
+	then
+		lsyncd.configure( 'logfile', uSettings.logfile )
+	end
 
-		for i, s in Syncs.iwalk( )
-		do
-			s:statusReport( f )
+	if uSettings.logident
+	then
+		lsyncd.configure( 'logident', uSettings.logident )
+	end
 
-			f:write( '\n' )
-		end
+	if uSettings.logfacility
+	then
+		lsyncd.configure( 'logfacility', uSettings.logfacility )
+	end
 
-		for i, t in Tunnels.iwalk( )
-		do
-			t:statusReport( f )
+	if uSettings.pidfile
+	then
+		lsyncd.configure( 'pidfile', uSettings.pidfile )
+	end
 
-			f:write( '\n' )
-		end
+	--
+	-- Transfers some defaults to uSettings
+	--
+	transferDefaults( uSettings )
 
-		Inotify.statusReport( f )
+	-- makes sure the user gave Lsyncd anything to do
+	if Syncs.size() == 0
+	then
+		log( 'Error', 'Nothing to watch!' )
 
-		f:close( )
+		os.exit( -1 )
 	end
 
+	-- from now on use logging as configured instead of stdout/err.
+	lsyncdStatus = 'run';
 
-	--
-	-- Public interface
-	--
-	return {
-		write = write,
-		getAlarm = getAlarm
-	}
+	lsyncd.configure( 'running' );
 
-end )( )
+	-- translates layer 3 scripts
+	for _, s in Syncs.iwalk()
+	do
+		translateLayer3( s.config )
+	end
 
+	-- runs through the Syncs created by users
+	for _, s in Syncs.iwalk( )
+	do
+		startSync( s )
+	end
+end
 
 --
--- Lets userscripts make their own alarms.
+-- Called by core to query the soonest alarm.
 --
-local UserAlarms = ( function
+-- @return false ... no alarm, core can go in untimed sleep
+--         true  ... immediate action
+--         times ... the alarm time (only read if number is 1)
+--
+function runner.getAlarm
 ( )
-	local alarms = { }
+	log( 'Function', 'getAlarm( )' )
+
+	if lsyncdStatus ~= 'run' then return false end
+
+	local alarm = false
+	local alarmSource = ""
 
 	--
-	-- Calls the user function at timestamp.
+	-- Checks if 'a' is sooner than the 'alarm' up-value.
 	--
-	local function alarm
+	local function checkAlarm
 	(
-		timestamp,
-		func,
-		extra
+		a,  -- alarm time
+		src -- name of subsystem
 	)
-		local idx
-
-		for k, v in ipairs( alarms )
-		do
-			if timestamp < v.timestamp
-			then
-				idx = k
-
-				break
-			end
-		end
-
-		local a =
-		{
-			timestamp = timestamp,
-			func = func,
-			extra = extra
-		}
+		if a == nil then error( 'got nil alarm' ) end
 
-		if idx
+		if (type(alarm) == "boolean" and alarm == true) or not a
 		then
-			table.insert( alarms, idx, a )
-		else
-			table.insert( alarms, a )
+			-- 'alarm' is already immediate or
+			-- a not a new alarm
+			return
 		end
-	end
-
 
-	--
-	-- Retrieves the soonest alarm.
-	--
-	local function getAlarm
-	( )
-		if #alarms == 0
+		-- sets 'alarm' to a if a is sooner
+		if not alarm or a < alarm
 		then
-			return false
-		else
-			return alarms[1].timestamp
+			alarm = a
+			alarmSource = src
 		end
 	end
 
-
 	--
-	-- Calls user alarms.
+	-- checks all syncs for their earliest alarm,
+	-- but only if the global process limit is not yet reached.
 	--
-	local function invoke
-	(
-		timestamp
-	)
-		while #alarms > 0
-		and alarms[ 1 ].timestamp <= timestamp
+
+	if not uSettings.maxProcesses
+	or processCount < uSettings.maxProcesses
+	then
+		for _, s in Syncs.iwalk( )
 		do
-			alarms[ 1 ].func( alarms[ 1 ].timestamp, alarms[ 1 ].extra )
-			table.remove( alarms, 1 )
+			checkAlarm( s:getAlarm( ), s.config.name )
 		end
+	else
+		log(
+			'Alarm',
+			'at global process limit.'
+		)
 	end
+	-- checks for tunnel alarm
+	checkAlarm( Tunnels.getAlarm( ), "Tunnels" )
 
+	-- checks if a statusfile write has been delayed
+	checkAlarm( StatusFile.getAlarm( ), "StatusFile" )
+	-- checks for an userAlarm
+	checkAlarm( UserAlarms.getAlarm( ), "UserAlarms" )
+	-- checks for directories to poll
+	checkAlarm( Inotify.getAlarm( ), "Inotify" )
+	-- checks for tree index scans going on
+	checkAlarm( TreeIndex.getAlarm( ), "TreeIndex" )
+	checkAlarm( Poll.getAlarm( ), "Poll" )
+	-- checks for a group commit of the journals
+	checkAlarm( Journal.getAlarm( ), "Journal" )
+	log( 'Alarm', 'runner.getAlarm returns: ', alarm, " Source:", alarmSource )
 
-	--
-	-- Public interface
-	--
-	return {
-		alarm    = alarm,
-		getAlarm = getAlarm,
-		invoke   = invoke
-	}
-
-end )( )
-
---============================================================================
--- Lsyncd runner's plugs. These functions are called from core.
---============================================================================
-
---
--- Current status of Lsyncd.
---
--- 'init'  ... on (re)init
--- 'run'   ... normal operation
--- 'fade'  ... waits for remaining processes
---
-local lsyncdStatus = 'init'
+	return alarm
+end
 
---
--- The cores interface to the runner.
---
-local runner = { }
 
 --
--- Last time said to be waiting for more child processes
+-- Called when an file system monitor events arrive
 --
-local lastReportedWaiting = false
+runner.inotifyEvent = Inotify.event
+runner.inotifyEvents = Inotify.events
+runner.fsEventsEvent = Fsevents.event
 
 --
--- Called from core whenever Lua code failed.
---
--- Logs a backtrace
+-- Collector for every child process that finished in startup phase
 --
-function runner.callError
+function runner.collector
 (
-	message
+	pid,       -- pid of the child process
+	exitcode   -- exitcode of the child process
 )
-	log( 'Error', 'in Lua: ', message )
-
-	-- prints backtrace
-	local level = 2
-
-	while true
-	do
-		local info = debug.getinfo( level, 'Sl' )
-
-		if not info
-		then
-			terminate( -1 )
-		end
-
-		log(
-			'Error',
-			'Backtrace ',
-			level - 1, ' :',
-			info.short_src, ':',
-			info.currentline
-		)
+	if exitcode ~= 0
+	then
+		log( 'Error', 'Startup process', pid, ' failed' )
 
-		level = level + 1
+		terminate( -1 )
 	end
-end
 
+	return 0
+end
 
 --
--- Called from core whenever a child process has finished and
--- the zombie process was collected by core.
+-- Called by core when an overflow happened.
 --
-function runner.collectProcess
-(
-	pid,       -- process id
-	exitcode   -- exitcode
-)
-	for _, s in Syncs.iwalk( )
-	do
-		if s:collect( pid, exitcode ) then
-			processCount = processCount - 1
-			break
-		end
-	end
-
-	for _, s in Tunnels.iwalk( )
-	do
-		if s:collect( pid, exitcode ) then
-			break
-		end
-	end
-
-	if processCount < 0
-	then
-		error( 'negative number of processes!' )
-	end
-
-
-end
-
 --
--- Called from core everytime a masterloop cycle runs through.
+-- With the 'onOverflow = "rescan"' setting, the watches and delays
+-- are kept and only directories changed since the oldest event
+-- still pending of any sync are rescanned.
 --
--- This happens in case of
---   * an expired alarm.
---   * a returned child process.
---   * received filesystem events.
---   * received a HUP, TERM or INT signal.
+-- Returns true if the core has to reset the daemon.
 --
-function runner.cycle(
-	timestamp   -- the current kernel time (in jiffies)
-)
-	log( 'Function', 'cycle( ', timestamp, ' )' )
+function runner.overflow
+( )
+	local rescan = uSettings.onOverflow == 'rescan'
 
-	if lsyncdStatus == 'fade'
+	local since
+
+	if rescan
 	then
-		if processCount > 0
-		then
-			if
-				lastReportedWaiting == false or
-				timestamp >= lastReportedWaiting + 60
+		for _, s in Syncs.iwalk( )
+		do
+			local ss = s:recoverySince( )
+
+			if not ss
 			then
-				lastReportedWaiting = timestamp
+				rescan = false
 
-				log(
-					'Normal',
-					'waiting for ',
-					processCount,
-					' more child processes.'
-				)
+				break
 			end
 
-			return true
-		else
-			Tunnels.killAll()
-			return false
-		end
-	end
-
-	if lsyncdStatus ~= 'run'
-	then
-		error( 'runner.cycle() called while not running!' )
-	end
-
-	-- check and start tunnels
-	if not uSettings.maxProcesses
-	or processCount < uSettings.maxProcesses
-	then
-		Tunnels.invoke( timestamp )
-	end
-
-	if uSettings.onepass
-	then
-		local allDone = true
-		for i, s in Syncs.iwalk( )
-		do
-			if s.initDone == true
+			if not since or ss < since
 			then
-				s.disabled = true
-			else
-				allDone = false
+				since = ss
 			end
 		end
-		if allDone and processCount == 0 then
-			log( 'Info', 'onepass active and all syncs finished. Exiting successfully')
-			os.exit(0)
-		end
 	end
 
-	--
-	-- goes through all syncs and spawns more actions
-	-- if possibly. But only let Syncs invoke actions if
-	-- not at global limit
-	--
-	if not uSettings.maxProcesses
-	or processCount < uSettings.maxProcesses
+	if not rescan or not since
 	then
-		local start = Syncs.getRound( )
+		log( 'Normal', '--- OVERFLOW in event queue ---' )
 
-		local ir = start
+		-- events got lost, the restart has to run the full init
+		Journal.discard( )
 
-		repeat
-			local s = Syncs.get( ir )
+		lsyncdStatus = 'fade'
 
-			s:invokeActions( timestamp )
+		return true
+	end
 
-			ir = ir + 1
+	log( 'Normal', '--- OVERFLOW in event queue, rescanning changed directories ---' )
 
-			if ir > Syncs.size( )
-			then
-				ir = 1
-			end
-		until ir == start
+	local dirs = Inotify.changedDirs( since )
 
-		Syncs.nextRound( )
-	end
+	for _, s in Syncs.iwalk( )
+	do
+		local sdirs = { }
 
-	UserAlarms.invoke( timestamp )
+		for _, dir in ipairs( dirs )
+		do
+			if splitPath( dir, s.source )
+			then
+				sdirs[ #sdirs + 1 ] = dir
+			end
+		end
 
-	if uSettings.statusFile
-	then
-		StatusFile.write( timestamp )
+		s:recover( sdirs, since )
 	end
 
-	return true
+	return false
 end
 
 --
--- Called by core if '-help' or '--help' is in
--- the arguments.
+-- Tells if two values of configs are the same.
 --
-function runner.help(_arg0)
-	io.stdout:write(
-'lsyncd version: ' .. lsyncd_version ..
-[[
-
-
-USAGE:
-  runs a config file:
-    lsyncd [OPTIONS] [CONFIG-FILE]
+-- Functions are only the same if they are the very same,
+-- those of a config file read again differ.
+--
+local function sameValue
+(
+	a,
+	b,
+	seen  -- the tables compared already
+)
+	if a == b
+	then
+		return true
+	end
 
-  default rsync behaviour:
-    lsyncd [OPTIONS] -rsync [SOURCE] [TARGET]
+	local ta = type( a )
 
-  default rsync with mv's through ssh:
-    lsyncd [OPTIONS] -rsyncssh [SOURCE] [HOST] [TARGETDIR]
+	if ta ~= type( b )
+	then
+		return false
+	end
 
-  default local copying mechanisms (cp|mv|rm):
-    lsyncd [OPTIONS] -direct [SOURCE] [TARGETDIR]
+	if ta ~= 'table'
+	then
+		return false
+	end
 
-OPTIONS:
-  -delay SECS         Overrides default delay times
-  -help               Shows this
-  -insist             Continues startup even if it cannot connect
-  -log    all         Logs everything (debug)
-  -log    scarce      Logs errors only
-  -log    [Category]  Turns on logging for a debug category
-  -logfile FILE       Writes log to FILE (DEFAULT: uses syslog)
-  -nodaemon           Does not detach and logs to stdout/stderr
-  -onepass            Sync once and exit
-  -pidfile FILE       Writes Lsyncds PID into FILE
-  -runner FILE        Loads Lsyncds lua part from FILE
-  -script FILE        Script to load before execting runner (ADVANCED)
-  -sshopts            Additional ssh command options when using rsyncssh
-  -version            Prints versions and exits
+	seen = seen or { }
 
-LICENSE:
-  GPLv2 or any later version.
+	if seen[ a ] == b
+	then
+		return true
+	end
 
-SEE:
-  `man lsyncd` for further information.
+	seen[ a ] = b
 
-]])
+	for k, v in pairs( a )
+	do
+		if not sameValue( v, rawget( b, k ), seen )
+		then
+			return false
+		end
+	end
 
---
---  -monitor NAME       Uses operating systems event montior NAME
---                      (inotify/fanotify/fsevents)
+	for k, _ in pairs( b )
+	do
+		if rawget( a, k ) == nil
+		then
+			return false
+		end
+	end
 
-	os.exit( -1 )
+	return true
 end
 
-
 --
--- Called from core to parse the command line arguments
+-- Config keys a reload compares by the excludes
+-- and filters loaded from them.
 --
--- returns a string as user script to load.
---    or simply 'true' if running with rsync bevaiour
+local filterKeys =
+{
+	exclude = true,
+	excludeFrom = true,
+	filter = true,
+	filterFrom = true,
+	subdirs = true,
+}
+
 --
--- terminates on invalid arguments.
+-- Tells if two configs are the same but for 'filterKeys'.
 --
-function runner.configure( args, monitors )
-
-	Monitors.initialize( monitors )
-
-	--
-	-- a list of all valid options
-	--
-	-- first paramter is the number of parameters an option takes
-	-- if < 0 the called function has to check the presence of
-	-- optional arguments.
-	--
-	-- second paramter is the function to call
-	--
-	local options =
-	{
-		-- log is handled by core already.
-
-		delay =
-		{
-			1,
-			function
-			(
-				secs
-			)
-				clSettings.delay = secs + 0
-			end
-		},
-
-		insist =
-		{
-			0,
-			function
-			( )
-				clSettings.insist = true
-			end
-		},
+local function sameConfig
+(
+	a,
+	b
+)
+	for k, v in pairs( a )
+	do
+		if not filterKeys[ k ] and not sameValue( v, b[ k ] )
+		then
+			return false
+		end
+	end
 
-		log =
-		{
-			1,
-			nil
-		},
+	for k, _ in pairs( b )
+	do
+		if not filterKeys[ k ] and a[ k ] == nil
+		then
+			return false
+		end
+	end
 
-		logfile =
-		{
-			1,
-			function
-			(
-				file
-			)
-				clSettings.logfile = file
-			end
-		},
+	return true
+end
 
-		monitor =
-		{
-			-1,
-			function
-			(
-				monitor
-			)
-				if not monitor
-				then
-					io.stdout:write( 'This Lsyncd supports these monitors:\n' )
-					for _, v in ipairs( Monitors.list )
-					do
-						io.stdout:write( '   ', v, '\n' )
-					end
+--
+-- Returns the lines of filters in order, nil for none.
+--
+local function filterLines
+(
+	filters
+)
+	if not filters
+	then
+		return nil
+	end
 
-					io.stdout:write('\n')
+	local lines = { }
 
-					lsyncd.terminate( -1 )
-				else
-					clSettings.monitor = monitor
-				end
-			end
-		},
+	for i, entry in ipairs( filters.list )
+	do
+		lines[ i ] = entry.rule .. entry.pattern
+	end
 
-		nodaemon =
-		{
-			0,
-			function
-			( )
-				clSettings.nodaemon = true
-			end
-		},
+	return lines
+end
 
-		onepass =
-		{
-			0,
-			function
-			( )
-				clSettings.onepass = true
-			end
-		},
+--
+-- Global functions acting on the running Lsyncd
+-- when called while a config file is read.
+--
+local liveFunctions =
+{
+	'alarm',
+	'nonobservefd',
+	'observefd',
+	'spawn',
+	'spawnShell',
+	'tunnel',
+}
 
-		pidfile =
-		{
-			1,
-			function
-			(
-				file
-			)
-				clSettings.pidfile=file
-			end
-		},
+--
+-- Reads the config file again without creating anything.
+--
+-- Returns a table of the sync{ } calls, the settings{ } made
+-- and the first function called acting on the running Lsyncd,
+-- or nil and an error message.
+--
+local function readConfig
+(
+	path
+)
+	local conf = { syncs = { }, settings = { }, live = nil }
 
-		sshopts =
-		{
-			1,
-			function
-			(
-				options
-			)
-				clSettings.ssh_extras = splitQuotedString(options)
-			end
-		},
+	-- the config file finds the globals of Lsyncd,
+	-- but creates its own ones in env
+	local env = setmetatable(
+		{ },
+		{ __index = function( _, k ) return rawget( _G, k ) end }
+	)
 
-		script =
-		{
-			1,
-			function
-			(
-				file
-			)
-				clSettings.scripts = clSettings.scripts or {}
-				table.insert(clSettings.scripts, file)
-			end
-		},
+	env.sync = function
+	(
+		opts
+	)
+		local info = debug.getinfo( 2, 'Sl' )
 
-		rsync  =
+		conf.syncs[ #conf.syncs + 1 ] =
 		{
-			2,
-			function
-			(
-				src,
-				trg
-			)
-				clSettings.syncs = clSettings.syncs or { }
-				table.insert( clSettings.syncs, { 'rsync', src, trg } )
-			end
-		},
+			opts = opts,
+			where = info.short_src .. ':' .. info.currentline,
+		}
+	end
 
-		rsyncssh =
-		{
-			3,
-			function
-			(
-				src,
-				host,
-				tdir
-			)
-				clSettings.syncs = clSettings.syncs or { }
+	env.settings = function
+	(
+		a1
+	)
+		if type( a1 ) == 'string'
+		then
+			return conf.settings[ a1 ]
+		end
 
-				table.insert( clSettings.syncs, { 'rsyncssh', src, host, tdir } )
-			end
-		},
+		setSettings( conf.settings, a1, 3 )
+	end
 
-		direct =
-		{
-			2,
-			function
-			(
-				src,
-				trg
-			)
-				clSettings.syncs = clSettings.syncs or { }
+	local readSettings = env.settings
 
-				table.insert( clSettings.syncs, { 'direct', src, trg } )
-			end
-		},
+	for _, name in ipairs( liveFunctions )
+	do
+		env[ name ] = function( )
+			conf.live = conf.live or name
+		end
+	end
 
-		version =
-		{
-			0,
-			function
-			( )
-				io.stdout:write( 'Version: ', lsyncd_version, '\n' )
+	local chunk, err
 
-				os.exit( 0 )
-			end
-		}
-	}
+	if _LUA_VERSION_MAJOR <= 5 and _LUA_VERSION_MINOR < 2 then
+		-- lua 5.1 and older
+		chunk, err = loadfile( path )
 
-	-- non-opts is filled with all args that were no part dash options
+		if chunk
+		then
+			--- @diagnostic disable-next-line deprecated
+			setfenv( chunk, env )
+		end
+	else
+		chunk, err = loadfile( path, 't', env )
+	end
 
-	local nonopts = { }
+	if not chunk
+	then
+		return nil, err
+	end
 
-	local i = 1
+	local ok, rerr = pcall( chunk )
 
-	while i <= #args
+	if not ok
+	then
+		return nil, rerr
+	end
+
+	if rawget( env, 'settings' ) ~= readSettings
+	then
+		return nil, 'Do not use settings = { ... }'
+	end
+
+	-- the functions of the config call the real ones from now on
+	env.sync = nil
+
+	env.settings = nil
+
+	for _, name in ipairs( liveFunctions )
 	do
-		local a = args[ i ]
+		env[ name ] = nil
+	end
 
-		if a:sub( 1, 1 ) ~= '-'
-		then
-			table.insert( nonopts, args[ i ] )
-		else
-			if a:sub( 1, 2 ) == '--'
-			then
-				a = a:sub( 3 )
-			else
-				a = a:sub( 2 )
-			end
+	return conf
+end
 
-			local o = options[ a ]
+--
+-- Returns the relative paths the Sync 'ns' freshly created
+-- by a reload includes, but the running Sync 's' does not.
+--
+-- Only the directories 's' includes are read, of a newly
+-- included directory nothing within is returned.
+--
+local function gainedPaths
+(
+	s,
+	ns
+)
+	local gained = { }
 
-			if not o
-			then
-				log( 'Error', 'unknown option command line option ', args[ i ] )
+	-- a sync turning to subdirs gains the directories of its root
+	local flat = s.config.subdirs == false and ns.config.subdirs ~= false
 
-				os.exit( -1 )
-			end
+	local stack = { { '/', s:dirVerdict( '/' ), ns:dirVerdict( '/' ) } }
 
-			if o[ 1 ] >= 0 and i + o[ 1 ] > #args
-			then
-				log( 'Error', a ,' needs ', o[ 1 ],' arguments' )
+	while #stack > 0
+	do
+		local dir, ov, nv = table.unpack( table.remove( stack ) )
 
-				os.exit( -1 )
-			elseif o[1] < 0
-			then
-				o[ 1 ] = -o[ 1 ]
-			end
+		-- nothing within is gained if all of it was included
+		-- or if all of it is excluded now
+		if ( ov ~= 'included' or flat ) and nv ~= 'excluded'
+		then
+			for _, e in ipairs( lsyncd.scandir( s.source .. dir:sub( 2 ) ) or { } )
+			do
+				local isdir = e.type == 'directory'
 
-			if o[ 2 ]
-			then
-				if o[ 1 ] == 0
-				then
-					o[ 2 ]( )
-				elseif o[ 1 ] == 1
+				local path = dir .. e.name .. ( isdir and '/' or '' )
+
+				if ns:testFilter( path, nv )
 				then
-					o[ 2 ]( args[ i + 1] )
-				elseif o[ 1 ] == 2
+					-- excluded now
+				elseif s:testFilter( path, ov ) or ( flat and isdir )
 				then
-					o[ 2 ]( args[ i + 1], args[ i + 2] )
-				elseif o[ 1 ] == 3
+					gained[ #gained + 1 ] = path
+				elseif isdir and ns.config.subdirs ~= false
 				then
-					o[ 2 ]( args[ i + 1], args[ i + 2], args[ i + 3] )
+					stack[ #stack + 1 ] =
+					{
+						path,
+						s:dirVerdict( path, ov ),
+						ns:dirVerdict( path, nv ),
+					}
 				end
 			end
-
-			i = i + o[1]
 		end
-
-		i = i + 1
 	end
 
-	log( 'Debug', 'lsyncd version: '.. lsyncd_version .. ' starting.' )
-	log( 'Debug', 'module search path: '.. package.path)
+	return gained
+end
 
-	if clSettings.scripts then
-		for _, file in ipairs(clSettings.scripts) do
-			log( 'Info', 'Run addition script: ' .. file )
-			dofile(file)
-		end
-	end
+--
+-- Removes the delays waiting on paths the Sync 's' excludes.
+--
+local function dropExcluded
+(
+	s
+)
+	local gone = { }
 
-	if clSettings.syncs
-	then
-		if #nonopts ~= 0
+	for _, d in s.delays:qpairs( )
+	do
+		if d.status ~= 'active'
+		and s:testFilter( d.path )
+		and ( not d.path2 or s:testFilter( d.path2 ) )
 		then
-			log( 'Error', 'There cannot be command line syncs and a config file together.' )
-
-			os.exit( -1 )
+			gone[ #gone + 1 ] = d
 		end
-	else
-		if #nonopts == 0
-		then
-			runner.help( args[ 0 ] )
-		elseif #nonopts == 1
-		then
-			return nonopts[ 1 ]
-		else
-			-- TODO make this possible
-			log( 'Error', 'There can only be one config file in the command line.' )
+	end
 
-			os.exit( -1 )
-		end
+	for _, d in ipairs( gone )
+	do
+		s:removeDelay( d )
 	end
-end
 
+	if #gone > 0
+	then
+		log( 'Normal', 'Dropped ', #gone, ' events of ', s.config.name, ' excluded now.' )
+	end
+end
 
 --
--- Called from core on init or restart after user configuration.
+-- Applies the excludes, filters and config of the Sync 'ns'
+-- freshly created by a reload to the running Sync 's'.
 --
--- firstTime:
---    true when Lsyncd startups the first time,
---    false on resets, due to HUP signal or monitor queue overflow.
+-- Returns 'widened' if anything formerly filtered may be
+-- included now, 'narrowed' if only more is filtered,
+-- 'changed' if only the config changed or nil if nothing did.
+-- When widened, also returns the paths included now
+-- as found by gainedPaths( ).
 --
-function runner.initialize( firstTime )
+local function applySync
+(
+	s,
+	ns
+)
+	local widened = false
 
-	-- Checks if user overwrote the settings function.
-	-- ( was Lsyncd <2.1 style )
-	if settings ~= settingsSafe
-	then
-		log(
-			'Error',
-			'Do not use settings = { ... }\n'..
-			'      please use settings{ ... } ( without the equal sign )'
-		)
+	local narrowed = false
 
-		os.exit( -1 )
+	for pattern, _ in pairs( s.excludes.list )
+	do
+		if not ns.excludes.list[ pattern ]
+		then
+			widened = true
+		end
 	end
 
-	lastReportedWaiting = false
-
-	--
-	-- From this point on, no globals may be created anymore
-	--
-	lockGlobals( )
-
-	--
-	-- all command line settings overwrite config file settings
-	--
-	for k, v in pairs( clSettings )
+	for pattern, _ in pairs( ns.excludes.list )
 	do
-		if k ~= 'syncs'
+		if not s.excludes.list[ pattern ]
 		then
-			uSettings[ k ] = v
+			narrowed = true
 		end
 	end
 
-	--
-	-- implicitly forces 'insist' on Lsyncd resets.
-	--
-	if not firstTime
+	local filtersChanged =
+		not sameValue( filterLines( s.filters ), filterLines( ns.filters ) )
+
+	if filtersChanged
 	then
-		uSettings.insist = true
+		widened = true
 	end
 
-	--
-	-- adds syncs specified by command line.
-	--
-	if clSettings.syncs
+	local subdirs = s.config.subdirs ~= false
+
+	if subdirs ~= ( ns.config.subdirs ~= false )
 	then
-		for _, s in ipairs( clSettings.syncs )
-		do
-			if s[ 1 ] == 'rsync'
-			then
-				sync{
-					default.rsync,
-					source = s[ 2 ],
-					target = s[ 3 ]
-				}
-			elseif s[ 1 ] == 'rsyncssh'
-			then
-				local opts = {
-					default.rsyncssh,
-					source = s[ 2 ],
-					host   = s[ 3 ],
-					targetdir=s[ 4 ]
-				}
-				if clSettings.ssh_extras ~= nil
-				then
-					opts.ssh = {_extra = clSettings.ssh_extras}
-				end
-				sync(opts)
-			elseif s[ 1 ] == 'direct'
-			then
-				sync{
-					default.direct,
-					source=s[ 2 ],
-					target=s[ 3 ]
-				}
-			end
+		s.filterRound = s.filterRound + 1
+
+		if subdirs then narrowed = true else widened = true end
+	end
+
+	-- what is gained is searched by the excludes before and after
+	local gained = widened and gainedPaths( s, ns )
+
+	for pattern, _ in pairs( s.excludes.list )
+	do
+		if not ns.excludes.list[ pattern ]
+		then
+			s:rmExclude( pattern )
 		end
 	end
 
-	if uSettings.nodaemon
-	then
-		lsyncd.configure( 'nodaemon' )
+	for pattern, _ in pairs( ns.excludes.list )
+	do
+		if not s.excludes.list[ pattern ]
+		then
+			s:addExclude( pattern )
+		end
 	end
 
-	if uSettings.logfile
+	if filtersChanged
 	then
-		lsyncd.configure( 'logfile', uSettings.logfile )
+		s:setFilters( ns.filters )
 	end
 
-	if uSettings.logident
+	local changed = not sameConfig( s.config, ns.config )
+
+	-- the functions of the config may differ by what they
+	-- enclose, so the new config is taken in any case
+	s.config = ns.config
+
+	s.cron = ns.cron
+
+	if changed
 	then
-		lsyncd.configure( 'logident', uSettings.logident )
+		s.nextCronAlarm = false
 	end
 
-	if uSettings.logfacility
+	if widened
 	then
-		lsyncd.configure( 'logfacility', uSettings.logfacility )
+		return 'widened', gained
+	elseif narrowed
+	then
+		return 'narrowed'
+	elseif changed
+	then
+		return 'changed'
 	end
 
-	if uSettings.pidfile
+	return nil
+end
+
+--
+-- Reloads the config file in place.
+--
+-- The Syncs are matched by what they transfer from and to,
+-- matched ones keep their watches and delays. Changed excludes
+-- and filters are applied to them, unmatched ones are removed
+-- or started anew.
+--
+-- Returns false if Lsyncd has to reset instead.
+--
+local function reload
+(
+	path
+)
+	local conf, err = readConfig( path )
+
+	if not conf
 	then
-		lsyncd.configure( 'pidfile', uSettings.pidfile )
+		log( 'Error', 'Cannot reload config: ', err )
+
+		log( 'Normal', 'Keeping the running configuration.' )
+
+		return true
 	end
 
-	--
-	-- Transfers some defaults to uSettings
-	--
-	if uSettings.statusInterval == nil
+	if conf.live
 	then
-		uSettings.statusInterval = default.statusInterval
+		log( 'Normal', 'The config calls ', conf.live, '( ) when loaded.' )
+
+		return false
 	end
 
-	-- makes sure the user gave Lsyncd anything to do
-	if Syncs.size() == 0
+	if #conf.syncs == 0
 	then
-		log( 'Error', 'Nothing to watch!' )
+		log( 'Error', 'Cannot reload config: nothing to watch!' )
 
-		os.exit( -1 )
+		log( 'Normal', 'Keeping the running configuration.' )
+
+		return true
 	end
 
-	-- from now on use logging as configured instead of stdout/err.
-	lsyncdStatus = 'run';
+	local newSettings = conf.settings
 
-	lsyncd.configure( 'running' );
+	for k, v in pairs( clSettings )
+	do
+		if k ~= 'syncs'
+		then
+			newSettings[ k ] = v
+		end
+	end
 
-	local ufuncs =
-	{
-		'onAttrib',
-		'onCreate',
-		'onDelete',
-		'onModify',
-		'onMove',
-		'onStartup',
-	}
+	transferDefaults( newSettings )
 
-	-- translates layer 3 scripts
-	for _, s in Syncs.iwalk()
+	for _, t in ipairs{ uSettings, newSettings }
 	do
-		-- checks if any user functions is a layer 3 string.
-		local config = s.config
-
-		for _, fn in ipairs( ufuncs )
+		for k, _ in pairs( t )
 		do
-			if type(config[fn]) == 'string'
+			if not reloadableSettings[ k ]
+			and not sameValue( uSettings[ k ], newSettings[ k ] )
 			then
-				local ft = functionWriter.translate( config[ fn ] )
-				if _LUA_VERSION_MAJOR <= 5 and _LUA_VERSION_MINOR < 2 then
-					-- lua 5.1 and older
-					--- @diagnostic disable-next-line deprecated
-					config[ fn ] = assert( loadstring( 'return '..ft ) )( )
-				else
-					config[ fn ] = assert( load( 'return '..ft ) )( )
-				end
+				log( 'Normal', 'The setting ', k, ' changed.' )
+
+				return false
 			end
 		end
 	end
 
-	-- runs through the Syncs created by users
-	for _, s in Syncs.iwalk( )
+	-- the syncs inherit settings when prepared
+	local oldSettings = { }
+
+	for k, _ in pairs( reloadableSettings )
 	do
-		if s.config.monitor == 'inotify'
+		oldSettings[ k ] = uSettings[ k ]
+
+		uSettings[ k ] = newSettings[ k ]
+	end
+
+	local fresh = { }
+
+	for i, c in ipairs( conf.syncs )
+	do
+		local ok, config, perr = pcall( Syncs.prepare, c.opts, 2 )
+
+		local ns
+
+		if ok and config
 		then
-			Inotify.addSync( s, s.source )
-		elseif s.config.monitor == 'fsevents'
+			-- so Sync{n} is still the n-th call to sync{}
+			if not config.name
+			then
+				config.name = 'Sync' .. i
+			end
+
+			ok, perr = pcall( translateLayer3, config )
+
+			if ok
+			then
+				ok, ns = pcall( Sync.new, config )
+
+				if not ok then perr = ns end
+			end
+		elseif not ok
 		then
-			Fsevents.addSync( s, s.source )
-		else
-			error(
-				'sync ' ..
-				s.config.name ..
-				' has no known event monitor interface.'
-			)
+			perr = config
 		end
 
-		-- if the sync has an init function, the init delay
-		-- is stacked which causes the init function to be called.
-		if s.config.init
+		if not ns
 		then
-			s:addInitDelay( )
+			for k, v in pairs( oldSettings )
+			do
+				uSettings[ k ] = v
+			end
+
+			log( 'Error', 'Cannot reload config: ', c.where, ': ', perr )
+
+			log( 'Normal', 'Keeping the running configuration.' )
+
+			return true
 		end
+
+		fresh[ i ] = ns
 	end
-end
 
---
--- Called by core to query the soonest alarm.
---
--- @return false ... no alarm, core can go in untimed sleep
---         true  ... immediate action
---         times ... the alarm time (only read if number is 1)
---
-function runner.getAlarm
-( )
-	log( 'Function', 'getAlarm( )' )
+	-- the running syncs by what they transfer
+	local running = { }
 
-	if lsyncdStatus ~= 'run' then return false end
+	for _, s in Syncs.iwalk( )
+	do
+		local id = Journal.identity( s.config )
 
-	local alarm = false
-	local alarmSource = ""
+		running[ id ] = running[ id ] or { }
 
-	--
-	-- Checks if 'a' is sooner than the 'alarm' up-value.
-	--
-	local function checkAlarm
-	(
-		a,  -- alarm time
-		src -- name of subsystem
-	)
-		if a == nil then error( 'got nil alarm' ) end
+		table.insert( running[ id ], s )
+	end
 
-		if (type(alarm) == "boolean" and alarm == true) or not a
+	local retired = { }
+
+	local started = { }
+
+	local counts = { kept = 0, changed = 0, filtered = 0 }
+
+	for _, ns in ipairs( fresh )
+	do
+		local list = running[ Journal.identity( ns.config ) ]
+
+		local s = list and table.remove( list, 1 )
+
+		if s and s.config.monitor ~= ns.config.monitor
 		then
-			-- 'alarm' is already immediate or
-			-- a not a new alarm
-			return
+			retired[ #retired + 1 ] = s
+
+			s = nil
 		end
 
-		-- sets 'alarm' to a if a is sooner
-		if not alarm or a < alarm
+		if not s
 		then
-			alarm = a
-			alarmSource = src
+			started[ #started + 1 ] = ns
+		else
+			local change, gained = applySync( s, ns )
+
+			if change == 'widened' or change == 'narrowed'
+			then
+				counts.filtered = counts.filtered + 1
+
+				log( 'Normal', 'Excludes or filters of ', s.config.name, ' changed.' )
+
+				dropExcluded( s )
+
+				if s.config.monitor == 'poll'
+				then
+					Poll.removeSync( s )
+
+					Poll.addSync( s, s.source )
+				end
+
+				if change == 'widened'
+				then
+					local dirs = { }
+
+					for _, path in ipairs( gained )
+					do
+						if path:byte( -1 ) == 47
+						then
+							dirs[ #dirs + 1 ] = path
+						end
+					end
+
+					if #gained > 0
+					then
+						log(
+							'Normal',
+							'Transferring ', #gained, ' paths of ', s.config.name,
+							' no longer excluded.'
+						)
+					end
+
+					-- what is included now is transferred
+					-- once it is watched
+					local function ready( )
+						if s.disabled
+						then
+							return
+						end
+
+						for _, path in ipairs( gained )
+						do
+							if s.config.full and path:byte( -1 ) == 47
+							then
+								s:addFullDelay( path, true )
+							else
+								s:delay( 'Create', now( ), path )
+							end
+						end
+					end
+
+					if s.config.monitor == 'inotify'
+					then
+						Inotify.rewatch( s, dirs, ready )
+					else
+						ready( )
+					end
+				end
+			elseif change == 'changed'
+			then
+				counts.changed = counts.changed + 1
+
+				log( 'Normal', 'Config of ', s.config.name, ' changed.' )
+			else
+				counts.kept = counts.kept + 1
+			end
 		end
 	end
 
-	--
-	-- checks all syncs for their earliest alarm,
-	-- but only if the global process limit is not yet reached.
-	--
-
-	if not uSettings.maxProcesses
-	or processCount < uSettings.maxProcesses
-	then
-		for _, s in Syncs.iwalk( )
+	for _, list in pairs( running )
+	do
+		for _, s in ipairs( list )
 		do
-			checkAlarm( s:getAlarm( ), s.config.name )
+			retired[ #retired + 1 ] = s
 		end
-	else
-		log(
-			'Alarm',
-			'at global process limit.'
-		)
 	end
-	-- checks for tunnel alarm
-	checkAlarm( Tunnels.getAlarm( ), "Tunnels" )
 
-	-- checks if a statusfile write has been delayed
-	checkAlarm( StatusFile.getAlarm( ), "StatusFile" )
-	-- checks for an userAlarm
-	checkAlarm( UserAlarms.getAlarm( ), "UserAlarms" )
-	log( 'Alarm', 'runner.getAlarm returns: ', alarm, " Source:", alarmSource )
+	for _, s in ipairs( retired )
+	do
+		Syncs.remove( s )
 
-	return alarm
-end
+		if s.config.monitor == 'inotify'
+		then
+			Inotify.removeSync( s )
+		elseif s.config.monitor == 'fanotify'
+		then
+			Fanotify.removeSync( s )
+		elseif s.config.monitor == 'fsevents'
+		then
+			Fsevents.removeSync( s )
+		elseif s.config.monitor == 'poll'
+		then
+			Poll.removeSync( s )
+		end
 
+		Journal.close( s )
 
---
--- Called when an file system monitor events arrive
---
-runner.inotifyEvent = Inotify.event
-runner.fsEventsEvent = Fsevents.event
+		TreeIndex.close( s )
 
---
--- Collector for every child process that finished in startup phase
---
-function runner.collector
-(
-	pid,       -- pid of the child process
-	exitcode   -- exitcode of the child process
-)
-	if exitcode ~= 0
-	then
-		log( 'Error', 'Startup process', pid, ' failed' )
+		-- its processes running are collected still
+		s.disabled = true
 
-		terminate( -1 )
+		log(
+			'Normal',
+			'Removed ', s.config.name, ' ( ',
+			Journal.identity( s.config ), ' ), ',
+			s.processes:size( ), ' processes still running.'
+		)
 	end
 
-	return 0
-end
+	for _, s in ipairs( started )
+	do
+		Syncs.insert( s )
 
---
--- Called by core when an overflow happened.
---
-function runner.overflow
-( )
-	log( 'Normal', '--- OVERFLOW in event queue ---' )
+		log(
+			'Normal',
+			'Starting ', s.config.name, ' ( ', Journal.identity( s.config ), ' )'
+		)
 
-	lsyncdStatus = 'fade'
+		startSync( s )
+	end
+
+	-- stops watching what the syncs are no longer interested in
+	if counts.filtered > 0 or #retired > 0
+	then
+		Inotify.prune( )
+	end
+
+	log(
+		'Normal',
+		'Reloaded config, kept ', counts.kept, ', changed ', counts.changed,
+		', refiltered ', counts.filtered, ', started ', #started,
+		' and removed ', #retired, ' syncs.'
+	)
+
+	return true
 end
 
 --
 -- Called by core on a hup signal.
 --
+-- Reloads the config file in place if possible,
+-- resets Lsyncd otherwise.
+--
 function runner.hup
-( )
+(
+	configFile  -- absolute path of the config file, nil if none
+)
+	-- syncs from the command line are not in the config file
+	if lsyncdStatus == 'run'
+	and configFile
+	and not clSettings.syncs
+	then
+		log( 'Normal', '--- HUP signal, reloading ', configFile, ' ---' )
+
+		if reload( configFile )
+		then
+			return
+		end
+	end
+
 	log( 'Normal', '--- HUP signal, resetting ---' )
 
 	lsyncdStatus = 'fade'
@@ -6431,18 +11975,20 @@ function spawn(
 
 		local sync = InletFactory.getSync( agent )
 
+		lsyncd.own_process( pid, sync )
+
 		-- delay or list
 		if dol.status
 		then
 			-- is a delay
-			dol:setActive( )
+			sync:activateDelay( dol )
 
 			sync.processes[ pid ] = dol
 		else
 			-- is a list
 			for _, d in ipairs( dol )
 			do
-				d:setActive( )
+				sync:activateDelay( d )
 			end
 
 			sync.processes[ pid ] = dol
@@ -6543,25 +12089,7 @@ function settings
 	end
 
 	-- if its a table it sets all the value of the bale
-	for k, v in pairs( a1 )
-	do
-		if type( k ) ~= 'number'
-		then
-			if not settingsCheckgauge[ k ]
-			then
-				error( 'setting "'..k..'" unknown.', 2 )
-			end
-
-			uSettings[ k ] = v
-		else
-			if not settingsCheckgauge[ v ]
-			then
-				error( 'setting "'..v..'" unknown.', 2 )
-			end
-
-			uSettings[ v ] = true
-		end
-	end
+	setSettings( uSettings, a1, 3 )
 end
 
 settingsSafe = settings
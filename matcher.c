@@ -0,0 +1,694 @@
+/*
+| matcher.c from Lsyncd - Live (Mirror) Syncing Demon
+|
+| License: GPLv2 (see COPYING) or any later version
+|
+| Authors: Axel Kittenberger <axkibe@gmail.com>
+|
+| -----------------------------------------------------------------------
+|
+| The exclude and filter matcher.
+|
+| A list of rsync like patterns is compiled once into one combined
+| automaton. A path is then tested against all patterns in a single
+| pass, linear in the length of the path and without allocating.
+|
+| The verdicts are the same as the ones of the Lua patterns
+| made by toLuaPattern( ) in the runner:
+|
+|   '?'   matches one character but '/'
+|   '*'   matches any number of characters but '/'
+|   '**'  matches any number of any characters
+|   '/'   at the begin anchors the pattern to the root,
+|         otherwise the pattern matches after any '/'
+|
+| A pattern has to match up to a '/' or the end of the path,
+| unless the pattern ends with a '$'. In that case it matches
+| a prefix, the '$' itself being a literal character.
+|
+| The automaton is a bit parallel nondeterministic one. Every token
+| of every pattern is a bit, preceded by one start bit per pattern.
+| A set bit means the pattern has been matched up to that token.
+| The patterns are laid out in list order, so a match of the pattern
+| at index m makes all bits from its start bit upwards irrelevant.
+*/
+
+#include "lsyncd.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#if defined(LUA_VERSION_NUM) && LUA_VERSION_NUM >= 504
+#define lua_objlen lua_rawlen
+#endif
+
+
+#define MATCHER_META "Lsyncd.matcher"
+
+
+/*
+| Tokens of a compiled pattern.
+*/
+#define TOKEN_LIT  0  // a literal character
+#define TOKEN_ONE  1  // '?'
+#define TOKEN_STAR 2  // '*'
+#define TOKEN_ANY  3  // '**'
+
+
+/*
+| A compiled list of patterns.
+*/
+struct matcher
+{
+	// number of patterns
+	int npatterns;
+
+	// number of state bits and 64 bit words holding them
+	int nstates;
+	int nwords;
+
+	// number of character classes
+	int nclasses;
+
+	// the character class of every byte
+	unsigned char cls[ 256 ];
+
+	// per character class the token bits a character of it matches
+	uint64_t *trans;
+
+	// the bits of star tokens, they repeat and match empty
+	uint64_t *star;
+
+	// the start bits of unanchored patterns, set on every position
+	uint64_t *start;
+
+	// the start bits of anchored patterns, set on the first position
+	uint64_t *anchor;
+
+	// the last token bits of patterns that have to be followed
+	// by a '/' or the end of the path
+	uint64_t *accept;
+
+	// the last token bits of patterns ending with a '$'
+	uint64_t *prefix;
+
+	// the pattern index of every bit
+	int *owner;
+
+	// the start bit of every pattern
+	int *base;
+
+	// the verdict of every pattern
+	bool *verdict;
+
+	// true if all patterns up to this one have the same verdict,
+	// a match of it settles the test
+	bool *settled;
+
+	// scratch space for the Lua test
+	uint64_t *scratch;
+};
+
+
+/*
+| Sets a bit.
+*/
+static inline void
+bit_set( uint64_t *set, int bit )
+{
+	set[ bit >> 6 ] |= ( (uint64_t) 1 ) << ( bit & 63 );
+}
+
+
+/*
+| Shifts all bits of 'src' one bit up into 'dst'.
+*/
+static inline void
+shift_up( uint64_t *dst, const uint64_t *src, int nwords )
+{
+	uint64_t carry = 0;
+	int w;
+
+	for( w = 0; w < nwords; w++ )
+	{
+		uint64_t v = src[ w ];
+		dst[ w ] = ( v << 1 ) | carry;
+		carry = v >> 63;
+	}
+}
+
+
+/*
+| Clears all bits from 'limit' upwards.
+|
+| Returns the number of words still in use.
+*/
+static inline int
+clip( uint64_t *set, int limit, int nwords )
+{
+	int lw = limit >> 6;
+	int w;
+
+	if( lw >= nwords ) return nwords;
+
+	set[ lw ] &= ( ( (uint64_t) 1 ) << ( limit & 63 ) ) - 1;
+
+	for( w = lw + 1; w < nwords; w++ ) set[ w ] = 0;
+
+	return lw + 1;
+}
+
+
+/*
+| Frees a matcher.
+*/
+static void
+free_matcher( struct matcher *m )
+{
+	free( m->trans );
+	free( m->star );
+	free( m->start );
+	free( m->anchor );
+	free( m->accept );
+	free( m->prefix );
+	free( m->owner );
+	free( m->base );
+	free( m->verdict );
+	free( m->settled );
+	free( m->scratch );
+
+	memset( m, 0, sizeof( *m ) );
+}
+
+
+/*
+| Returns the number of tokens of a pattern.
+*/
+static int
+count_tokens( const char *p, size_t len )
+{
+	// unanchored patterns get a leading '/'
+	int n = ( len > 0 && p[ 0 ] == '/' ) ? 0 : 1;
+	size_t i;
+
+	for( i = 0; i < len; n++ )
+	{
+		if( p[ i ] == '*' )
+		{
+			while( i < len && p[ i ] == '*' ) i++;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	return n;
+}
+
+
+/*
+| Compiles the tokens of a pattern starting with bit 'bit'.
+|
+| Since runs of stars are one token, no two star tokens follow
+| each other. Thus one step suffices to let stars match empty.
+*/
+static void
+compile_pattern(
+	struct matcher *m,
+	const char *p,
+	size_t len,
+	int bit
+)
+{
+	size_t i = 0;
+
+	if( len == 0 || p[ 0 ] != '/' )
+	{
+		bit++;
+		bit_set( m->trans + m->cls[ '/' ] * m->nwords, bit );
+	}
+
+	while( i < len )
+	{
+		int token;
+		int k;
+		unsigned char c = p[ i ];
+
+		bit++;
+
+		if( c == '*' )
+		{
+			size_t r = i;
+
+			while( i < len && p[ i ] == '*' ) i++;
+
+			token = i - r > 1 ? TOKEN_ANY : TOKEN_STAR;
+		}
+		else
+		{
+			token = c == '?' ? TOKEN_ONE : TOKEN_LIT;
+			i++;
+		}
+
+		if( token == TOKEN_LIT )
+		{
+			bit_set( m->trans + m->cls[ c ] * m->nwords, bit );
+			continue;
+		}
+
+		for( k = 0; k < m->nclasses; k++ )
+		{
+			if( token == TOKEN_ANY || k != m->cls[ '/' ] )
+			{
+				bit_set( m->trans + k * m->nwords, bit );
+			}
+		}
+
+		if( token != TOKEN_ONE ) bit_set( m->star, bit );
+	}
+}
+
+
+/*
+| Compiles a list of patterns.
+*/
+static void
+compile_matcher(
+	struct matcher *m,
+	const char **patterns,
+	const size_t *lens,
+	const bool *verdicts,
+	int npatterns
+)
+{
+	bool used[ 256 ];
+	size_t ws;
+	int bit = 0;
+	int c;
+	int i;
+
+	memset( used, 0, sizeof( used ) );
+
+	// every literal character gets a class of its own,
+	// all others share class 0
+	used[ '/' ] = true;
+
+	m->npatterns = npatterns;
+	m->nstates = 0;
+
+	for( i = 0; i < npatterns; i++ )
+	{
+		size_t k;
+
+		for( k = 0; k < lens[ i ]; k++ )
+		{
+			used[ (unsigned char) patterns[ i ][ k ] ] = true;
+		}
+
+		m->nstates += 1 + count_tokens( patterns[ i ], lens[ i ] );
+	}
+
+	used[ '*' ] = used[ '?' ] = false;
+
+	m->nclasses = 1;
+
+	for( c = 0; c < 256; c++ )
+	{
+		m->cls[ c ] = used[ c ] ? m->nclasses++ : 0;
+	}
+
+	m->nwords = ( m->nstates + 63 ) / 64;
+
+	if( m->nwords == 0 ) m->nwords = 1;
+
+	ws = m->nwords * sizeof( uint64_t );
+
+	m->trans   = s_calloc( m->nclasses, ws );
+	m->star    = s_calloc( 1, ws );
+	m->start   = s_calloc( 1, ws );
+	m->anchor  = s_calloc( 1, ws );
+	m->accept  = s_calloc( 1, ws );
+	m->prefix  = s_calloc( 1, ws );
+	m->scratch = s_calloc( 2, ws );
+	m->owner   = s_calloc( m->nstates + 1, sizeof( int ) );
+	m->base    = s_calloc( npatterns + 1, sizeof( int ) );
+	m->verdict = s_calloc( npatterns + 1, sizeof( bool ) );
+	m->settled = s_calloc( npatterns + 1, sizeof( bool ) );
+
+	for( i = 0; i < npatterns; i++ )
+	{
+		const char *p = patterns[ i ];
+		size_t len = lens[ i ];
+		int n = count_tokens( p, len );
+		int k;
+
+		m->base[ i ] = bit;
+		m->verdict[ i ] = verdicts[ i ];
+		m->settled[ i ] =
+			i == 0 || ( m->settled[ i - 1 ] && verdicts[ i ] == verdicts[ 0 ] );
+
+		for( k = 0; k <= n; k++ ) m->owner[ bit + k ] = i;
+
+		bit_set( len > 0 && p[ 0 ] == '/' ? m->anchor : m->start, bit );
+
+		bit_set(
+			len > 0 && p[ len - 1 ] == '$' ? m->prefix : m->accept,
+			bit + n
+		);
+
+		compile_pattern( m, p, len, bit );
+
+		bit += 1 + n;
+	}
+}
+
+
+/*
+| Runs a path through a matcher.
+|
+| 'scratch' has to hold 2 * m->nwords words, so runs can
+| happen concurrently on the same matcher.
+|
+| If 'within' is true the path is a directory and the verdict
+| is the one for all paths within it.
+|
+| Returns the index of the first pattern in list order that
+| matches or -1 if none does. For a directory -1 means no pattern
+| matches any path within and MATCH_MIXED that the paths within
+| have to be tested one by one.
+*/
+static int
+run_matcher(
+	const struct matcher *m,
+	const char *path,
+	size_t len,
+	bool within,
+	uint64_t *scratch
+)
+{
+	uint64_t *d = scratch;
+	uint64_t *t = scratch + m->nwords;
+	int nw = m->nwords;
+	int best = -1;
+	size_t k;
+	int w;
+
+	if( m->npatterns == 0 ) return -1;
+
+	memset( d, 0, nw * sizeof( uint64_t ) );
+
+	for( k = 0; ; k++ )
+	{
+		bool end = k == len;
+		unsigned char c = end ? 0 : path[ k ];
+		const uint64_t *tr;
+
+		// a path within a directory goes on with a name
+		bool tail = c == '/' || ( end && !within );
+
+		for( w = 0; w < nw; w++ )
+		{
+			d[ w ] |= m->start[ w ];
+
+			if( k == 0 ) d[ w ] |= m->anchor[ w ];
+		}
+
+		if( best >= 0 ) nw = clip( d, m->base[ best ], nw );
+
+		// stars match empty
+		shift_up( t, d, nw );
+
+		for( w = 0; w < nw; w++ ) d[ w ] |= t[ w ] & m->star[ w ];
+
+		for( w = 0; w < nw; w++ )
+		{
+			uint64_t a = d[ w ] & ( m->prefix[ w ] | ( tail ? m->accept[ w ] : 0 ) );
+
+			while( a )
+			{
+				int i = m->owner[ w * 64 + __builtin_ctzll( a ) ];
+
+				if( best < 0 || i < best ) best = i;
+
+				a &= a - 1;
+			}
+		}
+
+		if( best >= 0 )
+		{
+			if( m->settled[ best ] ) return best;
+
+			nw = clip( d, m->base[ best ], nw );
+		}
+
+		if( end ) break;
+
+		tr = m->trans + m->cls[ c ] * m->nwords;
+
+		shift_up( t, d, nw );
+
+		for( w = 0; w < nw; w++ )
+		{
+			d[ w ] = ( t[ w ] | ( d[ w ] & m->star[ w ] ) ) & tr[ w ];
+		}
+	}
+
+	if( !within ) return best;
+
+	// the paths within are decided if no pattern before the
+	// matched one can match anymore, the start bits of unanchored
+	// patterns are still set from the last position
+	for( w = 0; w < nw; w++ )
+	{
+		if( d[ w ] ) return MATCH_MIXED;
+	}
+
+	return best;
+}
+
+
+/*
+| Compiles a list of rsync like patterns.
+|
+| Params on Lua stack:
+|     1: table of patterns
+|     2: table of verdicts ( optional, defaults to all true )
+|
+| Returns on Lua stack:
+|     the matcher
+*/
+int
+l_matcher( lua_State *L )
+{
+	bool has_verdicts;
+	int n;
+	const char **patterns;
+	size_t *lens;
+	bool *verdicts;
+	struct matcher *m;
+	int i;
+
+	luaL_checktype( L, 1, LUA_TTABLE );
+
+	has_verdicts = !lua_isnoneornil( L, 2 );
+
+	if( has_verdicts ) luaL_checktype( L, 2, LUA_TTABLE );
+
+	n = lua_objlen( L, 1 );
+
+	patterns = s_calloc( n + 1, sizeof( char * ) );
+	lens = s_calloc( n + 1, sizeof( size_t ) );
+	verdicts = s_calloc( n + 1, sizeof( bool ) );
+
+	for( i = 0; i < n; i++ )
+	{
+		// the strings stay referenced by the table
+		// while the matcher is compiled
+		lua_rawgeti( L, 1, i + 1 );
+		patterns[ i ] = luaL_checklstring( L, -1, &lens[ i ] );
+		lua_pop( L, 1 );
+
+		if( has_verdicts )
+		{
+			lua_rawgeti( L, 2, i + 1 );
+			verdicts[ i ] = lua_toboolean( L, -1 );
+			lua_pop( L, 1 );
+		}
+		else
+		{
+			verdicts[ i ] = true;
+		}
+	}
+
+	m = lua_newuserdata( L, sizeof( struct matcher ) );
+
+	memset( m, 0, sizeof( *m ) );
+
+	luaL_getmetatable( L, MATCHER_META );
+	lua_setmetatable( L, -2 );
+
+	compile_matcher( m, patterns, lens, verdicts, n );
+
+	free( patterns );
+	free( lens );
+	free( verdicts );
+
+	return 1;
+}
+
+
+/*
+| Tests a path.
+|
+| Params on Lua stack:
+|     1: the matcher
+|     2: the path
+|
+| Returns on Lua stack:
+|     the verdict of the first matching pattern or nil
+*/
+static int
+l_matcher_test( lua_State *L )
+{
+	struct matcher *m = luaL_checkudata( L, 1, MATCHER_META );
+	size_t len;
+	const char *path = luaL_checklstring( L, 2, &len );
+	int i = run_matcher( m, path, len, false, m->scratch );
+
+	if( i < 0 )
+	{
+		lua_pushnil( L );
+	}
+	else
+	{
+		lua_pushboolean( L, m->verdict[ i ] );
+	}
+
+	return 1;
+}
+
+
+/*
+| Tests what a directory decides for all paths within it.
+|
+| Params on Lua stack:
+|     1: the matcher
+|     2: the path of the directory, ending with '/'
+|
+| Returns on Lua stack:
+|     true if all paths within get the same verdict, false otherwise
+|     the verdict of all paths within
+*/
+static int
+l_matcher_testdir( lua_State *L )
+{
+	struct matcher *m = luaL_checkudata( L, 1, MATCHER_META );
+	size_t len;
+	const char *path = luaL_checklstring( L, 2, &len );
+	int i = run_matcher( m, path, len, true, m->scratch );
+
+	lua_pushboolean( L, i != MATCH_MIXED );
+
+	if( i < 0 )
+	{
+		lua_pushnil( L );
+	}
+	else
+	{
+		lua_pushboolean( L, m->verdict[ i ] );
+	}
+
+	return 2;
+}
+
+
+/*
+| Returns the matcher at a Lua stack index.
+*/
+extern const struct matcher *
+check_matcher(
+	lua_State *L,
+	int arg
+)
+{
+	return luaL_checkudata( L, arg, MATCHER_META );
+}
+
+
+/*
+| Returns the bytes of scratch space matcher_verdict( ) needs.
+*/
+extern size_t
+matcher_scratch_size( const struct matcher *m )
+{
+	return 2 * m->nwords * sizeof( uint64_t );
+}
+
+
+/*
+| Tests a path for the core.
+|
+| Unlike the Lua test this can run concurrently on the same
+| matcher, as long as every thread has its own scratch space.
+|
+| Returns the verdict, MATCH_NONE if no pattern matches or
+| for a directory MATCH_MIXED.
+*/
+extern int
+matcher_verdict(
+	const struct matcher *m,
+	const char *path,
+	size_t len,
+	bool within,
+	void *scratch
+)
+{
+	int i = run_matcher( m, path, len, within, scratch );
+
+	if( i < 0 ) return i;
+
+	return m->verdict[ i ];
+}
+
+
+/*
+| Frees the matcher when garbage collected.
+*/
+static int
+l_matcher_gc( lua_State *L )
+{
+	struct matcher *m = luaL_checkudata( L, 1, MATCHER_META );
+
+	free_matcher( m );
+
+	return 0;
+}
+
+
+/*
+| Registers the metatable of matchers.
+*/
+extern void
+register_matcher( lua_State *L )
+{
+	luaL_newmetatable( L, MATCHER_META );
+
+	lua_newtable( L );
+	lua_pushcfunction( L, l_matcher_test );
+	lua_setfield( L, -2, "test" );
+	lua_pushcfunction( L, l_matcher_testdir );
+	lua_setfield( L, -2, "testdir" );
+	lua_setfield( L, -2, "__index" );
+
+	lua_pushcfunction( L, l_matcher_gc );
+	lua_setfield( L, -2, "__gc" );
+
+	lua_pop( L, 1 );
+}
@@ -0,0 +1,128 @@
+require( 'posix' )
+dofile( 'tests/testlib.lua' )
+
+cwriteln( '****************************************************************' )
+cwriteln( ' Testing reloading the config on HUP (rsync)' )
+cwriteln( '****************************************************************' )
+
+local tdir, srcdir, trgdir = mktemps( )
+local logfile = tdir .. 'log'
+local cfgfile = tdir .. 'config.lua'
+
+-- writes the config excluding 'exclude'
+local function writeconfig
+(
+	exclude
+)
+	writefile(cfgfile, [[
+settings {
+	logfile = "]]..logfile..[[",
+	nodaemon = true,
+}
+
+sync {
+	default.rsync,
+	source = "]]..srcdir..[[",
+	target = "]]..trgdir..[[",
+	delay = 3,
+	exclude = { ]]..exclude..[[ },
+}]])
+end
+
+--
+-- Tests if the filename exists
+-- fails if this is different to expect.
+--
+local function testfile
+(
+	filename,
+	expect
+)
+	local stat, err = posix.stat( filename )
+
+	if stat and not expect
+	then
+		cwriteln( 'failure: ', filename, ' should be excluded' )
+
+		os.exit( 1 )
+	end
+
+	if not stat and expect
+	then
+		cwriteln( 'failure: ', filename, ' should not be excluded' )
+
+		os.exit( 1 )
+	end
+end
+
+writeconfig( '"erf"' )
+
+posix.mkdir( srcdir .. 'd' )
+writefile( srcdir .. 'erf', 'erf' )
+writefile( srcdir .. 'd/erf', 'erf' )
+writefile( srcdir .. 'keep', 'keep' )
+
+cwriteln( 'starting Lsyncd' )
+
+local pid = spawn( './lsyncd', cfgfile, '-log', 'all' )
+
+cwriteln( 'waiting for Lsyncd to start' )
+
+posix.sleep( 3 )
+
+testfile( trgdir .. 'erf', false )
+testfile( trgdir .. 'd/erf', false )
+testfile( trgdir .. 'keep', true )
+
+cwriteln( 'reloading the config without the exclude' )
+
+writeconfig( '"ehf"' )
+
+-- changes queued before the reload are transferred after it
+writefile( srcdir .. 'queued', 'queued' )
+
+posix.kill( pid, 1 ) -- SIGHUP
+
+cwriteln( 'waiting for Lsyncd to transmit the files no longer excluded' )
+
+posix.sleep( 5 )
+
+testfile( trgdir .. 'erf', true )
+testfile( trgdir .. 'd/erf', true )
+testfile( trgdir .. 'queued', true )
+
+cwriteln( 'testing the new exclude' )
+
+writefile( srcdir .. 'ehf', 'ehf' )
+
+posix.sleep( 5 )
+
+testfile( trgdir .. 'ehf', false )
+
+local f = io.open( logfile )
+
+local log = f:read( '*a' )
+
+f:close( )
+
+if not log:find( 'Reloaded config' ) or log:find( 'resetting' )
+then
+	cwriteln( 'failure: Lsyncd did not reload the config in place' )
+
+	os.exit( 1 )
+end
+
+cwriteln( 'killing started Lsyncd' )
+
+posix.kill( pid )
+local _, exitmsg, exitcode = posix.wait( pid )
+
+cwriteln( 'Exitcode of Lsyncd = ', exitmsg, ' ', exitcode );
+
+if exitcode == 143
+then
+	cwriteln( 'OK' )
+	os.exit( 0 )
+else
+	os.exit( 1 )
+end
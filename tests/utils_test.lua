@@ -30,50 +30,592 @@ assert(type(lsyncd.get_free_port()) == "number")
 
 local function testQueue()
     local q = Queue.new()
-    q:push(1)
-    q:push(2)
-    q:push(3)
-    q:push(4)
-    assert(q:size(), 4)
-    assert(q[1], 1)
-    assert(q[4], 4)
+    assert(q:push(1) == 1)
+    assert(q:push(2) == 2)
+    assert(q:push(3) == 3)
+    assert(q:push(4) == 4)
+    assert(q:size() == 4)
+    assert(q[1] == 1)
+    assert(q[4] == 4)
+    assert(q:first() == 1)
+    assert(q:last() == 4)
 
-    q:remove(4)
-    assert(q:size(), 3)
-    assert(q[3], 3)
-    assert(q[1], 1)
+    -- removing from the middle leaves a hole,
+    -- the other items keep their positions
+    q:remove(2)
+    assert(q:size() == 3)
+    assert(q[2] == nil)
+    assert(q[1] == 1)
+    assert(q[3] == 3)
+    assert(q[4] == 4)
+
+    q:remove(3)
+    assert(q:size() == 2)
+    assert(q[4] == 4)
 
+    local pos, items = { }, { }
+    for p, v in q:qpairs() do
+        pos[#pos + 1] = p
+        items[#items + 1] = v
+    end
+    assert(isTableEqual(pos, { 1, 4 }))
+    assert(isTableEqual(items, { 1, 4 }))
+
+    pos = { }
+    for p in q:qpairsReverse() do pos[#pos + 1] = p end
+    assert(isTableEqual(pos, { 4, 1 }))
+
+    -- first and last skip over the holes
     q:remove(1)
-    assert(q:size(), 2)
-    assert(q[3], 3)
-    assert(q[2], 2)
-    assert(q.first, 2)
-    assert(q.last, 3)
-
-    q:push(5)
-    assert(q:size(), 3)
-    assert(q.last, 4)
-    assert(q.first, 2)
-    assert(q[4], 5)
-    assert(q[3], 3)
-    assert(q[2], 2)
+    assert(q:size() == 1)
+    assert(q:first() == 4)
+    assert(q:last() == 4)
 
-    q:remove(3)
-    assert(q:size(), 2)
-    assert(q.last, 3)
-    assert(q.first, 2)
-    assert(q[2], 2)
-    assert(q[3], 5)
+    assert(q:push(5) == 5)
+    assert(q:push(6) == 6)
+    q:remove(5)
+    q:remove(6)
+    assert(q:size() == 1)
+    assert(q:first() == 4)
+    assert(q:last() == 4)
 
+    -- pushing continues after the last position
+    assert(q:push(7) == 5)
+    assert(q[5] == 7)
+
+    -- injecting goes in front and shifts the positions
     q:inject(23)
-    assert(q:size(), 3)
-    assert(q.last, 3)
-    assert(q.first, 1)
-    assert(q[1], 23)
-    assert(q[2], 2)
-    assert(q[3], 5)
+    assert(q:size() == 3)
+    assert(q:first() == 23)
+    assert(q[4] == 23)
+    assert(q[5] == 4)
+    assert(q[6] == 7)
+    assert(q:last() == 7)
+
+    -- an emptied queue starts over
+    q:remove(4)
+    q:remove(5)
+    q:remove(6)
+    assert(q:size() == 0)
+    assert(q:first() == nil)
+    assert(q:last() == nil)
+    for _ in q:qpairs() do assert(false) end
+    assert(q:push(8) == 1)
+    assert(q:first() == 8)
 end
 
 testQueue()
 
+local function testMatcher()
+    local m = lsyncd.matcher({ "*.tmp", "/build", "cache/**", "a?c", "lock$" })
+    assert(m:test("/x.tmp") == true)
+    assert(m:test("/dir/x.tmp") == true)
+    assert(m:test("/dir/x.tmp/y") == true)
+    assert(m:test("/dir/x.tmpl") == nil)
+    assert(m:test("/build") == true)
+    assert(m:test("/build/x") == true)
+    assert(m:test("/src/build") == nil)
+    assert(m:test("/cache/a/b/c") == true)
+    assert(m:test("/abc") == true)
+    assert(m:test("/a/c") == nil)
+    assert(m:test("/lock$file") == true)
+    assert(m:test("/lockfile") == nil)
+
+    -- the first matching filter decides
+    local f = lsyncd.matcher({ "/keep/*.o", "*.o" }, { false, true })
+    assert(f:test("/keep/x.o") == false)
+    assert(f:test("/drop/x.o") == true)
+    assert(f:test("/drop/x.c") == nil)
+
+    assert(lsyncd.matcher({ }):test("/x") == nil)
+
+    -- verdicts for all paths within a directory
+    local decided, verdict = m:testdir("/build/")
+    assert(decided and verdict == true)
+    assert(not m:testdir("/src/"))
+
+    local a = lsyncd.matcher({ "/build", "/dist/*.o" })
+    decided, verdict = a:testdir("/src/")
+    assert(decided and verdict == nil)
+    assert(not a:testdir("/dist/"))
+end
+
+testMatcher()
+
+local function testTreeIndex()
+    local dir = os.tmpname()
+    os.remove(dir)
+    assert(os.execute("mkdir -p " .. dir .. "/src/a"))
+
+    local function write(path, data)
+        local f = assert(io.open(dir .. "/src" .. path, "w"))
+        f:write(data)
+        f:close()
+    end
+
+    local function scan(ti, covered)
+        local found = { }
+        assert(ti:scan(dir .. "/src/", lsyncd.matcher({ }), nil, covered))
+        -- one directory per step
+        local changes = ti:step(1)
+        while changes == false do changes = ti:step(1) end
+        assert(changes)
+        for i = 1, #changes, 2 do found[changes[i]] = changes[i + 1] end
+        return found
+    end
+
+    local function store(ti)
+        assert(ti:write())
+        assert(ti:written(true))
+    end
+
+    write("/a/f", "1")
+    write("/g", "2")
+
+    -- without an index the tree is recorded only
+    local ti = lsyncd.treeindex(dir .. "/index", "src -> dst")
+    assert(ti:count() == nil)
+    assert(next(scan(ti, true)) == nil)
+    assert(ti:count() == 4)
+    store(ti)
+
+    -- an index of another sync is not loaded
+    assert(lsyncd.treeindex(dir .. "/index", "src -> other"):count() == nil)
+
+    ti = lsyncd.treeindex(dir .. "/index", "src -> dst")
+    assert(ti:count() == 4)
+    assert(next(scan(ti, false)) == nil)
+
+    write("/a/f", "changed")
+    assert(os.execute("mkdir " .. dir .. "/src/new"))
+    write("/new/h", "3")
+
+    local found = scan(ti, false)
+    assert(found["/"] == "dir")
+    assert(found["/a/f"] == "file")
+    assert(found["/new/"] == "tree")
+    assert(found["/new/h"] == nil)
+
+    -- changed paths are found again until their records are set
+    assert(scan(ti, false)["/a/f"] == "file")
+
+    for path, _ in pairs(found) do
+        ti:set(path, ti:stat(dir .. "/src" .. path))
+    end
+    -- records set while writing are kept for the next write
+    assert(ti:write())
+    ti:set("/g", ti:stat(dir .. "/src/g"))
+    assert(ti:written(true))
+    assert(ti:pending() == 1)
+    assert(next(scan(ti, false)) == nil)
+
+    os.execute("rm -r " .. dir)
+end
+
+testTreeIndex()
+
+-- The modules of the runner are locals of it. As this script
+-- runs within the runner, they are found through the upvalues
+-- of the functions on the stack.
+local function runnerLocal(name)
+    local seen = { }
+    local todo = { }
+    local level = 2
+    while debug.getinfo(level, "f") do
+        todo[#todo + 1] = debug.getinfo(level, "f").func
+        level = level + 1
+    end
+    while #todo > 0 do
+        local v = table.remove(todo, 1)
+        if not seen[v] then
+            seen[v] = true
+            if type(v) == "function" then
+                local i = 1
+                while true do
+                    local n, uv = debug.getupvalue(v, i)
+                    if not n then break end
+                    if n == name then return uv end
+                    if type(uv) == "function" or type(uv) == "table" then
+                        todo[#todo + 1] = uv
+                    end
+                    i = i + 1
+                end
+            else
+                for _, x in pairs(v) do
+                    if type(x) == "function" or type(x) == "table" then
+                        todo[#todo + 1] = x
+                    end
+                end
+            end
+        end
+    end
+    error("runner has no local " .. name)
+end
+
+-- Runs a random walk of 'steps' steps, seeded by a fixed seed
+-- or by the environment variable 'SEED', so a failure can be
+-- reproduced with the seed logged.
+local function randomWalk(name, steps, step)
+    local seed = tonumber(os.getenv("SEED")) or 42
+    math.randomseed(seed)
+    cwriteln(name, " random walk seed: ", seed)
+    for _ = 1, steps do step() end
+end
+
+-- Creates a sync with nothing to watch or to transfer to.
+local function newSync(name, config)
+    local c = {
+        name = name,
+        source = "/nonexistent-lsyncd-test/",
+        delay = 0,
+        maxProcesses = 1,
+        onMove = true
+    }
+    for k, v in pairs(config or { }) do c[k] = v end
+    return runnerLocal("Sync").new(c)
+end
+
+local eventTypes = { "Attrib", "Modify", "Create", "Delete", "Move" }
+
+-- Returns a random event, moves stay files or directories.
+local function randomEvent(paths)
+    local etype = eventTypes[math.random(#eventTypes)]
+    local path = paths[math.random(#paths)]
+    local path2
+    if etype == "Move" then
+        repeat
+            path2 = paths[math.random(#paths)]
+        until (path2:byte(-1) == 47) == (path:byte(-1) == 47)
+    end
+    return etype, path, path2
+end
+
+-- Returns a random delay of a queue 'keep' is true for, if any.
+local function randomDelay(q, keep)
+    local live = { }
+    for _, d in q:qpairs() do
+        if not keep or keep(d) then live[#live + 1] = d end
+    end
+    if #live > 0 then return live[math.random(#live)] end
+end
+
+-- Activates a random delay of a list, if any, like starting its process.
+local function startDelay(s, dlist, active)
+    local d = dlist[math.random(#dlist + 1)]
+    if d and d.status == "wait" then
+        s:activateDelay(d)
+        active[#active + 1] = d
+    end
+end
+
+-- A random active delay finishes, or waits again
+-- until 'retry' if given, unblocking the delays it held back.
+local function finishDelay(s, active, retry)
+    if #active == 0 then return end
+    local d = table.remove(active, math.random(#active))
+    if s.delays[d.dpos] == d and d.status == "active" then
+        if retry == nil then
+            s:removeDelay(d)
+        else
+            s:waitDelay(d, retry)
+        end
+    end
+end
+
+local function testDelayIndex()
+    local Combiner = runnerLocal("Combiner")
+    local Delay = runnerLocal("Delay")
+    local DelayIndex = runnerLocal("DelayIndex")
+    local files = { "/a", "/a/b", "/a/b/c", "/ab", "/c/a", "/c/ab" }
+    local dirs = { "/a/", "/a/b/", "/ab/", "/c/", "/c/a/" }
+    local etypes = { "Attrib", "Modify", "Create", "Delete", "Move", "Full", "Blanket" }
+    local q = Queue.new()
+    local idx = DelayIndex.new()
+
+    randomWalk("testDelayIndex", 2000, function()
+        local etype = etypes[math.random(#etypes)]
+        local paths = math.random(2) == 1 and files or dirs
+        local path = paths[math.random(#paths)]
+        local path2
+        if etype == "Move" then
+            path2 = math.random(10) == 1 and path or paths[math.random(#paths)]
+        end
+        local nd = Delay.new(etype, nil, 0, path, path2)
+        if etype == "Full" then nd.subtree = paths == dirs end
+
+        -- the candidates are all delays the Combiner acts on,
+        -- latest first, like the full walk backwards did
+        local scanned = { }
+        for _, od in q:qpairsReverse() do
+            if Combiner.combine(od, nd) then scanned[#scanned + 1] = od end
+        end
+        local indexed = { }
+        local last
+        for _, od in ipairs(idx:candidates(nd)) do
+            assert(q[od.dpos] == od)
+            assert(not last or last > od.dpos)
+            last = od.dpos
+            if Combiner.combine(od, nd) then indexed[#indexed + 1] = od end
+        end
+        assert(#indexed == #scanned)
+        for i, od in ipairs(scanned) do assert(indexed[i] == od) end
+
+        nd.dpos = q:push(nd)
+        idx:add(nd)
+
+        -- removes some delays anywhere in the queue
+        while q:size() > 50 or q:size() > 0 and math.random(3) == 1 do
+            local od = randomDelay(q)
+            q:remove(od.dpos)
+            idx:remove(od)
+        end
+    end)
+end
+
+testDelayIndex()
+
+local function testReadyList()
+    local InletFactory = runnerLocal("InletFactory")
+    local s = newSync("ready")
+    local paths = { "/a", "/a/b", "/a/", "/a/b/", "/c", "/c/", "/c/d" }
+
+    -- the full walk of the delay FIFO getDelays( ) did before,
+    -- except the delays held back by active ones are not tested
+    local function walk(test)
+        local dlist = { }
+        local held = { }
+        local blocks = { }
+        local function getBlocks(delay, set)
+            set[delay] = true
+            for _, d in ipairs(delay.blocks or { }) do getBlocks(d, set) end
+        end
+        for _, d in s.delays:qpairs() do
+            if d.status == "active" or held[d] then
+                getBlocks(d, held)
+            else
+                local tr = true
+                if test then tr = test(InletFactory.d2e(d)) end
+                if tr == "break" then break end
+                if not tr then
+                    getBlocks(d, blocks)
+                elseif not blocks[d] then
+                    dlist[#dlist + 1] = d
+                end
+            end
+        end
+        return dlist
+    end
+
+    local tests = {
+        false,
+        function(e) return e.etype ~= "Delete" end,
+        function(e) if e.etype == "Move" then return "break" end return true end
+    }
+
+    local function check()
+        for _, test in ipairs(tests) do
+            local got = s:getDelays(test or nil)
+            local want = walk(test or nil)
+            assert(#got == #want)
+            for i, d in ipairs(want) do assert(got[i] == d) end
+        end
+    end
+
+    local active = { }
+    randomWalk("testReadyList", 600, function()
+        local r = math.random(10)
+        if r <= 5 then
+            local etype, path, path2 = randomEvent(paths)
+            s:delay(etype, nil, path, path2)
+        elseif r <= 7 then
+            -- activates a delay getDelays( ) returned
+            startDelay(s, walk(), active)
+        else
+            finishDelay(s, active, r == 10 and 0 or nil)
+        end
+        check()
+    end)
+end
+
+testReadyList()
+
+local function testAlarms()
+    local s = newSync("alarms")
+    local paths = { "/a", "/a/b", "/a/", "/a/b/", "/c", "/c/", "/c/d", "/e", "/f" }
+
+    -- the walk over all waiting delays getAlarm( ) did before
+    local function walk()
+        local rv = false
+        for _, d in s.delays:qpairs() do
+            if d.status == "wait" then
+                if d.alarm == true then return true end
+                if rv == false or d.alarm < rv then rv = d.alarm end
+            end
+        end
+        return rv
+    end
+
+    local active = { }
+    local clock = 0
+    randomWalk("testAlarms", 3000, function()
+        local r = math.random(10)
+        clock = clock + 1
+        if r <= 4 then
+            local etype, path, path2 = randomEvent(paths)
+            s:delay(etype, clock + math.random(50), path, path2)
+        elseif r <= 6 then
+            -- removes a delay anywhere in the queue
+            local d = randomDelay(s.delays, function(d) return d.status ~= "active" end)
+            if d then s:removeDelay(d) end
+        elseif r <= 8 then
+            startDelay(s, s:getDelays(), active)
+        else
+            finishDelay(s, active, r == 10 and (math.random(20) == 1 or clock + math.random(50)) or nil)
+        end
+        if math.random(2) == 1 then assert(s:getAlarm() == walk()) end
+    end)
+end
+
+testAlarms()
+
+local function testSpill()
+    local pageIn = runnerLocal("pageIn")
+
+    -- a spills, b gets the events when a reads them back
+    local a = newSync("spilling", { spillAfter = 16 })
+    local b = newSync("inmemory")
+    local pending = { }
+    local paths = { "/a", "/a/b", "/a/", "/a/b/", "/c", "/c/", "/c/d", "/e", "/f", "/g/" }
+    local spilled = 0
+    local moved = 0
+
+    local function check()
+        assert(a.delays:size() == b.delays:size())
+        local bd = { }
+        for _, d in b.delays:qpairs() do bd[#bd + 1] = d end
+        local i = 0
+        for _, d in a.delays:qpairs() do
+            i = i + 1
+            assert(d.etype == bd[i].etype)
+            assert(d.path == bd[i].path)
+            assert(d.path2 == bd[i].path2)
+            assert(d.status == bd[i].status)
+        end
+    end
+
+    randomWalk("testSpill", 3000, function()
+        if math.random(2) == 1 then
+            local etype, path, path2 = randomEvent(paths)
+            if etype == "Move" then
+                -- a Move the Combiner splits might be spilled halfway,
+                -- so moves go between paths of their own
+                moved = moved + 1
+                path = "/m" .. moved
+                path2 = "/n" .. moved
+            end
+            local count = a.spill and a.spill.count or 0
+            a:delay(etype, nil, path, path2)
+            if a.spill and a.spill.count > count then
+                pending[#pending + 1] = { etype, path, path2 }
+                spilled = spilled + 1
+            else
+                assert(#pending == 0)
+                b:delay(etype, nil, path, path2)
+            end
+        else
+            -- the oldest delay is done
+            if a.delays:size() > 0 then
+                a:removeDelay(a.delays:first())
+                b:removeDelay(b.delays:first())
+            end
+            local count = a.spill and a.spill.count or 0
+            pageIn(a)
+            for _ = 1, count - (a.spill and a.spill.count or 0) do
+                local e = table.remove(pending, 1)
+                b:delay(e[1], nil, e[2], e[3])
+            end
+        end
+        check()
+    end)
+    assert(spilled > 0)
+end
+
+testSpill()
+
+local function testJournal()
+    local Journal = runnerLocal("Journal")
+    local uSettings = runnerLocal("uSettings")
+    local dir = os.tmpname()
+    os.remove(dir)
+    assert(os.execute("mkdir -p " .. dir))
+    uSettings.journalDir = dir
+    uSettings.journalInterval = 1
+
+    local function newJournalSync()
+        return newSync("journal", { target = "/dst/", init = false })
+    end
+
+    local events = {
+        { "Modify", "/a" },
+        { "Create", "/b/" },
+        { "Move", "/c", "/d" },
+        { "Delete", "/e" },
+        { "Modify", "/f" },
+    }
+
+    local s = newJournalSync()
+    assert(Journal.open(s, true) == nil)
+    for i, e in ipairs(events) do
+        s:delay(e[1], nil, e[2], e[3])
+        -- the mark is set once, the last event is appended alone
+        if i == 4 or i == 5 then Journal.commit(nil, true) end
+    end
+    Journal.close(s)
+
+    local path = dir .. "/journal.journal"
+    local f = assert(io.open(path, "rb"))
+    local data = f:read("*a")
+    f:close()
+
+    -- the record of the last event
+    local first = data:find("E 5 ", 1, true)
+    local last = first + #"E 5 Modify 2 0\n/f" - 1
+    assert(data:sub(first, last) == "E 5 Modify 2 0\n/f")
+
+    -- a torn last record is ignored, the events before are replayed
+    for cut = first, last do
+        f = assert(io.open(path, "wb"))
+        f:write(data:sub(1, cut))
+        f:close()
+        local r = newJournalSync()
+        local resume = assert(Journal.open(r, true))
+        local n = cut < last and 4 or 5
+        assert(#resume.events == n)
+        r:replay(resume.events)
+        local i = 0
+        for _, d in r.delays:qpairs() do
+            i = i + 1
+            assert(d.etype == events[i][1])
+            assert(d.path == events[i][2])
+            assert(d.path2 == events[i][3])
+        end
+        assert(i == n)
+        Journal.close(r)
+    end
+
+    -- garbage after the last record is ignored as well
+    f = assert(io.open(path, "wb"))
+    f:write(data:sub(1, last) .. "E x\n")
+    f:close()
+    local r = newJournalSync()
+    assert(#assert(Journal.open(r, true)).events == 5)
+    Journal.close(r)
+
+    uSettings.journalDir = nil
+    uSettings.journalInterval = nil
+    os.execute("rm -r " .. dir)
+end
+
+testJournal()
+
 os.exit(0)
\ No newline at end of file
@@ -0,0 +1,1755 @@
+/*
+| treeindex.c from Lsyncd - Live (Mirror) Syncing Demon
+|
+| License: GPLv2 (see COPYING) or any later version
+|
+| Authors: Axel Kittenberger <axkibe@gmail.com>
+|
+| -----------------------------------------------------------------------
+|
+| The persistent index of a source tree.
+|
+| For every path synced the index keeps its inode, size, modification
+| and change time. On a restart a scan of the tree compared against
+| the index finds the paths changed meanwhile, so only these have to
+| be transferred instead of the whole tree.
+|
+| The paths are the ones of the runner, relative to the source with
+| a leading '/' and directories ending with '/'. Only a hash of the
+| path is kept, so a record is 40 bytes no matter how long the path.
+| A path gone from the tree is not reported by itself, the change of
+| its directory tells about it.
+|
+| The index file is a header followed by the records sorted by their
+| hash, so it is mapped into memory as is and searched by bisection:
+|
+|   magic     'LSYNCIDX'
+|   version   uint32
+|   recsize   uint32, the bytes of a record
+|   count     uint64, the number of records
+|   identity  uint64, the hash of the sync's source and target
+|   reserved  24 bytes
+|
+| The numbers are in the byte order of the host writing the index,
+| a host with another one refuses the index by its version.
+|
+| Records set while running are held in memory and merged into
+| a new index file when it is written, by a thread of its own if
+| available. The tree is scanned by the tree walker in steps between
+| handling events.
+*/
+
+#include "lsyncd.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+
+#define TREEINDEX_META "Lsyncd.treeindex"
+
+#define TREEINDEX_MAGIC "LSYNCIDX"
+
+#define TREEINDEX_VERSION 1
+
+
+/*
+| Records a worker collects before writing them out.
+*/
+#define SCAN_BATCH 1024
+
+
+/*
+| The header of an index file.
+*/
+struct ti_header
+{
+	char magic[ 8 ];
+	uint32_t version;
+	uint32_t recsize;
+	uint64_t count;
+	uint64_t identity;
+	uint8_t reserved[ 24 ];
+};
+
+
+/*
+| The record of a path.
+|
+| Times are in nanoseconds.
+*/
+struct ti_record
+{
+	uint64_t hash;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t ctime;
+};
+
+
+/*
+| A record set while running, not written yet.
+*/
+struct ti_update
+{
+	struct ti_record rec;
+
+	// the slot is taken
+	bool used;
+
+	// the path is gone
+	bool removed;
+};
+
+
+struct scan;
+struct ti_write;
+
+
+/*
+| An index.
+*/
+struct treeindex
+{
+	// the index file
+	char *path;
+
+	// the hash of the sync's source and target
+	uint64_t identity;
+
+	// false as long as no valid index was loaded or scanned
+	bool valid;
+
+	// the mapping holding the records
+	void *map;
+	size_t maplen;
+
+	// the records sorted by hash
+	const struct ti_record *recs;
+	size_t count;
+
+	// the records set while running, an open addressed hash table
+	struct ti_update *updates;
+	size_t nupdates;
+	size_t supdates;
+
+	// the scan going on or NULL
+	struct scan *scan;
+
+	// the write going on or NULL
+	struct ti_write *writing;
+};
+
+
+/*
+| Returns the hash of a path.
+*/
+static uint64_t
+ti_hash(
+	const char *s,
+	size_t len
+)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for( i = 0; i < len; i++ )
+	{
+		h ^= ( unsigned char ) s[ i ];
+		h *= 0x100000001b3ULL;
+	}
+
+	// spreads the bits, similar paths differ in their last bytes only
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+
+/*
+| Makes the record of a path from its status.
+*/
+static void
+ti_record_of(
+	struct ti_record *rec,
+	uint64_t hash,
+	const struct stat *st
+)
+{
+	rec->hash = hash;
+	rec->ino = st->st_ino;
+	rec->size = st->st_size;
+
+#ifdef __APPLE__
+	rec->mtime = ( int64_t ) st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+	rec->ctime = ( int64_t ) st->st_ctimespec.tv_sec * 1000000000 + st->st_ctimespec.tv_nsec;
+#else
+	rec->mtime = ( int64_t ) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	rec->ctime = ( int64_t ) st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+#endif
+}
+
+
+/*
+| True if two records tell about the same state of a path.
+*/
+static bool
+ti_same(
+	const struct ti_record *a,
+	const struct ti_record *b
+)
+{
+	return a->ino == b->ino
+		&& a->size == b->size
+		&& a->mtime == b->mtime
+		&& a->ctime == b->ctime;
+}
+
+
+/*
+| Returns the record of a hash or NULL.
+*/
+static const struct ti_record *
+ti_lookup(
+	const struct treeindex *ti,
+	uint64_t hash
+)
+{
+	size_t lo = 0;
+	size_t hi = ti->count;
+
+	while( lo < hi )
+	{
+		size_t mid = lo + ( hi - lo ) / 2;
+
+		if( ti->recs[ mid ].hash < hash ) lo = mid + 1;
+		else hi = mid;
+	}
+
+	if( lo < ti->count && ti->recs[ lo ].hash == hash )
+	{
+		return &ti->recs[ lo ];
+	}
+
+	return NULL;
+}
+
+
+/*
+| Orders records by their hash.
+*/
+static int
+ti_compare(
+	const void *a,
+	const void *b
+)
+{
+	uint64_t ha = ( ( const struct ti_record * ) a )->hash;
+	uint64_t hb = ( ( const struct ti_record * ) b )->hash;
+
+	return ha < hb ? -1 : ha > hb;
+}
+
+
+/*
+| Drops the mapped records.
+*/
+static void
+ti_unmap( struct treeindex *ti )
+{
+	if( ti->map )
+	{
+		munmap( ti->map, ti->maplen );
+	}
+
+	ti->map = NULL;
+	ti->maplen = 0;
+	ti->recs = NULL;
+	ti->count = 0;
+}
+
+
+/*
+| Maps the records of an index file.
+|
+| Returns false if there is none or it is not valid.
+*/
+static bool
+ti_load(
+	struct treeindex *ti,
+	const char *path
+)
+{
+	int fd = open( path, O_RDONLY | O_CLOEXEC );
+	struct stat st;
+	struct ti_header h;
+	void *map;
+
+	if( fd < 0 ) return false;
+
+	if(
+		fstat( fd, &st )
+		|| st.st_size < ( off_t ) sizeof( h )
+		|| pread( fd, &h, sizeof( h ), 0 ) != sizeof( h )
+		|| memcmp( h.magic, TREEINDEX_MAGIC, sizeof( h.magic ) )
+		|| h.version != TREEINDEX_VERSION
+		|| h.recsize != sizeof( struct ti_record )
+		|| h.identity != ti->identity
+		|| ( uint64_t ) st.st_size != sizeof( h ) + h.count * sizeof( struct ti_record )
+	)
+	{
+		close( fd );
+		return false;
+	}
+
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+
+	close( fd );
+
+	if( map == MAP_FAILED ) return false;
+
+	ti_unmap( ti );
+
+	ti->map = map;
+	ti->maplen = st.st_size;
+	ti->recs = ( const struct ti_record * ) ( ( char * ) map + sizeof( h ) );
+	ti->count = h.count;
+
+	return true;
+}
+
+
+/*
+| Sets a record in the table of updates.
+*/
+static void
+ti_update(
+	struct treeindex *ti,
+	const struct ti_record *rec,
+	bool removed
+)
+{
+	size_t mask;
+	size_t i;
+
+	if( 2 * ( ti->nupdates + 1 ) > ti->supdates )
+	{
+		struct ti_update *old = ti->updates;
+		size_t sold = ti->supdates;
+
+		ti->supdates = sold ? sold * 2 : 1024;
+		ti->updates = s_calloc( ti->supdates, sizeof( struct ti_update ) );
+		ti->nupdates = 0;
+
+		for( i = 0; i < sold; i++ )
+		{
+			if( old[ i ].used )
+			{
+				ti_update( ti, &old[ i ].rec, old[ i ].removed );
+			}
+		}
+
+		free( old );
+	}
+
+	mask = ti->supdates - 1;
+	i = rec->hash & mask;
+
+	while( ti->updates[ i ].used && ti->updates[ i ].rec.hash != rec->hash )
+	{
+		i = ( i + 1 ) & mask;
+	}
+
+	if( !ti->updates[ i ].used ) ti->nupdates++;
+
+	ti->updates[ i ].rec = *rec;
+	ti->updates[ i ].used = true;
+	ti->updates[ i ].removed = removed;
+}
+
+
+/*
+| Orders updates by their hash.
+*/
+static int
+ti_compare_updates(
+	const void *a,
+	const void *b
+)
+{
+	return ti_compare(
+		&( ( const struct ti_update * ) a )->rec,
+		&( ( const struct ti_update * ) b )->rec
+	);
+}
+
+
+/*
+| Writes records through a buffer.
+*/
+struct ti_writer
+{
+	FILE *f;
+	bool failed;
+};
+
+
+static void
+ti_put(
+	struct ti_writer *w,
+	const struct ti_record *rec
+)
+{
+	if( !w->failed && fwrite( rec, sizeof( *rec ), 1, w->f ) != 1 )
+	{
+		w->failed = true;
+	}
+}
+
+
+/*
+| A directory queued for a scan.
+|
+| 'path' is relative to the source, starting and ending with '/'.
+*/
+struct scan_dir
+{
+	// the transfer of a directory holding it covers all within
+	bool covered;
+
+	// the directory itself changed, its transfer covers its files
+	bool flat;
+
+	// all paths within are included, no need to test them
+	bool included;
+
+	size_t len;
+	char path[ ];
+};
+
+
+/*
+| A change found by a scan.
+*/
+struct scan_change
+{
+	// 't' a new directory, 'd' a changed directory, 'f' a changed file
+	char kind;
+
+	size_t len;
+	char path[ ];
+};
+
+
+/*
+| What a worker of the tree walker keeps for a scan.
+*/
+struct scan_worker
+{
+	// records not written out yet
+	struct ti_record batch[ SCAN_BATCH ];
+	int nbatch;
+
+	struct scan_change **changes;
+	size_t nchanges;
+	size_t schanges;
+
+	// scratch space for the matchers
+	void *scratch;
+};
+
+
+/*
+| A scan of a tree.
+|
+| It is walked in steps, so a large tree does not hold up
+| the masterloop. The matchers are kept referenced in the
+| registry by the scan until it is done.
+*/
+struct scan
+{
+	const struct treeindex *ti;
+
+	// the absolute source path ending with '/'
+	char *source;
+	size_t srclen;
+
+	// the matchers, filters is NULL if there are none
+	const struct matcher *excludes;
+	const struct matcher *filters;
+
+	// the file the records are written to and the bytes written
+	int fd;
+	size_t written;
+
+	// set with its error if writing the records failed
+	bool failed;
+	int error;
+
+	struct treewalk *walker;
+
+	struct scan_worker *workers;
+	int nworkers;
+};
+
+
+/*
+| Writes out the batch of a worker.
+*/
+static void
+scan_flush(
+	struct scan *scan,
+	struct scan_worker *w
+)
+{
+	size_t bytes = w->nbatch * sizeof( struct ti_record );
+	size_t off;
+
+	if( !bytes ) return;
+
+	off = __atomic_fetch_add( &scan->written, bytes, __ATOMIC_RELAXED );
+
+	if( pwrite( scan->fd, w->batch, bytes, off ) != ( ssize_t ) bytes )
+	{
+		scan->error = errno ? errno : ENOSPC;
+
+		__atomic_store_n( &scan->failed, true, __ATOMIC_RELAXED );
+	}
+
+	w->nbatch = 0;
+}
+
+
+/*
+| Adds a record to the new index.
+*/
+static void
+scan_record(
+	struct scan *scan,
+	struct scan_worker *w,
+	const struct ti_record *rec
+)
+{
+	w->batch[ w->nbatch++ ] = *rec;
+
+	if( w->nbatch == SCAN_BATCH ) scan_flush( scan, w );
+}
+
+
+/*
+| Reports a change.
+|
+| Returns false if out of memory, the scan failed then.
+*/
+static bool
+scan_report(
+	struct scan *scan,
+	struct scan_worker *w,
+	char kind,
+	const char *path,
+	size_t len
+)
+{
+	struct scan_change *c;
+
+	// called by workers, so no s_malloc( )
+	if( w->nchanges == w->schanges )
+	{
+		size_t schanges = w->schanges ? w->schanges * 2 : 64;
+		struct scan_change **changes =
+			realloc( w->changes, schanges * sizeof( struct scan_change * ) );
+
+		if( !changes )
+		{
+			treewalk_fail( scan->walker, ENOMEM );
+			return false;
+		}
+
+		w->changes = changes;
+		w->schanges = schanges;
+	}
+
+	c = malloc( sizeof( struct scan_change ) + len );
+
+	if( !c )
+	{
+		treewalk_fail( scan->walker, ENOMEM );
+		return false;
+	}
+
+	c->kind = kind;
+	c->len = len;
+
+	memcpy( c->path, path, len );
+
+	w->changes[ w->nchanges++ ] = c;
+
+	return true;
+}
+
+
+/*
+| Queues a directory.
+|
+| Returns false if out of memory, the scan failed then.
+*/
+static bool
+scan_queue(
+	struct scan *scan,
+	int worker,
+	const char *path,
+	size_t len,
+	bool covered,
+	bool flat,
+	bool included
+)
+{
+	struct scan_dir *d = malloc( sizeof( struct scan_dir ) + len + 1 );
+
+	if( !d )
+	{
+		treewalk_fail( scan->walker, ENOMEM );
+		return false;
+	}
+
+	d->covered = covered;
+	d->flat = flat;
+	d->included = included;
+	d->len = len;
+
+	memcpy( d->path, path, len );
+	d->path[ len ] = 0;
+
+	if( !treewalk_queue( scan->walker, worker, d ) )
+	{
+		free( d );
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+| Returns the verdict of the filters and excludes for a path,
+| like Sync.testFilter( ) and Sync.dirVerdict( ) do.
+*/
+static int
+scan_verdict(
+	struct scan *scan,
+	struct scan_worker *w,
+	const char *path,
+	size_t len,
+	bool within
+)
+{
+	int v = scan->filters
+		? matcher_verdict( scan->filters, path, len, within, w->scratch )
+		: MATCH_NONE;
+
+	if( v == MATCH_NONE )
+	{
+		v = matcher_verdict( scan->excludes, path, len, within, w->scratch );
+	}
+
+	return v;
+}
+
+
+/*
+| Compares a path against the index and records it.
+|
+| A changed path keeps its old record and a new path gets none,
+| until its transfer is done and the runner sets its record.
+|
+| Returns the kind of the change or 0 if none.
+*/
+static char
+scan_compare(
+	struct scan *scan,
+	struct scan_worker *w,
+	bool covered,
+	bool flat,
+	const struct ti_record *rec,
+	bool isdir
+)
+{
+	const struct ti_record *old;
+
+	if( covered || ( flat && !isdir ) )
+	{
+		scan_record( scan, w, rec );
+		return 0;
+	}
+
+	old = ti_lookup( scan->ti, rec->hash );
+
+	if( !old )
+	{
+		return isdir ? 't' : 'f';
+	}
+
+	scan_record( scan, w, old );
+
+	if( ti_same( old, rec ) )
+	{
+		return 0;
+	}
+
+	return isdir ? 'd' : 'f';
+}
+
+
+/*
+| Walks a directory.
+*/
+static void
+scan_visit(
+	struct treewalk *walker,
+	int worker,
+	void *task
+)
+{
+	struct scan *scan = treewalk_arg( walker );
+	struct scan_worker *w = &scan->workers[ worker ];
+	struct scan_dir *d = task;
+	char path[ PATH_MAX ];
+	char rel[ PATH_MAX ];
+	struct dirscan ds;
+	const char *name;
+	unsigned char type;
+	ino_t ino;
+
+	if( scan->srclen + d->len > sizeof( path ) )
+	{
+		free( d );
+		return;
+	}
+
+	// the source ends with '/' and the directory starts with it
+	memcpy( path, scan->source, scan->srclen - 1 );
+	memcpy( path + scan->srclen - 1, d->path, d->len + 1 );
+
+	if( !dirscan_open( &ds, path, false ) )
+	{
+		free( d );
+		return;
+	}
+
+	memcpy( rel, d->path, d->len );
+
+	while( dirscan_next( &ds, &name, &type, &ino ) )
+	{
+		struct stat st;
+		struct ti_record rec;
+		bool isdir;
+		bool included;
+		size_t nlen;
+		size_t len;
+		char kind;
+
+		// the record needs the status anyway
+		if( fstatat( dirscan_fd( &ds ), name, &st, AT_SYMLINK_NOFOLLOW ) ) continue;
+
+		isdir = S_ISDIR( st.st_mode );
+		nlen = strlen( name );
+		len = d->len + nlen + isdir;
+
+		if( len + 1 > sizeof( rel ) ) continue;
+
+		memcpy( rel + d->len, name, nlen );
+
+		if( isdir ) rel[ len - 1 ] = '/';
+
+		rel[ len ] = 0;
+
+		included = d->included;
+
+		if( !included )
+		{
+			if( scan_verdict( scan, w, rel, len, false ) > 0 ) continue;
+
+			if( isdir )
+			{
+				int v = scan_verdict( scan, w, rel, len, true );
+
+				if( v > 0 ) continue;
+
+				included = v != MATCH_MIXED;
+			}
+		}
+
+		ti_record_of( &rec, ti_hash( rel, len ), &st );
+
+		kind = scan_compare( scan, w, d->covered, d->flat, &rec, isdir );
+
+		if( kind && !scan_report( scan, w, kind, rel, len ) ) break;
+
+		if(
+			isdir
+			&& !scan_queue(
+				scan, worker, rel, len,
+				d->covered || kind == 't',
+				kind == 'd',
+				included
+			)
+		)
+		{
+			break;
+		}
+	}
+
+	dirscan_close( &ds );
+
+	free( d );
+}
+
+
+/*
+| Frees the scan of an index, done or not.
+*/
+static void
+scan_free(
+	lua_State *L,
+	struct treeindex *ti
+)
+{
+	struct scan *scan = ti->scan;
+	struct scan_dir *d;
+	int i;
+
+	while( ( d = treewalk_take( scan->walker ) ) )
+	{
+		free( d );
+	}
+
+	treewalk_free( scan->walker );
+
+	for( i = 0; i < scan->nworkers; i++ )
+	{
+		struct scan_worker *w = &scan->workers[ i ];
+		size_t k;
+
+		for( k = 0; k < w->nchanges; k++ )
+		{
+			free( w->changes[ k ] );
+		}
+
+		free( w->changes );
+		free( w->scratch );
+	}
+
+	free( scan->workers );
+
+	if( scan->fd >= 0 ) close( scan->fd );
+
+	free( scan->source );
+
+	// releases the matchers
+	lua_pushlightuserdata( L, scan );
+	lua_pushnil( L );
+	lua_settable( L, LUA_REGISTRYINDEX );
+
+	free( scan );
+
+	ti->scan = NULL;
+}
+
+
+/*
+| A write of the index file going on.
+|
+| The records set until it started are taken from the index,
+| the ones set meanwhile are written by the next one.
+*/
+struct ti_write
+{
+	// the index file and the new one written first
+	const char *path;
+	char *tmp;
+
+	uint64_t identity;
+
+	// the records of the index when the write started,
+	// these stay mapped until it is done
+	const struct ti_record *recs;
+	size_t count;
+
+	// the table of the updates taken and its size, these are
+	// moved to its begin and ordered by hash when writing
+	struct ti_update *ups;
+	size_t sups;
+	size_t nups;
+
+	// the error if writing failed
+	int error;
+
+	// true if written by a thread of its own
+	bool threaded;
+
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+
+	// set by the thread when it is done
+	bool done;
+#endif
+};
+
+
+/*
+| Writes the new index file and replaces the old one by it.
+|
+| It runs besides the masterloop, so it must neither log
+| nor allocate through s_malloc( ).
+*/
+static void
+ti_write_file( struct ti_write *wr )
+{
+	struct ti_writer w;
+	struct ti_header h;
+	char dir[ PATH_MAX ];
+	const char *slash;
+	size_t i = 0;
+	size_t k = 0;
+	uint64_t count = 0;
+	int dfd;
+
+	// the updates in order of their hash
+	for( i = 0; i < wr->sups; i++ )
+	{
+		if( wr->ups[ i ].used ) wr->ups[ wr->nups++ ] = wr->ups[ i ];
+	}
+
+	if( wr->nups )
+	{
+		qsort( wr->ups, wr->nups, sizeof( struct ti_update ), ti_compare_updates );
+	}
+
+	w.f = fopen( wr->tmp, "wb" );
+	w.failed = false;
+
+	if( !w.f )
+	{
+		wr->error = errno;
+		return;
+	}
+
+	memset( &h, 0, sizeof( h ) );
+	memcpy( h.magic, TREEINDEX_MAGIC, sizeof( h.magic ) );
+
+	h.version = TREEINDEX_VERSION;
+	h.recsize = sizeof( struct ti_record );
+	h.identity = wr->identity;
+
+	// the count is filled in at last
+	if( fwrite( &h, sizeof( h ), 1, w.f ) != 1 ) w.failed = true;
+
+	i = 0;
+
+	while( i < wr->count || k < wr->nups )
+	{
+		uint64_t hash;
+
+		if( k == wr->nups || ( i < wr->count && wr->recs[ i ].hash < wr->ups[ k ].rec.hash ) )
+		{
+			ti_put( &w, &wr->recs[ i++ ] );
+			count++;
+			continue;
+		}
+
+		hash = wr->ups[ k ].rec.hash;
+
+		// an update replaces all records of its hash
+		while( i < wr->count && wr->recs[ i ].hash == hash ) i++;
+
+		if( !wr->ups[ k ].removed )
+		{
+			ti_put( &w, &wr->ups[ k ].rec );
+			count++;
+		}
+
+		k++;
+	}
+
+	h.count = count;
+
+	if(
+		w.failed
+		|| fseek( w.f, 0, SEEK_SET )
+		|| fwrite( &h, sizeof( h ), 1, w.f ) != 1
+		|| fflush( w.f )
+		|| fsync( fileno( w.f ) )
+	)
+	{
+		w.failed = true;
+	}
+
+	wr->error = errno ? errno : EIO;
+
+	if( fclose( w.f ) && !w.failed )
+	{
+		w.failed = true;
+		wr->error = errno;
+	}
+
+	if( w.failed || rename( wr->tmp, wr->path ) )
+	{
+		if( !w.failed ) wr->error = errno;
+
+		unlink( wr->tmp );
+
+		return;
+	}
+
+	wr->error = 0;
+
+	// the rename is on disk only with its directory
+	slash = strrchr( wr->path, '/' );
+
+	if( !slash )
+	{
+		strcpy( dir, "." );
+	}
+	else if( slash == wr->path )
+	{
+		strcpy( dir, "/" );
+	}
+	else if( ( size_t ) ( slash - wr->path ) < sizeof( dir ) )
+	{
+		memcpy( dir, wr->path, slash - wr->path );
+		dir[ slash - wr->path ] = 0;
+	}
+	else
+	{
+		return;
+	}
+
+	dfd = open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+
+	if( dfd >= 0 )
+	{
+		fsync( dfd );
+		close( dfd );
+	}
+}
+
+
+#ifdef HAVE_PTHREAD
+
+/*
+| Runs the writing thread.
+*/
+static void *
+ti_write_thread( void *arg )
+{
+	struct ti_write *wr = arg;
+
+	ti_write_file( wr );
+
+	__atomic_store_n( &wr->done, true, __ATOMIC_RELEASE );
+
+	return NULL;
+}
+
+#endif
+
+
+/*
+| Returns true if there is an update of a hash.
+*/
+static bool
+ti_has_update(
+	const struct treeindex *ti,
+	uint64_t hash
+)
+{
+	size_t mask;
+	size_t i;
+
+	if( !ti->supdates ) return false;
+
+	mask = ti->supdates - 1;
+	i = hash & mask;
+
+	while( ti->updates[ i ].used )
+	{
+		if( ti->updates[ i ].rec.hash == hash ) return true;
+
+		i = ( i + 1 ) & mask;
+	}
+
+	return false;
+}
+
+
+/*
+| Finishes the write of an index, waiting for it if need be.
+|
+| Returns on Lua stack:
+|     true or nil and an error
+*/
+static int
+ti_write_finish(
+	lua_State *L,
+	struct treeindex *ti
+)
+{
+	struct ti_write *wr = ti->writing;
+	int error;
+	size_t i;
+
+#ifdef HAVE_PTHREAD
+	if( wr->threaded ) pthread_join( wr->thread, NULL );
+#endif
+
+	ti->writing = NULL;
+
+	error = wr->error;
+
+	// the records are the ones of the new file from now on
+	if( !error && !ti_load( ti, ti->path ) )
+	{
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot read back %s", ti->path );
+	}
+	else if( error )
+	{
+		// the updates not written are set again,
+		// unless these paths were set anew meanwhile
+		for( i = 0; i < wr->nups; i++ )
+		{
+			if( !ti_has_update( ti, wr->ups[ i ].rec.hash ) )
+			{
+				ti_update( ti, &wr->ups[ i ].rec, wr->ups[ i ].removed );
+			}
+		}
+
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot write %s: %s", ti->path, strerror( error ) );
+	}
+	else
+	{
+		lua_pushboolean( L, 1 );
+	}
+
+	free( wr->ups );
+	free( wr->tmp );
+	free( wr );
+
+	return lua_isnil( L, -1 ) ? 2 : 1;
+}
+
+
+/*
+| Opens an index.
+|
+| Params on Lua stack:
+|     1: the path of the index file
+|     2: the identity of the sync, its source and target
+|
+| Returns on Lua stack:
+|     the index, holding the records of the file if it is a valid
+|     index of the same sync
+*/
+int
+l_treeindex( lua_State *L )
+{
+	const char *path = luaL_checkstring( L, 1 );
+	size_t len;
+	const char *identity = luaL_checklstring( L, 2, &len );
+
+	struct treeindex *ti = lua_newuserdata( L, sizeof( struct treeindex ) );
+
+	memset( ti, 0, sizeof( *ti ) );
+
+	luaL_getmetatable( L, TREEINDEX_META );
+	lua_setmetatable( L, -2 );
+
+	ti->path = s_malloc( strlen( path ) + 1 );
+	strcpy( ti->path, path );
+
+	ti->identity = ti_hash( identity, len );
+	ti->valid = ti_load( ti, path );
+
+	return 1;
+}
+
+
+/*
+| Returns the number of records or nil if the index is not valid.
+*/
+static int
+l_treeindex_count( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+
+	if( !ti->valid )
+	{
+		lua_pushnil( L );
+	}
+	else
+	{
+		lua_pushinteger( L, ti->count );
+	}
+
+	return 1;
+}
+
+
+/*
+| Starts to scan the tree and compare it against the index.
+|
+| The tree is walked by step( ), once done the records found
+| become the records of the index.
+|
+| Params on Lua stack:
+|     1: the index
+|     2: absolute path of the source, ending with '/'
+|     3: the matcher of the excludes
+|     4: the matcher of the filters or nil
+|     5: if true nothing is compared and reported, as all of the
+|        tree is transferred anyway
+|
+| Returns on Lua stack:
+|     true or nil and an error
+*/
+static int
+l_treeindex_scan( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+	size_t srclen;
+	const char *source = luaL_checklstring( L, 2, &srclen );
+	const struct matcher *excludes = check_matcher( L, 3 );
+	const struct matcher *filters = lua_isnoneornil( L, 4 ) ? NULL : check_matcher( L, 4 );
+	bool covered = lua_toboolean( L, 5 );
+	struct scan *scan;
+	struct scan_worker *w0;
+	struct ti_record rec;
+	struct stat st;
+	char kind;
+	char *tmp;
+	size_t plen;
+	size_t scratch;
+	int fd;
+	int v;
+	int i;
+
+	if( ti->scan )
+	{
+		return luaL_error( L, "tree index scanned already" );
+	}
+
+	// the records of a write going on are replaced
+	if( ti->writing )
+	{
+		ti_write_finish( L, ti );
+		lua_settop( L, 5 );
+	}
+
+	if( !srclen || source[ srclen - 1 ] != '/' || lstat( source, &st ) )
+	{
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot scan %s", source );
+		return 2;
+	}
+
+	// the records are written next to the index,
+	// the file is gone once its mapping is
+	plen = strlen( ti->path );
+	tmp = s_malloc( plen + 6 );
+
+	memcpy( tmp, ti->path, plen );
+	memcpy( tmp + plen, ".scan", 6 );
+
+	fd = open( tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+
+	if( fd >= 0 ) unlink( tmp );
+
+	free( tmp );
+
+	if( fd < 0 )
+	{
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot write %s.scan: %s", ti->path, strerror( errno ) );
+		return 2;
+	}
+
+	scan = s_calloc( 1, sizeof( struct scan ) );
+
+	scan->ti = ti;
+	scan->fd = fd;
+	scan->source = s_malloc( srclen + 1 );
+	scan->srclen = srclen;
+	scan->excludes = excludes;
+	scan->filters = filters;
+
+	memcpy( scan->source, source, srclen + 1 );
+
+	// keeps the matchers until the scan is done
+	lua_pushlightuserdata( L, scan );
+	lua_createtable( L, 2, 0 );
+	lua_pushvalue( L, 3 );
+	lua_rawseti( L, -2, 1 );
+	lua_pushvalue( L, 4 );
+	lua_rawseti( L, -2, 2 );
+	lua_settable( L, LUA_REGISTRYINDEX );
+
+	ti->scan = scan;
+
+	scratch = matcher_scratch_size( excludes );
+
+	if( filters && matcher_scratch_size( filters ) > scratch )
+	{
+		scratch = matcher_scratch_size( filters );
+	}
+
+	scan->walker = treewalk_new( scan_visit, scan );
+	scan->nworkers = treewalk_workers( scan->walker );
+	scan->workers = s_calloc( scan->nworkers, sizeof( struct scan_worker ) );
+
+	for( i = 0; i < scan->nworkers; i++ )
+	{
+		scan->workers[ i ].scratch = s_calloc( 1, scratch + sizeof( uint64_t ) );
+	}
+
+	// the root itself
+	w0 = &scan->workers[ 0 ];
+
+	ti_record_of( &rec, ti_hash( "/", 1 ), &st );
+
+	kind = scan_compare( scan, w0, covered, false, &rec, true );
+
+	v = scan_verdict( scan, w0, "/", 1, true );
+
+	// a failure is reported by the first step
+	if( !kind || scan_report( scan, w0, kind, "/", 1 ) )
+	{
+		scan_queue( scan, 0, "/", 1, covered || kind == 't', kind == 'd', v != MATCH_MIXED );
+	}
+
+	lua_pushboolean( L, 1 );
+
+	return 1;
+}
+
+
+/*
+| Walks the next directories of the scan.
+|
+| Params on Lua stack:
+|     1: the index
+|     2: stops after walking about this many directories ( optional )
+|     3: stops after about this many seconds ( optional )
+|
+| Returns on Lua stack:
+|     false as long as the scan is not done, then
+|     a list with two entries per change, its path and
+|        'tree' for a new directory to transfer with all within,
+|        'dir'  for a changed directory to transfer flat,
+|        'file' for a new or changed file
+|     or nil and an error
+*/
+static int
+l_treeindex_step( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+	size_t limit = luaL_optinteger( L, 2, 0 );
+	double secs = luaL_optnumber( L, 3, 0 );
+	struct scan *scan = ti->scan;
+	size_t count;
+	void *map = NULL;
+	int n = 0;
+	int i;
+
+	if( !scan )
+	{
+		return luaL_error( L, "tree index not scanning" );
+	}
+
+	treewalk_run( scan->walker, limit, secs );
+
+	if( treewalk_error( scan->walker ) )
+	{
+		lua_pushnil( L );
+		lua_pushfstring(
+			L, "cannot scan %s: %s",
+			scan->source, strerror( treewalk_error( scan->walker ) )
+		);
+
+		scan_free( L, ti );
+
+		return 2;
+	}
+
+	if( treewalk_pending( scan->walker ) && !scan->failed )
+	{
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	for( i = 0; i < scan->nworkers; i++ )
+	{
+		scan_flush( scan, &scan->workers[ i ] );
+	}
+
+	// maps the new records and sorts them
+	count = scan->written / sizeof( struct ti_record );
+
+	if( !scan->failed && count )
+	{
+		map = mmap( NULL, scan->written, PROT_READ | PROT_WRITE, MAP_SHARED, scan->fd, 0 );
+
+		if( map == MAP_FAILED )
+		{
+			map = NULL;
+			scan->failed = true;
+			scan->error = errno;
+		}
+		else
+		{
+			qsort( map, count, sizeof( struct ti_record ), ti_compare );
+		}
+	}
+
+	if( scan->failed )
+	{
+		lua_pushnil( L );
+		lua_pushfstring( L, "cannot write %s.scan: %s", ti->path, strerror( scan->error ) );
+
+		scan_free( L, ti );
+
+		return 2;
+	}
+
+	lua_newtable( L );
+
+	for( i = 0; i < scan->nworkers; i++ )
+	{
+		struct scan_worker *w = &scan->workers[ i ];
+		size_t k;
+
+		for( k = 0; k < w->nchanges; k++ )
+		{
+			struct scan_change *c = w->changes[ k ];
+
+			lua_pushlstring( L, c->path, c->len );
+			lua_rawseti( L, -2, ++n );
+
+			lua_pushstring(
+				L,
+				c->kind == 't' ? "tree" : ( c->kind == 'd' ? "dir" : "file" )
+			);
+			lua_rawseti( L, -2, ++n );
+		}
+	}
+
+	printlogf(
+		L, "TreeIndex",
+		"scan( %s )-> %d entries, %d changed",
+		scan->source, ( int ) count, n / 2
+	);
+
+	scan_free( L, ti );
+
+	ti_unmap( ti );
+
+	ti->map = map;
+	ti->maplen = count * sizeof( struct ti_record );
+	ti->recs = map;
+	ti->count = count;
+	ti->valid = true;
+
+	return 1;
+}
+
+
+/*
+| Returns the status of a path as a record.
+|
+| Params on Lua stack:
+|     1: the index
+|     2: the absolute path, directories ending with '/'
+|
+| Returns on Lua stack:
+|     the status packed into a string or false if the path is gone
+*/
+static int
+l_treeindex_stat( lua_State *L )
+{
+	size_t len;
+	const char *path;
+	char buf[ PATH_MAX ];
+	struct stat st;
+	struct ti_record rec;
+
+	luaL_checkudata( L, 1, TREEINDEX_META );
+
+	path = luaL_checklstring( L, 2, &len );
+
+	if( len > 1 && path[ len - 1 ] == '/' && len <= sizeof( buf ) )
+	{
+		// with the slash a symlink to a directory would be followed
+		memcpy( buf, path, len - 1 );
+		buf[ len - 1 ] = 0;
+		path = buf;
+	}
+
+	if( lstat( path, &st ) )
+	{
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+
+	ti_record_of( &rec, 0, &st );
+
+	lua_pushlstring( L, ( const char * ) &rec, sizeof( rec ) );
+
+	return 1;
+}
+
+
+/*
+| Sets the record of a path.
+|
+| Params on Lua stack:
+|     1: the index
+|     2: the path relative to the source, starting with '/'
+|     3: its status as returned by stat( ) or false if it is gone
+*/
+static int
+l_treeindex_set( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+	size_t len;
+	const char *path = luaL_checklstring( L, 2, &len );
+	struct ti_record rec;
+	bool removed;
+
+	memset( &rec, 0, sizeof( rec ) );
+
+	removed = !lua_toboolean( L, 3 );
+
+	if( !removed )
+	{
+		size_t rlen;
+		const char *r = luaL_checklstring( L, 3, &rlen );
+
+		luaL_argcheck( L, rlen == sizeof( rec ), 3, "not a status" );
+
+		memcpy( &rec, r, sizeof( rec ) );
+	}
+
+	rec.hash = ti_hash( path, len );
+
+	ti_update( ti, &rec, removed );
+
+	return 0;
+}
+
+
+/*
+| Returns the number of records set but not written yet.
+*/
+static int
+l_treeindex_pending( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+
+	lua_pushinteger( L, ti->nupdates );
+
+	return 1;
+}
+
+
+/*
+| Starts to write the index file, merging the records set meanwhile.
+|
+| The new file replaces the old one only once it is on disk.
+| It is written by a thread of its own if available, written( )
+| tells when it is done.
+|
+| Returns on Lua stack:
+|     true or nil and an error
+*/
+static int
+l_treeindex_write( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+	size_t plen = strlen( ti->path );
+	struct ti_write *wr;
+
+	if( ti->scan || ti->writing )
+	{
+		return luaL_error( L, "tree index busy" );
+	}
+
+	wr = s_calloc( 1, sizeof( struct ti_write ) );
+
+	wr->path = ti->path;
+	wr->tmp = s_malloc( plen + 5 );
+
+	memcpy( wr->tmp, ti->path, plen );
+	memcpy( wr->tmp + plen, ".new", 5 );
+
+	wr->identity = ti->identity;
+	wr->recs = ti->recs;
+	wr->count = ti->count;
+	wr->ups = ti->updates;
+	wr->sups = ti->supdates;
+
+	// the records set from now on go to a new table
+	ti->updates = NULL;
+	ti->nupdates = 0;
+	ti->supdates = 0;
+
+	ti->writing = wr;
+
+#ifdef HAVE_PTHREAD
+	{
+		// no signals for the writer
+		sigset_t all, old;
+
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+
+		wr->threaded = !pthread_create( &wr->thread, NULL, ti_write_thread, wr );
+
+		pthread_sigmask( SIG_SETMASK, &old, NULL );
+	}
+
+	if( wr->threaded )
+	{
+		lua_pushboolean( L, 1 );
+		return 1;
+	}
+#endif
+
+	ti_write_file( wr );
+
+	return ti_write_finish( L, ti );
+}
+
+
+/*
+| Tells if the write of the index file is done.
+|
+| Params on Lua stack:
+|     1: the index
+|     2: if true waits for it
+|
+| Returns on Lua stack:
+|     false as long as it is written, then
+|     true or nil and an error
+*/
+static int
+l_treeindex_written( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+
+	if( !ti->writing )
+	{
+		lua_pushboolean( L, 1 );
+		return 1;
+	}
+
+#ifdef HAVE_PTHREAD
+	if(
+		!lua_toboolean( L, 2 )
+		&& !__atomic_load_n( &ti->writing->done, __ATOMIC_ACQUIRE )
+	)
+	{
+		lua_pushboolean( L, 0 );
+		return 1;
+	}
+#endif
+
+	return ti_write_finish( L, ti );
+}
+
+
+/*
+| Frees an index.
+*/
+static int
+l_treeindex_gc( lua_State *L )
+{
+	struct treeindex *ti = luaL_checkudata( L, 1, TREEINDEX_META );
+
+	if( ti->writing )
+	{
+		ti_write_finish( L, ti );
+	}
+
+	if( ti->scan )
+	{
+		scan_free( L, ti );
+	}
+
+	ti_unmap( ti );
+
+	free( ti->updates );
+	free( ti->path );
+
+	ti->updates = NULL;
+	ti->path = NULL;
+
+	return 0;
+}
+
+
+/*
+| Creates the metatable for indexes.
+*/
+void
+register_treeindex( lua_State *L )
+{
+	luaL_newmetatable( L, TREEINDEX_META );
+
+	lua_newtable( L );
+	lua_pushcfunction( L, l_treeindex_count );
+	lua_setfield( L, -2, "count" );
+	lua_pushcfunction( L, l_treeindex_pending );
+	lua_setfield( L, -2, "pending" );
+	lua_pushcfunction( L, l_treeindex_scan );
+	lua_setfield( L, -2, "scan" );
+	lua_pushcfunction( L, l_treeindex_set );
+	lua_setfield( L, -2, "set" );
+	lua_pushcfunction( L, l_treeindex_stat );
+	lua_setfield( L, -2, "stat" );
+	lua_pushcfunction( L, l_treeindex_step );
+	lua_setfield( L, -2, "step" );
+	lua_pushcfunction( L, l_treeindex_write );
+	lua_setfield( L, -2, "write" );
+	lua_pushcfunction( L, l_treeindex_written );
+	lua_setfield( L, -2, "written" );
+	lua_setfield( L, -2, "__index" );
+
+	lua_pushcfunction( L, l_treeindex_gc );
+	lua_setfield( L, -2, "__gc" );
+
+	lua_pop( L, 1 );
+}
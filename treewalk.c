@@ -0,0 +1,747 @@
+/*
+| treewalk.c from Lsyncd - Live (Mirror) Syncing Demon
+|
+| License: GPLv2 (see COPYING) or any later version
+|
+| Authors: Axel Kittenberger <axkibe@gmail.com>
+|
+| -----------------------------------------------------------------------
+|
+| The tree walker.
+|
+| Walks directory trees by a pool of threads, the main thread
+| first walks alone and calls for help only if the tree turns out
+| to be large. Every worker takes the directories to walk from the
+| bottom of its own deque and steals from the top of the others
+| when it runs dry. A worker finding nothing to steal sleeps until
+| another one queues more or the walk is done.
+|
+| A walk can be limited in directories and time, the directories
+| not walked yet stay queued, so a later turn of the masterloop
+| goes on with them.
+|
+| What a directory is and what walking it means is up to the
+| user of the walker, inotify watches the trees and the tree
+| index compares them against its records.
+|
+| The workers must neither log nor allocate through s_malloc( ),
+| as these are not thread safe. A worker failing tells the walker
+| by treewalk_fail( ), the main thread reports it after the run.
+*/
+
+#include "lsyncd.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#	include <pthread.h>
+#endif
+
+
+/*
+| The main thread calls for help after walking this many directories.
+*/
+#define TREEWALK_SPAWN_AFTER 64
+
+
+/*
+| Most workers of a walk.
+*/
+#define TREEWALK_MAX_WORKERS 16
+
+
+/*
+| Directories waiting to be walked by a worker.
+*/
+struct treewalk_deque
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+	void **tasks;
+	size_t top;
+	size_t bottom;
+	size_t size;
+};
+
+
+/*
+| A worker of a walk.
+*/
+struct treewalk_worker
+{
+	struct treewalk *walk;
+
+	struct treewalk_deque deque;
+
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+};
+
+
+/*
+| A walk.
+*/
+struct treewalk
+{
+	// walks a directory
+	void ( *visit )( struct treewalk *walk, int worker, void *task );
+
+	// the argument of the user of the walker
+	void *arg;
+
+	struct treewalk_worker *workers;
+	int nworkers;
+
+	// true once the main thread called for help in this run
+	bool helped;
+
+	// the workers besides the main thread running
+	int running;
+
+	// the directories queued but not yet walked
+	size_t pending;
+
+	// the directories walked in this run
+	size_t walked;
+
+	// the directories the main thread walked in this run
+	size_t main_walked;
+
+	// stops after this many directories, 0 for no limit
+	size_t limit;
+
+	// stops at this time, zero for no limit
+	struct timespec deadline;
+
+	// set when the limit or the deadline is reached
+	bool stop;
+
+	// the errno of a worker that failed, 0 if none did
+	int error;
+
+#ifdef HAVE_PTHREAD
+	// idle workers sleep on this
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+
+	// the workers sleeping
+	int idle;
+
+	// counts the wake ups, so a worker notices one that
+	// happened between looking for work and going to sleep
+	unsigned int wakes;
+#endif
+};
+
+
+/*
+| Pushes a directory to the bottom of a deque.
+|
+| Returns false if out of memory.
+*/
+static bool
+deque_push(
+	struct treewalk_deque *dq,
+	void *task
+)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &dq->lock );
+#endif
+
+	if( dq->bottom == dq->size )
+	{
+		if( dq->top > dq->size / 2 )
+		{
+			// moves the entries down
+			memmove(
+				dq->tasks, dq->tasks + dq->top,
+				( dq->bottom - dq->top ) * sizeof( void * )
+			);
+
+			dq->bottom -= dq->top;
+			dq->top = 0;
+		}
+		else
+		{
+			// called by workers, so no s_realloc( )
+			size_t size = dq->size ? dq->size * 2 : 64;
+			void **tasks = realloc( dq->tasks, size * sizeof( void * ) );
+
+			if( !tasks )
+			{
+#ifdef HAVE_PTHREAD
+				pthread_mutex_unlock( &dq->lock );
+#endif
+				return false;
+			}
+
+			dq->tasks = tasks;
+			dq->size = size;
+		}
+	}
+
+	dq->tasks[ dq->bottom++ ] = task;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &dq->lock );
+#endif
+
+	return true;
+}
+
+
+/*
+| Pops a directory from the bottom or, when stealing, from the top
+| of a deque. Returns NULL if empty.
+*/
+static void *
+deque_pop(
+	struct treewalk_deque *dq,
+	bool steal
+)
+{
+	void *task = NULL;
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock( &dq->lock );
+#endif
+
+	if( dq->top < dq->bottom )
+	{
+		task = steal ? dq->tasks[ dq->top++ ] : dq->tasks[ --dq->bottom ];
+
+		if( dq->top == dq->bottom ) dq->top = dq->bottom = 0;
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock( &dq->lock );
+#endif
+
+	return task;
+}
+
+
+/*
+| Makes a walker.
+|
+| The number of workers is fixed from the start, so the user
+| of the walker can keep its own state by worker.
+*/
+struct treewalk *
+treewalk_new(
+	void ( *visit )( struct treewalk *walk, int worker, void *task ),
+	void *arg
+)
+{
+	struct treewalk *walk = s_calloc( 1, sizeof( struct treewalk ) );
+	int i;
+
+	walk->visit = visit;
+	walk->arg = arg;
+	walk->nworkers = 1;
+
+#ifdef HAVE_PTHREAD
+	{
+		long ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+
+		if( ncpu > TREEWALK_MAX_WORKERS ) ncpu = TREEWALK_MAX_WORKERS;
+
+		if( ncpu > 1 ) walk->nworkers = ncpu;
+	}
+#endif
+
+	walk->workers = s_calloc( walk->nworkers, sizeof( struct treewalk_worker ) );
+
+	for( i = 0; i < walk->nworkers; i++ )
+	{
+		walk->workers[ i ].walk = walk;
+
+#ifdef HAVE_PTHREAD
+		pthread_mutex_init( &walk->workers[ i ].deque.lock, NULL );
+#endif
+	}
+
+#ifdef HAVE_PTHREAD
+	{
+		pthread_condattr_t attr;
+
+		// the deadline is on the monotonic clock
+		pthread_condattr_init( &attr );
+		pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+
+		pthread_mutex_init( &walk->lock, NULL );
+		pthread_cond_init( &walk->wake, &attr );
+
+		pthread_condattr_destroy( &attr );
+	}
+#endif
+
+	return walk;
+}
+
+
+/*
+| Returns the argument the walker was made with.
+*/
+void *
+treewalk_arg( struct treewalk *walk )
+{
+	return walk->arg;
+}
+
+
+/*
+| Returns the number of workers.
+*/
+int
+treewalk_workers( struct treewalk *walk )
+{
+	return walk->nworkers;
+}
+
+
+/*
+| Returns the number of directories queued but not yet walked.
+*/
+size_t
+treewalk_pending( struct treewalk *walk )
+{
+	return walk->pending;
+}
+
+
+/*
+| Wakes the sleeping workers.
+*/
+static void
+treewalk_wake( struct treewalk *walk )
+{
+#ifdef HAVE_PTHREAD
+	__atomic_fetch_add( &walk->wakes, 1, __ATOMIC_SEQ_CST );
+
+	// pairs with the sleeper counting itself before looking at wakes
+	if( __atomic_load_n( &walk->idle, __ATOMIC_SEQ_CST ) > 0 )
+	{
+		pthread_mutex_lock( &walk->lock );
+		pthread_cond_broadcast( &walk->wake );
+		pthread_mutex_unlock( &walk->lock );
+	}
+#else
+	( void ) walk;
+#endif
+}
+
+
+/*
+| Queues a directory to walk.
+|
+| Called by the main thread before a run or by a worker
+| from its visit.
+|
+| Returns false if out of memory, the walk failed then
+| and the task is still the caller's.
+*/
+bool
+treewalk_queue(
+	struct treewalk *walk,
+	int worker,
+	void *task
+)
+{
+	__atomic_fetch_add( &walk->pending, 1, __ATOMIC_RELAXED );
+
+	if( !deque_push( &walk->workers[ worker ].deque, task ) )
+	{
+		__atomic_fetch_sub( &walk->pending, 1, __ATOMIC_RELAXED );
+
+		treewalk_fail( walk, ENOMEM );
+
+		return false;
+	}
+
+	treewalk_wake( walk );
+
+	return true;
+}
+
+
+/*
+| A worker failed, stops the walk.
+|
+| Only the first error is kept.
+*/
+void
+treewalk_fail(
+	struct treewalk *walk,
+	int error
+)
+{
+	int none = 0;
+
+	__atomic_compare_exchange_n(
+		&walk->error, &none, error, false,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED
+	);
+
+	__atomic_store_n( &walk->stop, true, __ATOMIC_RELAXED );
+
+	treewalk_wake( walk );
+}
+
+
+/*
+| Returns the errno of a worker that failed, 0 if none did.
+|
+| Once failed a walk does not run anymore.
+*/
+int
+treewalk_error( struct treewalk *walk )
+{
+	return walk->error;
+}
+
+
+/*
+| Takes a directory not walked, NULL if none is left.
+|
+| Called between runs only.
+*/
+void *
+treewalk_take( struct treewalk *walk )
+{
+	int i;
+
+	for( i = 0; i < walk->nworkers; i++ )
+	{
+		void *task = deque_pop( &walk->workers[ i ].deque, true );
+
+		if( task )
+		{
+			walk->pending--;
+
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+| Takes the next directory for a worker, stealing if need be.
+*/
+static void *
+treewalk_next( struct treewalk_worker *w )
+{
+	struct treewalk *walk = w->walk;
+	void *task = deque_pop( &w->deque, false );
+	int self = w - walk->workers;
+	int i;
+
+	for( i = 1; !task && i < walk->nworkers; i++ )
+	{
+		task = deque_pop( &walk->workers[ ( self + i ) % walk->nworkers ].deque, true );
+	}
+
+	return task;
+}
+
+
+/*
+| Returns true if the run reached its limit or deadline.
+*/
+static bool
+treewalk_stop( struct treewalk_worker *w )
+{
+	struct treewalk *walk = w->walk;
+
+	if( __atomic_load_n( &walk->stop, __ATOMIC_RELAXED ) ) return true;
+
+	if(
+		__atomic_load_n( &walk->error, __ATOMIC_RELAXED )
+		|| (
+			walk->limit
+			&& __atomic_load_n( &walk->walked, __ATOMIC_RELAXED ) >= walk->limit
+		)
+	)
+	{
+		__atomic_store_n( &walk->stop, true, __ATOMIC_RELAXED );
+		treewalk_wake( walk );
+		return true;
+	}
+
+	// only the main thread looks at the clock
+	if( w == walk->workers && walk->deadline.tv_sec )
+	{
+		struct timespec ts;
+
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+
+		if(
+			ts.tv_sec > walk->deadline.tv_sec
+			|| (
+				ts.tv_sec == walk->deadline.tv_sec
+				&& ts.tv_nsec >= walk->deadline.tv_nsec
+			)
+		)
+		{
+			__atomic_store_n( &walk->stop, true, __ATOMIC_RELAXED );
+			treewalk_wake( walk );
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+#ifdef HAVE_PTHREAD
+
+static void treewalk_work( struct treewalk_worker *w );
+
+
+/*
+| Sleeps until another worker queued more, the walk is done
+| or, for the main thread, the deadline is reached.
+|
+| 'wakes' is what the worker saw before looking for work.
+*/
+static void
+treewalk_sleep(
+	struct treewalk_worker *w,
+	unsigned int wakes
+)
+{
+	struct treewalk *walk = w->walk;
+
+	pthread_mutex_lock( &walk->lock );
+
+	__atomic_fetch_add( &walk->idle, 1, __ATOMIC_SEQ_CST );
+
+	while(
+		__atomic_load_n( &walk->wakes, __ATOMIC_SEQ_CST ) == wakes
+		&& __atomic_load_n( &walk->pending, __ATOMIC_ACQUIRE ) > 0
+		&& !__atomic_load_n( &walk->stop, __ATOMIC_RELAXED )
+	)
+	{
+		if( w == walk->workers && walk->deadline.tv_sec )
+		{
+			if(
+				pthread_cond_timedwait( &walk->wake, &walk->lock, &walk->deadline )
+				== ETIMEDOUT
+			)
+			{
+				break;
+			}
+		}
+		else
+		{
+			pthread_cond_wait( &walk->wake, &walk->lock );
+		}
+	}
+
+	__atomic_fetch_sub( &walk->idle, 1, __ATOMIC_SEQ_CST );
+
+	pthread_mutex_unlock( &walk->lock );
+}
+
+
+/*
+| Runs a helping worker.
+*/
+static void *
+treewalk_thread( void *arg )
+{
+	treewalk_work( arg );
+
+	return NULL;
+}
+
+
+/*
+| A large tree, the main thread calls for help.
+*/
+static void
+treewalk_help( struct treewalk *walk )
+{
+	// no signals for the helpers
+	sigset_t all, old;
+	int i;
+
+	walk->helped = true;
+
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+
+	for( i = 1; i < walk->nworkers; i++ )
+	{
+		struct treewalk_worker *h = &walk->workers[ i ];
+
+		if( pthread_create( &h->thread, NULL, treewalk_thread, h ) )
+		{
+			break;
+		}
+
+		walk->running++;
+	}
+
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+}
+
+#endif
+
+
+/*
+| Walks until no directories are pending anymore
+| or the run reached its limit.
+*/
+static void
+treewalk_work( struct treewalk_worker *w )
+{
+	struct treewalk *walk = w->walk;
+	int self = w - walk->workers;
+
+	while(
+		__atomic_load_n( &walk->pending, __ATOMIC_ACQUIRE ) > 0
+		&& !treewalk_stop( w )
+	)
+	{
+#ifdef HAVE_PTHREAD
+		unsigned int wakes = __atomic_load_n( &walk->wakes, __ATOMIC_SEQ_CST );
+#endif
+		void *task = treewalk_next( w );
+
+		if( !task )
+		{
+#ifdef HAVE_PTHREAD
+			// others are still walking and might queue more
+			treewalk_sleep( w, wakes );
+#endif
+			continue;
+		}
+
+		walk->visit( walk, self, task );
+
+		__atomic_fetch_add( &walk->walked, 1, __ATOMIC_RELAXED );
+
+		if( __atomic_sub_fetch( &walk->pending, 1, __ATOMIC_RELEASE ) == 0 )
+		{
+			// the others are done as well
+			treewalk_wake( walk );
+		}
+
+#ifdef HAVE_PTHREAD
+		if(
+			!self && !walk->helped && walk->nworkers > 1
+			&& ++walk->main_walked >= TREEWALK_SPAWN_AFTER
+		)
+		{
+			treewalk_help( walk );
+		}
+#endif
+	}
+}
+
+
+/*
+| Walks the queued directories and all queued meanwhile.
+|
+| Stops after walking about 'limit' directories if not zero
+| and after about 'secs' seconds if positive, the directories
+| not walked stay queued for the next run.
+|
+| Returns the number of directories walked.
+*/
+size_t
+treewalk_run(
+	struct treewalk *walk,
+	size_t limit,
+	double secs
+)
+{
+	walk->helped = false;
+	walk->running = 0;
+	walk->walked = 0;
+	walk->main_walked = 0;
+	walk->limit = limit;
+	walk->stop = false;
+
+	memset( &walk->deadline, 0, sizeof( walk->deadline ) );
+
+	if( secs > 0 )
+	{
+		clock_gettime( CLOCK_MONOTONIC, &walk->deadline );
+
+		walk->deadline.tv_sec += ( time_t ) secs;
+		walk->deadline.tv_nsec += ( long ) ( ( secs - ( time_t ) secs ) * 1e9 );
+
+		if( walk->deadline.tv_nsec >= 1000000000 )
+		{
+			walk->deadline.tv_sec++;
+			walk->deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	treewalk_work( &walk->workers[ 0 ] );
+
+#ifdef HAVE_PTHREAD
+	{
+		int i;
+
+		for( i = 1; i <= walk->running; i++ )
+		{
+			pthread_join( walk->workers[ i ].thread, NULL );
+		}
+	}
+#endif
+
+	return walk->walked;
+}
+
+
+/*
+| Returns the number of workers that took part in the last run.
+*/
+int
+treewalk_ran( struct treewalk *walk )
+{
+	return walk->running + 1;
+}
+
+
+/*
+| Frees a walker.
+|
+| The directories still queued have to be taken before.
+*/
+void
+treewalk_free( struct treewalk *walk )
+{
+	int i;
+
+	for( i = 0; i < walk->nworkers; i++ )
+	{
+		free( walk->workers[ i ].deque.tasks );
+
+#ifdef HAVE_PTHREAD
+		pthread_mutex_destroy( &walk->workers[ i ].deque.lock );
+#endif
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy( &walk->lock );
+	pthread_cond_destroy( &walk->wake );
+#endif
+
+	free( walk->workers );
+	free( walk );
+}
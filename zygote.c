@@ -0,0 +1,1215 @@
+/*
+| zygote.c from Lsyncd - Live (Mirror) Syncing Demon
+|
+| License: GPLv2 (see COPYING) or any later version
+|
+| Authors: Axel Kittenberger <axkibe@gmail.com>
+|
+| -----------------------------------------------------------------------
+|
+| The spawn helper.
+|
+| It is forked at startup while the daemon is still small and spawns
+| the child processes on behalf of the core. Thus spawning costs
+| do not depend on the size of the daemon and the masterloop does not
+| block on process creation.
+|
+| The helper is forked twice, so it is not a child of the core and
+| the core's collecting of zombies cannot take it. Once the core is
+| gone it still waits for its children before it exits.
+|
+| The core talks to the helper over two socket pairs:
+|
+|   The request channel, the core sends spawn requests and
+|   the environment, the latter only when it changed.
+|
+|   The exit channel, the helper reports the pids of the children
+|   spawned and their exitstatus, the core observes it like any
+|   other fd.
+|
+| The core does not wait for the pid of a child, a spawn returns
+| a ticket instead. The runner takes it for the pid, it is collected
+| by it and lsyncd.kill( ) sends signals to the child it stands for.
+| Tickets are above any pid, so these never clash with the pids of
+| the children spawned directly.
+*/
+
+#include "lsyncd.h"
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+
+/*
+| Frame types.
+*/
+#define ZYGOTE_SPAWN   1  // core -> helper, spawns a child
+#define ZYGOTE_ENV     2  // core -> helper, the environment of the children
+#define ZYGOTE_SPAWNED 3  // helper -> core, the pid of the child
+#define ZYGOTE_EXITED  4  // helper -> core, a child has exited
+
+
+/*
+| The first ticket, above the pids of all systems.
+*/
+#define ZYGOTE_TICKETS 0x10000000
+
+
+/*
+| Every frame starts with this header.
+*/
+struct zygote_header
+{
+	uint32_t type;
+
+	// length of the payload following the header
+	uint32_t len;
+};
+
+
+/*
+| Payload of a ZYGOTE_SPAWN frame.
+|
+| It is followed by argc + 1 zero terminated strings:
+| the arguments (the first is the binary) and the file
+| to redirect stdout/stderr of the child into (empty for none).
+|
+| If flags has ZYGOTE_STDIN the fd to become stdin of the child
+| is attached to the header as SCM_RIGHTS.
+*/
+struct zygote_spawn
+{
+	int32_t ticket;
+	uint32_t argc;
+	uint32_t flags;
+};
+
+#define ZYGOTE_STDIN 1
+
+
+/*
+| Payload of a ZYGOTE_ENV frame.
+|
+| It is followed by envc zero terminated strings.
+*/
+struct zygote_env
+{
+	uint32_t envc;
+};
+
+
+/*
+| Payload of a ZYGOTE_SPAWNED and ZYGOTE_EXITED frame.
+*/
+struct zygote_child
+{
+	int32_t ticket;
+
+	// the pid or -1 if spawning failed
+	int32_t pid;
+
+	// the errno of a failed spawn or the waitpid( ) status
+	int32_t status;
+};
+
+
+/*
+| A child of the helper.
+*/
+struct zygote_job
+{
+	int32_t ticket;
+
+	// 0 as long as the core does not know it
+	pid_t pid;
+
+	// a signal to send once the pid is known
+	int sig;
+};
+
+
+extern char ** environ;
+
+
+/*
+| The children running, on both sides.
+*/
+static struct zygote_job * jobs = NULL;
+static size_t njobs = 0;
+static size_t sjobs = 0;
+
+
+/*
+| Writes all of buf to a socket, retries on EINTR.
+|
+| Returns false on failure, a peer gone raises no SIGPIPE.
+*/
+static bool
+write_all(
+	int fd,
+	const void * buf,
+	size_t len
+)
+{
+	const char * p = buf;
+
+	while( len > 0 )
+	{
+		ssize_t w = send( fd, p, len, MSG_NOSIGNAL );
+
+		if( w < 0 )
+		{
+			if( errno == EINTR ) continue;
+
+			return false;
+		}
+
+		p   += w;
+		len -= w;
+	}
+
+	return true;
+}
+
+
+/*
+| Reads all of buf, retries on EINTR.
+|
+| Returns false on failure or end of file.
+*/
+static bool
+read_all(
+	int fd,
+	void * buf,
+	size_t len
+)
+{
+	char * p = buf;
+
+	while( len > 0 )
+	{
+		ssize_t r = read( fd, p, len );
+
+		if( r < 0 && errno == EINTR ) continue;
+
+		if( r <= 0 ) return false;
+
+		p   += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+
+/*
+| Adds a child.
+*/
+static struct zygote_job *
+job_add(
+	int32_t ticket,
+	pid_t pid
+)
+{
+	struct zygote_job * job;
+
+	if( njobs == sjobs )
+	{
+		sjobs = sjobs ? sjobs * 2 : 16;
+		jobs = s_realloc( jobs, sjobs * sizeof( struct zygote_job ) );
+	}
+
+	job = &jobs[ njobs++ ];
+
+	job->ticket = ticket;
+	job->pid = pid;
+	job->sig = 0;
+
+	return job;
+}
+
+
+/*
+| Returns the child of a ticket or pid, NULL if none.
+*/
+static struct zygote_job *
+job_find(
+	int32_t ticket,
+	pid_t pid
+)
+{
+	size_t i;
+
+	for( i = 0; i < njobs; i++ )
+	{
+		if( ticket ? jobs[ i ].ticket == ticket : jobs[ i ].pid == pid )
+		{
+			return &jobs[ i ];
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+| Removes a child.
+*/
+static void
+job_remove( struct zygote_job * job )
+{
+	*job = jobs[ --njobs ];
+}
+
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*
+(              The helper                   )
+ *~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+/*
+| Frames not yet written to the core.
+*/
+static char * pending     = NULL;
+static size_t pending_len = 0;
+
+
+/*
+| The environment for the children, NULL to inherit the helper's.
+*/
+static char * env_payload = NULL;
+static char ** env_list   = NULL;
+
+
+/*
+| Signal handler of the helper.
+*/
+static void
+zygote_sig_child( int sig )
+{
+	// nothing, just wakes the pselect( )
+	( void ) sig;
+}
+
+
+/*
+| Queues a frame for the core on the exit channel.
+*/
+static void
+zygote_queue(
+	uint32_t type,
+	int32_t ticket,
+	pid_t pid,
+	int status
+)
+{
+	struct zygote_header hdr = { type, sizeof( struct zygote_child ) };
+	struct zygote_child child = { ticket, pid, status };
+
+	pending = s_realloc( pending, pending_len + sizeof( hdr ) + sizeof( child ) );
+
+	memcpy( pending + pending_len, &hdr, sizeof( hdr ) );
+	pending_len += sizeof( hdr );
+
+	memcpy( pending + pending_len, &child, sizeof( child ) );
+	pending_len += sizeof( child );
+}
+
+
+/*
+| Writes as much of the queued frames as the exit
+| channel takes without blocking.
+|
+| Returns false if the core is gone.
+*/
+static bool
+zygote_flush( int fd )
+{
+	while( pending_len > 0 )
+	{
+		ssize_t w = write( fd, pending, pending_len );
+
+		if( w < 0 )
+		{
+			if( errno == EINTR ) continue;
+
+			// EAGAIN waits for the channel to become writeable again
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		memmove( pending, pending + w, pending_len - w );
+		pending_len -= w;
+	}
+
+	return true;
+}
+
+
+/*
+| Takes the environment sent by the core.
+*/
+static void
+zygote_env(
+	char * payload,
+	uint32_t len
+)
+{
+	struct zygote_env env;
+	char * p;
+	uint32_t i;
+
+	if( len < sizeof( env ) )
+	{
+		free( payload );
+		return;
+	}
+
+	memcpy( &env, payload, sizeof( env ) );
+
+	free( env_list );
+	free( env_payload );
+
+	env_payload = payload;
+	env_list = s_calloc( env.envc + 1, sizeof( char * ) );
+
+	p = payload + sizeof( env );
+
+	for( i = 0; i < env.envc && p < payload + len; i++ )
+	{
+		env_list[ i ] = p;
+		p += strlen( p ) + 1;
+	}
+}
+
+
+/*
+| Spawns a child requested by the core.
+*/
+static void
+zygote_spawn_child(
+	char * payload,
+	uint32_t len,
+	int stdin_fd
+)
+{
+	struct zygote_spawn spawn;
+	char ** argv;
+	const char * log_file;
+	char * p;
+	pid_t pid;
+	uint32_t i;
+
+	if( len < sizeof( spawn ) )
+	{
+		return;
+	}
+
+	memcpy( &spawn, payload, sizeof( spawn ) );
+
+	argv = s_calloc( spawn.argc + 1, sizeof( char * ) );
+
+	p = payload + sizeof( spawn );
+
+	for( i = 0; i < spawn.argc && p < payload + len; i++ )
+	{
+		argv[ i ] = p;
+		p += strlen( p ) + 1;
+	}
+
+	log_file = p < payload + len ? p : "";
+
+	pid = fork( );
+
+	if( pid == 0 )
+	{
+		sigset_t sigset;
+
+		log_forked( );
+
+		// the child does not inherit the helper's signal setup
+		signal( SIGCHLD, SIG_DFL );
+		signal( SIGHUP,  SIG_DFL );
+		signal( SIGINT,  SIG_DFL );
+		signal( SIGTERM, SIG_DFL );
+		signal( SIGPIPE, SIG_DFL );
+
+		sigemptyset( &sigset );
+		sigprocmask( SIG_SETMASK, &sigset, NULL );
+
+		// replaces stdin for pipes
+		if( stdin_fd >= 0 )
+		{
+			dup2( stdin_fd, STDIN_FILENO );
+		}
+
+		// redirects stdout/stderr to the logfile
+		if( *log_file )
+		{
+			if( !freopen( log_file, "a", stdout ) )
+			{
+				logstring( "Error", "cannot redirect stdout to logfile." );
+			}
+
+			if( !freopen( log_file, "a", stderr ) )
+			{
+				logstring( "Error", "cannot redirect stderr to logfile." );
+			}
+		}
+
+		if( env_list )
+		{
+			environ = env_list;
+		}
+
+		execvp( argv[ 0 ], argv );
+
+		// in a sane world execv does not return!
+		fprintf( stderr, "Failed executing [ %s ]!\n", argv[ 0 ] );
+
+		_exit( -1 );
+	}
+
+	free( argv );
+
+	if( pid < 0 )
+	{
+		zygote_queue( ZYGOTE_SPAWNED, spawn.ticket, -1, errno );
+		return;
+	}
+
+	job_add( spawn.ticket, pid );
+
+	// queued before its exit can be
+	zygote_queue( ZYGOTE_SPAWNED, spawn.ticket, pid, 0 );
+}
+
+
+/*
+| Handles a frame of the core.
+|
+| Returns false if the core closed the request channel.
+*/
+static bool
+zygote_request( int fd )
+{
+	struct zygote_header hdr;
+	char cbuf[ CMSG_SPACE( sizeof( int ) ) ];
+	struct iovec iov = { &hdr, sizeof( hdr ) };
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	int stdin_fd = -1;
+	char * payload;
+	ssize_t r;
+
+	memset( &msg, 0, sizeof( msg ) );
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cbuf;
+	msg.msg_controllen = sizeof( cbuf );
+
+	do
+	{
+		r = recvmsg( fd, &msg, 0 );
+	}
+	while( r < 0 && errno == EINTR );
+
+	if( r <= 0 )
+	{
+		return false;
+	}
+
+	for( cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+	{
+		if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+		{
+			memcpy( &stdin_fd, CMSG_DATA( cmsg ), sizeof( int ) );
+		}
+	}
+
+	if( r < ( ssize_t ) sizeof( hdr ) && !read_all( fd, ( char * ) &hdr + r, sizeof( hdr ) - r ) )
+	{
+		return false;
+	}
+
+	payload = s_malloc( hdr.len + 1 );
+
+	if( !read_all( fd, payload, hdr.len ) )
+	{
+		free( payload );
+		return false;
+	}
+
+	payload[ hdr.len ] = 0;
+
+	switch( hdr.type )
+	{
+		case ZYGOTE_SPAWN :
+			zygote_spawn_child( payload, hdr.len, stdin_fd );
+			free( payload );
+			break;
+
+		case ZYGOTE_ENV :
+			// keeps the payload
+			zygote_env( payload, hdr.len );
+			break;
+
+		default :
+			free( payload );
+			break;
+	}
+
+	if( stdin_fd >= 0 )
+	{
+		close( stdin_fd );
+	}
+
+	return true;
+}
+
+
+/*
+| The main loop of the helper.
+|
+| Runs until the core closed the request channel
+| and all children have exited.
+*/
+static void
+zygote_main(
+	int req,  // the helper's end of the request channel
+	int ex    // the helper's end of the exit channel
+)
+{
+	sigset_t sigset;
+	long maxfd = sysconf( _SC_OPEN_MAX );
+	bool closed = false;
+	bool gone = false;
+	int fd;
+
+	log_forked( );
+
+	// the core's children are not the helper's
+	njobs = 0;
+
+	// only keeps the std streams and its channels
+	if( maxfd < 0 || maxfd > 65536 ) maxfd = 65536;
+
+	for( fd = 3; fd < maxfd; fd++ )
+	{
+		if( fd != req && fd != ex ) close( fd );
+	}
+
+	non_block_fd( ex );
+
+	// signals are for the core, the helper leaves when it closes
+	signal( SIGHUP,  SIG_IGN );
+	signal( SIGINT,  SIG_IGN );
+	signal( SIGTERM, SIG_IGN );
+
+	// a core gone is told by the write failing
+	signal( SIGPIPE, SIG_IGN );
+
+	// SIGCHLD is only received in the pselect( )
+	signal( SIGCHLD, zygote_sig_child );
+	sigemptyset( &sigset );
+	sigaddset( &sigset, SIGCHLD );
+	sigprocmask( SIG_BLOCK, &sigset, NULL );
+	sigemptyset( &sigset );
+
+	while( !closed || njobs > 0 || ( pending_len > 0 && !gone ) )
+	{
+		fd_set rfds;
+		fd_set wfds;
+		int nfds = ex;
+		int status;
+		pid_t pid;
+		int pr;
+
+		FD_ZERO( &rfds );
+		FD_ZERO( &wfds );
+
+		if( !closed )
+		{
+			FD_SET( req, &rfds );
+
+			if( req > nfds ) nfds = req;
+		}
+
+		if( pending_len > 0 && !gone )
+		{
+			FD_SET( ex, &wfds );
+		}
+
+		pr = pselect( nfds + 1, &rfds, &wfds, NULL, NULL, &sigset );
+
+		while( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 )
+		{
+			struct zygote_job * job = job_find( 0, pid );
+
+			if( job )
+			{
+				zygote_queue( ZYGOTE_EXITED, job->ticket, pid, status );
+				job_remove( job );
+			}
+		}
+
+		if( !gone && !zygote_flush( ex ) )
+		{
+			// nobody to report to anymore
+			gone = true;
+			pending_len = 0;
+		}
+
+		if( !closed && pr > 0 && FD_ISSET( req, &rfds ) && !zygote_request( req ) )
+		{
+			// waits for the children still running
+			closed = true;
+			close( req );
+		}
+	}
+
+	_exit( 0 );
+}
+
+
+/*~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*
+(               The core side               )
+ *~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~*/
+
+
+/*
+| The core's ends of the channels, and the pid of the helper.
+*/
+static int request_fd = -1;
+static int exit_fd    = -1;
+static pid_t zygote_pid = 0;
+
+
+/*
+| Buffer of the exit channel, frames may arrive split.
+*/
+static char exit_buf[ 64 * ( sizeof( struct zygote_header ) + sizeof( struct zygote_child ) ) ];
+static size_t exit_buf_len = 0;
+
+
+/*
+| The next ticket.
+*/
+static int32_t next_ticket = ZYGOTE_TICKETS;
+
+
+/*
+| The hash of the environment the helper has.
+*/
+static uint64_t env_hash = 0;
+
+
+/*
+| Returns the hash of the core's environment.
+*/
+static uint64_t
+zygote_env_hash( void )
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for( i = 0; environ[ i ]; i++ )
+	{
+		const unsigned char * p = ( const unsigned char * ) environ[ i ];
+
+		// the terminating zero is hashed as well
+		do
+		{
+			h ^= *p;
+			h *= 0x100000001b3ULL;
+		}
+		while( *p++ );
+	}
+
+	return h;
+}
+
+
+/*
+| Stops using the helper.
+|
+| It goes on until its children have exited,
+| their exits are not collected anymore.
+*/
+static void
+zygote_tidy( struct observance * obs )
+{
+	close( obs->fd );
+	exit_fd = -1;
+
+	// closing the request channel makes the helper quit
+	if( request_fd >= 0 )
+	{
+		close( request_fd );
+		request_fd = -1;
+	}
+
+	zygote_pid = 0;
+	exit_buf_len = 0;
+	njobs = 0;
+}
+
+
+/*
+| The helper is gone.
+|
+| The children it did not report are collected as failed,
+| so the runner retries their work.
+*/
+static void
+zygote_gone(
+	lua_State * L,
+	struct observance * obs
+)
+{
+	logstring( "Error", "The spawn helper died, spawning directly." );
+
+	// the runner might spawn again when collecting
+	if( request_fd >= 0 )
+	{
+		close( request_fd );
+		request_fd = -1;
+	}
+
+	while( njobs > 0 )
+	{
+		int32_t ticket = jobs[ njobs - 1 ].ticket;
+
+		njobs--;
+
+		// as if the exec failed
+		collect_child( L, ticket, 255 << 8 );
+	}
+
+	nonobserve_fd( obs->fd );
+}
+
+
+/*
+| The helper reported spawned or exited children.
+*/
+static void
+zygote_exit_ready(
+	lua_State * L,
+	struct observance * obs
+)
+{
+	const size_t flen = sizeof( struct zygote_header ) + sizeof( struct zygote_child );
+	size_t pos = 0;
+	ssize_t r;
+
+	do
+	{
+		r = read( obs->fd, exit_buf + exit_buf_len, sizeof( exit_buf ) - exit_buf_len );
+	}
+	while( r < 0 && errno == EINTR );
+
+	if( r == 0 || ( r < 0 && errno != EAGAIN ) )
+	{
+		zygote_gone( L, obs );
+		return;
+	}
+
+	if( r < 0 )
+	{
+		return;
+	}
+
+	exit_buf_len += r;
+
+	while( exit_buf_len - pos >= flen )
+	{
+		struct zygote_header hdr;
+		struct zygote_child child;
+		struct zygote_job * job;
+
+		memcpy( &hdr, exit_buf + pos, sizeof( hdr ) );
+		memcpy( &child, exit_buf + pos + sizeof( hdr ), sizeof( child ) );
+		pos += flen;
+
+		job = job_find( child.ticket, 0 );
+
+		if( !job )
+		{
+			continue;
+		}
+
+		if( hdr.type == ZYGOTE_SPAWNED && child.pid > 0 )
+		{
+			job->pid = child.pid;
+
+			if( job->sig )
+			{
+				kill( job->pid, job->sig );
+			}
+		}
+		else if( hdr.type == ZYGOTE_SPAWNED )
+		{
+			printlogf(
+				L, "Error",
+				"spawn helper cannot fork: %s",
+				strerror( child.status )
+			);
+
+			job_remove( job );
+
+			// as if the exec failed
+			collect_child( L, child.ticket, 255 << 8 );
+		}
+		else if( hdr.type == ZYGOTE_EXITED )
+		{
+			job_remove( job );
+
+			collect_child( L, child.ticket, child.status );
+		}
+	}
+
+	memmove( exit_buf, exit_buf + pos, exit_buf_len - pos );
+	exit_buf_len -= pos;
+}
+
+
+/*
+| Starts the spawn helper.
+|
+| Does nothing if it is running already.
+*/
+extern void
+open_zygote( lua_State * L )
+{
+	int req[ 2 ];
+	int ex[ 2 ];
+	pid_t pid;
+
+	if( request_fd >= 0 )
+	{
+		return;
+	}
+
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, req ) < 0 )
+	{
+		logstring( "Error", "Cannot create socketpair for the spawn helper." );
+		return;
+	}
+
+	if( socketpair( AF_UNIX, SOCK_STREAM, 0, ex ) < 0 )
+	{
+		logstring( "Error", "Cannot create socketpair for the spawn helper." );
+		close( req[ 0 ] );
+		close( req[ 1 ] );
+		return;
+	}
+
+	pid = fork( );
+
+	if( pid == 0 )
+	{
+		// the helper is forked once more, so it is not a child of the core
+		pid_t helper = fork( );
+
+		if( helper == 0 )
+		{
+			close( req[ 0 ] );
+			close( ex[ 0 ] );
+
+			zygote_main( req[ 1 ], ex[ 1 ] );
+		}
+
+		write_all( req[ 1 ], &helper, sizeof( helper ) );
+
+		_exit( 0 );
+	}
+
+	close( req[ 1 ] );
+	close( ex[ 1 ] );
+
+	zygote_pid = -1;
+
+	// the intermediate child exits right away
+	if( pid > 0 )
+	{
+		while( waitpid( pid, NULL, 0 ) < 0 && errno == EINTR );
+
+		if( !read_all( req[ 0 ], &zygote_pid, sizeof( zygote_pid ) ) )
+		{
+			zygote_pid = -1;
+		}
+	}
+
+	if( zygote_pid < 0 )
+	{
+		logstring( "Error", "Cannot fork the spawn helper." );
+		close( req[ 0 ] );
+		close( ex[ 0 ] );
+		zygote_pid = 0;
+		return;
+	}
+
+	printlogf( L, "Exec", "spawn helper pid = %d", ( int ) zygote_pid );
+
+	request_fd = req[ 0 ];
+	exit_fd    = ex[ 0 ];
+
+	close_exec_fd( request_fd );
+	close_exec_fd( exit_fd );
+	non_block_fd( exit_fd );
+
+	// the helper has the environment of the core by now
+	env_hash = zygote_env_hash( );
+
+	observe_fd( exit_fd, zygote_exit_ready, NULL, zygote_tidy, NULL );
+}
+
+
+/*
+| Sends a frame to the helper, with an fd if not -1.
+|
+| Returns false on failure.
+*/
+static bool
+zygote_send(
+	uint32_t type,
+	const char * payload,
+	size_t len,
+	int fd
+)
+{
+	struct zygote_header hdr = { type, len };
+	char cbuf[ CMSG_SPACE( sizeof( int ) ) ];
+	struct iovec iov = { &hdr, sizeof( hdr ) };
+	struct msghdr msg;
+	ssize_t sent;
+
+	// sends the header together with the fd
+	memset( &msg, 0, sizeof( msg ) );
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if( fd >= 0 )
+	{
+		struct cmsghdr * cmsg;
+
+		memset( cbuf, 0, sizeof( cbuf ) );
+		msg.msg_control    = cbuf;
+		msg.msg_controllen = sizeof( cbuf );
+
+		cmsg = CMSG_FIRSTHDR( &msg );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN( sizeof( int ) );
+		memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ) );
+	}
+
+	do
+	{
+		sent = sendmsg( request_fd, &msg, MSG_NOSIGNAL );
+	}
+	while( sent < 0 && errno == EINTR );
+
+	return sent == sizeof( hdr ) && write_all( request_fd, payload, len );
+}
+
+
+/*
+| Sends the core's environment to the helper if it changed.
+|
+| Returns false on failure.
+*/
+static bool
+zygote_send_env( void )
+{
+	struct zygote_env env = { 0 };
+	uint64_t hash = zygote_env_hash( );
+	char * payload;
+	char * p;
+	size_t len = sizeof( env );
+	bool ok;
+	int i;
+
+	if( hash == env_hash )
+	{
+		return true;
+	}
+
+	for( i = 0; environ[ i ]; i++ )
+	{
+		len += strlen( environ[ i ] ) + 1;
+		env.envc++;
+	}
+
+	payload = s_malloc( len );
+	memcpy( payload, &env, sizeof( env ) );
+	p = payload + sizeof( env );
+
+	for( i = 0; environ[ i ]; i++ )
+	{
+		size_t elen = strlen( environ[ i ] ) + 1;
+
+		memcpy( p, environ[ i ], elen );
+		p += elen;
+	}
+
+	ok = zygote_send( ZYGOTE_ENV, payload, len, -1 );
+
+	free( payload );
+
+	if( ok )
+	{
+		env_hash = hash;
+	}
+
+	return ok;
+}
+
+
+/*
+| Spawns a child process through the helper.
+|
+| The child gets the core's current environment, it is sent
+| to the helper whenever it changed.
+|
+| The core does not wait for the helper to fork, the pid of the
+| child is reported on the exit channel later on.
+|
+| Returns the ticket standing for the child or -1 if the helper
+| is not running or failed, the caller spawns directly then.
+*/
+extern pid_t
+zygote_spawn(
+	lua_State * L,
+	const char * binary,   // the binary to call
+	char const ** argv,    // the arguments, argv[ 0 ] is the binary
+	int stdin_fd,          // if >= 0 becomes stdin of the child
+	const char * log_file  // if not NULL stdout/stderr of the child go there
+)
+{
+	struct zygote_spawn spawn = { 0, 0, 0 };
+	char * payload;
+	char * p;
+	size_t len;
+	bool ok;
+	int i;
+
+	( void ) L;
+
+	if( request_fd < 0 )
+	{
+		return -1;
+	}
+
+	if( !log_file )
+	{
+		log_file = "";
+	}
+
+	spawn.ticket = next_ticket;
+
+	// computes the length of the payload
+	len = sizeof( spawn ) + strlen( log_file ) + 1;
+
+	for( i = 0; argv[ i ]; i++ )
+	{
+		len += strlen( i ? argv[ i ] : binary ) + 1;
+		spawn.argc++;
+	}
+
+	if( stdin_fd >= 0 )
+	{
+		spawn.flags |= ZYGOTE_STDIN;
+	}
+
+	payload = s_malloc( len );
+	memcpy( payload, &spawn, sizeof( spawn ) );
+	p = payload + sizeof( spawn );
+
+	for( i = 0; argv[ i ]; i++ )
+	{
+		const char * a = i ? argv[ i ] : binary;
+		size_t alen = strlen( a ) + 1;
+
+		memcpy( p, a, alen );
+		p += alen;
+	}
+
+	memcpy( p, log_file, strlen( log_file ) + 1 );
+
+	ok =
+		zygote_send_env( )
+		&& zygote_send( ZYGOTE_SPAWN, payload, len, stdin_fd );
+
+	free( payload );
+
+	if( !ok )
+	{
+		logstring( "Error", "The spawn helper failed, spawning directly." );
+
+		// the helper still reports the children it has,
+		// then it quits and zygote_gone( ) tidies up
+		close( request_fd );
+		request_fd = -1;
+
+		return -1;
+	}
+
+	job_add( spawn.ticket, 0 );
+
+	next_ticket = next_ticket < INT32_MAX ? next_ticket + 1 : ZYGOTE_TICKETS;
+
+	return spawn.ticket;
+}
+
+
+/*
+| Sends a signal to a child, spawned by the helper or not.
+|
+| A child whose pid is not known yet gets the signal once it is,
+| until then it counts as running.
+|
+| Returns like kill( ).
+*/
+extern int
+zygote_kill(
+	pid_t pid,  // the pid or the ticket of the child
+	int sig
+)
+{
+	struct zygote_job * job = pid >= ZYGOTE_TICKETS ? job_find( pid, 0 ) : NULL;
+
+	if( !job )
+	{
+		return kill( pid, sig );
+	}
+
+	if( job->pid > 0 )
+	{
+		return kill( job->pid, sig );
+	}
+
+	if( sig )
+	{
+		job->sig = sig;
+	}
+
+	return 0;
+}